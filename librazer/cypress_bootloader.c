@@ -47,6 +47,21 @@ struct cypress_status {
 #define CYPRESS_STAT_INVALCMD	0x80 /* Invalid command error */
 #define CYPRESS_STAT_ALL	0xFF
 
+/* The first and the last wait for a new status report. */
+#define CYPRESS_STATUS_WAIT_MIN_MSEC	5
+#define CYPRESS_STATUS_WAIT_MAX_MSEC	80
+/* The maximum number of stale status reports dropped before a command. */
+#define CYPRESS_STATUS_DRAIN_MAX	8
+/* Event handling errors tolerated after cancelling the status read. */
+#define CYPRESS_EVENT_ERRORS_MAX	8
+
+/* A queued status read. The completion handler writes to it, so it
+ * is leaked together with the transfer, if that cannot be cancelled. */
+struct cypress_status_read {
+	struct cypress_status status;
+	int completed;
+};
+
 
 static void cypress_print_one_status(int *ctx, char *buf, const char *message)
 {
@@ -92,36 +107,182 @@ static void cmd_checksum(struct cypress_command *_cmd)
 	cmd[45] = sum & 0xFF;
 }
 
+static void cypress_status_complete(struct libusb_transfer *xfer)
+{
+	struct cypress_status_read *rd = xfer->user_data;
+
+	rd->completed = 1;
+}
+
+/* Wait for a transfer submitted with cypress_status_complete().
+ * If USB event handling fails, the transfer is cancelled. If it keeps
+ * failing after that, this gives up.
+ * Returns false, if the transfer did not complete. It must not be
+ * freed then. */
+static bool cypress_wait_transfer(struct libusb_transfer *xfer,
+				  struct cypress_status_read *rd)
+{
+	unsigned int errors = 0;
+	int err;
+
+	while (!rd->completed) {
+		err = libusb_handle_events_completed(razer_libusb_context(),
+						     &rd->completed);
+		if (!err || err == LIBUSB_ERROR_INTERRUPTED)
+			continue;
+		razer_error("cypress: USB event handling failed (%d)\n", err);
+		if (errors++ == 0)
+			libusb_cancel_transfer(xfer);
+		else if (errors > CYPRESS_EVENT_ERRORS_MAX)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Returns CYPRESS_STAT_BLMODE, if the status is OK. */
+static uint8_t cypress_check_status(const struct cypress_status *status,
+				    uint8_t status_mask)
+{
+	status_mask |= CYPRESS_STAT_BLMODE; /* Always check the blmode bit */
+	status_mask &= ~CYPRESS_STAT_BOOTOK; /* Always ignore the bootok bit */
+
+	return (status->status0 | status->status1) & status_mask;
+}
+
+/* Wait up to timeout_msec for a new status report. */
+static int cypress_read_status(struct cypress *c, struct cypress_status *status,
+			       unsigned int timeout_msec)
+{
+	struct cypress_status new_status;
+	int err, transferred;
+
+	err = libusb_bulk_transfer(c->usb.h, c->ep_in,
+				   (unsigned char *)&new_status, sizeof(new_status),
+				   &transferred, timeout_msec);
+	if (err == LIBUSB_ERROR_TIMEOUT)
+		return -ETIMEDOUT;
+	if (err || transferred != sizeof(new_status))
+		return -EIO;
+	*status = new_status;
+
+	return 0;
+}
+
+/* Drop the status reports that are still pending, so that the next
+ * report that is read belongs to the next command. Otherwise a report
+ * that the bootloader posted late for the previous command could be
+ * taken as the result of the next one. This costs 1 msec per command. */
+static int cypress_drain_status(struct cypress *c)
+{
+	struct cypress_status status;
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < CYPRESS_STATUS_DRAIN_MAX; i++) {
+		err = cypress_read_status(c, &status, 1);
+		if (err == -ETIMEDOUT)
+			return 0;
+		if (err) {
+			razer_error("cypress: Failed to receive status report\n");
+			return err;
+		}
+		razer_debug("cypress: Dropped stale status 0x%02X/0x%02X\n",
+			    status.status0, status.status1);
+	}
+	razer_error("cypress: The bootloader keeps posting status reports\n");
+
+	return -EIO;
+}
+
 static int cypress_send_command(struct cypress *c,
 				struct cypress_command *command,
 				size_t command_size, uint8_t status_mask)
 {
+	struct cypress_status_read *rd;
 	struct cypress_status status;
+	struct libusb_transfer *xfer;
 	int err, transferred;
+	unsigned int wait;
 	uint8_t stat;
 
 	cmd_checksum(command);
 
-razer_dump("cypress command", command, sizeof(*command));
+	err = cypress_drain_status(c);
+	if (err)
+		return err;
+
+	/* Queue the status read before sending the command. It completes
+	 * as soon as the bootloader processed the command, instead of
+	 * after a fixed delay. */
+	rd = zalloc(sizeof(*rd));
+	xfer = libusb_alloc_transfer(0);
+	if (!rd || !xfer) {
+		libusb_free_transfer(xfer);
+		razer_free(rd, sizeof(*rd));
+		return -ENOMEM;
+	}
+	libusb_fill_bulk_transfer(xfer, c->usb.h, c->ep_in,
+				  (unsigned char *)&rd->status, sizeof(rd->status),
+				  cypress_status_complete, rd,
+				  RAZER_USB_TIMEOUT);
+	err = libusb_submit_transfer(xfer);
+	if (err) {
+		razer_error("cypress: Failed to queue the status read\n");
+		libusb_free_transfer(xfer);
+		razer_free(rd, sizeof(*rd));
+		return -EIO;
+	}
+
 	err = libusb_bulk_transfer(c->usb.h, c->ep_out,
 				   (unsigned char *)command, command_size,
 				   &transferred, RAZER_USB_TIMEOUT);
 	if (err || transferred < 0 || (size_t)transferred != command_size) {
 		razer_error("cypress: Failed to send command 0x%02X\n",
 			    be16_to_cpu(command->command));
-		return -1;
+		libusb_cancel_transfer(xfer);
+		if (!cypress_wait_transfer(xfer, rd))
+			return -EIO; /* Leak it. See struct cypress_status_read. */
+		libusb_free_transfer(xfer);
+		razer_free(rd, sizeof(*rd));
+		return -EIO;
 	}
-	razer_msleep(100);
-	err = libusb_bulk_transfer(c->usb.h, c->ep_in,
-				   (unsigned char *)&status, sizeof(status),
-				   &transferred, RAZER_USB_TIMEOUT);
-	if (err || transferred != sizeof(status)) {
+	if (!cypress_wait_transfer(xfer, rd)) {
 		razer_error("cypress: Failed to receive status report\n");
-		return -1;
+		return -EIO; /* Leak it. See struct cypress_status_read. */
+	}
+	err = (xfer->status != LIBUSB_TRANSFER_COMPLETED ||
+	       xfer->actual_length != sizeof(rd->status));
+	status = rd->status;
+	libusb_free_transfer(xfer);
+	razer_free(rd, sizeof(*rd));
+	if (err) {
+		razer_error("cypress: Failed to receive status report\n");
+		return -EIO;
+	}
+	stat = cypress_check_status(&status, status_mask);
+	/* The pending reports were dropped before the command was sent,
+	 * so this report belongs to it. The bootloader may still post
+	 * a bad report before it is done with the command. Wait for a
+	 * newer one a few times, with growing timeouts, before the
+	 * command counts as failed. This waits 155 msec at most, a bit
+	 * more than the fixed delay that was used before. */
+	for (wait = CYPRESS_STATUS_WAIT_MIN_MSEC;
+	     stat != CYPRESS_STAT_BLMODE && wait <= CYPRESS_STATUS_WAIT_MAX_MSEC;
+	     wait *= 2) {
+		razer_debug("cypress: Command 0x%04X status 0x%02X/0x%02X. "
+			    "Waiting %u msec for a new status\n",
+			    be16_to_cpu(command->command),
+			    status.status0, status.status1, wait);
+		err = cypress_read_status(c, &status, wait);
+		if (err == -ETIMEDOUT)
+			continue;
+		if (err) {
+			razer_error("cypress: Failed to receive status report\n");
+			return err;
+		}
+		stat = cypress_check_status(&status, status_mask);
 	}
-	status_mask |= CYPRESS_STAT_BLMODE; /* Always check the blmode bit */
-	status_mask &= ~CYPRESS_STAT_BOOTOK; /* Always ignore the bootok bit */
-	stat = (status.status0 | status.status1) & status_mask;
 	if (stat != CYPRESS_STAT_BLMODE) {
 		razer_error("cypress: Command 0x%04X failed with "
 			    "status0=0x%02X status1=0x%02X\n",
@@ -220,6 +381,7 @@ static int cypress_writeflash(struct cypress *c,
 		return -EINVAL;
 	}
 
+	razer_flash_report_progress(c->mouse, 0, len);
 	for (block = 0; block < len / 64; block++) {
 		/* First 32 bytes */
 		err = cypress_cmd_writefl(c, block, 0, image);
@@ -237,6 +399,7 @@ static int cypress_writeflash(struct cypress *c,
 			return -EIO;
 		}
 		image += 32;
+		razer_flash_report_progress(c->mouse, (block + 1) * 64, len);
 	}
 
 	return 0;
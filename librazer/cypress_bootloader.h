@@ -9,6 +9,8 @@ struct cypress {
 	unsigned int ep_in;
 	unsigned int ep_out;
 	void (*assign_key)(uint8_t *key);
+	/* The mouse the flash progress is reported for. May be NULL. */
+	struct razer_mouse *mouse;
 };
 
 #define CYPRESS_BOOT_VENDORID	0x04B4
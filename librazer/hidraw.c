@@ -0,0 +1,238 @@
+/*
+ *   Lowlevel hidraw feature report access
+ *
+ *   Copyright (C) 2007-2016 Michael Buesch <m@bues.ch>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include "hidraw.h"
+#include "razer_private.h"
+
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#ifdef __linux__
+# include <sys/ioctl.h>
+# include <linux/hidraw.h>
+#endif
+
+
+/* HID class requests. These are the same numbers as the
+ * CLEAR_FEATURE and SET_CONFIGURATION standard requests,
+ * which is what the drivers use. */
+#define HID_REQ_GET_REPORT		0x01
+#define HID_REQ_SET_REPORT		0x09
+
+#define HID_REPORT_TYPE_FEATURE		0x03
+
+#define HIDRAW_MAX_REPORT_SIZE		256
+
+#define SYSFS_HIDRAW			"/sys/class/hidraw"
+
+#ifdef __linux__
+
+static int read_sysfs_uint(const char *dir, const char *attr,
+			   int base, unsigned int *value)
+{
+	char path[PATH_MAX], buf[32];
+	FILE *fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	fd = fopen(path, "r");
+	if (!fd)
+		return -ENOENT;
+	if (!fgets(buf, sizeof(buf), fd)) {
+		fclose(fd);
+		return -EIO;
+	}
+	fclose(fd);
+	*value = strtoul(buf, NULL, base);
+
+	return 0;
+}
+
+/* Strip the last component from a path. */
+static bool path_up(char *path)
+{
+	char *slash;
+
+	slash = strrchr(path, '/');
+	if (!slash || slash == path)
+		return 0;
+	*slash = '\0';
+
+	return 1;
+}
+
+/* Find the hidraw node of the first used interface of the USB device. */
+static int hidraw_find_node(struct razer_usb_context *ctx,
+			    char *node, size_t node_size)
+{
+	DIR *dir;
+	struct dirent *de;
+	char link[PATH_MAX], path[PATH_MAX];
+	unsigned int intf, busnum, devnum;
+	int err = -ENODEV;
+
+	if (!ctx->nr_interfaces)
+		return -ENODEV;
+
+	dir = opendir(SYSFS_HIDRAW);
+	if (!dir)
+		return -ENODEV;
+	while ((de = readdir(dir))) {
+		if (strncmp(de->d_name, "hidraw", 6) != 0)
+			continue;
+		snprintf(link, sizeof(link), SYSFS_HIDRAW "/%s/device",
+			 de->d_name);
+		if (!realpath(link, path))
+			continue;
+		/* path is .../USBDEV/USBDEV:CONFIG.INTERFACE/HIDDEV */
+		if (!path_up(path) ||
+		    read_sysfs_uint(path, "bInterfaceNumber", 16, &intf))
+			continue;
+		if (!path_up(path) ||
+		    read_sysfs_uint(path, "busnum", 10, &busnum) ||
+		    read_sysfs_uint(path, "devnum", 10, &devnum))
+			continue;
+		if (intf != ctx->interfaces[0].bInterfaceNumber ||
+		    busnum != libusb_get_bus_number(ctx->dev) ||
+		    devnum != libusb_get_device_address(ctx->dev))
+			continue;
+		snprintf(node, node_size, "/dev/%s", de->d_name);
+		err = 0;
+		break;
+	}
+	closedir(dir);
+
+	return err;
+}
+
+static int razer_hidraw_claim(struct razer_usb_context *ctx)
+{
+	char node[PATH_MAX];
+	int err, fd;
+
+	err = hidraw_find_node(ctx, node, sizeof(node));
+	if (err)
+		return err;
+	fd = open(node, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		err = -errno;
+		razer_debug("Failed to open %s (%s)\n", node, strerror(errno));
+		return err;
+	}
+	ctx->hidraw_fd = fd;
+	ctx->transport = &razer_hidraw_transport;
+
+	return 0;
+}
+
+static void razer_hidraw_release(struct razer_usb_context *ctx)
+{
+	close(ctx->hidraw_fd);
+	ctx->hidraw_fd = -1;
+	/* hidraw is selected on each claim. */
+	ctx->transport = NULL;
+}
+
+static int razer_hidraw_ctrl_write(struct razer_usb_context *ctx,
+				   uint8_t request, uint16_t value,
+				   uint16_t index,
+				   const void *buf, size_t size)
+{
+	uint8_t report[1 + HIDRAW_MAX_REPORT_SIZE];
+	int res;
+
+	if (request != HID_REQ_SET_REPORT ||
+	    (value >> 8) != HID_REPORT_TYPE_FEATURE)
+		return -EOPNOTSUPP;
+	if (size > HIDRAW_MAX_REPORT_SIZE)
+		return -EINVAL;
+
+	report[0] = value & 0xFF; /* Report ID */
+	memcpy(report + 1, buf, size);
+	res = ioctl(ctx->hidraw_fd, HIDIOCSFEATURE(size + 1), report);
+	if (res < 0)
+		return -errno;
+	if ((size_t)res != size + 1)
+		return -EIO;
+
+	return 0;
+}
+
+static int razer_hidraw_ctrl_read(struct razer_usb_context *ctx,
+				  uint8_t request, uint16_t value,
+				  uint16_t index,
+				  void *buf, size_t size)
+{
+	uint8_t report[1 + HIDRAW_MAX_REPORT_SIZE];
+	int res;
+
+	if (request != HID_REQ_GET_REPORT ||
+	    (value >> 8) != HID_REPORT_TYPE_FEATURE)
+		return -EOPNOTSUPP;
+	if (size > HIDRAW_MAX_REPORT_SIZE)
+		return -EINVAL;
+
+	report[0] = value & 0xFF; /* Report ID */
+	res = ioctl(ctx->hidraw_fd, HIDIOCGFEATURE(size + 1), report);
+	if (res < 0)
+		return -errno;
+	if ((size_t)res != size + 1)
+		return -EIO;
+	memcpy(buf, report + 1, size);
+
+	return 0;
+}
+
+#else /* __linux__ */
+
+static int razer_hidraw_claim(struct razer_usb_context *ctx)
+{
+	return -EOPNOTSUPP;
+}
+
+static void razer_hidraw_release(struct razer_usb_context *ctx)
+{
+}
+
+static int razer_hidraw_ctrl_write(struct razer_usb_context *ctx,
+				   uint8_t request, uint16_t value,
+				   uint16_t index,
+				   const void *buf, size_t size)
+{
+	return -EOPNOTSUPP;
+}
+
+static int razer_hidraw_ctrl_read(struct razer_usb_context *ctx,
+				  uint8_t request, uint16_t value,
+				  uint16_t index,
+				  void *buf, size_t size)
+{
+	return -EOPNOTSUPP;
+}
+
+#endif /* __linux__ */
+
+const struct razer_usb_transport razer_hidraw_transport = {
+	.name		= "hidraw",
+	.claim		= razer_hidraw_claim,
+	.release	= razer_hidraw_release,
+	.ctrl_write	= razer_hidraw_ctrl_write,
+	.ctrl_read	= razer_hidraw_ctrl_read,
+};
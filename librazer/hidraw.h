@@ -0,0 +1,9 @@
+#ifndef RAZER_HIDRAW_H_
+#define RAZER_HIDRAW_H_
+
+#include "razer_private.h"
+
+
+extern const struct razer_usb_transport razer_hidraw_transport;
+
+#endif /* RAZER_HIDRAW_H_ */
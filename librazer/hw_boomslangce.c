@@ -20,6 +20,7 @@
 
 #include "hw_boomslangce.h"
 #include "razer_private.h"
+#include "usb_async.h"
 #include "buttonmapping.h"
 
 #include <errno.h>
@@ -225,13 +226,12 @@ static int boomslangce_usb_write(struct boomslangce_private *priv,
 {
 	int err;
 
-	err = libusb_control_transfer(
-		priv->m->usb_ctx->h,
-		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS |
-		LIBUSB_RECIPIENT_OTHER,
-		request, command, index,
-		(unsigned char *)buf, size, RAZER_USB_TIMEOUT);
-	if (err < 0 || (size_t)err != size) {
+	err = razer_usb_ctrl_write(priv->m->usb_ctx,
+				   LIBUSB_REQUEST_TYPE_CLASS |
+				   LIBUSB_RECIPIENT_OTHER,
+				   request, command, index,
+				   buf, size);
+	if (err) {
 		razer_error("razer-boomslangce: "
 			"USB write 0x%02X 0x%02X 0x%02X failed: %d\n",
 			request, command, index, err);
@@ -247,13 +247,12 @@ static int boomslangce_usb_read(struct boomslangce_private *priv,
 {
 	int err;
 
-	err = libusb_control_transfer(
-		priv->m->usb_ctx->h,
-		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS |
-		LIBUSB_RECIPIENT_OTHER,
-		request, command, index,
-		(unsigned char *)buf, size, RAZER_USB_TIMEOUT);
-	if (err < 0 || (size_t)err != size) {
+	err = razer_usb_ctrl_read(priv->m->usb_ctx,
+				  LIBUSB_REQUEST_TYPE_CLASS |
+				  LIBUSB_RECIPIENT_OTHER,
+				  request, command, index,
+				  buf, size);
+	if (err) {
 		razer_error("razer-boomslangce: "
 			"USB read 0x%02X 0x%02X 0x%02X failed: %d\n",
 			request, command, index, err);
@@ -822,7 +821,7 @@ int razer_boomslangce_init(struct razer_mouse *m,
 	}
 
 	m->type = RAZER_MOUSETYPE_BOOMSLANGCE;
-	razer_generic_usb_gen_idstr(usbdev, NULL, "Boomslang-CE", 1,
+	razer_generic_usb_gen_idstr(m->usb_ctx, "Boomslang-CE", 1,
 				    NULL, m->idstr);
 
 	m->get_fw_version = boomslangce_get_fw_version;
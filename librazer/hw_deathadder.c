@@ -21,6 +21,7 @@
 
 #include "hw_deathadder.h"
 #include "razer_private.h"
+#include "usb_async.h"
 #include "cypress_bootloader.h"
 
 #include <errno.h>
@@ -91,14 +92,11 @@ static int deathadder_usb_write(struct deathadder_private *priv,
 		return 0;
 	}
 
-	err = libusb_control_transfer(
-		priv->m->usb_ctx->h,
-		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS |
-		LIBUSB_RECIPIENT_INTERFACE,
-		request, command, 0,
-		(unsigned char *)buf, size,
-		RAZER_USB_TIMEOUT);
-	if (err < 0 || (size_t)err != size) {
+	err = razer_usb_ctrl_write(priv->m->usb_ctx,
+				   RAZER_USB_CMD_TYPE_DEFAULT,
+				   request, command, 0,
+				   buf, size);
+	if (err) {
 		razer_error("razer-deathadder: "
 			"USB write 0x%02X 0x%02X failed: %d\n",
 			request, command, err);
@@ -119,14 +117,11 @@ static int deathadder_usb_read(struct deathadder_private *priv,
 		return 0;
 	}
 
-	err = libusb_control_transfer(
-		priv->m->usb_ctx->h,
-		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS |
-		LIBUSB_RECIPIENT_INTERFACE,
-		request, command, 0,
-		buf, size,
-		RAZER_USB_TIMEOUT);
-	if (err < 0 || (size_t)err != size) {
+	err = razer_usb_ctrl_read(priv->m->usb_ctx,
+				  RAZER_USB_CMD_TYPE_DEFAULT,
+				  request, command, 0,
+				  buf, size);
+	if (err) {
 		razer_error("razer-deathadder: "
 			"USB read 0x%02X 0x%02X failed: %d\n",
 			request, command, err);
@@ -594,6 +589,7 @@ cydev=NULL;
 	err = cypress_open(&cy, cydev, NULL);
 	if (err)
 		return err;
+	cy.mouse = m;
 	err = cypress_upload_image(&cy, data, len);
 	cypress_close(&cy);
 	if (err)
@@ -763,7 +759,7 @@ int razer_deathadder_init(struct razer_mouse *m,
 		devname = "DeathAdder Black Edition";
 		break;
 	}
-	razer_generic_usb_gen_idstr(usbdev, m->usb_ctx->h, devname, 0,
+	razer_generic_usb_gen_idstr(m->usb_ctx, devname, 0,
 				    NULL, m->idstr);
 
 	m->get_fw_version = deathadder_get_fw_version;
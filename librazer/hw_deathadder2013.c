@@ -23,6 +23,7 @@
 
 #include "hw_deathadder2013.h"
 #include "razer_private.h"
+#include "usb_async.h"
 
 #include <errno.h>
 #include <stdlib.h>
@@ -39,6 +40,16 @@ enum {
 enum {	/* Misc constants */
 	DEATHADDER2013_NR_DPIMAPPINGS = 64,
 	DEATHADDER2013_NR_AXES = 3,
+	DEATHADDER2013_PACKET_SPACING_MS = 35,
+	DEATHADDER2013_PACKET_SPACING_MIN_MS = 2,
+	DEATHADDER2013_COMMAND_TRIES = 3,
+};
+
+enum {	/* Command status */
+	DEATHADDER2013_STATUS_NEW = 0x00,
+	DEATHADDER2013_STATUS_BUSY = 0x01,
+	DEATHADDER2013_STATUS_SUCCESS = 0x02,
+	DEATHADDER2013_STATUS_FAILURE = 0x03,
 };
 
 struct deathadder2013_command {
@@ -71,6 +82,8 @@ struct deathadder2013_private {
 	struct razer_axis axes[DEATHADDER2013_NR_AXES];
 
 	bool commit_pending;
+
+	struct razer_event_spacing packet_spacing;
 };
 
 static void deathadder2013_command_init(struct deathadder2013_command *cmd)
@@ -78,79 +91,58 @@ static void deathadder2013_command_init(struct deathadder2013_command *cmd)
 	memset(cmd, 0, sizeof(*cmd));
 }
 
-static int deathadder2013_usb_write(struct deathadder2013_private *priv,
-				    int request, int command,
-				    void *buf, size_t size)
+/* Only a reply that shows the command was processed confirms it.
+ * NEW, BUSY or a reply to another command means the read came too
+ * early. The firmware answers some working commands with FAILURE,
+ * so that is a valid reply, too. Set-commands don't reliably echo
+ * their values, so those are not compared. */
+static int deathadder2013_check_reply(const void *_request, const void *_reply)
 {
-	int err;
-
-	err = libusb_control_transfer(priv->m->usb_ctx->h,
-				      LIBUSB_ENDPOINT_OUT |
-				      LIBUSB_REQUEST_TYPE_CLASS |
-				      LIBUSB_RECIPIENT_INTERFACE, request,
-				      command, 0, (unsigned char *)buf, size,
-				      RAZER_USB_TIMEOUT);
-	if (err < 0 || (size_t)err != size) {
-		razer_error("razer-deathadder2013: "
-			    "USB write 0x%02X 0x%02X failed: %d\n",
-			    request, command, err);
-		return err;
+	const struct deathadder2013_command *request = _request;
+	const struct deathadder2013_command *reply = _reply;
+
+	if (reply->status == DEATHADDER2013_STATUS_NEW ||
+	    reply->status == DEATHADDER2013_STATUS_BUSY)
+		return -EAGAIN;
+	if (reply->command != request->command ||
+	    reply->request != request->request)
+		return -EAGAIN;
+	if (reply->status != DEATHADDER2013_STATUS_SUCCESS &&
+	    reply->status != DEATHADDER2013_STATUS_FAILURE) {
+		razer_error("razer-deathadder2013: Command %04X/%04X failed with %02X\n",
+			    le16_to_cpu(request->command),
+			    le16_to_cpu(request->request), reply->status);
 	}
-	return 0;
-}
 
-static int deathadder2013_usb_read(struct deathadder2013_private *priv,
-				   int request, int command,
-				   void *buf, size_t size)
-{
-	int err, try;
-
-	for (try = 0; try < 3; try++) {
-		err = libusb_control_transfer(priv->m->usb_ctx->h,
-					      LIBUSB_ENDPOINT_IN |
-					      LIBUSB_REQUEST_TYPE_CLASS |
-					      LIBUSB_RECIPIENT_INTERFACE,
-					      request, command, 0, buf, size,
-					      RAZER_USB_TIMEOUT);
-		if (err >= 0 && (size_t)err == size)
-			break;
-	}
-
-	if (err < 0 || (size_t)err != size) {
-		razer_error("razer-deathadder2013: USB read 0x%02X 0x%02X failed: %d\n",
-			    request, command, err);
-		return err;
-	}
 	return 0;
 }
 
 static int deathadder2013_send_command(struct deathadder2013_private *priv,
 				       struct deathadder2013_command *cmd)
 {
-	int err, i;
-
-	/* commands seem to fail less often when you do them a few times. */
-	for (i = 0; i < 3; i++) {
-		cmd->status = 0x00;
-
-		err = deathadder2013_usb_write(priv,
-					       LIBUSB_REQUEST_SET_CONFIGURATION,
-					       0x300, cmd, sizeof(*cmd));
-		if (err)
-			return err;
-		err = deathadder2013_usb_read(priv,
-					      LIBUSB_REQUEST_CLEAR_FEATURE,
-					      0x300, cmd, sizeof(*cmd));
-		if (err)
-			return err;
-		if (cmd->status != 3 &&
-		    cmd->status != 2 && cmd->status != 1 && cmd->status != 0) {
-			razer_error("razer-deathadder2013: Command %04X/%04X failed with %02X\n",
-				    le16_to_cpu(cmd->command),
-				    le16_to_cpu(cmd->request), cmd->status);
-		}
+	int err;
 
-		razer_msleep(35);
+	/* Commands sometimes fail. Resend only the ones
+	 * the device did not confirm. */
+	cmd->status = DEATHADDER2013_STATUS_NEW;
+	err = razer_usb_report_exec(priv->m->usb_ctx, &priv->packet_spacing,
+				    cmd, sizeof(*cmd),
+				    deathadder2013_check_reply,
+				    DEATHADDER2013_COMMAND_TRIES);
+	if (err == -EAGAIN) {
+		/* The device usually applied it anyway.
+		 * This was never treated as an error. */
+		razer_debug("razer-deathadder2013: Command %04X/%04X not "
+			    "confirmed (status %02X)\n",
+			    le16_to_cpu(cmd->command),
+			    le16_to_cpu(cmd->request), cmd->status);
+		return 0;
+	}
+	if (err) {
+		razer_error("razer-deathadder2013: Command %04X/%04X failed: %d\n",
+			    le16_to_cpu(cmd->command),
+			    le16_to_cpu(cmd->request), err);
+		return err;
 	}
 
 	return 0;
@@ -507,10 +499,16 @@ int razer_deathadder2013_init(struct razer_mouse *m,
 	priv->m = m;
 	m->drv_data = priv;
 
+	razer_event_spacing_init_adaptive(&priv->packet_spacing,
+					  DEATHADDER2013_PACKET_SPACING_MIN_MS,
+					  DEATHADDER2013_PACKET_SPACING_MS);
+	m->usb_ctx->pacing = &priv->packet_spacing;
+
 	err = razer_usb_add_used_interface(m->usb_ctx, 0, 0);
 
 	if (err)
 		goto err_free;
+	m->usb_ctx->prefer_hidraw = 1;
 
 	err = m->claim(m);
 	if (err) {
@@ -525,6 +523,8 @@ int razer_deathadder2013_init(struct razer_mouse *m,
 		goto err_release;
 	}
 	priv->fw_version = fwver;
+	razer_event_spacing_learn(&priv->packet_spacing, m->usb_ctx,
+				  priv->fw_version);
 	priv->frequency = RAZER_MOUSE_FREQ_1000HZ;
 
 	for (i = 0; i < DEATHADDER2013_NR_LEDS; i++)
@@ -553,7 +553,7 @@ int razer_deathadder2013_init(struct razer_mouse *m,
 			"Y", RAZER_AXIS_INDEPENDENT_DPIMAPPING, "Scroll", 0);
 
 	m->type = RAZER_MOUSETYPE_DEATHADDER;
-	razer_generic_usb_gen_idstr(usbdev, m->usb_ctx->h,
+	razer_generic_usb_gen_idstr(m->usb_ctx,
 				    "DeathAdder 2013 Edition", 1, NULL,
 				    m->idstr);
 
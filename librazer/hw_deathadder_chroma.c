@@ -19,6 +19,7 @@
 
 #include "hw_deathadder_chroma.h"
 #include "razer_private.h"
+#include "usb_async.h"
 
 #include <errno.h>
 #include <stdlib.h>
@@ -96,8 +97,11 @@ enum deathadder_chroma_constants {
 	    ARRAY_SIZE(deathadder_chroma_resolution_stages_list),
 
 	DEATHADDER_CHROMA_USB_SETUP_PACKET_VALUE = 0x300,
+	DEATHADDER_CHROMA_BUSY_STATUS = 0x01,
 	DEATHADDER_CHROMA_SUCCESS_STATUS = 0x02,
 	DEATHADDER_CHROMA_PACKET_SPACING_MS = 35,
+	DEATHADDER_CHROMA_PACKET_SPACING_MIN_MS = 2,
+	DEATHADDER_CHROMA_COMMAND_RETRIES = 3,
 
 	/*
 	 * Experiments suggest that the value in the 'magic' byte of the command
@@ -154,12 +158,22 @@ struct deathadder_chroma_rgb_color
 	uint8_t b;
 };
 
+/* Settings changed in a transaction, but not yet sent. */
+enum deathadder_chroma_dirty {
+	DEATHADDER_CHROMA_DIRTY_RESOLUTION = (1 << 0),
+	DEATHADDER_CHROMA_DIRTY_FREQUENCY = (1 << 1),
+	DEATHADDER_CHROMA_DIRTY_LED_STATE = (1 << 2),
+	DEATHADDER_CHROMA_DIRTY_LED_MODE = (1 << 3),
+	DEATHADDER_CHROMA_DIRTY_LED_COLOR = (1 << 4),
+};
+
 struct deathadder_chroma_led
 {
 	enum deathadder_chroma_led_id id;
 	enum deathadder_chroma_led_mode mode;
 	enum deathadder_chroma_led_state state;
 	struct deathadder_chroma_rgb_color color;
+	unsigned int dirty;
 };
 
 struct deathadder_chroma_driver_data
@@ -175,14 +189,15 @@ struct deathadder_chroma_driver_data
 	struct razer_axis axes[DEATHADDER_CHROMA_AXES_NUM];
 	uint16_t fw_version;
 	char serial[DEATHADDER_CHROMA_REQUEST_SIZE_GET_SERIAL_NO];
+	unsigned int dirty;
 };
 
-static uint8_t deathadder_chroma_checksum(struct deathadder_chroma_command *cmd)
+static uint8_t deathadder_chroma_checksum(const struct deathadder_chroma_command *cmd)
 {
 	size_t control_size;
 
 	control_size = sizeof(cmd->size) + sizeof(cmd->request);
-	return razer_xor8_checksum((uint8_t *)&cmd->size,
+	return razer_xor8_checksum((const uint8_t *)&cmd->size,
 				   control_size + cmd->size);
 }
 
@@ -202,31 +217,24 @@ static int deathadder_chroma_translate_frequency(enum razer_mouse_freq freq)
 	}
 }
 
-static int deathadder_chroma_usb_action(
-    struct razer_mouse *m, enum libusb_endpoint_direction direction,
-    enum libusb_standard_request request, uint16_t command,
-    struct deathadder_chroma_command *cmd)
+static int deathadder_chroma_check_reply(const void *_request, const void *_reply)
 {
-	int err;
-	struct deathadder_chroma_driver_data *drv_data;
-
-	drv_data = m->drv_data;
-
-	razer_event_spacing_enter(&drv_data->packet_spacing);
-	err = libusb_control_transfer(m->usb_ctx->h,
-				      direction | LIBUSB_REQUEST_TYPE_CLASS |
-					  LIBUSB_RECIPIENT_INTERFACE,
-				      request, command, 0, (unsigned char *)cmd,
-				      sizeof(*cmd), RAZER_USB_TIMEOUT);
-	razer_event_spacing_leave(&drv_data->packet_spacing);
+	const struct deathadder_chroma_command *reply = _reply;
+	uint8_t checksum;
 
-	if (err != sizeof(*cmd)) {
+	/* The read back status tells whether the packet
+	 * came too early. If so, retry with a larger spacing. */
+	checksum = deathadder_chroma_checksum(reply);
+	if (checksum != reply->checksum) {
 		razer_error("razer-deathadder-chroma: "
-			    "USB %s 0x%01X 0x%02X failed with %d\n",
-			    direction == LIBUSB_ENDPOINT_IN ? "read" : "write",
-			    request, command, err);
-		return err;
+			    "Command %02X %04X bad response checksum %02X "
+			    "(expected %02X)\n",
+			    reply->size, be16_to_cpu(reply->request),
+			    checksum, reply->checksum);
+		return -EBADMSG;
 	}
+	if (reply->status == DEATHADDER_CHROMA_BUSY_STATUS)
+		return -EBUSY;
 
 	return 0;
 }
@@ -234,37 +242,22 @@ static int deathadder_chroma_usb_action(
 static int deathadder_chroma_send_command(struct razer_mouse *m,
 					  struct deathadder_chroma_command *cmd)
 {
+	struct deathadder_chroma_driver_data *drv_data = m->drv_data;
 	int err;
-	uint8_t checksum;
 
 	cmd->checksum = deathadder_chroma_checksum(cmd);
-	err = deathadder_chroma_usb_action(
-	    m, LIBUSB_ENDPOINT_OUT, LIBUSB_REQUEST_SET_CONFIGURATION,
-	    DEATHADDER_CHROMA_USB_SETUP_PACKET_VALUE, cmd);
-	if (err)
-		return err;
-
-	err = deathadder_chroma_usb_action(
-	    m, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_CLEAR_FEATURE,
-	    DEATHADDER_CHROMA_USB_SETUP_PACKET_VALUE, cmd);
+	err = razer_usb_report_exec(m->usb_ctx, &drv_data->packet_spacing,
+				    cmd, sizeof(*cmd),
+				    deathadder_chroma_check_reply,
+				    DEATHADDER_CHROMA_COMMAND_RETRIES);
 	if (err)
 		return err;
 
-	checksum = deathadder_chroma_checksum(cmd);
-	if (checksum != cmd->checksum) {
-		razer_error("razer-deathadder-chroma: "
-			    "Command %02X %04X bad response checksum %02X "
-			    "(expected %02X)\n",
-			    cmd->size, be16_to_cpu(cmd->request), checksum,
-			    cmd->checksum);
-
-		return -EBADMSG;
-	}
-
-	if (cmd->status != DEATHADDER_CHROMA_SUCCESS_STATUS)
+	if (cmd->status != DEATHADDER_CHROMA_SUCCESS_STATUS) {
 		razer_error("razer-deathadder-chroma: "
 			    "Command %02X %04X failed with %02X\n",
 			    cmd->size, be16_to_cpu(cmd->request), cmd->status);
+	}
 
 	return 0;
 }
@@ -320,6 +313,8 @@ static int deathadder_chroma_send_get_firmware_command(struct razer_mouse *m)
 	fw_major = cmd.bvalue[0];
 	fw_minor = be16_to_cpu(cmd.value[0]);
 	drv_data->fw_version = (fw_major << 8) | fw_minor;
+	razer_event_spacing_learn(&drv_data->packet_spacing, m->usb_ctx,
+				  drv_data->fw_version);
 
 	return 0;
 }
@@ -425,6 +420,96 @@ deathadder_chroma_send_set_led_color_command(struct razer_mouse *m,
 	return deathadder_chroma_send_command(m, &cmd);
 }
 
+/* Send a setting now, or record it for the commit in a transaction. */
+static int deathadder_chroma_update(struct razer_mouse *m,
+				   unsigned int dirty,
+				   int (*send)(struct razer_mouse *m))
+{
+	struct deathadder_chroma_driver_data *drv_data = m->drv_data;
+
+	if (razer_mouse_in_transaction(m)) {
+		drv_data->dirty |= dirty;
+		return 0;
+	}
+
+	return send(m);
+}
+
+static int deathadder_chroma_update_led(struct razer_mouse *m,
+					struct deathadder_chroma_led *led,
+					unsigned int dirty,
+					int (*send)(struct razer_mouse *m,
+						    struct deathadder_chroma_led *led))
+{
+	if (razer_mouse_in_transaction(m)) {
+		led->dirty |= dirty;
+		return 0;
+	}
+
+	return send(m, led);
+}
+
+static int deathadder_chroma_commit_led(struct razer_mouse *m,
+					struct deathadder_chroma_led *led,
+					int force)
+{
+	int err;
+
+	if (force)
+		led->dirty = DEATHADDER_CHROMA_DIRTY_LED_STATE |
+			     DEATHADDER_CHROMA_DIRTY_LED_MODE |
+			     DEATHADDER_CHROMA_DIRTY_LED_COLOR;
+	if (led->dirty & DEATHADDER_CHROMA_DIRTY_LED_STATE) {
+		err = deathadder_chroma_send_set_led_state_command(m, led);
+		if (err)
+			return err;
+		led->dirty &= ~DEATHADDER_CHROMA_DIRTY_LED_STATE;
+	}
+	if (led->dirty & DEATHADDER_CHROMA_DIRTY_LED_MODE) {
+		err = deathadder_chroma_send_set_led_mode_command(m, led);
+		if (err)
+			return err;
+		led->dirty &= ~DEATHADDER_CHROMA_DIRTY_LED_MODE;
+	}
+	if (led->dirty & DEATHADDER_CHROMA_DIRTY_LED_COLOR) {
+		err = deathadder_chroma_send_set_led_color_command(m, led);
+		if (err)
+			return err;
+		led->dirty &= ~DEATHADDER_CHROMA_DIRTY_LED_COLOR;
+	}
+
+	return 0;
+}
+
+static int deathadder_chroma_commit(struct razer_mouse *m, int force)
+{
+	struct deathadder_chroma_driver_data *drv_data = m->drv_data;
+	int err;
+
+	if (!m->claim_count)
+		return -EBUSY;
+	if (force)
+		drv_data->dirty = DEATHADDER_CHROMA_DIRTY_RESOLUTION |
+				  DEATHADDER_CHROMA_DIRTY_FREQUENCY;
+	if (drv_data->dirty & DEATHADDER_CHROMA_DIRTY_RESOLUTION) {
+		err = deathadder_chroma_send_set_resolution_command(m);
+		if (err)
+			return err;
+		drv_data->dirty &= ~DEATHADDER_CHROMA_DIRTY_RESOLUTION;
+	}
+	if (drv_data->dirty & DEATHADDER_CHROMA_DIRTY_FREQUENCY) {
+		err = deathadder_chroma_send_set_frequency_command(m);
+		if (err)
+			return err;
+		drv_data->dirty &= ~DEATHADDER_CHROMA_DIRTY_FREQUENCY;
+	}
+	err = deathadder_chroma_commit_led(m, &drv_data->scroll_led, force);
+	if (err)
+		return err;
+
+	return deathadder_chroma_commit_led(m, &drv_data->logo_led, force);
+}
+
 static int deathadder_chroma_get_fw_version(struct razer_mouse *m)
 {
 	struct deathadder_chroma_driver_data *drv_data;
@@ -533,7 +618,9 @@ static int deathadder_chroma_change_dpimapping(struct razer_mouse_dpimapping *d,
 
 	drv_data = d->mouse->drv_data;
 	if (d == drv_data->current_dpimapping)
-		return deathadder_chroma_send_set_resolution_command(d->mouse);
+		return deathadder_chroma_update(d->mouse,
+				DEATHADDER_CHROMA_DIRTY_RESOLUTION,
+				deathadder_chroma_send_set_resolution_command);
 
 	return 0;
 }
@@ -560,8 +647,9 @@ static int deathadder_chroma_led_toggle_state(struct razer_led *led,
 		break;
 	}
 
-	return deathadder_chroma_send_set_led_state_command(led->u.mouse,
-							    priv_led);
+	return deathadder_chroma_update_led(led->u.mouse, priv_led,
+				DEATHADDER_CHROMA_DIRTY_LED_STATE,
+				deathadder_chroma_send_set_led_state_command);
 }
 
 static int
@@ -583,8 +671,9 @@ deathadder_chroma_led_change_color(struct razer_led *led,
 	priv_led->color = (struct deathadder_chroma_rgb_color){
 	    .r = new_color->r, .g = new_color->g, .b = new_color->b};
 
-	return deathadder_chroma_send_set_led_color_command(led->u.mouse,
-							    priv_led);
+	return deathadder_chroma_update_led(led->u.mouse, priv_led,
+				DEATHADDER_CHROMA_DIRTY_LED_COLOR,
+				deathadder_chroma_send_set_led_color_command);
 }
 
 static int deathadder_chroma_set_freq(struct razer_mouse_profile *p,
@@ -602,7 +691,9 @@ static int deathadder_chroma_set_freq(struct razer_mouse_profile *p,
 	drv_data = p->mouse->drv_data;
 	drv_data->current_freq = freq;
 
-	return deathadder_chroma_send_set_frequency_command(p->mouse);
+	return deathadder_chroma_update(p->mouse,
+				DEATHADDER_CHROMA_DIRTY_FREQUENCY,
+				deathadder_chroma_send_set_frequency_command);
 }
 
 static int deathadder_chroma_set_dpimapping(struct razer_mouse_profile *p,
@@ -617,7 +708,9 @@ static int deathadder_chroma_set_dpimapping(struct razer_mouse_profile *p,
 	drv_data = p->mouse->drv_data;
 	drv_data->current_dpimapping = &drv_data->dpimappings[d->nr];
 
-	return deathadder_chroma_send_set_resolution_command(p->mouse);
+	return deathadder_chroma_update(p->mouse,
+				DEATHADDER_CHROMA_DIRTY_RESOLUTION,
+				deathadder_chroma_send_set_resolution_command);
 }
 
 static int
@@ -667,8 +760,9 @@ static int deathadder_chroma_led_set_mode(struct razer_led *led,
 		return err;
 
 	priv_led->mode = err;
-	return deathadder_chroma_send_set_led_mode_command(led->u.mouse,
-							   priv_led);
+	return deathadder_chroma_update_led(led->u.mouse, priv_led,
+				DEATHADDER_CHROMA_DIRTY_LED_MODE,
+				deathadder_chroma_send_set_led_mode_command);
 }
 
 static int deathadder_chroma_get_leds(struct razer_mouse *m,
@@ -755,8 +849,10 @@ int razer_deathadder_chroma_init(struct razer_mouse *m,
 	if (!drv_data)
 		return -ENOMEM;
 
-	razer_event_spacing_init(&drv_data->packet_spacing,
-				 DEATHADDER_CHROMA_PACKET_SPACING_MS);
+	razer_event_spacing_init_adaptive(&drv_data->packet_spacing,
+					  DEATHADDER_CHROMA_PACKET_SPACING_MIN_MS,
+					  DEATHADDER_CHROMA_PACKET_SPACING_MS);
+	m->usb_ctx->pacing = &drv_data->packet_spacing;
 
 	for (i = 0; i < DEATHADDER_CHROMA_DPIMAPPINGS_NUM; ++i) {
 		drv_data->dpimappings[i] = (struct razer_mouse_dpimapping){
@@ -790,6 +886,7 @@ int razer_deathadder_chroma_init(struct razer_mouse *m,
 			0);
 
 	m->drv_data = drv_data;
+	m->usb_ctx->prefer_hidraw = 1;
 
 	if ((err = razer_usb_add_used_interface(m->usb_ctx, 0, 0)) ||
 	    (err = m->claim(m))) {
@@ -828,11 +925,12 @@ int razer_deathadder_chroma_init(struct razer_mouse *m,
 	    .get_dpimapping = deathadder_chroma_get_dpimapping,
 	    .set_dpimapping = deathadder_chroma_set_dpimapping};
 
-	razer_generic_usb_gen_idstr(usbdev, m->usb_ctx->h,
+	razer_generic_usb_gen_idstr(m->usb_ctx,
 				    DEATHADDER_CHROMA_DEVICE_NAME, false,
 				    drv_data->serial, m->idstr);
 
 	m->type = RAZER_MOUSETYPE_DEATHADDER;
+	m->commit = deathadder_chroma_commit;
 	m->get_fw_version = deathadder_chroma_get_fw_version;
 	m->global_get_leds = deathadder_chroma_get_leds;
 	m->get_profiles = deathadder_chroma_get_profiles;
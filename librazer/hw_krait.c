@@ -20,6 +20,7 @@
 
 #include "hw_krait.h"
 #include "razer_private.h"
+#include "usb_async.h"
 
 #include <errno.h>
 #include <stdlib.h>
@@ -45,14 +46,11 @@ static int krait_usb_write(struct krait_private *priv,
 {
 	int err;
 
-	err = libusb_control_transfer(
-		priv->m->usb_ctx->h,
-		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS |
-		LIBUSB_RECIPIENT_INTERFACE,
-		request, command, 0,
-		buf, size,
-		RAZER_USB_TIMEOUT);
-	if (err < 0 || (size_t)err != size)
+	err = razer_usb_ctrl_write(priv->m->usb_ctx,
+				   RAZER_USB_CMD_TYPE_DEFAULT,
+				   request, command, 0,
+				   buf, size);
+	if (err)
 		return err;
 	return 0;
 }
@@ -64,14 +62,11 @@ static int krait_usb_read(struct krait_private *priv,
 {
 	int err;
 
-	err = libusb_control_transfer(
-		priv->m->usb_ctx->h,
-		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS |
-		LIBUSB_RECIPIENT_INTERFACE,
-		request, command, 0,
-		(unsigned char *)buf, size,
-		RAZER_USB_TIMEOUT);
-	if (err < 0 || (size_t)err != size)
+	err = razer_usb_ctrl_read(priv->m->usb_ctx,
+				  RAZER_USB_CMD_TYPE_DEFAULT,
+				  request, command, 0,
+				  buf, size);
+	if (err)
 		return err;
 	return 0;
 }
@@ -212,7 +207,7 @@ int razer_krait_init(struct razer_mouse *m,
 	priv->cur_dpimapping = &priv->dpimapping[1];
 
 	m->type = RAZER_MOUSETYPE_KRAIT;
-	razer_generic_usb_gen_idstr(usbdev, NULL, "Krait", 1,
+	razer_generic_usb_gen_idstr(m->usb_ctx, "Krait", 1,
 				    NULL, m->idstr);
 
 	m->commit = krait_commit;
@@ -20,6 +20,7 @@
 
 #include "hw_lachesis.h"
 #include "razer_private.h"
+#include "usb_async.h"
 #include "buttonmapping.h"
 
 #include <errno.h>
@@ -97,6 +98,9 @@ struct lachesis_private {
 
 	uint16_t fw_version;
 
+	/* The spacing between two USB packets. */
+	struct razer_event_spacing packet_spacing;
+
 	/* The currently set LED states. */
 	enum razer_led_state led_states[LACHESIS_NR_LEDS];
 
@@ -183,18 +187,17 @@ static int lachesis_usb_write(struct lachesis_private *priv,
 {
 	int err;
 
-	err = libusb_control_transfer(
-		priv->m->usb_ctx->h,
-		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS |
-		LIBUSB_RECIPIENT_INTERFACE,
-		request, command, index,
-		buf, size,
-		RAZER_USB_TIMEOUT);
-	if (err < 0 || (size_t)err != size) {
+	razer_event_spacing_enter(&priv->packet_spacing);
+	err = razer_usb_ctrl_write(priv->m->usb_ctx,
+				   RAZER_USB_CMD_TYPE_DEFAULT,
+				   request, command, index,
+				   buf, size);
+	razer_event_spacing_leave(&priv->packet_spacing);
+	razer_event_spacing_result(&priv->packet_spacing, err);
+	if (err) {
 		razer_error("hw_lachesis: usb_write failed\n");
 		return -EIO;
 	}
-	razer_msleep(5);
 
 	return 0;
 }
@@ -205,18 +208,17 @@ static int lachesis_usb_read(struct lachesis_private *priv,
 {
 	int err;
 
-	err = libusb_control_transfer(
-		priv->m->usb_ctx->h,
-		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS |
-		LIBUSB_RECIPIENT_INTERFACE,
-		request, command, index,
-		buf, size,
-		RAZER_USB_TIMEOUT);
-	if (err < 0 || (size_t)err != size) {
+	razer_event_spacing_enter(&priv->packet_spacing);
+	err = razer_usb_ctrl_read(priv->m->usb_ctx,
+				  RAZER_USB_CMD_TYPE_DEFAULT,
+				  request, command, index,
+				  buf, size);
+	razer_event_spacing_leave(&priv->packet_spacing);
+	razer_event_spacing_result(&priv->packet_spacing, err);
+	if (err) {
 		razer_error("hw_lachesis: usb_read failed\n");
 		return -EIO;
 	}
-	razer_msleep(5);
 
 	return 0;
 }
@@ -750,6 +752,11 @@ int razer_lachesis_init(struct razer_mouse *m,
 	priv->m = m;
 	m->drv_data = priv;
 
+	/* The firmware needs at least 5 msec between USB packets.
+	 * There is no status read back, so the spacing is fixed. */
+	razer_event_spacing_init(&priv->packet_spacing, 5);
+	m->usb_ctx->pacing = &priv->packet_spacing;
+
 	err = razer_usb_add_used_interface(m->usb_ctx, 0, 0);
 	err |= razer_usb_add_used_interface(m->usb_ctx, 1, 0);
 	if (err) {
@@ -801,7 +808,7 @@ int razer_lachesis_init(struct razer_mouse *m,
 			    "Failed to read the configuration from hardware\n");
 		goto err_release;
 	}
-	razer_generic_usb_gen_idstr(usbdev, m->usb_ctx->h, "Lachesis Classic", 1,
+	razer_generic_usb_gen_idstr(m->usb_ctx, "Lachesis Classic", 1,
 				    NULL, m->idstr);
 
 	m->type = RAZER_MOUSETYPE_LACHESIS;
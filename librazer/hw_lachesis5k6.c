@@ -33,7 +33,7 @@ int razer_lachesis5k6_init(struct razer_mouse *m,
 	if (err)
 		return err;
 
-	razer_generic_usb_gen_idstr(usbdev, m->usb_ctx->h, "Lachesis 5600 DPI", 1,
+	razer_generic_usb_gen_idstr(m->usb_ctx, "Lachesis 5600 DPI", 1,
 				    razer_synapse_get_serial(m), m->idstr);
 
 	return 0;
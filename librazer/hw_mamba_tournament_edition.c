@@ -20,6 +20,7 @@
 
 #include "hw_mamba_tournament_edition.h"
 #include "razer_private.h"
+#include "usb_async.h"
 
 #include <errno.h>
 #include <stdlib.h>
@@ -118,8 +119,11 @@ enum mamba_te_constants
 	MAMBA_TE_DPIMAPPINGS_NUM		= ARRAY_SIZE(mamba_te_resolution_stages_list),
 
 	MAMBA_TE_USB_SETUP_PACKET_VALUE		= 0x300,
+	MAMBA_TE_BUSY_STATUS			= 0x01,
 	MAMBA_TE_SUCCESS_STATUS			= 0x02,
 	MAMBA_TE_PACKET_SPACING_MS		= 35,
+	MAMBA_TE_PACKET_SPACING_MIN_MS		= 2,
+	MAMBA_TE_COMMAND_RETRIES		= 3,
 
 	/*
 	 * Experiments suggest that the value in the 'magic' byte of the command
@@ -176,6 +180,15 @@ struct mamba_te_rgb_color
 	uint8_t b;
 };
 
+/* Settings changed in a transaction, but not yet sent.
+ * All LED requests send the complete LED setting, so the LED
+ * has one bit. */
+enum mamba_te_dirty {
+	MAMBA_TE_DIRTY_RESOLUTION = (1 << 0),
+	MAMBA_TE_DIRTY_FREQUENCY = (1 << 1),
+	MAMBA_TE_DIRTY_LED = (1 << 2),
+};
+
 struct mamba_te_led
 {
 	enum mamba_te_led_mode mode;
@@ -195,14 +208,15 @@ struct mamba_te_driver_data
 	struct razer_axis axes[MAMBA_TE_AXES_NUM];
 	uint16_t fw_version;
 	char serial[MAMBA_TE_REQUEST_SIZE_GET_SERIAL_NO];
+	unsigned int dirty;
 };
 
-static uint8_t mamba_te_checksum(struct mamba_te_command *cmd)
+static uint8_t mamba_te_checksum(const struct mamba_te_command *cmd)
 {
 	size_t control_size;
 
 	control_size = sizeof(cmd->size) + sizeof(cmd->request);
-	return razer_xor8_checksum((uint8_t *)&cmd->size, control_size + cmd->size);
+	return razer_xor8_checksum((const uint8_t *)&cmd->size, control_size + cmd->size);
 }
 
 static int mamba_te_translate_frequency(enum razer_mouse_freq freq)
@@ -220,33 +234,24 @@ static int mamba_te_translate_frequency(enum razer_mouse_freq freq)
 	}
 }
 
-static int mamba_te_usb_action(struct razer_mouse *m,
-			       enum libusb_endpoint_direction direction,
-			       enum libusb_standard_request request,
-			       uint16_t command,
-			       struct mamba_te_command *cmd)
+static int mamba_te_check_reply(const void *_request, const void *_reply)
 {
-	int err;
-	struct mamba_te_driver_data *drv_data;
-
-	drv_data = m->drv_data;
+	const struct mamba_te_command *reply = _reply;
+	uint8_t checksum;
 
-	razer_event_spacing_enter(&drv_data->packet_spacing);
-	err = libusb_control_transfer(m->usb_ctx->h,
-				      direction |
-				      LIBUSB_REQUEST_TYPE_CLASS |
-				      LIBUSB_RECIPIENT_INTERFACE,
-				      request, command, 0,
-				      (unsigned char *)cmd, sizeof(*cmd),
-				      RAZER_USB_TIMEOUT);
-	razer_event_spacing_leave(&drv_data->packet_spacing);
-	if (err != sizeof(*cmd)) {
+	/* The read back status tells whether the packet
+	 * came too early. If so, retry with a larger spacing. */
+	checksum = mamba_te_checksum(reply);
+	if (checksum != reply->checksum) {
 		razer_error("razer-mamba-tournament-edition: "
-			    "USB %s 0x%01X 0x%02X failed with %d\n",
-			    direction == LIBUSB_ENDPOINT_IN ? "read" : "write",
-			    request, command, err);
-		return err;
+			    "Command %02X %04X bad response checksum %02X "
+			    "(expected %02X)\n",
+			    reply->size, be16_to_cpu(reply->request),
+			    checksum, reply->checksum);
+		return -EBADMSG;
 	}
+	if (reply->status == MAMBA_TE_BUSY_STATUS)
+		return -EBUSY;
 
 	return 0;
 }
@@ -254,31 +259,17 @@ static int mamba_te_usb_action(struct razer_mouse *m,
 static int mamba_te_send_command(struct razer_mouse *m,
 				 struct mamba_te_command *cmd)
 {
+	struct mamba_te_driver_data *drv_data = m->drv_data;
 	int err;
-	uint8_t checksum;
 
 	cmd->checksum = mamba_te_checksum(cmd);
-	err = mamba_te_usb_action(m, LIBUSB_ENDPOINT_OUT,
-				  LIBUSB_REQUEST_SET_CONFIGURATION,
-				  MAMBA_TE_USB_SETUP_PACKET_VALUE, cmd);
-	if (err)
-		return err;
-	err = mamba_te_usb_action(m, LIBUSB_ENDPOINT_IN,
-				  LIBUSB_REQUEST_CLEAR_FEATURE,
-				  MAMBA_TE_USB_SETUP_PACKET_VALUE, cmd);
+	err = razer_usb_report_exec(m->usb_ctx, &drv_data->packet_spacing,
+				    cmd, sizeof(*cmd),
+				    mamba_te_check_reply,
+				    MAMBA_TE_COMMAND_RETRIES);
 	if (err)
 		return err;
 
-	checksum = mamba_te_checksum (cmd);
-	if (checksum != cmd->checksum) {
-		razer_error("razer-mamba-tournament-edition: "
-			    "Command %02X %04X bad response checksum %02X "
-			    "(expected %02X)\n",
-			    cmd->size, be16_to_cpu(cmd->request),
-			    checksum, cmd->checksum);
-		return -EBADMSG;
-	}
-
 	if (cmd->status != MAMBA_TE_SUCCESS_STATUS) {
 		razer_error("razer-mamba-tournament-edition: "
 			    "Command %02X %04X failed with %02X\n",
@@ -341,6 +332,8 @@ static int mamba_te_send_get_firmware_command(struct razer_mouse *m)
 	fw_major = cmd.bvalue[0];
 	fw_minor = be16_to_cpu(cmd.value[0]);
 	drv_data->fw_version = (fw_major << 8) | fw_minor;
+	razer_event_spacing_learn(&drv_data->packet_spacing, m->usb_ctx,
+				  drv_data->fw_version);
 
 	return 0;
 }
@@ -489,6 +482,68 @@ static int mamba_te_send_set_led_color_command(struct razer_mouse *m,
 	return mamba_te_send_command(m, &cmd);
 }
 
+/* Send a setting now, or record it for the commit in a transaction. */
+static int mamba_te_update(struct razer_mouse *m, unsigned int dirty,
+			   int (*send)(struct razer_mouse *m))
+{
+	struct mamba_te_driver_data *drv_data = m->drv_data;
+
+	if (razer_mouse_in_transaction(m)) {
+		drv_data->dirty |= dirty;
+		return 0;
+	}
+
+	return send(m);
+}
+
+static int mamba_te_update_led(struct razer_mouse *m,
+			       struct mamba_te_led *led,
+			       int (*send)(struct razer_mouse *m,
+					   struct mamba_te_led *led))
+{
+	struct mamba_te_driver_data *drv_data = m->drv_data;
+
+	if (razer_mouse_in_transaction(m)) {
+		drv_data->dirty |= MAMBA_TE_DIRTY_LED;
+		return 0;
+	}
+
+	return send(m, led);
+}
+
+static int mamba_te_commit(struct razer_mouse *m, int force)
+{
+	struct mamba_te_driver_data *drv_data = m->drv_data;
+	int err;
+
+	if (!m->claim_count)
+		return -EBUSY;
+	if (force)
+		drv_data->dirty = MAMBA_TE_DIRTY_RESOLUTION |
+				  MAMBA_TE_DIRTY_FREQUENCY |
+				  MAMBA_TE_DIRTY_LED;
+	if (drv_data->dirty & MAMBA_TE_DIRTY_RESOLUTION) {
+		err = mamba_te_send_set_resolution_command(m);
+		if (err)
+			return err;
+		drv_data->dirty &= ~MAMBA_TE_DIRTY_RESOLUTION;
+	}
+	if (drv_data->dirty & MAMBA_TE_DIRTY_FREQUENCY) {
+		err = mamba_te_send_set_frequency_command(m);
+		if (err)
+			return err;
+		drv_data->dirty &= ~MAMBA_TE_DIRTY_FREQUENCY;
+	}
+	if (drv_data->dirty & MAMBA_TE_DIRTY_LED) {
+		err = mamba_te_send_set_led_mode_command(m, &drv_data->led);
+		if (err)
+			return err;
+		drv_data->dirty &= ~MAMBA_TE_DIRTY_LED;
+	}
+
+	return 0;
+}
+
 static int mamba_te_get_fw_version(struct razer_mouse *m)
 {
 	struct mamba_te_driver_data *drv_data;
@@ -595,7 +650,8 @@ static int mamba_te_change_dpimapping(struct razer_mouse_dpimapping *d,
 
 	drv_data = d->mouse->drv_data;
 	if (d == drv_data->current_dpimapping)
-		return mamba_te_send_set_resolution_command(d->mouse);
+		return mamba_te_update(d->mouse, MAMBA_TE_DIRTY_RESOLUTION,
+				       mamba_te_send_set_resolution_command);
 
 	return 0;
 }
@@ -621,7 +677,8 @@ static int mamba_te_led_toggle_state(struct razer_led *led,
 		break;
 	}
 
-	return mamba_te_send_set_led_state_command(led->u.mouse, priv_led);
+	return mamba_te_update_led(led->u.mouse, priv_led,
+				   mamba_te_send_set_led_state_command);
 }
 
 static int mamba_te_led_change_color(struct razer_led *led,
@@ -644,7 +701,8 @@ static int mamba_te_led_change_color(struct razer_led *led,
 		.b = new_color->b,
 	};
 
-	return mamba_te_send_set_led_color_command(led->u.mouse, priv_led);
+	return mamba_te_update_led(led->u.mouse, priv_led,
+				   mamba_te_send_set_led_color_command);
 }
 
 static int mamba_te_set_freq(struct razer_mouse_profile *p,
@@ -663,7 +721,8 @@ static int mamba_te_set_freq(struct razer_mouse_profile *p,
 	drv_data = p->mouse->drv_data;
 	drv_data->current_freq = freq;
 
-	return mamba_te_send_set_frequency_command(p->mouse);
+	return mamba_te_update(p->mouse, MAMBA_TE_DIRTY_FREQUENCY,
+			       mamba_te_send_set_frequency_command);
 }
 
 static int mamba_te_set_dpimapping(struct razer_mouse_profile *p,
@@ -678,7 +737,8 @@ static int mamba_te_set_dpimapping(struct razer_mouse_profile *p,
 	drv_data = p->mouse->drv_data;
 	drv_data->current_dpimapping = &drv_data->dpimappings[d->nr];
 
-	return mamba_te_send_set_resolution_command(p->mouse);
+	return mamba_te_update(p->mouse, MAMBA_TE_DIRTY_RESOLUTION,
+			       mamba_te_send_set_resolution_command);
 }
 
 static int mamba_te_translate_led_mode(enum mamba_te_led_mode mode)
@@ -735,7 +795,8 @@ static int mamba_te_led_set_mode(struct razer_led *led,
 		return err;
 	priv_led->mode = err;
 
-	return mamba_te_send_set_led_mode_command(led->u.mouse, priv_led);
+	return mamba_te_update_led(led->u.mouse, priv_led,
+				   mamba_te_send_set_led_mode_command);
 }
 
 static int mamba_te_get_leds(struct razer_mouse *m,
@@ -793,8 +854,10 @@ int razer_mamba_te_init(struct razer_mouse *m,
 	if (!drv_data)
 		return -ENOMEM;
 
-	razer_event_spacing_init(&drv_data->packet_spacing,
-				 MAMBA_TE_PACKET_SPACING_MS);
+	razer_event_spacing_init_adaptive(&drv_data->packet_spacing,
+					  MAMBA_TE_PACKET_SPACING_MIN_MS,
+					  MAMBA_TE_PACKET_SPACING_MS);
+	m->usb_ctx->pacing = &drv_data->packet_spacing;
 
 	for (i = 0; i < MAMBA_TE_DPIMAPPINGS_NUM; i++) {
 		drv_data->dpimappings[i] = (struct razer_mouse_dpimapping){
@@ -823,6 +886,7 @@ int razer_mamba_te_init(struct razer_mouse *m,
 			"Scroll", 0, NULL, 0);
 
 	m->drv_data = drv_data;
+	m->usb_ctx->prefer_hidraw = 1;
 
 	if ((err = razer_usb_add_used_interface(m->usb_ctx, 0, 0)) ||
 	    (err = m->claim(m))) {
@@ -853,11 +917,12 @@ int razer_mamba_te_init(struct razer_mouse *m,
 		.set_dpimapping = mamba_te_set_dpimapping,
 	};
 
-	razer_generic_usb_gen_idstr(usbdev, m->usb_ctx->h,
+	razer_generic_usb_gen_idstr(m->usb_ctx,
 				    MAMBA_TE_DEVICE_NAME, false,
 				    drv_data->serial, m->idstr);
 
 	m->type = RAZER_MOUSETYPE_MAMBA_TE;
+	m->commit = mamba_te_commit;
 	m->get_fw_version = mamba_te_get_fw_version;
 	m->global_get_leds = mamba_te_get_leds;
 	m->get_profiles = mamba_te_get_profiles;
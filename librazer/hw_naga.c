@@ -23,6 +23,7 @@
 
 #include "hw_naga.h"
 #include "razer_private.h"
+#include "usb_async.h"
 
 #include <errno.h>
 #include <stdlib.h>
@@ -142,15 +143,13 @@ static int naga_usb_write(struct naga_private *priv,
 	int err;
 
 	razer_event_spacing_enter(&priv->packet_spacing);
-	err = libusb_control_transfer(
-		priv->m->usb_ctx->h,
-		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS |
-		LIBUSB_RECIPIENT_INTERFACE,
-		request, command, 0,
-		(unsigned char *)buf, size,
-		RAZER_USB_TIMEOUT);
+	err = razer_usb_ctrl_write(priv->m->usb_ctx,
+				   RAZER_USB_CMD_TYPE_DEFAULT,
+				   request, command, 0,
+				   buf, size);
 	razer_event_spacing_leave(&priv->packet_spacing);
-	if (err < 0 || (size_t)err != size) {
+	razer_event_spacing_result(&priv->packet_spacing, err);
+	if (err) {
 		razer_error("razer-naga: "
 			"USB write 0x%02X 0x%02X failed: %d\n",
 			request, command, err);
@@ -168,18 +167,16 @@ static int naga_usb_read(struct naga_private *priv,
 
 	for (try = 0; try < 3; try++) {
 		razer_event_spacing_enter(&priv->packet_spacing);
-		err = libusb_control_transfer(
-			priv->m->usb_ctx->h,
-			LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS |
-			LIBUSB_RECIPIENT_INTERFACE,
-			request, command, 0,
-			buf, size,
-			RAZER_USB_TIMEOUT);
+		err = razer_usb_ctrl_read(priv->m->usb_ctx,
+					  RAZER_USB_CMD_TYPE_DEFAULT,
+					  request, command, 0,
+					  buf, size);
 		razer_event_spacing_leave(&priv->packet_spacing);
-		if (err >= 0 && (size_t)err == size)
+		razer_event_spacing_result(&priv->packet_spacing, err);
+		if (!err)
 			break;
 	}
-	if (err < 0 || (size_t)err != size) {
+	if (err) {
 		razer_error("razer-naga: "
 			"USB read 0x%02X 0x%02X failed: %d\n",
 			request, command, err);
@@ -517,7 +514,7 @@ int razer_naga_init(struct razer_mouse *m,
 
 	BUILD_BUG_ON(sizeof(struct naga_command) != 90);
 
-	err = libusb_get_device_descriptor(usbdev, &desc);
+	err = razer_usb_get_device_descriptor(m->usb_ctx, &desc);
 	if (err) {
 		razer_error("hw_naga: Failed to get device descriptor\n");
 		return -EIO;
@@ -530,12 +527,17 @@ int razer_naga_init(struct razer_mouse *m,
 	m->drv_data = priv;
 
 	/* Need to wait some time between USB packets to
-	 * not confuse the firmware of some devices. */
+	 * not confuse the firmware of some devices.
+	 * The spacing is fixed. A completed transfer does not tell
+	 * whether the firmware kept up, and the status byte is not
+	 * known to report that either. */
 	razer_event_spacing_init(&priv->packet_spacing, 25);
+	m->usb_ctx->pacing = &priv->packet_spacing;
 
 	err = razer_usb_add_used_interface(m->usb_ctx, 0, 0);
 	if (err)
 		goto err_free;
+	m->usb_ctx->prefer_hidraw = 1;
 
 	err = m->claim(m);
 	if (err) {
@@ -622,7 +624,7 @@ int razer_naga_init(struct razer_mouse *m,
 	    model = "Naga 2014";
 	    break;
 	}
-	razer_generic_usb_gen_idstr(usbdev, m->usb_ctx->h, model, 1,
+	razer_generic_usb_gen_idstr(m->usb_ctx, model, 1,
 				    NULL, m->idstr);
 
 	m->get_fw_version = naga_get_fw_version;
@@ -21,6 +21,7 @@
 
 #include "hw_taipan.h"
 #include "razer_private.h"
+#include "usb_async.h"
 
 #include <errno.h>
 #include <stdlib.h>
@@ -84,14 +85,11 @@ static int taipan_usb_write(struct taipan_private *priv,
 {
 	int err;
 
-	err = libusb_control_transfer(
-		priv->m->usb_ctx->h,
-		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS |
-		LIBUSB_RECIPIENT_INTERFACE,
-		request, command, 0,
-		(unsigned char *)buf, size,
-		RAZER_USB_TIMEOUT);
-	if (err < 0 || (size_t)err != size) {
+	err = razer_usb_ctrl_write(priv->m->usb_ctx,
+				   RAZER_USB_CMD_TYPE_DEFAULT,
+				   request, command, 0,
+				   buf, size);
+	if (err) {
 		razer_error("razer-taipan: "
 			"USB write 0x%02X 0x%02X failed: %d\n",
 			request, command, err);
@@ -106,14 +104,11 @@ static int taipan_usb_read(struct taipan_private *priv,
 {
 	int err;
 
-	err = libusb_control_transfer(
-		priv->m->usb_ctx->h,
-		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS |
-		LIBUSB_RECIPIENT_INTERFACE,
-		request, command, 0,
-		buf, size,
-		RAZER_USB_TIMEOUT);
-	if (err < 0 || (size_t)err != size) {
+	err = razer_usb_ctrl_read(priv->m->usb_ctx,
+				  RAZER_USB_CMD_TYPE_DEFAULT,
+				  request, command, 0,
+				  buf, size);
+	if (err) {
 		razer_error("razer-taipan: "
 			"USB read 0x%02X 0x%02X failed: %d\n",
 			request, command, err);
@@ -465,6 +460,7 @@ int razer_taipan_init(struct razer_mouse *m,
 	err = razer_usb_add_used_interface(m->usb_ctx, 0, 0);
 	if (err)
 		goto err_free;
+	m->usb_ctx->prefer_hidraw = 1;
 
 	err = m->claim(m);
 	if (err) {
@@ -508,7 +504,7 @@ int razer_taipan_init(struct razer_mouse *m,
 			"Scroll", 0);
 
 	m->type = RAZER_MOUSETYPE_TAIPAN;
-	razer_generic_usb_gen_idstr(usbdev, m->usb_ctx->h, "Taipan", 1,
+	razer_generic_usb_gen_idstr(m->usb_ctx, "Taipan", 1,
 				    NULL, m->idstr);
 
 	m->get_fw_version = taipan_get_fw_version;
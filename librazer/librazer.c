@@ -16,6 +16,9 @@
 
 #include "librazer.h"
 #include "razer_private.h"
+#include "usb_async.h"
+#include "hidraw.h"
+#include "usb_emu.h"
 #include "config.h"
 #include "profile_emulation.h"
 
@@ -39,6 +42,8 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <pthread.h>
+#include <fcntl.h>
 
 
 enum razer_devtype {
@@ -181,8 +186,84 @@ static struct libusb_context *libusb_ctx;
 static struct razer_mouse *mice_list = NULL;
 /* We currently only have one handler. */
 static razer_event_handler_t event_handler;
-static struct config_file *razer_config_file = NULL;
+static struct mouse_config *razer_mouse_config = NULL;
+/* Protects razer_mouse_config and the config refcounts.
+ * Mice are configured from hotplug init threads and device workers. */
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
 static bool profile_emu_enabled;
+static unsigned int claim_lease_msec;
+
+enum mouse_config_type {
+	MOUSE_CONF_PROFILE,	/* Select the active profile. */
+	MOUSE_CONF_RES,		/* Set the DPI mapping of a profile. */
+	MOUSE_CONF_FREQ,	/* Set the frequency of a profile. */
+	MOUSE_CONF_LED,		/* Switch an LED on or off. */
+	MOUSE_CONF_MODE,	/* Set the mode of an LED. */
+	MOUSE_CONF_COLOR,	/* Set the color of an LED. */
+};
+
+/* A config item, parsed at razer_load_config() time. */
+struct mouse_config_item {
+	struct mouse_config_item *next;
+	enum mouse_config_type type;
+	/* The item name, for error messages. */
+	const char *item;
+	/* The profile number, starting at 1. 0 selects the active profile
+	 * for res and freq, and the global LEDs for led, mode and color. */
+	int profile;
+	/* The profile number, resolution or frequency. */
+	int value;
+	char led_name[64];
+	bool led_on;
+	enum razer_led_mode led_mode;
+	struct razer_rgb_color led_color;
+};
+
+/* A config section with its idstr glob split into the four fields. */
+struct mouse_config_section {
+	struct mouse_config_section *next;
+	const char *name;
+	char glob[RAZER_IDSTR_MAX_SIZE + 1];
+	char *glob_fields[4];
+	bool disabled;
+	struct mouse_config_item *items;
+};
+
+/* The compiled config file. The names point into file. */
+struct mouse_config {
+	/* The current config and every mouse it was applied to
+	 * hold a reference. */
+	unsigned int refcount;
+	struct config_file *file;
+	struct mouse_config_section *sections;
+};
+
+struct razer_hotplug_event {
+	struct razer_hotplug_event *next;
+	struct libusb_device *dev;
+	libusb_hotplug_event event;
+};
+
+static bool hotplug_enabled;
+static libusb_hotplug_callback_handle hotplug_handle;
+/* The hotplug callback runs in any thread that handles USB events.
+ * hotplug_lock protects hotplug_events. */
+static pthread_mutex_t hotplug_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct razer_hotplug_event *hotplug_events;
+/* Hotplugged mice that are being initialized on a thread.
+ * Protected by hotplug_lock. */
+static struct new_razer_usb_device *hotplug_inits;
+/* The running razer_usb_reconnect_guard_wait() calls.
+ * Protected by hotplug_lock. The hotplug events of a device are held
+ * back while it reconnects or a hotplug init runs on it, because the
+ * device of that mouse is in flux. */
+static struct razer_usb_reconnect_guard *hotplug_guards;
+/* A byte is written to hotplug_pipe when a hotplug init or a
+ * reconnect guard finishes, to wake up the event loop. */
+static int hotplug_pipe[2] = { -1, -1 };
+static razer_mouse_trylock_t mouse_trylock;
+static razer_mouse_unlock_t mouse_unlock;
+static razer_claim_lease_handler_t claim_lease_handler;
 
 razer_logfunc_t razer_logfunc_info;
 razer_logfunc_t razer_logfunc_error;
@@ -194,6 +275,11 @@ static inline bool razer_initialized(void)
 	return !!libusb_ctx;
 }
 
+struct libusb_context * razer_libusb_context(void)
+{
+	return libusb_ctx;
+}
+
 int razer_register_event_handler(razer_event_handler_t handler)
 {
 	if (event_handler)
@@ -274,7 +360,7 @@ static struct razer_mouse * mouse_list_find(struct razer_mouse *base,
 	uint8_t devaddr = libusb_get_device_address(udev);
 
 	razer_for_each_mouse(m, next, base) {
-		if (m->usb_ctx) {
+		if (m->usb_ctx && !m->usb_ctx->emu) {
 			if (libusb_get_bus_number(m->usb_ctx->dev) == busnr &&
 			    libusb_get_device_address(m->usb_ctx->dev) == devaddr)
 				return m;
@@ -332,46 +418,29 @@ static bool simple_globcmp(const char *string,
 	return 1; /* Match */
 }
 
-static bool mouse_idstr_glob_match(struct config_file *f,
-				   void *context, void *data,
-				   const char *section)
+/* Split an idstr (or idstr glob) into its four fields.
+ * buf receives a copy of idstr, which the fields point into. */
+static int split_idstr(const char *idstr, char *buf, size_t buf_size,
+		       char **fields)
 {
-	struct razer_mouse *m = context;
-	const char **matched_section = data;
-	char idstr[RAZER_IDSTR_MAX_SIZE + 1] = { 0, };
-	char *idstr_devtype, *idstr_devname, *idstr_buspos, *idstr_devid;
-	char globstr[RAZER_IDSTR_MAX_SIZE + 1] = { 0, };
-	char *globstr_devtype, *globstr_devname, *globstr_buspos, *globstr_devid;
+	if (strlen(idstr) >= buf_size)
+		return -ENAMETOOLONG;
+	strcpy(buf, idstr);
 
-	if (strlen(section) > RAZER_IDSTR_MAX_SIZE) {
-		razer_error("globbed idstr \"%s\" in config too long\n",
-			section);
-		return 1;
-	}
-	strcpy(globstr, section);
-	strcpy(idstr, m->idstr);
-	if (parse_idstr(globstr, &globstr_devtype, &globstr_devname,
-				 &globstr_buspos, &globstr_devid))
-		return 1;
-	if (parse_idstr(idstr, &idstr_devtype, &idstr_devname,
-			       &idstr_buspos, &idstr_devid)) {
-		razer_error("INTERNAL-ERROR: Failed to parse idstr \"%s\"\n",
-			idstr);
-		return 1;
-	}
+	return parse_idstr(buf, &fields[0], &fields[1], &fields[2], &fields[3]);
+}
 
-	if (!simple_globcmp(idstr_devtype, globstr_devtype))
-		return 1;
-	if (!simple_globcmp(idstr_devname, globstr_devname))
-		return 1;
-	if (!simple_globcmp(idstr_buspos, globstr_buspos))
-		return 1;
-	if (!simple_globcmp(idstr_devid, globstr_devid))
-		return 1;
+static bool mouse_config_section_match(const struct mouse_config_section *sect,
+				       char * const *idstr_fields)
+{
+	unsigned int i;
 
-	*matched_section = section;
+	for (i = 0; i < ARRAY_SIZE(sect->glob_fields); i++) {
+		if (!simple_globcmp(idstr_fields[i], sect->glob_fields[i]))
+			return 0;
+	}
 
-	return 0; /* Match */
+	return 1; /* Match */
 }
 
 static struct razer_mouse_profile * find_prof(struct razer_mouse *m, unsigned int nr)
@@ -415,391 +484,687 @@ static int parse_int_int_pair(const char *str, int *val0, int *val1)
 	return 0;
 }
 
-static bool mouse_apply_one_config(struct config_file *f,
-				   void *context, void *data,
-				   const char *section,
-				   const char *item,
-				   const char *value)
+/* Parse "[PROFILE:]VALUE". A missing profile is the active profile (0). */
+static int mouse_config_parse_prof_value(struct mouse_config_item *ci,
+					 const char *value)
+{
+	int err;
+
+	err = parse_int_int_pair(value, &ci->profile, &ci->value);
+	if (err == 1)
+		ci->profile = 0;
+	else if (err || ci->profile < 1)
+		return -EINVAL;
+	if (ci->value < 1)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* Parse "[PROFILE:]LEDNAME:SETTING". A missing profile selects
+ * the global LEDs (0). Returns the stripped SETTING in setting. */
+static int mouse_config_parse_led(struct mouse_config_item *ci,
+				  const char *value,
+				  char *a, char *b, char *c, size_t tmplen,
+				  const char **setting)
+{
+	const char *ledname;
+	int err;
+
+	err = razer_split_tuple(value, ':', tmplen, a, b, c, NULL);
+	if (err && err != -ENODATA)
+		return -EINVAL;
+	if (!strlen(a) || !strlen(b))
+		return -EINVAL;
+	if (strlen(c)) {
+		/* A profile was specified */
+		err = razer_string_to_int(razer_string_strip(a), &ci->profile);
+		if (err || ci->profile < 1)
+			return -EINVAL;
+		ledname = razer_string_strip(b);
+		*setting = razer_string_strip(c);
+	} else {
+		/* Modify global LEDs */
+		ci->profile = 0;
+		ledname = razer_string_strip(a);
+		*setting = razer_string_strip(b);
+	}
+	razer_strlcpy(ci->led_name, ledname, sizeof(ci->led_name));
+
+	return 0;
+}
+
+/* Parse one config item into ci.
+ * Returns -ENODATA for items that are not applied to the mouse. */
+static int mouse_config_parse_item(struct mouse_config_item *ci,
+				   const char *item, const char *value)
 {
-	struct razer_mouse *m = context;
-	struct razer_mouse_profile *prof;
-	bool *error_status = data;
-	int err, nr;
 	static const size_t tmplen = 128;
 	char a[tmplen], b[tmplen], c[tmplen];
+	const char *setting;
+	int err;
 
-//FIXME fixes for glob/prof configs
 	if (strcasecmp(item, "profile") == 0) {
-		int profile;
+		ci->type = MOUSE_CONF_PROFILE;
+		err = razer_string_to_int(value, &ci->value);
+		if (err || ci->value < 1)
+			return -EINVAL;
+	} else if (strcasecmp(item, "res") == 0) {
+		ci->type = MOUSE_CONF_RES;
+		return mouse_config_parse_prof_value(ci, value);
+	} else if (strcasecmp(item, "freq") == 0) {
+		ci->type = MOUSE_CONF_FREQ;
+		return mouse_config_parse_prof_value(ci, value);
+	} else if (strcasecmp(item, "led") == 0) {
+		ci->type = MOUSE_CONF_LED;
+		err = mouse_config_parse_led(ci, value, a, b, c, tmplen, &setting);
+		if (err)
+			return err;
+		return razer_string_to_bool(setting, &ci->led_on);
+	} else if (strcasecmp(item, "mode") == 0) {
+		ci->type = MOUSE_CONF_MODE;
+		err = mouse_config_parse_led(ci, value, a, b, c, tmplen, &setting);
+		if (err)
+			return err;
+		return razer_string_to_mode(setting, &ci->led_mode);
+	} else if (strcasecmp(item, "color") == 0) {
+		ci->type = MOUSE_CONF_COLOR;
+		err = mouse_config_parse_led(ci, value, a, b, c, tmplen, &setting);
+		if (err)
+			return err;
+		return razer_string_to_color(setting, &ci->led_color);
+	} else if (strcasecmp(item, "disabled") == 0) {
+		return -ENODATA;
+	} else
+		return -EINVAL;
 
-		err = razer_string_to_int(value, &profile);
-		if (err || profile < 1 || (unsigned int)profile > m->nr_profiles)
-			goto error;
-		if (m->set_active_profile) {
-			prof = find_prof(m, profile - 1);
-			if (!prof)
-				goto error;
-			err = m->set_active_profile(m, prof);
-			if (err)
-				goto error;
+	return 0;
+}
+
+static void mouse_config_free(struct mouse_config *conf)
+{
+	struct mouse_config_section *sect, *next_sect;
+	struct mouse_config_item *ci, *next_ci;
+
+	if (!conf)
+		return;
+	for (sect = conf->sections; sect; sect = next_sect) {
+		next_sect = sect->next;
+		for (ci = sect->items; ci; ci = next_ci) {
+			next_ci = ci->next;
+			razer_free(ci, sizeof(*ci));
 		}
-	} else if (strcasecmp(item, "res") == 0) {
-		int profile, resolution, i;
-		struct razer_mouse_dpimapping *mappings;
+		razer_free(sect, sizeof(*sect));
+	}
+	config_file_free(conf->file);
+	razer_free(conf, sizeof(*conf));
+}
 
-		err = parse_int_int_pair(value, &profile, &resolution);
-		if (err == 1) {
+/* Get a reference to the current config, or NULL if there is none. */
+static struct mouse_config * mouse_config_get(void)
+{
+	struct mouse_config *conf;
+
+	pthread_mutex_lock(&config_lock);
+	conf = razer_mouse_config;
+	if (conf)
+		conf->refcount++;
+	pthread_mutex_unlock(&config_lock);
+
+	return conf;
+}
+
+static void mouse_config_put(struct mouse_config *conf)
+{
+	bool last;
+
+	if (!conf)
+		return;
+	pthread_mutex_lock(&config_lock);
+	last = (--conf->refcount == 0);
+	pthread_mutex_unlock(&config_lock);
+	if (last)
+		mouse_config_free(conf);
+}
+
+static struct mouse_config_section * mouse_config_compile_section(const struct config_section *s)
+{
+	struct mouse_config_section *sect;
+	struct mouse_config_item *ci, **ci_tail;
+	const struct config_item *item;
+	bool have_disabled = 0;
+	int err;
+
+	sect = zalloc(sizeof(*sect));
+	if (!sect)
+		return NULL;
+	sect->name = s->name;
+	err = split_idstr(s->name, sect->glob, sizeof(sect->glob),
+			  sect->glob_fields);
+	if (err) {
+		razer_error("Config section \"%s\" is not a valid "
+			    "idstr glob. Ignoring it.\n", s->name);
+		razer_free(sect, sizeof(*sect));
+		return NULL;
+	}
+
+	ci_tail = &sect->items;
+	for (item = s->items; item; item = item->next) {
+		if (strcasecmp(item->name, "disabled") == 0) {
+			/* The first one counts. */
+			if (!have_disabled &&
+			    razer_string_to_bool(item->value, &sect->disabled))
+				goto invalid;
+			have_disabled = 1;
+			continue;
+		}
+		ci = zalloc(sizeof(*ci));
+		if (!ci) {
+			razer_error("Config section \"%s\": Out of memory\n",
+				    s->name);
+			break;
+		}
+		ci->item = item->name;
+		err = mouse_config_parse_item(ci, item->name, item->value);
+		if (err) {
+			razer_free(ci, sizeof(*ci));
+			if (err == -ENODATA)
+				continue;
+			goto invalid;
+		}
+		*ci_tail = ci;
+		ci_tail = &ci->next;
+		continue;
+invalid:
+		razer_error("Config section \"%s\" item \"%s\" "
+			"invalid.\n", s->name, item->name);
+	}
+
+	return sect;
+}
+
+/* Compile a parsed config file into pre-split section globs and
+ * typed items, so that applying it to a new mouse needs no parsing.
+ * Takes ownership of f. */
+static struct mouse_config * mouse_config_compile(struct config_file *f)
+{
+	struct mouse_config *conf;
+	struct mouse_config_section *sect, **sect_tail;
+	const struct config_section *s;
+
+	conf = zalloc(sizeof(*conf));
+	if (!conf) {
+		config_file_free(f);
+		return NULL;
+	}
+	conf->refcount = 1;
+	conf->file = f;
+
+	sect_tail = &conf->sections;
+	for (s = f->sections; s; s = s->next) {
+		sect = mouse_config_compile_section(s);
+		if (!sect)
+			continue;
+		*sect_tail = sect;
+		sect_tail = &sect->next;
+	}
+
+	return conf;
+}
+
+/* Get the LEDs of a profile, or the global LEDs if prof is NULL.
+ * Returns the number of LEDs or a negative error code. */
+static int mouse_config_get_leds(struct razer_mouse *m,
+				 struct razer_mouse_profile *prof,
+				 struct razer_led **leds)
+{
+	if (prof && prof->get_leds)
+		return prof->get_leds(prof, leds);
+	/* Try to fall back to global */
+	if (!m->global_get_leds)
+		return 0;
+	return m->global_get_leds(m, leds);
+}
+
+/* Apply one compiled config item.
+ * Returns 0 on success, 1 if the item is invalid for this mouse
+ * and is ignored, or a negative error code. */
+static int mouse_apply_one_config(struct razer_mouse *m,
+				  const struct mouse_config_item *ci)
+{
+	struct razer_mouse_profile *prof = NULL;
+	struct razer_mouse_dpimapping *mappings;
+	enum razer_mouse_freq *freqs;
+	struct razer_led *leds, *led;
+	int err, nr, i;
+
+//FIXME fixes for glob/prof configs
+	switch (ci->type) {
+	case MOUSE_CONF_PROFILE:
+		if ((unsigned int)ci->value > m->nr_profiles)
+			return -EINVAL;
+		if (!m->set_active_profile)
+			return 0;
+		prof = find_prof(m, ci->value - 1);
+		if (!prof)
+			return -EINVAL;
+		return m->set_active_profile(m, prof);
+	case MOUSE_CONF_RES:
+		if (ci->profile)
+			prof = find_prof(m, ci->profile - 1);
+		else
 			prof = m->get_active_profile(m);
-			profile = prof->nr + 1;
-		} else if (err)
-			goto error;
-		if (profile < 1 || resolution < 1)
-			goto error;
-		prof = find_prof(m, profile - 1);
 		if (!prof)
-			goto error;
+			return -EINVAL;
 		nr = m->supported_dpimappings(m, &mappings);
 		if (nr <= 0)
-			goto error;
+			return -EINVAL;
 		//FIXME dims
 		for (i = 0; i < nr; i++) {
-			if (resolution >= 100) {
-				if ((int)(mappings[i].res[RAZER_DIM_0]) != resolution)
+			if (ci->value >= 100) {
+				if ((int)(mappings[i].res[RAZER_DIM_0]) != ci->value)
 					continue;
 			} else {
-				if (mappings[i].nr != (unsigned int)resolution)
+				if (mappings[i].nr != (unsigned int)ci->value)
 					continue;
 			}
-			err = prof->set_dpimapping(prof, NULL, &mappings[i]);
-			if (err)
-				goto error;
-			goto ok;
+			return prof->set_dpimapping(prof, NULL, &mappings[i]);
 		}
-		goto invalid; /* res is invalid. Ignore it. */
-	} else if (strcasecmp(item, "freq") == 0) {
-		int profile, freq, i;
-		enum razer_mouse_freq *freqs;
-
-		err = parse_int_int_pair(value, &profile, &freq);
-		if (err == 1) {
+		return 1; /* res is invalid. Ignore it. */
+	case MOUSE_CONF_FREQ:
+		if (ci->profile)
+			prof = find_prof(m, ci->profile - 1);
+		else
 			prof = m->get_active_profile(m);
-			profile = prof->nr + 1;
-		} else if (err)
-			goto error;
-		if (profile < 1 || freq < 1)
-			goto error;
-		prof = find_prof(m, profile - 1);
 		if (!prof)
-			goto error;
+			return -EINVAL;
 		nr = m->supported_freqs(m, &freqs);
 		if (nr <= 0)
-			goto error;
+			return -EINVAL;
+		err = -EINVAL;
 		for (i = 0; i < nr; i++) {
-			if (freqs[i] != (enum razer_mouse_freq)freq)
+			if (freqs[i] != (enum razer_mouse_freq)ci->value)
 				continue;
 			if (!prof->set_freq)
-				goto invalid;
-			err = prof->set_freq(prof, freqs[i]);
-			razer_free_freq_list(freqs, nr);
-			if (err)
-				goto error;
-			goto ok;
+				err = 1;
+			else
+				err = prof->set_freq(prof, freqs[i]);
+			break;
 		}
 		razer_free_freq_list(freqs, nr);
-		goto error;
-	} else if (strcasecmp(item, "led") == 0) {
-		bool on;
-		struct razer_led *leds, *led;
-		const char *ledname, *ledstate;
-		int profile;
-
-		err = razer_split_tuple(value, ':', tmplen, a, b, c, NULL);
-		if (err && err != -ENODATA)
-			goto error;
-		if (!strlen(a) || !strlen(b))
-			goto error;
-		if (strlen(c)) {
-			/* A profile was specified */
-			err = razer_string_to_int(razer_string_strip(a), &profile);
-			if (err || profile < 1)
-				goto error;
-			prof = find_prof(m, profile - 1);
-			if (!prof)
-				goto error;
-			ledname = razer_string_strip(b);
-			ledstate = razer_string_strip(c);
-		} else {
-			/* Modify global LEDs */
-			prof = NULL;
-			ledname = razer_string_strip(a);
-			ledstate = razer_string_strip(b);
-		}
-		err = razer_string_to_bool(ledstate, &on);
-		if (err)
-			goto error;
-		if (prof) {
-			if (prof->get_leds) {
-				err = prof->get_leds(prof, &leds);
-			} else {
-				/* Try to fall back to global */
-				if (!m->global_get_leds)
-					goto ok; /* No LEDs. Ignore config. */
-				err = m->global_get_leds(m, &leds);
-			}
-		} else {
-			if (!m->global_get_leds)
-				goto ok; /* No LEDs. Ignore config. */
-			err = m->global_get_leds(m, &leds);
-		}
-		if (err < 0)
-			goto error;
-		if (err == 0)
-			goto ok; /* No LEDs. Ignore config. */
-		for (led = leds; led; led = led->next) {
-			if (strcasecmp(led->name, ledname) != 0)
-				continue;
-			if (!led->toggle_state) {
-				razer_free_leds(leds);
-				goto invalid;
-			}
-			err = led->toggle_state(led,
-				on ? RAZER_LED_ON : RAZER_LED_OFF);
-			razer_free_leds(leds);
-			if (err)
-				goto error;
-			goto ok;
-		}
-		razer_free_leds(leds);
-		goto error;
-	} else if (strcasecmp(item, "mode") == 0) {
-		enum razer_led_mode mode;
-		struct razer_led *leds, *led;
-		const char *ledname, *ledmode;
-		int profile;
-
-		err = razer_split_tuple(value, ':', tmplen, a, b, c, NULL);
-		if (err && err != -ENODATA)
-			goto error;
-		if (!strlen(a) || !strlen(b))
-			goto error;
-		if (strlen(c)) {
-			/* A profile was specified */
-			err = razer_string_to_int(razer_string_strip(a), &profile);
-			if (err || profile < 1)
-				goto error;
-			prof = find_prof(m, profile - 1);
+		return err;
+	case MOUSE_CONF_LED:
+	case MOUSE_CONF_MODE:
+	case MOUSE_CONF_COLOR:
+		if (ci->profile) {
+			prof = find_prof(m, ci->profile - 1);
 			if (!prof)
-				goto error;
-			ledname = razer_string_strip(b);
-			ledmode = razer_string_strip(c);
-		} else {
-			/* Modify global LEDs */
-			prof = NULL;
-			ledname = razer_string_strip(a);
-			ledmode = razer_string_strip(b);
+				return -EINVAL;
 		}
-		err = razer_string_to_mode(ledmode, &mode);
-		if (err)
-			goto error;
-		if (prof) {
-			if (prof->get_leds) {
-				err = prof->get_leds(prof, &leds);
-			} else {
-				/* Try to fall back to global */
-				if (!m->global_get_leds)
-					goto ok; /* No LEDs. Ignore config. */
-				err = m->global_get_leds(m, &leds);
-			}
-		} else {
-			if (!m->global_get_leds)
-				goto ok; /* No LEDs. Ignore config. */
-			err = m->global_get_leds(m, &leds);
-		}
-		if (err < 0)
-			goto error;
-		if (err == 0)
-			goto ok; /* No LEDs. Ignore config. */
+		nr = mouse_config_get_leds(m, prof, &leds);
+		if (nr <= 0)
+			return nr; /* No LEDs. Ignore config. */
+		err = -EINVAL;
 		for (led = leds; led; led = led->next) {
-			if (strcasecmp(led->name, ledname) != 0)
+			if (strcasecmp(led->name, ci->led_name) != 0)
 				continue;
-			if (!led->set_mode) {
-				razer_free_leds(leds);
-				goto invalid;
-			}
-			err = led->set_mode(led, mode);
-			razer_free_leds(leds);
-			if (err)
-				goto error;
-			goto ok;
-		}
-		razer_free_leds(leds);
-		goto error;
-	} else if (strcasecmp(item, "color") == 0) {
-		struct razer_rgb_color color;
-		struct razer_led *leds, *led;
-		const char *ledname, *ledcolor;
-		int profile;
-
-		err = razer_split_tuple(value, ':', tmplen, a, b, c, NULL);
-		if (err && err != -ENODATA)
-			goto error;
-		if (!strlen(a) || !strlen(b))
-			goto error;
-		if (strlen(c)) {
-			/* A profile was specified */
-			err = razer_string_to_int(razer_string_strip(a), &profile);
-			if (err || profile < 1)
-				goto error;
-			prof = find_prof(m, profile - 1);
-			if (!prof)
-				goto error;
-			ledname = razer_string_strip(b);
-			ledcolor = razer_string_strip(c);
-		} else {
-			/* Modify global LEDs */
-			prof = NULL;
-			ledname = razer_string_strip(a);
-			ledcolor = razer_string_strip(b);
-		}
-		err = razer_string_to_color(ledcolor, &color);
-		if (err)
-			goto error;
-		if (prof) {
-			if (prof->get_leds) {
-				err = prof->get_leds(prof, &leds);
+			if (ci->type == MOUSE_CONF_LED) {
+				err = led->toggle_state ?
+				      led->toggle_state(led, ci->led_on ?
+							RAZER_LED_ON : RAZER_LED_OFF) : 1;
+			} else if (ci->type == MOUSE_CONF_MODE) {
+				err = led->set_mode ?
+				      led->set_mode(led, ci->led_mode) : 1;
 			} else {
-				/* Try to fall back to global */
-				if (!m->global_get_leds)
-					goto ok; /* No LEDs. Ignore config. */
-				err = m->global_get_leds(m, &leds);
-			}
-		} else {
-			if (!m->global_get_leds)
-				goto ok; /* No LEDs. Ignore config. */
-			err = m->global_get_leds(m, &leds);
-		}
-		if (err < 0)
-			goto error;
-		if (err == 0)
-			goto ok; /* No LEDs. Ignore config. */
-		for (led = leds; led; led = led->next) {
-			if (strcasecmp(led->name, ledname) != 0)
-				continue;
-			if (!led->change_color) {
-				razer_free_leds(leds);
-				goto invalid;
+				err = led->change_color ?
+				      led->change_color(led, &ci->led_color) : 1;
 			}
-			err = led->change_color(led, &color);
-			razer_free_leds(leds);
-			if (err)
-				goto error;
-			goto ok;
+			break;
 		}
 		razer_free_leds(leds);
-		goto error;
-	} else if (strcasecmp(item, "disabled") == 0) {
-		goto ok;
-	} else
-		goto invalid;
-ok:
+		return err;
+	}
+
 	return 1;
-error:
-	*error_status = 1;
-invalid:
-	razer_error("Config section \"%s\" item \"%s\" "
-		"invalid.\n", section, item);
-	return *error_status ? 0 : 1;
 }
 
-static void mouse_apply_initial_config(struct razer_mouse *m)
+static const struct mouse_config_section * mouse_config_find_section(const struct mouse_config *conf,
+								     char * const *idstr_fields)
 {
-	const char *section = NULL;
-	int err;
-	bool error_status = 0;
+	const struct mouse_config_section *sect;
 
-	config_for_each_section(razer_config_file,
-				m, &section,
-				mouse_idstr_glob_match);
-	if (!section)
-		return;
-	if (config_get_bool(razer_config_file, section,
-			    "disabled", 0, CONF_NOCASE)) {
-		razer_debug("Initial config for \"%s\" is disabled. Not applying.\n",
-			    m->idstr);
-		return;
-	}
-	razer_debug("Applying config section \"%s\" to \"%s\"\n",
-		section, m->idstr);
-	err = m->claim(m);
-	if (err) {
-		razer_error("Failed to claim \"%s\"\n", m->idstr);
-		return;
-	}
-	config_for_each_item(razer_config_file,
-			     m, &error_status,
-			     section,
-			     mouse_apply_one_config);
-	m->release(m);
-	if (error_status) {
-		razer_error("Failed to apply initial config "
-			"to \"%s\"\n", m->idstr);
+	if (!conf)
+		return NULL;
+	for (sect = conf->sections; sect; sect = sect->next) {
+		if (mouse_config_section_match(sect, idstr_fields))
+			return sect;
 	}
+
+	return NULL;
 }
 
-static struct razer_usb_context * razer_create_usb_ctx(struct libusb_device *dev)
+/* Check whether two items configure the same setting. */
+static bool mouse_config_item_same_key(const struct mouse_config_item *a,
+				       const struct mouse_config_item *b)
 {
-	struct razer_usb_context *ctx;
-
-	ctx = zalloc(sizeof(*ctx));
-	if (!ctx)
-		return NULL;
-	ctx->dev = dev;
-	ctx->bConfigurationValue = 1;
+	if (a->type != b->type)
+		return 0;
+	switch (a->type) {
+	case MOUSE_CONF_PROFILE:
+		return 1;
+	case MOUSE_CONF_RES:
+	case MOUSE_CONF_FREQ:
+		return a->profile == b->profile;
+	case MOUSE_CONF_LED:
+	case MOUSE_CONF_MODE:
+	case MOUSE_CONF_COLOR:
+		return a->profile == b->profile &&
+		       strcasecmp(a->led_name, b->led_name) == 0;
+	}
 
-	return ctx;
+	return 0;
 }
 
-static int mouse_default_claim(struct razer_mouse *m)
+/* Check whether two items with the same key set the same value. */
+static bool mouse_config_item_same_value(const struct mouse_config_item *a,
+					 const struct mouse_config_item *b)
 {
-	return razer_generic_usb_claim_refcount(m->usb_ctx, &m->claim_count);
+	switch (a->type) {
+	case MOUSE_CONF_PROFILE:
+	case MOUSE_CONF_RES:
+	case MOUSE_CONF_FREQ:
+		return a->value == b->value;
+	case MOUSE_CONF_LED:
+		return a->led_on == b->led_on;
+	case MOUSE_CONF_MODE:
+		return a->led_mode == b->led_mode;
+	case MOUSE_CONF_COLOR:
+		return a->led_color.r == b->led_color.r &&
+		       a->led_color.g == b->led_color.g &&
+		       a->led_color.b == b->led_color.b;
+	}
+
+	return 0;
 }
 
-static int mouse_default_release(struct razer_mouse *m)
+/* Get the item of list that is in effect for the setting of ci.
+ * That is the last one with the same key. */
+static const struct mouse_config_item * mouse_config_effective(const struct mouse_config_item *list,
+							       const struct mouse_config_item *ci)
 {
-	int err = 0;
+	const struct mouse_config_item *i, *found = NULL;
 
-	if (m->claim_count == 1) {
-		if (m->commit)
-			err = m->commit(m, 0);
+	for (i = list; i; i = i->next) {
+		if (mouse_config_item_same_key(i, ci))
+			found = i;
 	}
-	razer_generic_usb_release_refcount(m->usb_ctx, &m->claim_count);
 
-	return err;
+	return found;
 }
 
-static struct razer_mouse * mouse_new(const struct razer_usb_device *id,
-				      struct libusb_device *udev)
+/* Check whether ci changes the effective settings of old_sect.
+ * old_sect is NULL, if no enabled section applied before.
+ * profile_changed is set, if the profile= item changed. */
+static bool mouse_config_item_changed(const struct mouse_config_item *ci,
+				      const struct mouse_config_section *old_sect,
+				      bool profile_changed)
 {
-	struct razer_event_data ev;
-	struct razer_mouse *m;
-	int err;
+	const struct mouse_config_item *old;
 
-	libusb_ref_device(udev);
+	/* A later item overrides this one. */
+	if (mouse_config_effective(ci, ci) != ci)
+		return 0;
+	if (!old_sect)
+		return 1;
+	/* Items without a profile number apply to the active profile.
+	 * They have to be applied to the newly selected one, too. */
+	if (profile_changed && !ci->profile &&
+	    (ci->type == MOUSE_CONF_RES || ci->type == MOUSE_CONF_FREQ))
+		return 1;
+	old = mouse_config_effective(old_sect->items, ci);
 
-	m = zalloc(sizeof(*m));
-	if (!m)
-		return NULL;
-	m->usb_ctx = razer_create_usb_ctx(udev);
-	if (!m->usb_ctx)
-		goto err_free_mouse;
+	return !old || !mouse_config_item_same_value(old, ci);
+}
 
-	/* Set default values and callbacks */
-	m->nr_profiles = 1;
-	m->claim = mouse_default_claim;
-	m->release = mouse_default_release;
+/* Apply the items of a section as one transaction.
+ * If diff is true, only the items that change the effective settings
+ * of old_sect are applied. The device is not touched, if there are none.
+ * Returns 0 on success or a negative error code. */
+static int mouse_apply_config(struct razer_mouse *m,
+			      const struct mouse_config_section *sect,
+			      const struct mouse_config_section *old_sect,
+			      bool diff)
+{
+	const struct mouse_config_item *ci;
+	unsigned int nr_items = 0;
+	int err, ret = 0;
+	bool profile_changed = 0;
+
+	for (ci = sect->items; ci; ci = ci->next) {
+		if (diff && ci->type == MOUSE_CONF_PROFILE &&
+		    mouse_config_item_changed(ci, old_sect, 0))
+			profile_changed = 1;
+	}
+	for (ci = sect->items; ci; ci = ci->next) {
+		if (!diff || mouse_config_item_changed(ci, old_sect, profile_changed))
+			nr_items++;
+	}
+	if (!nr_items) {
+		razer_debug("Config section \"%s\" does not change \"%s\"\n",
+			    sect->name, m->idstr);
+		return 0;
+	}
 
-	/* Call the driver init */
-	m->base_ops = id->u.mouse_ops;
+	razer_debug("Applying %u items of config section \"%s\" to \"%s\"\n",
+		nr_items, sect->name, m->idstr);
+	err = razer_mouse_begin(m);
+	if (err) {
+		razer_error("Failed to claim \"%s\"\n", m->idstr);
+		return err;
+	}
+	for (ci = sect->items; ci; ci = ci->next) {
+		if (diff && !mouse_config_item_changed(ci, old_sect, profile_changed))
+			continue;
+		err = mouse_apply_one_config(m, ci);
+		if (!err)
+			continue;
+		razer_error("Config section \"%s\" item \"%s\" "
+			"invalid.\n", sect->name, ci->item);
+		if (err < 0) {
+			ret = err;
+			break;
+		}
+	}
+	err = razer_mouse_commit(m);
+	if (err && !ret)
+		ret = err;
+	if (ret) {
+		razer_error("Failed to apply %s config "
+			"to \"%s\"\n", diff ? "changed" : "initial", m->idstr);
+	}
+
+	return ret;
+}
+
+static void mouse_apply_initial_config(struct razer_mouse *m)
+{
+	const struct mouse_config_section *sect;
+	char idstr[RAZER_IDSTR_MAX_SIZE + 1];
+	char *idstr_fields[4];
+
+	if (split_idstr(m->idstr, idstr, sizeof(idstr), idstr_fields)) {
+		razer_error("INTERNAL-ERROR: Failed to parse idstr \"%s\"\n",
+			m->idstr);
+		return;
+	}
+	/* The mouse keeps the config, to diff it on a reload. */
+	m->config = mouse_config_get();
+	sect = mouse_config_find_section(m->config, idstr_fields);
+	if (!sect)
+		return;
+	if (sect->disabled) {
+		razer_debug("Initial config for \"%s\" is disabled. Not applying.\n",
+			    m->idstr);
+		return;
+	}
+	mouse_apply_config(m, sect, NULL, 0);
+}
+
+/* Apply the difference between the effective settings of the old and
+ * the new config to a mouse.
+ * Returns 0 on success or a negative error code. */
+static int mouse_apply_config_diff(struct razer_mouse *m,
+				   const struct mouse_config *old_conf,
+				   const struct mouse_config *new_conf)
+{
+	const struct mouse_config_section *sect, *old_sect;
+	char idstr[RAZER_IDSTR_MAX_SIZE + 1];
+	char *idstr_fields[4];
+
+	if (split_idstr(m->idstr, idstr, sizeof(idstr), idstr_fields)) {
+		razer_error("INTERNAL-ERROR: Failed to parse idstr \"%s\"\n",
+			m->idstr);
+		return -EINVAL;
+	}
+	sect = mouse_config_find_section(new_conf, idstr_fields);
+	if (!sect || sect->disabled)
+		return 0;
+	old_sect = mouse_config_find_section(old_conf, idstr_fields);
+	if (old_sect && old_sect->disabled)
+		old_sect = NULL;
+
+	return mouse_apply_config(m, sect, old_sect, 1);
+}
+
+int razer_mouse_reload_config(struct razer_mouse *m)
+{
+	struct mouse_config *conf;
+	int err;
+
+	conf = mouse_config_get();
+	if (conf == m->config) {
+		mouse_config_put(conf);
+		return 0;
+	}
+	err = mouse_apply_config_diff(m, m->config, conf);
+	/* Do not retry a failed diff on the next reload. */
+	mouse_config_put(m->config);
+	m->config = conf;
+
+	return err;
+}
+
+static struct razer_usb_context * razer_create_usb_ctx(struct libusb_device *dev,
+							struct razer_usb_emu *emu)
+{
+	struct razer_usb_context *ctx;
+
+	ctx = zalloc(sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+	ctx->dev = dev;
+	ctx->bConfigurationValue = 1;
+	ctx->hidraw_fd = -1;
+	if (emu) {
+		ctx->emu = emu;
+		ctx->transport = &razer_usb_emu_transport;
+	}
+
+	return ctx;
+}
+
+static int mouse_default_claim(struct razer_mouse *m)
+{
+	if (m->usb_ctx->lease_held) {
+		/* The device is still claimed from the last lease. */
+		WARN_ON(m->claim_count);
+		m->usb_ctx->lease_held = 0;
+		m->usb_ctx->lease_expiring = 0;
+		m->claim_count = 1;
+		return 0;
+	}
+
+	return razer_generic_usb_claim_refcount(m->usb_ctx, &m->claim_count);
+}
+
+static int mouse_default_release(struct razer_mouse *m)
+{
+	int err = 0;
+
+	if (m->claim_count == 1) {
+		if (claim_lease_msec) {
+			/* Keep the device claimed for a while and
+			 * commit lazily, when the lease expires. */
+			m->claim_count = 0;
+			m->usb_ctx->lease_held = 1;
+			m->usb_ctx->lease_expire = razer_monotonic_usec() +
+						   (uint64_t)claim_lease_msec * 1000;
+			return 0;
+		}
+		if (m->commit)
+			err = m->commit(m, 0);
+	}
+	razer_generic_usb_release_refcount(m->usb_ctx, &m->claim_count);
+
+	return err;
+}
+
+/* Commit the device and drop the claim lease.
+ * The caller that released the device got success back, so a failed
+ * commit is reported through RAZER_EV_MOUSE_COMMIT_FAILED, if notify is set.
+ * Returns the commit error. */
+static int mouse_drop_claim_lease(struct razer_mouse *m, bool notify)
+{
+	struct razer_event_data ev;
+	int err;
+
+	if (!m->usb_ctx->lease_held)
+		return 0;
+	m->usb_ctx->lease_held = 0;
+	m->usb_ctx->lease_expiring = 0;
+	m->claim_count = 1;
+	err = m->release(m);
+	if (!err)
+		return 0;
+	razer_error("Failed to commit \"%s\" on lease expiry (%d)\n",
+		    m->idstr, err);
+	if (notify) {
+		ev.u.mouse = m;
+		ev.error = err;
+		razer_notify_event(RAZER_EV_MOUSE_COMMIT_FAILED, &ev);
+	}
+
+	return err;
+}
+
+/* Initialize a new mouse. udev is NULL for emulated devices.
+ * This does not touch the mice list or notify the event handler,
+ * so it may run in parallel for several devices. */
+static struct razer_mouse * mouse_init(const struct razer_usb_device *id,
+				       struct libusb_device *udev,
+				       struct razer_usb_emu *emu)
+{
+	struct razer_mouse *m;
+	int err;
+
+	if (udev)
+		libusb_ref_device(udev);
+
+	m = zalloc(sizeof(*m));
+	if (!m)
+		goto err_unref;
+	m->refcount = 1;
+	m->usb_ctx = razer_create_usb_ctx(udev, emu);
+	if (!m->usb_ctx)
+		goto err_free_mouse;
+
+	/* Set default values and callbacks */
+	m->nr_profiles = 1;
+	m->claim = mouse_default_claim;
+	m->release = mouse_default_release;
+
+	/* Call the driver init */
+	m->base_ops = id->u.mouse_ops;
 	err = m->base_ops->init(m, udev);
 	if (err)
 		goto err_free_ctx;
@@ -820,9 +1185,6 @@ static struct razer_mouse * mouse_new(const struct razer_usb_device *id,
 	razer_debug("Allocated and initialized new mouse \"%s\"\n",
 		m->idstr);
 
-	ev.u.mouse = m;
-	razer_notify_event(RAZER_EV_MOUSE_ADD, &ev);
-
 	return m;
 
 err_release:
@@ -831,34 +1193,79 @@ err_free_ctx:
 	razer_free(m->usb_ctx, sizeof(*(m->usb_ctx)));
 err_free_mouse:
 	razer_free(m, sizeof(*m));
-	libusb_unref_device(udev);
+err_unref:
+	if (udev)
+		libusb_unref_device(udev);
 
 	return NULL;
 }
 
-static void razer_free_mouse(struct razer_mouse *m)
+static void mouse_notify_add(struct razer_mouse *m)
 {
 	struct razer_event_data ev;
 
+	ev.u.mouse = m;
+	razer_notify_event(RAZER_EV_MOUSE_ADD, &ev);
+}
+
+/* Create a new mouse. udev is NULL for emulated devices. */
+static struct razer_mouse * mouse_new(const struct razer_usb_device *id,
+				      struct libusb_device *udev,
+				      struct razer_usb_emu *emu)
+{
+	struct razer_mouse *m;
+
+	m = mouse_init(id, udev, emu);
+	if (m)
+		mouse_notify_add(m);
+
+	return m;
+}
+
+/* Free a mouse. This does not notify the event handler. */
+static void mouse_destroy(struct razer_mouse *m)
+{
 	razer_debug("Freeing mouse (type=%d)\n",
 		m->base_ops->type);
 
-	ev.u.mouse = m;
-	razer_notify_event(RAZER_EV_MOUSE_REMOVE, &ev);
-
 	if (m->release == mouse_default_release) {
 		while (m->claim_count)
 			m->release(m);
+		mouse_drop_claim_lease(m, 0);
 	}
 	razer_mouse_exit_profile_emulation(m);
 	m->base_ops->release(m);
+	mouse_config_put(m->config);
 
-	libusb_unref_device(m->usb_ctx->dev);
+	if (m->usb_ctx->dev)
+		libusb_unref_device(m->usb_ctx->dev);
 
 	razer_free(m->usb_ctx, sizeof(*(m->usb_ctx)));
 	razer_free(m, sizeof(*m));
 }
 
+static void razer_free_mouse(struct razer_mouse *m)
+{
+	struct razer_event_data ev;
+
+	ev.u.mouse = m;
+	razer_notify_event(RAZER_EV_MOUSE_REMOVE, &ev);
+	razer_mouse_put(m);
+}
+
+void razer_mouse_get(struct razer_mouse *m)
+{
+	m->refcount++;
+}
+
+void razer_mouse_put(struct razer_mouse *m)
+{
+	if (WARN_ON(!m->refcount))
+		return;
+	if (!--m->refcount)
+		mouse_destroy(m);
+}
+
 static void razer_free_mice(struct razer_mouse *mouse_list)
 {
 	struct razer_mouse *mouse, *next;
@@ -870,11 +1277,153 @@ static void razer_free_mice(struct razer_mouse *mouse_list)
 	}
 }
 
+/* A device found by razer_rescan_mice() or hotplug
+ * that we don't have, yet. */
 struct new_razer_usb_device {
+	struct new_razer_usb_device *next;
 	const struct razer_usb_device *id;
-	struct usb_device *udev;
+	struct libusb_device *udev;
+	struct razer_usb_emu *emu;
+
+	struct razer_mouse *m;
+	pthread_t thread;
+	bool threaded;
+
+	/* Hotplug init only. Protected by hotplug_lock. */
+	bool done;
 };
 
+/* Check whether dev is being initialized by a hotplug init thread. */
+static bool hotplug_init_find(struct libusb_device *dev)
+{
+	struct new_razer_usb_device *new;
+	uint8_t busnr = libusb_get_bus_number(dev);
+	uint8_t devaddr = libusb_get_device_address(dev);
+	bool found = 0;
+
+	pthread_mutex_lock(&hotplug_lock);
+	for (new = hotplug_inits; new; new = new->next) {
+		if (libusb_get_bus_number(new->udev) == busnr &&
+		    libusb_get_device_address(new->udev) == devaddr) {
+			found = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&hotplug_lock);
+
+	return found;
+}
+
+static void new_mouse_queue(struct new_razer_usb_device **list,
+			    const struct razer_usb_device *id,
+			    struct libusb_device *udev,
+			    struct razer_usb_emu *emu)
+{
+	struct new_razer_usb_device *new, *i;
+
+	new = zalloc(sizeof(*new));
+	if (!new) {
+		razer_error("new_mouse_queue: Out of memory\n");
+		return;
+	}
+	new->id = id;
+	new->udev = udev;
+	new->emu = emu;
+
+	if (!*list) {
+		*list = new;
+	} else {
+		for (i = *list; i->next; i = i->next)
+			;
+		i->next = new;
+	}
+}
+
+static void * new_mouse_thread(void *arg)
+{
+	struct new_razer_usb_device *new = arg;
+
+	new->m = mouse_init(new->id, new->udev, new->emu);
+
+	return NULL;
+}
+
+/* Initialize all new devices in parallel, so the rescan takes as long as
+ * the slowest device instead of the sum of all. A single device is
+ * initialized in the calling thread. */
+static void new_mice_init(struct new_razer_usb_device *list)
+{
+	struct new_razer_usb_device *new;
+	int err;
+
+	for (new = list; new; new = new->next) {
+		if (list->next) {
+			err = pthread_create(&new->thread, NULL,
+					     new_mouse_thread, new);
+			if (!err) {
+				new->threaded = 1;
+				continue;
+			}
+			razer_debug("Failed to create init thread (%d). "
+				    "Initializing synchronously.\n", err);
+		}
+		new_mouse_thread(new);
+	}
+	for (new = list; new; new = new->next) {
+		if (new->threaded)
+			pthread_join(new->thread, NULL);
+	}
+}
+
+/* Add the initialized new mice to the mice list. */
+static void new_mice_add(struct new_razer_usb_device *list)
+{
+	struct new_razer_usb_device *new, *next;
+
+	for (new = list; new; new = next) {
+		next = new->next;
+		if (new->m) {
+			mouse_notify_add(new->m);
+			new->m->flags |= RAZER_MOUSEFLG_PRESENT;
+			mouse_list_add(&mice_list, new->m);
+		}
+		razer_free(new, sizeof(*new));
+	}
+}
+
+static struct razer_mouse * mouse_list_find_emu(struct razer_mouse *base,
+						struct razer_usb_emu *emu)
+{
+	struct razer_mouse *m, *next;
+
+	razer_for_each_mouse(m, next, base) {
+		if (m->usb_ctx && m->usb_ctx->emu == emu)
+			return m;
+	}
+
+	return NULL;
+}
+
+static void razer_rescan_emulated_mice(struct new_razer_usb_device **new_mice)
+{
+	struct razer_usb_emu *emu;
+	struct libusb_device_descriptor desc;
+	const struct razer_usb_device *id;
+	struct razer_mouse *m;
+
+	for (emu = razer_usb_emu_list(); emu; emu = emu->next) {
+		razer_usb_emu_get_descriptor(emu, &desc);
+		id = usbdev_lookup(&desc);
+		if (WARN_ON(!id || id->type != RAZER_DEVTYPE_MOUSE))
+			continue;
+		m = mouse_list_find_emu(mice_list, emu);
+		if (m)
+			m->flags |= RAZER_MOUSEFLG_PRESENT;
+		else
+			new_mouse_queue(new_mice, id, NULL, emu);
+	}
+}
+
 struct razer_mouse * razer_rescan_mice(void)
 {
 	struct libusb_device **devlist, *dev;
@@ -884,6 +1433,7 @@ struct razer_mouse * razer_rescan_mice(void)
 	struct libusb_device_descriptor desc;
 	const struct razer_usb_device *id;
 	struct razer_mouse *m, *next;
+	struct new_razer_usb_device *new_mice = NULL;
 
 	nr_devices = libusb_get_device_list(libusb_ctx, &devlist);
 	if (nr_devices < 0) {
@@ -905,49 +1455,552 @@ struct razer_mouse * razer_rescan_mice(void)
 		if (m) {
 			/* We already had this mouse */
 			m->flags |= RAZER_MOUSEFLG_PRESENT;
+		} else if (hotplug_init_find(dev)) {
+			/* A hotplug init thread is setting it up. */
 		} else {
 			/* We don't have this mouse, yet. Create a new one */
-			m = mouse_new(id, dev);
-			if (m) {
-				m->flags |= RAZER_MOUSEFLG_PRESENT;
-				mouse_list_add(&mice_list, m);
-			}
+			new_mouse_queue(&new_mice, id, dev, NULL);
+		}
+	}
+	razer_rescan_emulated_mice(&new_mice);
+	new_mice_init(new_mice);
+	new_mice_add(new_mice);
+	/* Remove mice that are not connected anymore. */
+	razer_for_each_mouse(m, next, mice_list) {
+		if (m->flags & RAZER_MOUSEFLG_PRESENT) {
+			m->flags &= ~RAZER_MOUSEFLG_PRESENT;
+			continue;
+		}
+		mouse_list_del(&mice_list, m);
+		razer_free_mouse(m);
+	}
+
+	libusb_free_device_list(devlist, 1);
+
+	return mice_list;
+}
+
+struct razer_mouse * razer_get_mice(void)
+{
+	return mice_list;
+}
+
+static int LIBUSB_CALL razer_hotplug_callback(struct libusb_context *ctx,
+					      struct libusb_device *dev,
+					      libusb_hotplug_event event,
+					      void *user_data)
+{
+	struct razer_hotplug_event *ev, *i;
+
+	/* We must not do synchronous USB I/O from within the libusb
+	 * event handler. Queue the event for razer_handle_hotplug_events(). */
+	ev = zalloc(sizeof(*ev));
+	if (!ev) {
+		razer_error("razer_hotplug_callback: Out of memory\n");
+		return 0;
+	}
+	ev->dev = libusb_ref_device(dev);
+	ev->event = event;
+
+	pthread_mutex_lock(&hotplug_lock);
+	if (!hotplug_events) {
+		hotplug_events = ev;
+	} else {
+		for (i = hotplug_events; i->next; i = i->next)
+			;
+		i->next = ev;
+	}
+	pthread_mutex_unlock(&hotplug_lock);
+
+	return 0;
+}
+
+static void hotplug_wakeup(void)
+{
+	char c = 0;
+
+	if (hotplug_pipe[1] < 0)
+		return;
+	if (write(hotplug_pipe[1], &c, 1) < 0)
+		razer_error("Failed to wake up the hotplug handler\n");
+}
+
+static void * hotplug_init_thread(void *arg)
+{
+	struct new_razer_usb_device *new = arg;
+
+	new->m = mouse_init(new->id, new->udev, NULL);
+
+	pthread_mutex_lock(&hotplug_lock);
+	new->done = 1;
+	pthread_mutex_unlock(&hotplug_lock);
+	hotplug_wakeup();
+
+	return NULL;
+}
+
+static void razer_hotplug_add(struct libusb_device *dev)
+{
+	struct libusb_device_descriptor desc;
+	const struct razer_usb_device *id;
+	struct new_razer_usb_device *new;
+	struct razer_mouse *m;
+	int err;
+
+	err = libusb_get_device_descriptor(dev, &desc);
+	if (err) {
+		razer_error("razer_hotplug_add: Failed to get descriptor\n");
+		return;
+	}
+	id = usbdev_lookup(&desc);
+	if (!id || id->type != RAZER_DEVTYPE_MOUSE)
+		return;
+	pthread_mutex_lock(&hotplug_lock);
+	m = mouse_list_find(mice_list, dev);
+	pthread_mutex_unlock(&hotplug_lock);
+	if (m) {
+		/* We already have this mouse. It probably just
+		 * reconnected through a reconnect guard. */
+		return;
+	}
+	if (hotplug_init_find(dev))
+		return;
+
+	/* Driver init takes a while. Don't block the caller's
+	 * event loop on it. */
+	new = zalloc(sizeof(*new));
+	if (!new) {
+		razer_error("razer_hotplug_add: Out of memory\n");
+		return;
+	}
+	new->id = id;
+	new->udev = libusb_ref_device(dev);
+
+	pthread_mutex_lock(&hotplug_lock);
+	new->next = hotplug_inits;
+	hotplug_inits = new;
+	pthread_mutex_unlock(&hotplug_lock);
+
+	err = pthread_create(&new->thread, NULL, hotplug_init_thread, new);
+	if (!err) {
+		new->threaded = 1;
+		return;
+	}
+	razer_debug("Failed to create init thread (%d). "
+		    "Initializing synchronously.\n", err);
+	hotplug_init_thread(new);
+}
+
+static void razer_hotplug_remove(struct libusb_device *dev)
+{
+	struct razer_mouse *m;
+
+	/* A reconnect guard that started after this event was popped
+	 * may swap the device of its mouse. */
+	pthread_mutex_lock(&hotplug_lock);
+	m = mouse_list_find(mice_list, dev);
+	pthread_mutex_unlock(&hotplug_lock);
+	if (!m)
+		return;
+	mouse_list_del(&mice_list, m);
+	razer_free_mouse(m);
+}
+
+/* Take the finished (or, if all is true, all) hotplug inits off
+ * the list and join their threads. */
+static struct new_razer_usb_device * hotplug_inits_reap(bool all)
+{
+	struct new_razer_usb_device *new, **pprev, *list = NULL;
+	char buf[64];
+
+	if (hotplug_pipe[0] >= 0) {
+		while (read(hotplug_pipe[0], buf, sizeof(buf)) > 0)
+			;
+	}
+
+	pthread_mutex_lock(&hotplug_lock);
+	pprev = &hotplug_inits;
+	while ((new = *pprev)) {
+		if (!new->done && !all) {
+			pprev = &new->next;
+			continue;
+		}
+		*pprev = new->next;
+		new->next = list;
+		list = new;
+	}
+	pthread_mutex_unlock(&hotplug_lock);
+
+	for (new = list; new; new = new->next) {
+		if (new->threaded)
+			pthread_join(new->thread, NULL);
+	}
+
+	return list;
+}
+
+static void hotplug_init_free(struct new_razer_usb_device *new)
+{
+	libusb_unref_device(new->udev);
+	razer_free(new, sizeof(*new));
+}
+
+/* Add the mice that finished hotplug init. */
+static void razer_handle_hotplug_inits(void)
+{
+	struct new_razer_usb_device *new, *next;
+
+	for (new = hotplug_inits_reap(0); new; new = next) {
+		next = new->next;
+		if (new->m) {
+			mouse_notify_add(new->m);
+			mouse_list_add(&mice_list, new->m);
+		}
+		hotplug_init_free(new);
+	}
+}
+
+int razer_hotplug_pollfd(void)
+{
+	return hotplug_pipe[0];
+}
+
+/* Check whether the event concerns a device that reconnects or is
+ * being initialized. The reconnected device may show up on another
+ * address, so guards match all devices of the same type on their bus.
+ * The caller holds hotplug_lock. */
+static bool hotplug_event_held(const struct razer_hotplug_event *ev)
+{
+	const struct razer_usb_reconnect_guard *guard;
+	const struct new_razer_usb_device *new;
+	struct libusb_device_descriptor desc;
+	uint8_t busnr = libusb_get_bus_number(ev->dev);
+	uint8_t devaddr = libusb_get_device_address(ev->dev);
+
+	for (guard = hotplug_guards; guard; guard = guard->next) {
+		if (guard->old_busnr != busnr)
+			continue;
+		if (guard->old_devaddr == devaddr)
+			return 1;
+		if (libusb_get_device_descriptor(ev->dev, &desc) == 0 &&
+		    desc.idVendor == guard->old_desc.idVendor &&
+		    desc.idProduct == guard->old_desc.idProduct)
+			return 1;
+	}
+	for (new = hotplug_inits; new; new = new->next) {
+		if (libusb_get_bus_number(new->udev) == busnr &&
+		    libusb_get_device_address(new->udev) == devaddr)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Pop the next hotplug event. Unless all is true, the events of
+ * a device are held back while it reconnects or is being initialized.
+ * A device that disconnects and reconnects through a reconnect guard
+ * would otherwise be removed, or show up twice.
+ * The events of other devices are not delayed. */
+static struct razer_hotplug_event * hotplug_event_pop(bool all)
+{
+	struct razer_hotplug_event *ev, **pprev;
+
+	pthread_mutex_lock(&hotplug_lock);
+	for (pprev = &hotplug_events; (ev = *pprev); pprev = &ev->next) {
+		if (all || !hotplug_event_held(ev)) {
+			*pprev = ev->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&hotplug_lock);
+
+	return ev;
+}
+
+void razer_handle_hotplug_events(void)
+{
+	struct razer_hotplug_event *ev;
+
+	razer_handle_hotplug_inits();
+	while ((ev = hotplug_event_pop(0))) {
+
+		if (ev->event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+			razer_hotplug_add(ev->dev);
+		else if (ev->event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+			razer_hotplug_remove(ev->dev);
+
+		libusb_unref_device(ev->dev);
+		razer_free(ev, sizeof(*ev));
+	}
+}
+
+int razer_enable_hotplug(void)
+{
+	int err;
+
+	if (!razer_initialized())
+		return -EINVAL;
+	if (hotplug_enabled)
+		return 0;
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return -EOPNOTSUPP;
+	if (pipe2(hotplug_pipe, O_NONBLOCK | O_CLOEXEC)) {
+		razer_error("razer_enable_hotplug: Failed to create "
+			    "pipe: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	err = libusb_hotplug_register_callback(libusb_ctx,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+			LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+			LIBUSB_HOTPLUG_NO_FLAGS,
+			RAZER_USB_VENDOR_ID, LIBUSB_HOTPLUG_MATCH_ANY,
+			LIBUSB_HOTPLUG_MATCH_ANY,
+			razer_hotplug_callback, NULL,
+			&hotplug_handle);
+	if (err) {
+		razer_error("razer_enable_hotplug: Failed to register "
+			    "hotplug callback (%d)\n", err);
+		close(hotplug_pipe[0]);
+		close(hotplug_pipe[1]);
+		hotplug_pipe[0] = hotplug_pipe[1] = -1;
+		return -EIO;
+	}
+	hotplug_enabled = 1;
+
+	return 0;
+}
+
+static void razer_disable_hotplug(void)
+{
+	struct razer_hotplug_event *ev;
+	struct new_razer_usb_device *new, *next;
+
+	if (!hotplug_enabled)
+		return;
+	libusb_hotplug_deregister_callback(libusb_ctx, hotplug_handle);
+	hotplug_enabled = 0;
+
+	while ((ev = hotplug_event_pop(1))) {
+		libusb_unref_device(ev->dev);
+		razer_free(ev, sizeof(*ev));
+	}
+	/* Wait for running inits. Their mice were never announced. */
+	for (new = hotplug_inits_reap(1); new; new = next) {
+		next = new->next;
+		if (new->m)
+			mouse_destroy(new->m);
+		hotplug_init_free(new);
+	}
+	close(hotplug_pipe[0]);
+	close(hotplug_pipe[1]);
+	hotplug_pipe[0] = hotplug_pipe[1] = -1;
+}
+
+void razer_set_claim_lease(unsigned int msec)
+{
+	struct razer_mouse *m, *next;
+
+	claim_lease_msec = msec;
+	if (!msec) {
+		razer_for_each_mouse(m, next, mice_list)
+			mouse_drop_claim_lease(m, 1);
+	}
+}
+
+void razer_set_mouse_lock_handlers(razer_mouse_trylock_t trylock,
+				   razer_mouse_unlock_t unlock)
+{
+	mouse_trylock = trylock;
+	mouse_unlock = unlock;
+}
+
+void razer_set_claim_lease_handler(razer_claim_lease_handler_t handler)
+{
+	claim_lease_handler = handler;
+}
+
+int razer_mouse_expire_claim_lease(struct razer_mouse *m)
+{
+	/* The lease may have been renewed since it expired. */
+	if (m->usb_ctx->lease_held &&
+	    m->usb_ctx->lease_expire > razer_monotonic_usec())
+		return 0;
+
+	return mouse_drop_claim_lease(m, 0);
+}
+
+static bool mouse_trylock_lease(struct razer_mouse *m)
+{
+	if (mouse_trylock)
+		return mouse_trylock(m) == 0;
+	return 1;
+}
+
+static void mouse_unlock_lease(struct razer_mouse *m)
+{
+	if (mouse_unlock)
+		mouse_unlock(m);
+}
+
+/* Returns the number of milliseconds until the next lease expires,
+ * or -1 if there is no lease. */
+int razer_claim_lease_timeout(void)
+{
+	struct razer_mouse *m, *next;
+	uint64_t now;
+	int msec, timeout = -1;
+
+	now = razer_monotonic_usec();
+	razer_for_each_mouse(m, next, mice_list) {
+		/* A busy mouse updates its lease when it is done.
+		 * The caller polls again after that. */
+		if (!mouse_trylock_lease(m))
+			continue;
+		/* The handler of an expiring lease drops it later. */
+		if (m->usb_ctx->lease_held && !m->usb_ctx->lease_expiring) {
+			if (m->usb_ctx->lease_expire > now)
+				msec = (m->usb_ctx->lease_expire - now + 999) / 1000;
+			else
+				msec = 0;
+			if (timeout < 0 || msec < timeout)
+				timeout = msec;
 		}
+		mouse_unlock_lease(m);
 	}
-	/* Remove mice that are not connected anymore. */
+
+	return timeout;
+}
+
+void razer_handle_claim_leases(void)
+{
+	struct razer_mouse *m, *next;
+	uint64_t now;
+	bool expired;
+
+	now = razer_monotonic_usec();
 	razer_for_each_mouse(m, next, mice_list) {
-		if (m->flags & RAZER_MOUSEFLG_PRESENT) {
-			m->flags &= ~RAZER_MOUSEFLG_PRESENT;
+		if (!mouse_trylock_lease(m))
 			continue;
+		expired = m->usb_ctx->lease_held &&
+			  !m->usb_ctx->lease_expiring &&
+			  m->usb_ctx->lease_expire <= now;
+		if (expired && claim_lease_handler) {
+			/* The application drops it, where it owns the mouse. */
+			m->usb_ctx->lease_expiring = 1;
+		} else if (expired) {
+			mouse_drop_claim_lease(m, 1);
+			expired = 0;
 		}
-		mouse_list_del(&mice_list, m);
-		razer_free_mouse(m);
+		mouse_unlock_lease(m);
+		if (expired)
+			claim_lease_handler(m);
 	}
+}
 
-	libusb_free_device_list(devlist, 1);
+int razer_mouse_reconfig(struct razer_mouse *m)
+{
+	int err;
 
-	return mice_list;
+	err = m->claim(m);
+	if (err)
+		return err;
+	if (m->commit)
+		err = m->commit(m, 1);
+	m->release(m);
+
+	return err;
 }
 
 int razer_reconfig_mice(void)
 {
 	struct razer_mouse *m, *next;
-	int err;
+	int err, first_err = 0;
 
+	/* A failing mouse must not keep the others unconfigured. */
 	razer_for_each_mouse(m, next, mice_list) {
-		err = m->claim(m);
-		if (err)
-			return err;
-		if (m->commit)
-			err = m->commit(m, 1);
-		m->release(m);
-		if (err)
-			return err;
+		err = razer_mouse_reconfig(m);
+		if (err) {
+			razer_error("Failed to reconfigure \"%s\" (%d)\n",
+				    m->idstr, err);
+			if (!first_err)
+				first_err = err;
+		}
 	}
 
+	return first_err;
+}
+
+int razer_mouse_begin(struct razer_mouse *m)
+{
+	int err;
+
+	err = m->claim(m);
+	if (err)
+		return err;
+	m->transaction_depth++;
+
 	return 0;
 }
 
+int razer_mouse_commit(struct razer_mouse *m)
+{
+	int err = 0, release_err;
+
+	if (WARN_ON(!m->transaction_depth))
+		return -EINVAL;
+	m->transaction_depth--;
+	/* Commit now. A claim lease would defer it. */
+	if (!m->transaction_depth && m->commit)
+		err = m->commit(m, 0);
+	release_err = m->release(m);
+
+	return err ? err : release_err;
+}
+
+struct razer_flash_progress {
+	razer_flash_progress_t callback;
+	void *priv;
+};
+
+int razer_mouse_flash_firmware(struct razer_mouse *m,
+			       const char *data, size_t len,
+			       razer_flash_progress_t progress,
+			       void *priv)
+{
+	struct razer_flash_progress fp = {
+		.callback	= progress,
+		.priv		= priv,
+	};
+	int err;
+
+	if (!m->flash_firmware)
+		return -EOPNOTSUPP;
+	m->flash_progress = &fp;
+	err = m->flash_firmware(m, data, len, RAZER_FW_FLASH_MAGIC);
+	m->flash_progress = NULL;
+
+	return err;
+}
+
+/* Called by the drivers while a firmware image is written. */
+void razer_flash_report_progress(struct razer_mouse *m,
+				 size_t done, size_t total)
+{
+	if (m && m->flash_progress && m->flash_progress->callback)
+		m->flash_progress->callback(m, done, total, m->flash_progress->priv);
+}
+
+void razer_mouse_get_info(struct razer_mouse *m, struct razer_mouse_info *info)
+{
+	memset(info, 0, sizeof(*info));
+	info->fw_version = -EOPNOTSUPP;
+	if (m->get_fw_version)
+		info->fw_version = m->get_fw_version(m);
+	if (m->usb_ctx)
+		razer_strlcpy(info->serial, m->usb_ctx->serial, sizeof(info->serial));
+}
+
 void razer_free_freq_list(enum razer_mouse_freq *freq_list, int count)
 {
 	if (freq_list)
@@ -987,15 +2040,54 @@ void razer_exit(void)
 {
 	if (!razer_initialized())
 		return;
+	razer_disable_hotplug();
 	razer_free_mice(mice_list);
 	mice_list = NULL;
-	config_file_free(razer_config_file);
-	razer_config_file = NULL;
+	mouse_config_put(razer_mouse_config);
+	razer_mouse_config = NULL;
+	razer_usb_emu_exit();
+	razer_set_state_cache("");
 
 	libusb_exit(libusb_ctx);
 	libusb_ctx = NULL;
 }
 
+int razer_add_emulated_mice(const char *model, unsigned int count,
+			    unsigned int latency_msec)
+{
+	if (!razer_initialized())
+		return -EINVAL;
+
+	return razer_usb_emu_add(model, count, latency_msec);
+}
+
+int razer_usb_get_device_descriptor(struct razer_usb_context *ctx,
+				    struct libusb_device_descriptor *desc)
+{
+	if (ctx->emu) {
+		razer_usb_emu_get_descriptor(ctx->emu, desc);
+		return 0;
+	}
+
+	return libusb_get_device_descriptor(ctx->dev, desc);
+}
+
+uint8_t razer_usb_get_bus_number(struct razer_usb_context *ctx)
+{
+	if (ctx->emu)
+		return 0;
+
+	return libusb_get_bus_number(ctx->dev);
+}
+
+uint8_t razer_usb_get_device_address(struct razer_usb_context *ctx)
+{
+	if (ctx->emu)
+		return ctx->emu->devaddr;
+
+	return libusb_get_device_address(ctx->dev);
+}
+
 int razer_usb_add_used_interface(struct razer_usb_context *ctx,
 				 int bInterfaceNumber,
 				 int bAlternateSetting)
@@ -1049,6 +2141,15 @@ int razer_generic_usb_claim(struct razer_usb_context *ctx)
 	int err, config;
 	struct razer_usb_interface *interf;
 
+	if (ctx->transport)
+		return ctx->transport->claim(ctx);
+	if (ctx->prefer_hidraw) {
+		err = razer_hidraw_transport.claim(ctx);
+		if (!err)
+			return 0;
+		razer_debug("hidraw not available (%d). Using libusb.\n", err);
+	}
+
 	err = libusb_open(ctx->dev, &ctx->h);
 	if (err) {
 		razer_error("razer_generic_usb_claim: Failed to open USB device\n");
@@ -1158,9 +2259,15 @@ void razer_generic_usb_release(struct razer_usb_context *ctx)
 {
 	int i;
 
+	if (ctx->transport) {
+		ctx->transport->release(ctx);
+		return;
+	}
+	razer_usb_cmd_flush(ctx);
 	for (i = ctx->nr_interfaces - 1; i >= 0; i--)
 		razer_usb_release(ctx, ctx->interfaces[i].bInterfaceNumber);
 	libusb_close(ctx->h);
+	ctx->h = NULL;
 }
 
 void razer_generic_usb_release_refcount(struct razer_usb_context *ctx,
@@ -1173,8 +2280,7 @@ void razer_generic_usb_release_refcount(struct razer_usb_context *ctx,
 	}
 }
 
-void razer_generic_usb_gen_idstr(struct libusb_device *udev,
-				 struct libusb_device_handle *h,
+void razer_generic_usb_gen_idstr(struct razer_usb_context *ctx,
 				 const char *devname,
 				 bool include_devicenr,
 				 const char *serial,
@@ -1189,17 +2295,19 @@ void razer_generic_usb_gen_idstr(struct libusb_device *udev,
 	int err;
 	struct libusb_device_descriptor devdesc;
 	struct razer_usb_context usbctx = {
-		.dev = udev,
-		.h = h,
+		.dev = ctx->dev,
+		.h = ctx->h,
 	};
 
-	err = libusb_get_device_descriptor(udev, &devdesc);
+	err = razer_usb_get_device_descriptor(ctx, &devdesc);
 	if (err) {
 		razer_error("razer_generic_usb_gen_idstr: Failed to get "
 			"device descriptor (%d)\n", err);
 		return;
 	}
 
+	if (ctx->emu && !(serial && strlen(serial)))
+		serial = razer_usb_emu_serial(ctx->emu);
 	if (serial && strlen(serial)) {
 		/* Enforce ASCII characters. */
 		for (i = 0; i < ARRAY_SIZE(serial_buf) - 1; i++) {
@@ -1219,7 +2327,7 @@ void razer_generic_usb_gen_idstr(struct libusb_device *udev,
 		err = -EINVAL;
 		if (serial_index) {
 			err = 0;
-			if (!h)
+			if (!ctx->h)
 				err = razer_generic_usb_claim(&usbctx);
 			if (err) {
 				razer_error("Failed to claim device for serial fetching.\n");
@@ -1227,7 +2335,7 @@ void razer_generic_usb_gen_idstr(struct libusb_device *udev,
 				err = libusb_get_string_descriptor_ascii(
 					usbctx.h, serial_index,
 					(unsigned char *)serial_buf, sizeof(serial_buf));
-				if (!h)
+				if (!ctx->h)
 					razer_generic_usb_release(&usbctx);
 				/* Enforce ASCII characters. */
 				for (i = 0; i < ARRAY_SIZE(serial_buf); i++) {
@@ -1243,16 +2351,18 @@ void razer_generic_usb_gen_idstr(struct libusb_device *udev,
 		serial = serial_buf;
 	}
 
+	razer_strlcpy(ctx->serial, serial, sizeof(ctx->serial));
+
 	snprintf(devid, sizeof(devid), "%04X-%04X-%s",
 		 devdesc.idVendor,
 		 devdesc.idProduct, serial);
 	if (include_devicenr) {
 		snprintf(buspos, sizeof(buspos), "%03d-%03d",
-			 libusb_get_bus_number(udev),
-			 libusb_get_device_address(udev));
+			 razer_usb_get_bus_number(ctx),
+			 razer_usb_get_device_address(ctx));
 	} else {
 		snprintf(buspos, sizeof(buspos), "%03d",
-			 libusb_get_bus_number(udev));
+			 razer_usb_get_bus_number(ctx));
 	}
 
 	razer_create_idstr(idstr_buf, BUSTYPESTR_USB, buspos,
@@ -1347,16 +2457,48 @@ int razer_usb_reconnect_guard_init(struct razer_usb_reconnect_guard *guard,
 	return 0;
 }
 
+static bool guard_dev_addr_matches(uint8_t dev_addr,
+				   uint8_t expected_dev_addr,
+				   bool exact_match)
+{
+	unsigned int j;
+
+	if (exact_match)
+		return dev_addr == expected_dev_addr;
+	for (j = 0; j < 64; j++) {
+		if (dev_addr == ((expected_dev_addr + j) & 0x7F))
+			return 1;
+	}
+
+	return 0;
+}
+
+static bool guard_dev_matches(struct libusb_device *dev,
+			      const struct libusb_device_descriptor *expected_desc,
+			      uint8_t expected_bus_number,
+			      uint8_t expected_dev_addr,
+			      bool exact_match)
+{
+	struct libusb_device_descriptor desc;
+
+	if (libusb_get_bus_number(dev) != expected_bus_number)
+		return 0;
+	if (libusb_get_device_descriptor(dev, &desc))
+		return 0;
+	if (memcmp(&desc, expected_desc, sizeof(desc)) != 0)
+		return 0;
+
+	return guard_dev_addr_matches(libusb_get_device_address(dev),
+				      expected_dev_addr, exact_match);
+}
+
 static struct libusb_device * guard_find_usb_dev(const struct libusb_device_descriptor *expected_desc,
 						 uint8_t expected_bus_number,
 						 uint8_t expected_dev_addr,
 						 bool exact_match)
 {
 	struct libusb_device **devlist, *dev;
-	struct libusb_device_descriptor desc;
-	uint8_t dev_addr;
-	ssize_t nr_devices, i, j;
-	int err;
+	ssize_t nr_devices, i;
 
 	nr_devices = libusb_get_device_list(libusb_ctx, &devlist);
 	if (nr_devices < 0) {
@@ -1366,23 +2508,9 @@ static struct libusb_device * guard_find_usb_dev(const struct libusb_device_desc
 
 	for (i = 0; i < nr_devices; i++) {
 		dev = devlist[i];
-		if (libusb_get_bus_number(dev) != expected_bus_number)
-			continue;
-		err = libusb_get_device_descriptor(dev, &desc);
-		if (err)
-			continue;
-		if (memcmp(&desc, expected_desc, sizeof(desc)) != 0)
-			continue;
-		dev_addr = libusb_get_device_address(dev);
-		if (exact_match) {
-			if (dev_addr == expected_dev_addr)
-				goto found_dev;
-		} else {
-			for (j = 0; j < 64; j++) {
-				if (dev_addr == ((expected_dev_addr + j) & 0x7F))
-					goto found_dev;
-			}
-		}
+		if (guard_dev_matches(dev, expected_desc, expected_bus_number,
+				      expected_dev_addr, exact_match))
+			goto found_dev;
 	}
 	libusb_free_device_list(devlist, 1);
 
@@ -1395,6 +2523,163 @@ found_dev:
 	return dev;
 }
 
+/* Hotplug state of one razer_usb_reconnect_guard_wait() call.
+ * The callback runs in whatever thread handles USB events, so
+ * left, dev and completed are protected by hotplug_lock. */
+struct guard_hotplug {
+	const struct razer_usb_reconnect_guard *guard;
+	uint8_t reconn_dev_addr;
+	bool registered;
+	libusb_hotplug_callback_handle handle;
+	/* Set, if we already did the one device list scan of this phase. */
+	bool scanned;
+
+	bool left;
+	struct libusb_device *dev;
+	int completed;
+};
+
+static int LIBUSB_CALL guard_hotplug_callback(struct libusb_context *ctx,
+					      struct libusb_device *dev,
+					      libusb_hotplug_event event,
+					      void *user_data)
+{
+	struct guard_hotplug *gh = user_data;
+	const struct razer_usb_reconnect_guard *guard = gh->guard;
+
+	pthread_mutex_lock(&hotplug_lock);
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+		if (libusb_get_bus_number(dev) == guard->old_busnr &&
+		    libusb_get_device_address(dev) == guard->old_devaddr) {
+			gh->left = 1;
+			gh->completed = 1;
+		}
+	} else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		if (!gh->dev &&
+		    guard_dev_matches(dev, &guard->old_desc, guard->old_busnr,
+				      gh->reconn_dev_addr, 0)) {
+			gh->dev = libusb_ref_device(dev);
+			gh->completed = 1;
+		}
+	}
+	pthread_mutex_unlock(&hotplug_lock);
+
+	return 0;
+}
+
+static void guard_hotplug_register(struct guard_hotplug *gh)
+{
+	const struct razer_usb_reconnect_guard *guard = gh->guard;
+	int err;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return;
+	err = libusb_hotplug_register_callback(libusb_ctx,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+			LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+			LIBUSB_HOTPLUG_NO_FLAGS,
+			guard->old_desc.idVendor, guard->old_desc.idProduct,
+			LIBUSB_HOTPLUG_MATCH_ANY,
+			guard_hotplug_callback, gh,
+			&gh->handle);
+	if (err) {
+		razer_debug("razer_usb_reconnect_guard: Failed to register "
+			    "hotplug callback (%d). Polling instead.\n", err);
+		return;
+	}
+	gh->registered = 1;
+}
+
+static void guard_hotplug_unregister(struct guard_hotplug *gh)
+{
+	if (gh->registered)
+		libusb_hotplug_deregister_callback(libusb_ctx, gh->handle);
+	gh->registered = 0;
+	if (gh->dev)
+		libusb_unref_device(gh->dev);
+	gh->dev = NULL;
+}
+
+/* Check whether the old device is gone. */
+static bool guard_disconnected(struct guard_hotplug *gh)
+{
+	const struct razer_usb_reconnect_guard *guard = gh->guard;
+	struct libusb_device *dev;
+	bool gone;
+
+	if (gh->registered) {
+		pthread_mutex_lock(&hotplug_lock);
+		/* A reconnect implies that the old device is gone. */
+		gone = gh->left || gh->dev;
+		pthread_mutex_unlock(&hotplug_lock);
+		if (gone)
+			return 1;
+		/* The device might have disconnected before we
+		 * registered the callback. Look once. */
+		if (gh->scanned)
+			return 0;
+		gh->scanned = 1;
+	}
+	dev = guard_find_usb_dev(&guard->old_desc,
+				 guard->old_busnr, guard->old_devaddr, 1);
+	if (!dev)
+		return 1;
+	libusb_unref_device(dev);
+
+	return 0;
+}
+
+/* Get a reference to the reconnected device, or NULL. */
+static struct libusb_device * guard_reconnected(struct guard_hotplug *gh)
+{
+	const struct razer_usb_reconnect_guard *guard = gh->guard;
+	struct libusb_device *dev;
+
+	if (gh->registered) {
+		pthread_mutex_lock(&hotplug_lock);
+		dev = gh->dev;
+		gh->dev = NULL;
+		pthread_mutex_unlock(&hotplug_lock);
+		if (dev)
+			return dev;
+		/* The device might have reconnected before we
+		 * registered the callback. Look once. */
+		if (gh->scanned)
+			return NULL;
+		gh->scanned = 1;
+	}
+
+	return guard_find_usb_dev(&guard->old_desc, guard->old_busnr,
+				  gh->reconn_dev_addr, 0);
+}
+
+/* Wait for the next hotplug event, or for one poll interval.
+ * Returns false, if the deadline passed. */
+static bool guard_wait_event(struct guard_hotplug *gh, uint64_t deadline)
+{
+	struct timeval tv;
+	uint64_t now, remaining;
+
+	now = razer_monotonic_usec();
+	if (now >= deadline)
+		return 0;
+	if (!gh->registered) {
+		razer_msleep(50);
+		return 1;
+	}
+
+	remaining = deadline - now;
+	tv.tv_sec = remaining / 1000000;
+	tv.tv_usec = remaining % 1000000;
+	libusb_handle_events_timeout_completed(libusb_ctx, &tv, &gh->completed);
+
+	pthread_mutex_lock(&hotplug_lock);
+	gh->completed = 0;
+	pthread_mutex_unlock(&hotplug_lock);
+
+	return 1;
+}
+
 /** razer_usb_reconnect_guard_wait - Protect against a firmware reconnect.
  *
  * If the firmware does a reconnect of the device on the USB bus, this
@@ -1402,18 +2687,31 @@ found_dev:
  * usb context information.
  * Of course, this is not completely race-free, but we try to do our best.
  *
+ * If libusb supports hotplug, this waits for the disconnect and reconnect
+ * events. Otherwise it falls back to polling the device list.
+ *
  * hub_reset is true, if the device reconnects due to a HUB reset event.
  * Otherwise it's assumed that the device reconnects on behalf of itself.
  * If hub_reset is false, the device is expected to be claimed.
  */
 int razer_usb_reconnect_guard_wait(struct razer_usb_reconnect_guard *guard, bool hub_reset)
 {
-	uint8_t reconn_dev_addr;
-	uint8_t old_dev_addr = guard->old_devaddr;
-	uint8_t old_bus_number = guard->old_busnr;
+	struct guard_hotplug gh = { .guard = guard, };
+	struct razer_usb_reconnect_guard **pguard;
 	int res, errorcode = 0;
 	struct libusb_device *dev;
-	struct timeval now, timeout;
+	uint64_t deadline;
+
+	/* Construct the device address it will reconnect on.
+	 * On a device reset the new dev addr will be >= reconn_dev_addr.
+	 */
+	gh.reconn_dev_addr = (guard->old_devaddr + 1) & 0x7F;
+
+	pthread_mutex_lock(&hotplug_lock);
+	guard->next = hotplug_guards;
+	hotplug_guards = guard;
+	pthread_mutex_unlock(&hotplug_lock);
+	guard_hotplug_register(&gh);
 
 	if (!hub_reset) {
 		/* Release the device, so the kernel can detect the bus reconnect. */
@@ -1421,16 +2719,9 @@ int razer_usb_reconnect_guard_wait(struct razer_usb_reconnect_guard *guard, bool
 	}
 
 	/* Wait for the device to disconnect. */
-	gettimeofday(&timeout, NULL);
-	razer_timeval_add_msec(&timeout, 3000);
-	while (1) {
-		dev = guard_find_usb_dev(&guard->old_desc,
-				old_bus_number, old_dev_addr, 1);
-		if (!dev)
-			break;
-		libusb_unref_device(dev);
-		gettimeofday(&now, NULL);
-		if (razer_timeval_after(&now, &timeout)) {
+	deadline = razer_monotonic_usec() + 3000 * 1000;
+	while (!guard_disconnected(&gh)) {
+		if (!guard_wait_event(&gh, deadline)) {
 			/* Timeout. Hm. It seems the device won't reconnect.
 			 * That's probably OK. Reclaim it. */
 			razer_error("razer_usb_reconnect_guard: "
@@ -1438,37 +2729,28 @@ int razer_usb_reconnect_guard_wait(struct razer_usb_reconnect_guard *guard, bool
 				"does not work anymore, try to replug it.\n");
 			goto reclaim;
 		}
-		razer_msleep(50);
 	}
 
-	/* Construct the device address it will reconnect on.
-	 * On a device reset the new dev addr will be >= reconn_dev_addr.
-	 */
-	reconn_dev_addr = (old_dev_addr + 1) & 0x7F;
-
 	/* Wait for the device to reconnect. */
-	gettimeofday(&timeout, NULL);
-	razer_timeval_add_msec(&timeout, 3000);
-	while (1) {
-		dev = guard_find_usb_dev(&guard->old_desc,
-				old_bus_number, reconn_dev_addr, 0);
-		if (dev)
-			break;
-		gettimeofday(&now, NULL);
-		if (razer_timeval_after(&now, &timeout)) {
+	gh.scanned = 0;
+	deadline = razer_monotonic_usec() + 3000 * 1000;
+	while (!(dev = guard_reconnected(&gh))) {
+		if (!guard_wait_event(&gh, deadline)) {
 			razer_error("razer_usb_reconnect_guard: The device did not "
 				"reconnect! It might not work anymore. Try to replug it.\n");
 			razer_debug("Expected reconnect busid was: %02u:>=%03u\n",
-				old_dev_addr, reconn_dev_addr);
+				guard->old_busnr, gh.reconn_dev_addr);
 			errorcode = -EBUSY;
 			goto out;
 		}
-		razer_msleep(50);
 	}
 
-	/* Update the USB context. */
+	/* Update the USB context. The hotplug handler looks up
+	 * mice by their device under hotplug_lock. */
+	pthread_mutex_lock(&hotplug_lock);
 	libusb_unref_device(guard->ctx->dev);
 	guard->ctx->dev = dev;
+	pthread_mutex_unlock(&hotplug_lock);
 
 reclaim:
 	if (!hub_reset) {
@@ -1476,33 +2758,72 @@ reclaim:
 		res = razer_generic_usb_claim(guard->ctx);
 		if (res) {
 			razer_error("razer_usb_reconnect_guard: Reclaim failed.\n");
-			return res;
+			errorcode = res;
 		}
 	}
 out:
+	guard_hotplug_unregister(&gh);
+	pthread_mutex_lock(&hotplug_lock);
+	for (pguard = &hotplug_guards; *pguard; pguard = &(*pguard)->next) {
+		if (*pguard == guard) {
+			*pguard = guard->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&hotplug_lock);
+	/* Handle the held back hotplug events. */
+	hotplug_wakeup();
+
 	return errorcode;
 }
 
+static int mouse_config_load(const char *path, struct mouse_config **conf)
+{
+	struct config_file *file;
+
+	*conf = NULL;
+	if (!path)
+		path = RAZER_DEFAULT_CONFIG;
+	if (!strlen(path))
+		return 0;
+	file = config_file_parse(path, 1);
+	if (!file)
+		return -ENOENT;
+	/* Invalid sections and items are reported here
+	 * and dropped from the compiled config. */
+	*conf = mouse_config_compile(file);
+	if (!*conf)
+		return -ENOMEM;
+
+	return 0;
+}
+
 int razer_load_config(const char *path)
 {
-	struct config_file *conf = NULL;
+	struct mouse_config *conf, *old_conf;
+	int err;
 
 	if (!razer_initialized())
 		return -EINVAL;
 
-	if (!path)
-		path = RAZER_DEFAULT_CONFIG;
-	if (strlen(path)) {
-		conf = config_file_parse(path, 1);
-		if (!conf)
-			return -ENOENT;
-	}
-	config_file_free(razer_config_file);
-	razer_config_file = conf;
+	err = mouse_config_load(path, &conf);
+	if (err)
+		return err;
+	pthread_mutex_lock(&config_lock);
+	old_conf = razer_mouse_config;
+	razer_mouse_config = conf;
+	pthread_mutex_unlock(&config_lock);
+	mouse_config_put(old_conf);
 
 	return 0;
 }
 
+int razer_reload_config(const char *path)
+{
+	/* The mice are updated by razer_mouse_reload_config(). */
+	return razer_load_config(path);
+}
+
 void razer_set_logging(razer_logfunc_t info_callback,
 		       razer_logfunc_t error_callback,
 		       razer_logfunc_t debug_callback)
@@ -1549,35 +2870,173 @@ struct razer_mouse_dpimapping * razer_mouse_get_dpimapping_by_res(
 	return mapping;
 }
 
+/* The spacing learned per device model and firmware version.
+ * A newly detected device starts with the spacing an identical
+ * device already proved to be safe with. */
+struct learned_spacing {
+	uint16_t vendor;
+	uint16_t product;
+	int fw;
+	unsigned int spacing_usec;
+};
+
+#define MAX_LEARNED_SPACINGS	32
+
+static struct learned_spacing learned_spacings[MAX_LEARNED_SPACINGS];
+static unsigned int nr_learned_spacings;
+static pthread_mutex_t learned_spacings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct learned_spacing * find_learned_spacing(struct razer_event_spacing *es)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_learned_spacings; i++) {
+		if (learned_spacings[i].vendor == es->learn_vendor &&
+		    learned_spacings[i].product == es->learn_product &&
+		    learned_spacings[i].fw == es->learn_fw)
+			return &learned_spacings[i];
+	}
+
+	return NULL;
+}
+
+static void store_learned_spacing(struct razer_event_spacing *es)
+{
+	struct learned_spacing *ls;
+
+	if (!es->learn_vendor)
+		return;
+	pthread_mutex_lock(&learned_spacings_lock);
+	ls = find_learned_spacing(es);
+	if (!ls && nr_learned_spacings < ARRAY_SIZE(learned_spacings)) {
+		ls = &learned_spacings[nr_learned_spacings++];
+		ls->vendor = es->learn_vendor;
+		ls->product = es->learn_product;
+		ls->fw = es->learn_fw;
+	}
+	if (ls)
+		ls->spacing_usec = es->spacing_usec;
+	pthread_mutex_unlock(&learned_spacings_lock);
+}
+
 void razer_event_spacing_init(struct razer_event_spacing *es,
 			      unsigned int msec)
+{
+	razer_event_spacing_init_adaptive(es, msec, msec);
+}
+
+/* Initialize an adaptive event spacing.
+ * The spacing starts at max_msec and shrinks towards min_msec as
+ * long as the device accepts the events. Errors back it off again. */
+void razer_event_spacing_init_adaptive(struct razer_event_spacing *es,
+				       unsigned int min_msec,
+				       unsigned int max_msec)
 {
 	memset(es, 0, sizeof(*es));
-	es->spacing_msec = msec;
+	es->min_usec = min(min_msec, max_msec) * 1000;
+	es->max_usec = max_msec * 1000;
+	es->spacing_usec = es->max_usec;
+}
+
+/* Store the learned spacing for the model and firmware version of the
+ * device and start with the spacing learned previously, if any. */
+void razer_event_spacing_learn(struct razer_event_spacing *es,
+			       struct razer_usb_context *ctx,
+			       int fw_version)
+{
+	struct libusb_device_descriptor desc;
+	struct learned_spacing *ls;
+
+	if (es->min_usec == es->max_usec)
+		return;
+	if (razer_usb_get_device_descriptor(ctx, &desc))
+		return;
+	es->learn_vendor = desc.idVendor;
+	es->learn_product = desc.idProduct;
+	es->learn_fw = fw_version;
+
+	pthread_mutex_lock(&learned_spacings_lock);
+	ls = find_learned_spacing(es);
+	if (ls) {
+		es->spacing_usec = ls->spacing_usec;
+		es->nr_ok = 0;
+	}
+	pthread_mutex_unlock(&learned_spacings_lock);
 }
 
 void razer_event_spacing_enter(struct razer_event_spacing *es)
 {
-	struct timeval now, deadline;
-	int wait_msec;
-
-	gettimeofday(&now, NULL);
-	deadline = es->last_event;
-	razer_timeval_add_msec(&deadline, es->spacing_msec);
-
-	if (razer_timeval_after(&deadline, &now)) {
-		/* We have to sleep long enough to ensure we're
-		 * after the deadline. */
-		wait_msec = razer_timeval_msec_diff(&deadline, &now);
-		WARN_ON(wait_msec < 0);
-		razer_msleep(wait_msec + 1);
-		gettimeofday(&now, NULL);
-		razer_error_on(razer_timeval_after(&deadline, &now),
+	uint64_t now, deadline;
+
+	now = razer_monotonic_usec();
+	if (!es->last_event)
+		return;
+	deadline = es->last_event + es->spacing_usec;
+	if (deadline > now) {
+		razer_usleep(deadline - now);
+		now = razer_monotonic_usec();
+		razer_error_on(deadline > now,
 			       "Failed to maintain event spacing\n");
 	}
+	/* Only back-to-back events tell about the achieved spacing. */
+	if (now - es->last_event <= es->max_usec) {
+		es->nr_spaced++;
+		es->spaced_usec += now - es->last_event;
+	}
 }
 
 void razer_event_spacing_leave(struct razer_event_spacing *es)
 {
-	gettimeofday(&es->last_event, NULL);
+	es->last_event = razer_monotonic_usec();
+	es->nr_events++;
+}
+
+/* Report the outcome of the last event.
+ * err is 0, if the device accepted the event. That is, if the transfer
+ * succeeded and the status read back from the device was OK.
+ * Errors double the spacing, up to the safe spacing.
+ * A run of successes shrinks it by a quarter, down to the minimum. */
+void razer_event_spacing_result(struct razer_event_spacing *es, int err)
+{
+	unsigned int spacing = es->spacing_usec;
+
+	if (err) {
+		es->nr_errors++;
+		es->nr_ok = 0;
+		spacing = max(spacing * 2, es->max_usec / 8);
+		spacing = min(spacing, es->max_usec);
+	} else {
+		if (++es->nr_ok < RAZER_EVENT_SPACING_SHRINK_AFTER)
+			return;
+		es->nr_ok = 0;
+		spacing = max(spacing - spacing / 4, es->min_usec);
+	}
+	if (spacing == es->spacing_usec)
+		return;
+	razer_debug("Event spacing %u -> %u usec\n",
+		    es->spacing_usec, spacing);
+	es->spacing_usec = spacing;
+	store_learned_spacing(es);
+}
+
+int razer_mouse_get_pacing_stats(struct razer_mouse *m,
+				 struct razer_pacing_stats *stats)
+{
+	struct razer_event_spacing *es;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!m->usb_ctx || !m->usb_ctx->pacing)
+		return -EOPNOTSUPP;
+	es = m->usb_ctx->pacing;
+
+	stats->spacing_usec = es->spacing_usec;
+	stats->min_usec = es->min_usec;
+	stats->max_usec = es->max_usec;
+	if (es->nr_spaced)
+		stats->achieved_usec = es->spaced_usec / es->nr_spaced;
+	stats->nr_packets = es->nr_events;
+	stats->nr_errors = es->nr_errors;
+	stats->nr_retries = es->nr_retries;
+
+	return 0;
 }
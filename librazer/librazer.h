@@ -31,12 +31,15 @@
 
 #define RAZER_IDSTR_MAX_SIZE	128
 #define RAZER_LEDNAME_MAX_SIZE	64
+#define RAZER_SERIAL_MAX_SIZE	64
 #define RAZER_DEFAULT_CONFIG	"/etc/razer.conf"
+#define RAZER_DEFAULT_STATE_DIR	"/var/lib/razercfg"
 
 /* Opaque internal data structures */
 struct razer_usb_context;
 struct razer_mouse_base_ops;
 struct razer_mouse_profile_emu;
+struct mouse_config;
 
 struct razer_mouse;
 
@@ -433,6 +436,8 @@ enum {
 	RAZER_NR_EMULATED_PROFILES	= 20,
 };
 
+struct razer_flash_progress;
+
 /** struct razer_mouse - Representation of a mouse device
   *
   * @next: Linked list to the next mouse.
@@ -457,8 +462,9 @@ enum {
   *	This usually doesn't have to be called explicitly.
   *	May be NULL.
   *
-  * @get_fw_version: Read the firmware version from the device.
+  * @get_fw_version: Get the firmware version.
   *     Returns the firmware version or a negative error code.
+  *     Returns the version read at init. Safe to call unclaimed.
   *
   * @flash_firmware: Upload a firmware image to the device and
   *     flash it to the PROM. &magic_number is &RAZER_FW_FLASH_MAGIC.
@@ -518,6 +524,11 @@ enum {
   *	The function return value is the positive list size or a negative
   *	error code.
   *	May be NULL.
+  *
+  * get_fw_version and the supported_... methods are metadata methods.
+  * They never access the device and may be called while it is not
+  * claimed. Claiming detaches the kernel driver, so status queries
+  * should only use these and razer_mouse_get_info().
   */
 struct razer_mouse {
 	struct razer_mouse *next;
@@ -567,7 +578,11 @@ struct razer_mouse {
 	const struct razer_mouse_base_ops *base_ops;
 	struct razer_usb_context *usb_ctx;
 	unsigned int claim_count;
+	unsigned int refcount;
+	unsigned int transaction_depth;
+	struct razer_flash_progress *flash_progress;
 	struct razer_mouse_profile_emu *profemu;
+	struct mouse_config *config;
 	void *drv_data; /* For use by the hardware driver */
 };
 
@@ -583,6 +598,104 @@ void razer_msleep(unsigned int msecs);
  */
 void razer_strlcpy(char *dst, const char *src, size_t dst_size);
 
+/** razer_mouse_begin - Begin a configuration transaction.
+  * Claims the mouse. Until the matching razer_mouse_commit(), drivers
+  * only record the changes in software, so a set of changes costs
+  * one hardware commit instead of one write per change.
+  * Transactions nest.
+  * Returns 0 on success or a negative error code.
+  */
+int razer_mouse_begin(struct razer_mouse *m);
+
+/** razer_mouse_commit - Commit a configuration transaction.
+  * Ends a transaction started with razer_mouse_begin().
+  * The outermost commit writes all recorded changes to the device.
+  * The mouse is always released.
+  * Returns 0 on success or a negative commit error code.
+  */
+int razer_mouse_commit(struct razer_mouse *m);
+
+/** razer_flash_progress_t - Firmware flash progress callback.
+  * @m: The mouse that is flashed.
+  * @done: The number of bytes written to the flash.
+  * @total: The size of the image.
+  * @priv: The private pointer passed to razer_mouse_flash_firmware().
+  */
+typedef void (*razer_flash_progress_t)(struct razer_mouse *m,
+				       size_t done, size_t total,
+				       void *priv);
+
+/** razer_mouse_flash_firmware - Flash a firmware image.
+  * Calls the flash_firmware method of the mouse.
+  * The mouse must be claimed.
+  * @progress: Called while the image is written. May be NULL.
+  * @priv: Passed to the progress callback.
+  * Returns 0 on success or a negative error code.
+  */
+int razer_mouse_flash_firmware(struct razer_mouse *m,
+			       const char *data, size_t len,
+			       razer_flash_progress_t progress,
+			       void *priv);
+
+/** struct razer_mouse_info - Static device metadata.
+  *
+  * @fw_version: The firmware version or a negative error code.
+  *
+  * @serial: The serial number of the device, as used in the idstr.
+  *	May be empty.
+  */
+struct razer_mouse_info {
+	int fw_version;
+	char serial[RAZER_SERIAL_MAX_SIZE];
+};
+
+/** razer_mouse_get_info - Get the static metadata of a mouse.
+  * The metadata is cached when the mouse is detected.
+  * This never accesses the device, so it is safe to call
+  * while the mouse is not claimed.
+  */
+void razer_mouse_get_info(struct razer_mouse *m, struct razer_mouse_info *info);
+
+/** struct razer_pacing_stats - Packet pacing statistics.
+  *
+  * @spacing_usec: The current minimum spacing between two packets,
+  *	in microseconds.
+  *
+  * @min_usec: The lower bound of the adaptive spacing.
+  *
+  * @max_usec: The upper bound of the adaptive spacing. This is the
+  *	spacing the device is known to be safe with.
+  *	Equal to min_usec, if the spacing is fixed.
+  *
+  * @achieved_usec: The average spacing achieved between back-to-back
+  *	packets, in microseconds. 0, if no packets were spaced, yet.
+  *
+  * @nr_packets: The number of packets sent.
+  *
+  * @nr_errors: The number of failed packets. Each failure backs off
+  *	the spacing.
+  *
+  * @nr_retries: The number of packets sent again, because the device
+  *	did not confirm them.
+  */
+struct razer_pacing_stats {
+	unsigned int spacing_usec;
+	unsigned int min_usec;
+	unsigned int max_usec;
+	unsigned int achieved_usec;
+	unsigned int nr_packets;
+	unsigned int nr_errors;
+	unsigned int nr_retries;
+};
+
+/** razer_mouse_get_pacing_stats - Get the packet pacing statistics.
+  * This never accesses the device, so it is safe to call
+  * while the mouse is not claimed.
+  * Returns -EOPNOTSUPP, if the driver does not pace its packets.
+  */
+int razer_mouse_get_pacing_stats(struct razer_mouse *m,
+				 struct razer_pacing_stats *stats);
+
 /** razer_free_freq_list - Free an array of frequencies.
   * This function frees a whole array of frequencies as returned
   * by the device methods.
@@ -609,9 +722,68 @@ void razer_free_leds(struct razer_led *led_list);
   */
 struct razer_mouse * razer_rescan_mice(void);
 
-/** razer_reconfig_mice - Reconfigure all detected razer mice.
+/** razer_get_mice - Get the list of detected razer mice.
+  * Returns a pointer to the linked list of mice. The list changes
+  * on razer_rescan_mice() and on hotplug events.
+  */
+struct razer_mouse * razer_get_mice(void);
+
+/** razer_mouse_get - Take a reference to a mouse.
+  * A mouse that is removed (RAZER_EV_MOUSE_REMOVE) is freed once the
+  * last reference is dropped. Until then, its methods may still be
+  * called. They fail, as the device is gone.
+  * The references must be dropped before razer_exit().
+  * Call this from the thread that calls razer_handle_events().
+  */
+void razer_mouse_get(struct razer_mouse *m);
+
+/** razer_mouse_put - Drop a reference to a mouse.
+  * Call this from the thread that calls razer_handle_events().
+  */
+void razer_mouse_put(struct razer_mouse *m);
+
+/** razer_enable_hotplug - Enable USB hotplug detection.
+  * Razer mice are added and removed incrementally from within
+  * razer_handle_events(), as they are plugged and unplugged.
+  * New mice are initialized on a background thread and show up
+  * in a later razer_handle_events() call, once that finished.
+  * Returns 0 on success or a negative error code.
+  * Returns -EOPNOTSUPP, if libusb does not support hotplug on this system.
+  */
+int razer_enable_hotplug(void);
+
+/** razer_set_claim_lease - Set the claim lease timeout.
+  * If nonzero, a mouse stays claimed for msec milliseconds after
+  * the last release, so that a burst of commands only claims it once.
+  * The pending changes are committed, when the lease expires.
+  * Leases expire from within razer_handle_events(). A failed commit
+  * is reported through RAZER_EV_MOUSE_COMMIT_FAILED.
+  * See razer_set_claim_lease_handler() to commit somewhere else.
+  * If zero (the default), the mouse is committed and released immediately.
+  */
+void razer_set_claim_lease(unsigned int msec);
+
+/** razer_add_emulated_mice - Add virtual mice backed by an in-process emulator.
+  * model is one of "naga", "taipan", "deathadder-chroma" or "lachesis5k6".
+  * count is the number of mice to add.
+  * latency_msec is the emulated latency of each USB packet.
+  * The mice appear on the next razer_rescan_mice().
+  * Returns 0 on success or a negative error code.
+  */
+int razer_add_emulated_mice(const char *model, unsigned int count,
+			    unsigned int latency_msec);
+
+/** razer_mouse_reconfig - Rewrite the whole configuration of a mouse.
+  * This writes the current state to the device again, for example
+  * after the device lost it in a system suspend.
   * Returns 0 on success or an error code.
   */
+int razer_mouse_reconfig(struct razer_mouse *m);
+
+/** razer_reconfig_mice - Reconfigure all detected razer mice.
+  * A mouse that fails does not stop the others from being reconfigured.
+  * Returns 0 on success or the error code of the first failed mouse.
+  */
 int razer_reconfig_mice(void);
 
 /** razer_for_each_mouse - Convenience helper for traversing a mouse list
@@ -632,14 +804,19 @@ int razer_reconfig_mice(void);
 enum razer_event {
 	RAZER_EV_MOUSE_ADD,
 	RAZER_EV_MOUSE_REMOVE,
+	/* A lazy commit on claim lease expiry failed. The hardware
+	 * may not match the settings of the mouse. */
+	RAZER_EV_MOUSE_COMMIT_FAILED,
 };
 
 /** struct razer_event_data - Context data for an event.
+ * @error: The error code of RAZER_EV_MOUSE_COMMIT_FAILED.
  */
 struct razer_event_data {
 	union {
 		struct razer_mouse *mouse;
 	} u;
+	int error;
 };
 
 /** razer_event_handler_t - The type of an event handler.
@@ -655,6 +832,78 @@ int razer_register_event_handler(razer_event_handler_t handler);
  */
 void razer_unregister_event_handler(razer_event_handler_t handler);
 
+/** razer_mouse_trylock_t - Try to lock a mouse for exclusive access.
+ * Returns 0, if the mouse was locked. Nonzero, if it is busy.
+ */
+typedef int (*razer_mouse_trylock_t)(struct razer_mouse *m);
+
+/** razer_mouse_unlock_t - Unlock a mouse locked by razer_mouse_trylock_t.
+ */
+typedef void (*razer_mouse_unlock_t)(struct razer_mouse *m);
+
+/** razer_set_mouse_lock_handlers - Set the mouse locking handlers.
+ * Applications that access mice from several threads lock a mouse
+ * while they operate on it. razer_get_next_timeout() and
+ * razer_handle_events() check the claim leases of the mice.
+ * They use these handlers and skip busy mice.
+ * Pass NULL to remove the handlers.
+ */
+void razer_set_mouse_lock_handlers(razer_mouse_trylock_t trylock,
+				   razer_mouse_unlock_t unlock);
+
+/** razer_claim_lease_handler_t - Handle the expiry of a claim lease.
+ * Called from razer_handle_events(), without the mouse locked.
+ * The application calls razer_mouse_expire_claim_lease() later,
+ * while it has exclusive access to the mouse.
+ */
+typedef void (*razer_claim_lease_handler_t)(struct razer_mouse *m);
+
+/** razer_set_claim_lease_handler - Set the claim lease expiry handler.
+ * If set, razer_handle_events() does not commit the mouse of an expired
+ * lease itself, but calls the handler once for that lease.
+ * This keeps the device I/O of the commit out of the event loop.
+ * Pass NULL to commit from within razer_handle_events() again.
+ */
+void razer_set_claim_lease_handler(razer_claim_lease_handler_t handler);
+
+/** razer_mouse_expire_claim_lease - Drop the expired claim lease of a mouse.
+ * This commits the pending changes and releases the device.
+ * Nothing is done, if the lease was renewed in the meantime.
+ * The commit error is returned. It is not reported through
+ * RAZER_EV_MOUSE_COMMIT_FAILED.
+ */
+int razer_mouse_expire_claim_lease(struct razer_mouse *m);
+
+/** struct razer_pollfd - A file descriptor used by librazer.
+ * @fd: The file descriptor.
+ * @events: The poll(2) events to wait for (POLLIN, POLLOUT).
+ */
+struct razer_pollfd {
+	int fd;
+	short events;
+};
+
+/** razer_get_pollfds - Get the file descriptors of the USB event engine.
+ * The caller should poll these in its event loop and call
+ * razer_handle_events() if any of them becomes ready.
+ * @fds: Array to store the file descriptors in.
+ * @max_fds: Number of entries in the fds array.
+ * Returns the number of file descriptors or a negative error code.
+ */
+int razer_get_pollfds(struct razer_pollfd *fds, unsigned int max_fds);
+
+/** razer_get_next_timeout - Get the next USB event timeout.
+ * Returns the number of milliseconds until razer_handle_events()
+ * has to be called, or -1 if there is no pending timeout.
+ */
+int razer_get_next_timeout(void);
+
+/** razer_handle_events - Handle pending asynchronous USB events.
+ * This does not block. Pending hotplug events are processed, too.
+ * Returns 0 on success or a negative error code.
+ */
+int razer_handle_events(void);
+
 /** razer_load_config - Load a configuration file.
  * If path is NULL, the default config is loaded.
  * If path is an empty string, the current config (if any) will be
@@ -662,6 +911,35 @@ void razer_unregister_event_handler(razer_event_handler_t handler);
  */
 int razer_load_config(const char *path);
 
+/** razer_reload_config - Reload the configuration file.
+ * The path is interpreted like in razer_load_config().
+ * This does not access the mice. Call razer_mouse_reload_config()
+ * for each mouse to apply the new config.
+ * If the new config cannot be loaded, the old one stays in effect.
+ */
+int razer_reload_config(const char *path);
+
+/** razer_mouse_reload_config - Apply a reloaded config to a mouse.
+ * Only the settings that differ between the config that was last
+ * applied to the mouse and the current one are applied,
+ * as one transaction. The mouse is not accessed, if its effective
+ * settings did not change.
+ * The caller must have exclusive access to the mouse, but other
+ * mice may be reconfigured in parallel.
+ * Returns 0 on success or a negative error code.
+ */
+int razer_mouse_reload_config(struct razer_mouse *m);
+
+/** razer_set_state_cache - Set the device state cache directory.
+ * Drivers cache the device state there, keyed by serial number
+ * and firmware version, to avoid reading it back from the hardware
+ * on initialization.
+ * If dir is NULL, RAZER_DEFAULT_STATE_DIR is used.
+ * If dir is an empty string, the cache is disabled (the default).
+ * Returns 0 on success or a negative error code.
+ */
+int razer_set_state_cache(const char *dir);
+
 typedef void (*razer_logfunc_t)(const char *fmt, ...);
 
 /** razer_set_logging - Set log callbacks.
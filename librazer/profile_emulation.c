@@ -18,11 +18,43 @@
 #include "profile_emulation.h"
 
 
+/* Check whether data differs from what is written to the hardware. */
+static bool mouse_profemu_differs(struct razer_mouse_profile_emu *emu,
+				  const struct razer_mouse_profile_emu_data *data)
+{
+	struct razer_mouse_profile *hw_profile = emu->hw_profile;
+	const struct razer_mouse_profile_emu_data *hw = &emu->hw_data;
+	unsigned int i;
+
+	if (hw_profile->set_dpimapping) {
+		for (i = 0; i < data->nr_dpimappings; i++) {
+			if (data->dpimappings[i] &&
+			    data->dpimappings[i] != hw->dpimappings[i])
+				return 1;
+		}
+	}
+	if (hw_profile->set_button_function) {
+		for (i = 0; i < data->nr_butfuncs; i++) {
+			if (data->butfuncs[i] &&
+			    data->butfuncs[i] != hw->butfuncs[i])
+				return 1;
+		}
+	}
+	if (hw_profile->set_freq && data->freq != hw->freq)
+		return 1;
+
+	return 0;
+}
+
+/* Write the settings of the active profile to the hardware profile.
+ * Only the settings that differ from the hardware are written.
+ * In particular, an unchanged frequency is never rewritten, because
+ * that reboots some devices. */
 static int mouse_profemu_commit(struct razer_mouse_profile_emu *emu)
 {
 	struct razer_mouse_profile *hw_profile = emu->hw_profile;
 	unsigned int active_prof_nr = emu->active_profile->nr;
-	struct razer_mouse_profile_emu_data *data;
+	struct razer_mouse_profile_emu_data *data, *hw = &emu->hw_data;
 	struct razer_mouse *mouse = emu->mouse;
 	unsigned int i;
 	int err;
@@ -31,56 +63,52 @@ static int mouse_profemu_commit(struct razer_mouse_profile_emu *emu)
 		return -EINVAL;
 	data = &emu->data[active_prof_nr];
 
+	if (!mouse_profemu_differs(emu, data)) {
+		razer_debug("profile emulation: Active profile is unchanged\n");
+		return 0;
+	}
+
 	err = mouse->claim(mouse);
 	if (err) {
 		razer_error("profile emulation: Failed to claim mouse\n");
 		return err;
 	}
 
+	/* hw is updated per setting, so that a failed commit
+	 * is retried for the settings that did not make it. */
 	if (hw_profile->set_dpimapping) {
-		struct razer_axis *axes = NULL;
-
-		if (mouse->supported_axes) {
-			err = mouse->supported_axes(mouse, &axes);
-			if (err < 0)
-				goto error;
-			WARN_ON((unsigned int)err != data->nr_dpimappings);
-		}
 		for (i = 0; i < data->nr_dpimappings; i++) {
-			if (!data->dpimappings[i])
+			if (!data->dpimappings[i] ||
+			    data->dpimappings[i] == hw->dpimappings[i])
 				continue;
 			err = hw_profile->set_dpimapping(
 						hw_profile,
-						axes ? &axes[i] : NULL,
+						emu->axes ? &emu->axes[i] : NULL,
 						data->dpimappings[i]);
 			if (err)
 				goto error;
+			hw->dpimappings[i] = data->dpimappings[i];
 		}
 	}
 	if (hw_profile->set_button_function) {
-		struct razer_button *buttons = NULL;
-
-		if (mouse->supported_buttons) {
-			err = mouse->supported_buttons(mouse, &buttons);
-			if (err < 0)
-				goto error;
-			WARN_ON((unsigned int)err != data->nr_butfuncs);
-		}
 		for (i = 0; i < data->nr_butfuncs; i++) {
-			if (!data->butfuncs[i])
+			if (!data->butfuncs[i] ||
+			    data->butfuncs[i] == hw->butfuncs[i])
 				continue;
 			err = hw_profile->set_button_function(
 						hw_profile,
-						buttons ? &buttons[i] : NULL,
+						emu->buttons ? &emu->buttons[i] : NULL,
 						data->butfuncs[i]);
 			if (err)
 				goto error;
+			hw->butfuncs[i] = data->butfuncs[i];
 		}
 	}
-	if (hw_profile->set_freq) {
+	if (hw_profile->set_freq && data->freq != hw->freq) {
 		err = hw_profile->set_freq(hw_profile, data->freq);
 		if (err)
 			goto error;
+		hw->freq = data->freq;
 	}
 
 	mouse->release(mouse);
@@ -285,7 +313,6 @@ int razer_mouse_init_profile_emulation(struct razer_mouse *m)
 	struct razer_mouse_profile_emu_data *data;
 	struct razer_mouse_profile *prof, *hw_profile;
 	unsigned int i, j;
-	int err;
 	struct razer_axis *axes = NULL;
 	int nr_axes = 1;
 	struct razer_button *buttons = NULL;
@@ -366,10 +393,11 @@ int razer_mouse_init_profile_emulation(struct razer_mouse *m)
 		}
 	}
 	emu->active_profile = &emu->profiles[0];
-
-	err = mouse_profemu_commit(emu);
-	if (err)
-		goto err_free;
+	emu->axes = axes;
+	emu->buttons = buttons;
+	/* All profiles were loaded from the hardware,
+	 * so the active profile is already applied. */
+	emu->hw_data = emu->data[0];
 
 	m->nr_profiles = ARRAY_SIZE(emu->profiles);
 	m->get_profiles = mouse_profemu_get;
@@ -27,6 +27,11 @@ struct razer_mouse_profile_emu {
 	struct razer_mouse_profile *active_profile;
 	/* The hardware profile. This is what the driver uses. */
 	struct razer_mouse_profile *hw_profile;
+	/* The settings currently written to the hardware profile. */
+	struct razer_mouse_profile_emu_data hw_data;
+	/* The axes and buttons of the mouse, or NULL. */
+	struct razer_axis *axes;
+	struct razer_button *buttons;
 };
 
 
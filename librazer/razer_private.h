@@ -34,6 +34,9 @@ extern razer_logfunc_t razer_logfunc_debug;
 						__FILE__, __func__, __LINE__)
 
 
+/* The Razer USB vendor ID */
+#define RAZER_USB_VENDOR_ID		0x1532
+
 /* Default USB timeout */
 #define RAZER_USB_TIMEOUT		3000
 
@@ -44,8 +47,27 @@ struct razer_usb_interface {
 
 #define RAZER_MAX_NR_INTERFACES		2
 
+struct razer_usb_cmd;
+struct razer_usb_context;
+struct razer_usb_emu;
+struct razer_event_spacing;
+
+/* A transport replaces libusb for the I/O of a USB context.
+ * The transport operations are synchronous. */
+struct razer_usb_transport {
+	const char *name;
+	int (*claim)(struct razer_usb_context *ctx);
+	void (*release)(struct razer_usb_context *ctx);
+	int (*ctrl_write)(struct razer_usb_context *ctx,
+			  uint8_t request, uint16_t value, uint16_t index,
+			  const void *buf, size_t size);
+	int (*ctrl_read)(struct razer_usb_context *ctx,
+			 uint8_t request, uint16_t value, uint16_t index,
+			 void *buf, size_t size);
+};
+
 struct razer_usb_context {
-	/* Device pointer. */
+	/* Device pointer. NULL for emulated devices. */
 	struct libusb_device *dev;
 	/* The handle for all operations. */
 	struct libusb_device_handle *h;
@@ -54,8 +76,42 @@ struct razer_usb_context {
 	/* The interfaces we use. */
 	struct razer_usb_interface interfaces[RAZER_MAX_NR_INTERFACES];
 	unsigned int nr_interfaces;
+	/* Queue of asynchronous commands. The head is in flight. */
+	struct razer_usb_cmd *cmd_queue;
+	/* The device is still claimed after the last release.
+	 * The lease is dropped (and the device committed) at lease_expire,
+	 * which is in razer_monotonic_usec() time. */
+	bool lease_held;
+	uint64_t lease_expire;
+	/* The lease expired and was handed to the claim lease handler.
+	 * Cleared, when the lease is dropped or taken over by a claim. */
+	bool lease_expiring;
+	/* The transport used instead of libusb, or NULL. */
+	const struct razer_usb_transport *transport;
+	/* Set by the driver, if the feature reports may be sent through
+	 * the hidraw device instead of libusb. The kernel driver then stays
+	 * attached. Falls back to libusb, if hidraw is not available. */
+	bool prefer_hidraw;
+	int hidraw_fd;
+	/* The emulated device, if this is a virtual device. */
+	struct razer_usb_emu *emu;
+	/* The serial number. Set by razer_generic_usb_gen_idstr(). */
+	char serial[RAZER_SERIAL_MAX_SIZE];
+	/* The packet spacing of the driver, or NULL. For the statistics. */
+	struct razer_event_spacing *pacing;
 };
 
+struct libusb_context * razer_libusb_context(void);
+void razer_handle_hotplug_events(void);
+int razer_hotplug_pollfd(void);
+int razer_claim_lease_timeout(void);
+void razer_handle_claim_leases(void);
+
+int razer_usb_get_device_descriptor(struct razer_usb_context *ctx,
+				    struct libusb_device_descriptor *desc);
+uint8_t razer_usb_get_bus_number(struct razer_usb_context *ctx);
+uint8_t razer_usb_get_device_address(struct razer_usb_context *ctx);
+
 int razer_usb_add_used_interface(struct razer_usb_context *ctx,
 				 int bInterfaceNumber,
 				 int bAlternateSetting);
@@ -72,6 +128,8 @@ struct razer_usb_reconnect_guard {
 	struct libusb_device_descriptor old_desc;
 	uint8_t old_busnr;
 	uint8_t old_devaddr;
+	/* The list of waiting guards. */
+	struct razer_usb_reconnect_guard *next;
 };
 
 int razer_usb_reconnect_guard_init(struct razer_usb_reconnect_guard *guard,
@@ -80,6 +138,13 @@ int razer_usb_reconnect_guard_wait(struct razer_usb_reconnect_guard *guard, bool
 
 int razer_usb_force_hub_reset(struct razer_usb_context *ctx);
 
+/* Returns true, if changes to the mouse should only be recorded
+ * and written to the device by the commit method. */
+static inline bool razer_mouse_in_transaction(struct razer_mouse *m)
+{
+	return m->transaction_depth != 0;
+}
+
 #define BUSTYPESTR_USB		"USB"
 #define DEVTYPESTR_MOUSE	"Mouse"
 static inline void razer_create_idstr(char *buf,
@@ -93,8 +158,7 @@ static inline void razer_create_idstr(char *buf,
 		 devtype, devname, bustype, busposition, devid);
 }
 
-void razer_generic_usb_gen_idstr(struct libusb_device *udev,
-				 struct libusb_device_handle *h,
+void razer_generic_usb_gen_idstr(struct razer_usb_context *ctx,
 				 const char *devname,
 				 bool include_devicenr,
 				 const char *serial,
@@ -109,14 +173,48 @@ struct razer_mouse_dpimapping * razer_mouse_get_dpimapping_by_res(
 		struct razer_mouse_dpimapping *mappings, size_t nr_mappings,
 		enum razer_dimension dim, enum razer_mouse_res res);
 
+/* Adaptive spacing shrinks the spacing after this many
+ * consecutive successful events. */
+#define RAZER_EVENT_SPACING_SHRINK_AFTER	16
+
 struct razer_event_spacing {
-	unsigned int spacing_msec;
-	struct timeval last_event;
+	/* The spacing the device is known to be safe with.
+	 * This is the upper bound and the initial spacing. */
+	unsigned int max_usec;
+	/* The lower bound of the spacing. Equal to max_usec,
+	 * if the spacing is fixed. */
+	unsigned int min_usec;
+	/* The current spacing. */
+	unsigned int spacing_usec;
+	/* Consecutive successful events at the current spacing. */
+	unsigned int nr_ok;
+	/* The device the learned spacing is stored for. */
+	uint16_t learn_vendor;
+	uint16_t learn_product;
+	int learn_fw;
+	/* Monotonic timestamp of the last event, or 0. */
+	uint64_t last_event;
+	/* Statistics */
+	unsigned int nr_events;
+	unsigned int nr_errors;
+	unsigned int nr_retries;
+	unsigned int nr_spaced;
+	uint64_t spaced_usec;
 };
 
+void razer_flash_report_progress(struct razer_mouse *m,
+				 size_t done, size_t total);
+
 void razer_event_spacing_init(struct razer_event_spacing *es,
 			      unsigned int msec);
+void razer_event_spacing_init_adaptive(struct razer_event_spacing *es,
+				       unsigned int min_msec,
+				       unsigned int max_msec);
+void razer_event_spacing_learn(struct razer_event_spacing *es,
+			       struct razer_usb_context *ctx,
+			       int fw_version);
 void razer_event_spacing_enter(struct razer_event_spacing *es);
 void razer_event_spacing_leave(struct razer_event_spacing *es);
+void razer_event_spacing_result(struct razer_event_spacing *es, int err);
 
 #endif /* RAZER_PRIVATE_H_ */
@@ -0,0 +1,207 @@
+/*
+ *   On-disk device state cache
+ *
+ *   Copyright (C) 2007-2016 Michael Buesch <m@bues.ch>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include "state_cache.h"
+#include "razer_private.h"
+#include "util.h"
+
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+
+#define STATE_CACHE_VERSION	1
+
+struct state_cache_header {
+	char magic[4];
+	uint8_t version;
+	uint8_t _padding;
+	le16_t fw_version;
+	le32_t size;
+	le16_t checksum;
+} _packed;
+
+static const char state_cache_magic[4] = { 'R', 'Z', 'S', 'C', };
+
+/* The cache directory. NULL, if the cache is disabled. */
+static char *state_cache_dir;
+
+
+int razer_set_state_cache(const char *dir)
+{
+	char *new_dir = NULL;
+
+	if (!dir)
+		dir = RAZER_DEFAULT_STATE_DIR;
+	if (strlen(dir)) {
+		new_dir = strdup(dir);
+		if (!new_dir)
+			return -ENOMEM;
+	}
+	free(state_cache_dir);
+	state_cache_dir = new_dir;
+
+	return 0;
+}
+
+static int state_cache_path(char *path, size_t path_size,
+			    const char *name, const char *serial)
+{
+	char safe_serial[64];
+	size_t i;
+	char c;
+
+	if (!state_cache_dir)
+		return -EOPNOTSUPP;
+	if (!serial || !strlen(serial))
+		return -ENOENT;
+
+	/* The serial comes from the device. Only use safe characters. */
+	for (i = 0; i < sizeof(safe_serial) - 1 && serial[i]; i++) {
+		c = serial[i];
+		if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+		    (c >= 'A' && c <= 'Z') || c == '-')
+			safe_serial[i] = c;
+		else
+			safe_serial[i] = '_';
+	}
+	safe_serial[i] = '\0';
+
+	snprintf(path, path_size, "%s/%s-%s.state",
+		 state_cache_dir, name, safe_serial);
+
+	return 0;
+}
+
+/** razer_state_cache_load - Load cached device state.
+ * @name: The name of the driver.
+ * @serial: The serial number of the device.
+ * @fw_version: The firmware version of the device.
+ *	The cache is only valid for the same firmware version.
+ * @data: The state buffer.
+ * @size: The size of the state buffer.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int razer_state_cache_load(const char *name, const char *serial,
+			   uint16_t fw_version,
+			   void *data, size_t size)
+{
+	char path[PATH_MAX];
+	struct state_cache_header hdr;
+	FILE *fd;
+	int err;
+
+	err = state_cache_path(path, sizeof(path), name, serial);
+	if (err)
+		return err;
+	fd = fopen(path, "rb");
+	if (!fd)
+		return -errno;
+	err = -EINVAL;
+	if (fread(&hdr, sizeof(hdr), 1, fd) != 1)
+		goto out_close;
+	if (memcmp(hdr.magic, state_cache_magic, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != STATE_CACHE_VERSION ||
+	    le32_to_cpu(hdr.size) != size)
+		goto out_close;
+	err = -ESTALE;
+	if (le16_to_cpu(hdr.fw_version) != fw_version)
+		goto out_close;
+	err = -EIO;
+	if (fread(data, size, 1, fd) != 1)
+		goto out_close;
+	err = -EBADMSG;
+	if (hdr.checksum != razer_xor16_checksum(data, size))
+		goto out_close;
+	err = 0;
+out_close:
+	fclose(fd);
+	if (err)
+		razer_debug("Ignoring state cache %s (%d)\n", path, err);
+
+	return err;
+}
+
+/** razer_state_cache_store - Store the device state in the cache.
+ * @name: The name of the driver.
+ * @serial: The serial number of the device.
+ * @fw_version: The firmware version of the device.
+ * @data: The state.
+ * @size: The size of the state.
+ *
+ * The cache file is replaced atomically.
+ * Returns 0 on success or a negative error code.
+ */
+int razer_state_cache_store(const char *name, const char *serial,
+			    uint16_t fw_version,
+			    const void *data, size_t size)
+{
+	char path[PATH_MAX], tmp_path[PATH_MAX + 4];
+	struct state_cache_header hdr;
+	FILE *fd;
+	int err;
+
+	err = state_cache_path(path, sizeof(path), name, serial);
+	if (err)
+		return err;
+	if (mkdir(state_cache_dir, 0755) && errno != EEXIST) {
+		err = -errno;
+		razer_error("Failed to create state cache directory %s: %s\n",
+			    state_cache_dir, strerror(errno));
+		return err;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, state_cache_magic, sizeof(hdr.magic));
+	hdr.version = STATE_CACHE_VERSION;
+	hdr.fw_version = cpu_to_le16(fw_version);
+	hdr.size = cpu_to_le32(size);
+	hdr.checksum = razer_xor16_checksum(data, size);
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	fd = fopen(tmp_path, "wb");
+	if (!fd) {
+		err = -errno;
+		goto error;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, fd) != 1 ||
+	    fwrite(data, size, 1, fd) != 1) {
+		err = -EIO;
+		fclose(fd);
+		goto err_unlink;
+	}
+	if (fclose(fd)) {
+		err = -errno;
+		goto err_unlink;
+	}
+	if (rename(tmp_path, path)) {
+		err = -errno;
+		goto err_unlink;
+	}
+
+	return 0;
+
+err_unlink:
+	unlink(tmp_path);
+error:
+	razer_error("Failed to write state cache %s (%d)\n", path, err);
+	return err;
+}
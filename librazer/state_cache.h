@@ -0,0 +1,15 @@
+#ifndef RAZER_STATE_CACHE_H_
+#define RAZER_STATE_CACHE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+int razer_state_cache_load(const char *name, const char *serial,
+			   uint16_t fw_version,
+			   void *data, size_t size);
+int razer_state_cache_store(const char *name, const char *serial,
+			    uint16_t fw_version,
+			    const void *data, size_t size);
+
+#endif /* RAZER_STATE_CACHE_H_ */
@@ -21,8 +21,10 @@
 #include "librazer.h"
 #include "synapse.h"
 #include "razer_private.h"
+#include "usb_async.h"
 #include "util.h"
 #include "buttonmapping.h"
+#include "state_cache.h"
 
 
 enum synapse_constants {
@@ -114,6 +116,14 @@ struct synapse_request_hwconfig {
 } _packed;
 
 
+/* The raw configuration, as it is stored on the device.
+ * This is what the state cache stores. */
+struct synapse_hw_state {
+	struct synapse_request_globconfig globconfig;
+	struct synapse_request_profname profnames[SYNAPSE_NR_PROFILES];
+	struct synapse_request_hwconfig hwconfigs[SYNAPSE_NR_PROFILES];
+} _packed;
+
 struct synapse_buttons {
 	struct razer_buttonmapping mapping[NR_SYNAPSE_PHYSBUT];
 };
@@ -138,6 +148,9 @@ struct razer_synapse {
 	/* Device serial number */
 	char serial[SYNAPSE_SERIAL_MAX_LEN + 1];
 
+	/* The spacing between two USB packets. */
+	struct razer_event_spacing packet_spacing;
+
 	/* LED names */
 	struct synapse_led_name led_names[SYNAPSE_NR_LEDS];
 	/* The currently set LED states. */
@@ -166,7 +179,13 @@ struct razer_synapse {
 	/* The active button mapping; per profile. */
 	struct synapse_buttons buttons[SYNAPSE_NR_PROFILES];
 
-	bool commit_pending;
+	/* The last configuration read from or written to the device. */
+	struct synapse_hw_state hw_state;
+
+	/* Configuration blocks that changed since the last commit. */
+	bool hwconfig_dirty[SYNAPSE_NR_PROFILES];
+	bool profname_dirty[SYNAPSE_NR_PROFILES];
+	bool globconfig_dirty;
 };
 
 
@@ -251,18 +270,17 @@ static int synapse_usb_write(struct razer_synapse *s,
 {
 	int err;
 
-	err = libusb_control_transfer(
-		s->m->usb_ctx->h,
-		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS |
-		LIBUSB_RECIPIENT_INTERFACE,
-		request, command, index,
-		buf, size,
-		RAZER_USB_TIMEOUT);
-	if (err < 0 || (size_t)err != size) {
+	razer_event_spacing_enter(&s->packet_spacing);
+	err = razer_usb_ctrl_write(s->m->usb_ctx,
+				   RAZER_USB_CMD_TYPE_DEFAULT,
+				   request, command, index,
+				   buf, size);
+	razer_event_spacing_leave(&s->packet_spacing);
+	razer_event_spacing_result(&s->packet_spacing, err);
+	if (err) {
 		razer_error("synapse: usb_write failed\n");
 		return -EIO;
 	}
-	razer_msleep(5);
 
 	return 0;
 }
@@ -273,18 +291,17 @@ static int synapse_usb_read(struct razer_synapse *s,
 {
 	int err;
 
-	err = libusb_control_transfer(
-		s->m->usb_ctx->h,
-		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS |
-		LIBUSB_RECIPIENT_INTERFACE,
-		request, command, index,
-		buf, size,
-		RAZER_USB_TIMEOUT);
-	if (err < 0 || (size_t)err != size) {
+	razer_event_spacing_enter(&s->packet_spacing);
+	err = razer_usb_ctrl_read(s->m->usb_ctx,
+				  RAZER_USB_CMD_TYPE_DEFAULT,
+				  request, command, index,
+				  buf, size);
+	razer_event_spacing_leave(&s->packet_spacing);
+	razer_event_spacing_result(&s->packet_spacing, err);
+	if (err) {
 		razer_error("synapse: usb_read failed\n");
 		return -EIO;
 	}
-	razer_msleep(5);
 
 	return 0;
 }
@@ -421,21 +438,18 @@ static int synapse_request_read(struct razer_synapse *s,
 	return 0;
 }
 
-static int synapse_read_config_from_hw(struct razer_synapse *s)
+/* Parse the raw configuration in s->hw_state. */
+static int synapse_parse_hw_state(struct razer_synapse *s)
 {
 	unsigned int i, j;
 	int err;
-	struct synapse_request_profname profname;
+	struct synapse_request_profname *profname;
 	struct synapse_request_globconfig globconfig;
 	struct synapse_request_hwconfig hwconfig;
 	enum razer_mouse_res res_x, res_y;
 
-	/* Get global config */
-	memset(&globconfig, 0, sizeof(globconfig));
-	err = synapse_request_read(s, 5, 1,
-				   &globconfig, sizeof(globconfig));
-	if (err)
-		return err;
+	/* Parse global config */
+	globconfig = s->hw_state.globconfig;
 	if (globconfig.profile < 1 || globconfig.profile > SYNAPSE_NR_PROFILES) {
 		razer_error("synapse: Got invalid profile number: %u\n",
 			    (unsigned int)globconfig.profile);
@@ -459,29 +473,19 @@ static int synapse_read_config_from_hw(struct razer_synapse *s)
 		s->cur_freq = RAZER_MOUSE_FREQ_125HZ;
 	}
 
-	/* Get the profile names */
+	/* Parse the profile names */
 	for (i = 0; i < SYNAPSE_NR_PROFILES; i++) {
-		memset(&profname, 0, sizeof(profname));
-		profname.profile = i + 1;
-		err = synapse_request_read(s, 0x22, 1,
-					   &profname, sizeof(profname));
-		if (err)
-			return err;
+		profname = &s->hw_state.profnames[i];
 		memset(&s->profile_names[i], 0, sizeof(s->profile_names[i]));
 		for (j = 0; j < SYNAPSE_PROFNAME_MAX_LEN; j++) {
-			s->profile_names[i].name[j] = profname.name_raw[j * 2 + 0];
-			s->profile_names[i].name[j] |= (uint16_t)profname.name_raw[j * 2 + 1] << 8;
+			s->profile_names[i].name[j] = profname->name_raw[j * 2 + 0];
+			s->profile_names[i].name[j] |= (uint16_t)profname->name_raw[j * 2 + 1] << 8;
 		}
 	}
 
-	/* Get the profile configs */
+	/* Parse the profile configs */
 	for (i = 0; i < SYNAPSE_NR_PROFILES; i++) {
-		memset(&hwconfig, 0, sizeof(hwconfig));
-		hwconfig.profile = i + 1;
-		err = synapse_request_read(s, 6, 1,
-					   &hwconfig, sizeof(hwconfig));
-		if (err)
-			return err;
+		hwconfig = s->hw_state.hwconfigs[i];
 		if (hwconfig.profile != i + 1) {
 			razer_error("synapse: Failed to read hw config (%u vs %u)\n",
 				    hwconfig.profile, i + 1);
@@ -532,6 +536,67 @@ static int synapse_read_config_from_hw(struct razer_synapse *s)
 	return 0;
 }
 
+static int synapse_read_config_from_hw(struct razer_synapse *s)
+{
+	unsigned int i;
+	int err;
+	struct synapse_hw_state *hw = &s->hw_state;
+
+	memset(hw, 0, sizeof(*hw));
+
+	/* Get global config */
+	err = synapse_request_read(s, 5, 1,
+				   &hw->globconfig, sizeof(hw->globconfig));
+	if (err)
+		return err;
+
+	/* Get the profile names */
+	for (i = 0; i < SYNAPSE_NR_PROFILES; i++) {
+		hw->profnames[i].profile = i + 1;
+		err = synapse_request_read(s, 0x22, 1,
+					   &hw->profnames[i],
+					   sizeof(hw->profnames[i]));
+		if (err)
+			return err;
+	}
+
+	/* Get the profile configs */
+	for (i = 0; i < SYNAPSE_NR_PROFILES; i++) {
+		hw->hwconfigs[i].profile = i + 1;
+		err = synapse_request_read(s, 6, 1,
+					   &hw->hwconfigs[i],
+					   sizeof(hw->hwconfigs[i]));
+		if (err)
+			return err;
+	}
+
+	return synapse_parse_hw_state(s);
+}
+
+/* Load the configuration from the state cache.
+ * The devinfo must have been read already. */
+static int synapse_load_state_cache(struct razer_synapse *s)
+{
+	int err;
+
+	err = razer_state_cache_load("synapse", s->serial, s->fw_version,
+				     &s->hw_state, sizeof(s->hw_state));
+	if (err)
+		return err;
+	err = synapse_parse_hw_state(s);
+	if (err)
+		return err;
+	razer_debug("synapse: Using cached state for %s\n", s->serial);
+
+	return 0;
+}
+
+static void synapse_store_state_cache(struct razer_synapse *s)
+{
+	razer_state_cache_store("synapse", s->serial, s->fw_version,
+				&s->hw_state, sizeof(s->hw_state));
+}
+
 static int synapse_read_devinfo(struct razer_synapse *s)
 {
 	struct synapse_request_devinfo devinfo;
@@ -559,6 +624,31 @@ static int synapse_get_fw_version(struct razer_mouse *m)
 	return s->fw_version;
 }
 
+static void synapse_mark_all_dirty(struct razer_synapse *s)
+{
+	unsigned int i;
+
+	for (i = 0; i < SYNAPSE_NR_PROFILES; i++) {
+		s->hwconfig_dirty[i] = 1;
+		s->profname_dirty[i] = 1;
+	}
+	s->globconfig_dirty = 1;
+}
+
+/* Mark the hwconfig of a profile dirty.
+ * The global config mirrors the DPI mapping of the active profile,
+ * so it changes along with the active profile's hwconfig. */
+static void synapse_mark_hwconfig_dirty(struct razer_synapse *s,
+					unsigned int profile)
+{
+	if (WARN_ON(profile >= SYNAPSE_NR_PROFILES))
+		return;
+	s->hwconfig_dirty[profile] = 1;
+	if (s->cur_profile && s->cur_profile->nr == profile)
+		s->globconfig_dirty = 1;
+}
+
+/* Write the configuration blocks that are marked dirty. */
 static int synapse_do_commit(struct razer_synapse *s)
 {
 	struct synapse_request_profname profname;
@@ -566,9 +656,12 @@ static int synapse_do_commit(struct razer_synapse *s)
 	struct synapse_request_hwconfig hwconfig;
 	int err;
 	unsigned int i, j;
+	bool written = 0;
 
 	/* Commit profile configs */
 	for (i = 0; i < SYNAPSE_NR_PROFILES; i++) {
+		if (!s->hwconfig_dirty[i])
+			continue;
 		memset(&hwconfig, 0, sizeof(hwconfig));
 		hwconfig.profile = i + 1;
 		hwconfig.leds = 0x04; /* Bit 2 is always set */
@@ -599,10 +692,15 @@ static int synapse_do_commit(struct razer_synapse *s)
 					    &hwconfig, sizeof(hwconfig));
 		if (err)
 			return err;
+		s->hw_state.hwconfigs[i] = hwconfig;
+		s->hwconfig_dirty[i] = 0;
+		written = 1;
 	}
 
 	/* Commit profile names */
 	for (i = 0; i < SYNAPSE_NR_PROFILES; i++) {
+		if (!s->profname_dirty[i])
+			continue;
 		memset(&profname, 0, sizeof(profname));
 		profname.profile = i + 1;
 		for (j = 0; j < SYNAPSE_PROFNAME_MAX_LEN; j++) {
@@ -613,9 +711,14 @@ static int synapse_do_commit(struct razer_synapse *s)
 					    &profname, sizeof(profname));
 		if (err)
 			return err;
+		s->hw_state.profnames[i] = profname;
+		s->profname_dirty[i] = 0;
+		written = 1;
 	}
 
 	/* Commit global config */
+	if (!s->globconfig_dirty)
+		goto out;
 	memset(&globconfig, 0, sizeof(globconfig));
 	globconfig.profile = s->cur_profile->nr + 1;
 	switch (s->cur_freq) {
@@ -637,6 +740,12 @@ static int synapse_do_commit(struct razer_synapse *s)
 				    &globconfig, sizeof(globconfig));
 	if (err)
 		return err;
+	s->hw_state.globconfig = globconfig;
+	s->globconfig_dirty = 0;
+	written = 1;
+out:
+	if (written)
+		synapse_store_state_cache(s);
 
 	return 0;
 }
@@ -644,17 +753,13 @@ static int synapse_do_commit(struct razer_synapse *s)
 static int synapse_commit(struct razer_mouse *m, int force)
 {
 	struct razer_synapse *s = m->drv_data;
-	int err = 0;
 
 	if (!m->claim_count)
 		return -EBUSY;
-	if (s->commit_pending || force) {
-		err = synapse_do_commit(s);
-		if (!err)
-			s->commit_pending = 0;
-	}
+	if (force)
+		synapse_mark_all_dirty(s);
 
-	return err;
+	return synapse_do_commit(s);
 }
 
 static enum razer_mouse_freq synapse_global_get_freq(struct razer_mouse *m)
@@ -673,7 +778,7 @@ static int synapse_global_set_freq(struct razer_mouse *m,
 		return -EBUSY;
 
 	s->cur_freq = freq;
-	s->commit_pending = 1;
+	s->globconfig_dirty = 1;
 
 	return 0;
 }
@@ -704,7 +809,7 @@ static int synapse_profile_set_name(struct razer_mouse_profile *p,
 
 	err = razer_utf16_cpy(s->profile_names[p->nr].name,
 			      new_name, SYNAPSE_PROFNAME_MAX_LEN);
-	s->commit_pending = 1;
+	s->profname_dirty[p->nr] = 1;
 
 	return err;
 }
@@ -728,7 +833,7 @@ static int synapse_led_toggle(struct razer_led *led,
 		return -EBUSY;
 
 	s->led_states[p->nr][led->id] = new_state;
-	s->commit_pending = 1;
+	s->hwconfig_dirty[p->nr] = 1;
 
 	return 0;
 }
@@ -749,7 +854,7 @@ static int synapse_led_change_color(struct razer_led *led,
 		return -EBUSY;
 
 	s->led_colors[p->nr][led->id] = *new_color;
-	s->commit_pending = 1;
+	s->hwconfig_dirty[p->nr] = 1;
 
 	return 0;
 }
@@ -779,7 +884,7 @@ static int synapse_set_active_profile(struct razer_mouse *m,
 		return -EBUSY;
 
 	s->cur_profile = p;
-	s->commit_pending = 1;
+	s->globconfig_dirty = 1;
 
 	return 0;
 }
@@ -823,7 +928,7 @@ static int synapse_set_dpimapping(struct razer_mouse_profile *p,
 		return -EINVAL;
 
 	s->cur_dpimapping[p->nr] = d;
-	s->commit_pending = 1;
+	synapse_mark_hwconfig_dirty(s, p->nr);
 
 	return 0;
 }
@@ -841,7 +946,8 @@ static int synapse_dpimapping_modify(struct razer_mouse_dpimapping *d,
 		return -EBUSY;
 
 	d->res[dim] = res;
-	s->commit_pending = 1;
+	/* The mapping belongs to profile nr / 10. */
+	synapse_mark_hwconfig_dirty(s, d->nr / 10);
 
 	return 0;
 }
@@ -989,7 +1095,7 @@ static int synapse_set_button_function(struct razer_mouse_profile *p,
 		return -ENODEV;
 
 	mapping->logical = f->id;
-	s->commit_pending = 1;
+	s->hwconfig_dirty[p->nr] = 1;
 
 	return 0;
 }
@@ -1000,6 +1106,7 @@ int razer_synapse_init(struct razer_mouse *m,
 {
 	struct razer_synapse *s;
 	int i, j, k, err;
+	bool cache_hit;
 
 	BUILD_BUG_ON(sizeof(struct synapse_request) != 90);
 	BUILD_BUG_ON(sizeof(struct synapse_request_devinfo) != 34);
@@ -1016,11 +1123,18 @@ int razer_synapse_init(struct razer_mouse *m,
 	s->drv_data = drv_data;
 	s->features = features;
 
+	/* The firmware needs at least 5 msec between USB packets
+	 * on some devices. The responses are not checksummed and the
+	 * TRANSOK flag is only checked on reads, so the spacing is fixed. */
+	razer_event_spacing_init(&s->packet_spacing, 5);
+	m->usb_ctx->pacing = &s->packet_spacing;
+
 	err = razer_usb_add_used_interface(m->usb_ctx, 0, 0);
 	if (err) {
 		err = -ENODEV;
 		goto err_free;
 	}
+	m->usb_ctx->prefer_hidraw = 1;
 
 	for (i = 0; i < SYNAPSE_NR_PROFILES; i++) {
 		s->profiles[i].nr = i;
@@ -1069,11 +1183,17 @@ int razer_synapse_init(struct razer_mouse *m,
 		goto err_release;
 	}
 
-	err = synapse_read_config_from_hw(s);
-	if (err) {
-		razer_error("synapse: "
-			    "Failed to read the configuration from hardware\n");
-		goto err_release;
+	/* The devinfo read above verifies the identity of the device.
+	 * Trust the cached configuration, if there is one for this
+	 * serial number and firmware version. */
+	cache_hit = !synapse_load_state_cache(s);
+	if (!cache_hit) {
+		err = synapse_read_config_from_hw(s);
+		if (err) {
+			razer_error("synapse: "
+				    "Failed to read the configuration from hardware\n");
+			goto err_release;
+		}
 	}
 
 	m->get_fw_version = synapse_get_fw_version;
@@ -1091,10 +1211,13 @@ int razer_synapse_init(struct razer_mouse *m,
 	m->supported_buttons = synapse_supported_buttons;
 	m->supported_button_functions = synapse_supported_button_functions;
 
-	err = synapse_do_commit(s);
-	if (err) {
-		razer_error("synapse: Failed to commit initial settings\n");
-		goto err_release;
+	if (!cache_hit) {
+		synapse_mark_all_dirty(s);
+		err = synapse_do_commit(s);
+		if (err) {
+			razer_error("synapse: Failed to commit initial settings\n");
+			goto err_release;
+		}
 	}
 	m->release(m);
 
@@ -0,0 +1,565 @@
+/*
+ *   Lowlevel asynchronous USB command engine
+ *
+ *   Copyright (C) 2007-2016 Michael Buesch <m@bues.ch>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include "usb_async.h"
+#include "razer_private.h"
+
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+
+/* Each USB context owns a FIFO of commands. Only the head of the
+ * queue is in flight. Commands on different contexts are in flight
+ * concurrently. The synchronous helpers (razer_usb_ctrl_write/read)
+ * still wait for their command, so a wedged device only stalls
+ * its own caller if the devices are driven from different threads,
+ * like razerd's device workers do.
+ *
+ * cmd->completed is set by whatever thread handles USB events,
+ * so it is accessed atomically. */
+
+static int razer_usb_errno(int libusb_err)
+{
+	switch (libusb_err) {
+	case LIBUSB_SUCCESS:
+		return 0;
+	case LIBUSB_ERROR_NO_DEVICE:
+		return -ENODEV;
+	case LIBUSB_ERROR_BUSY:
+		return -EBUSY;
+	case LIBUSB_ERROR_NO_MEM:
+		return -ENOMEM;
+	case LIBUSB_ERROR_TIMEOUT:
+		return -ETIMEDOUT;
+	case LIBUSB_ERROR_INVALID_PARAM:
+		return -EINVAL;
+	case LIBUSB_ERROR_PIPE:
+		return -EPIPE;
+	case LIBUSB_ERROR_INTERRUPTED:
+		return -EINTR;
+	default:
+		return -EIO;
+	}
+}
+
+static int razer_usb_xfer_errno(enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return -ETIMEDOUT;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return -ENODEV;
+	case LIBUSB_TRANSFER_STALL:
+		return -EPIPE;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return -ECANCELED;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return -EOVERFLOW;
+	default:
+		return -EIO;
+	}
+}
+
+static inline struct razer_usb_cmd_stage * cmd_cur_stage(struct razer_usb_cmd *cmd)
+{
+	return cmd->in_read_stage ? &cmd->rd : &cmd->wr;
+}
+
+static void LIBUSB_CALL razer_usb_cmd_xfer_done(struct libusb_transfer *xfer);
+static void razer_usb_queue_kick(struct razer_usb_context *ctx);
+
+static int razer_usb_cmd_submit_stage(struct razer_usb_cmd *cmd)
+{
+	struct razer_usb_cmd_stage *stage = cmd_cur_stage(cmd);
+	uint8_t dir;
+
+	dir = cmd->in_read_stage ? LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT;
+	libusb_fill_control_setup(cmd->buf, cmd->type | dir,
+				  stage->request, stage->value, stage->index,
+				  stage->size);
+	if (!cmd->in_read_stage) {
+		memcpy(cmd->buf + LIBUSB_CONTROL_SETUP_SIZE,
+		       stage->buf, stage->size);
+	}
+	libusb_fill_control_transfer(cmd->xfer, cmd->ctx->h, cmd->buf,
+				     razer_usb_cmd_xfer_done, cmd,
+				     cmd->timeout ? cmd->timeout
+						  : RAZER_USB_TIMEOUT);
+
+	return razer_usb_errno(libusb_submit_transfer(cmd->xfer));
+}
+
+static int razer_usb_cmd_start(struct razer_usb_cmd *cmd)
+{
+	int err;
+
+	cmd->xfer = libusb_alloc_transfer(0);
+	if (!cmd->xfer)
+		return -ENOMEM;
+	cmd->in_read_stage = !cmd->wr.size;
+	err = razer_usb_cmd_submit_stage(cmd);
+	if (err) {
+		libusb_free_transfer(cmd->xfer);
+		cmd->xfer = NULL;
+	}
+
+	return err;
+}
+
+/* Remove the queue head, start the next command and
+ * run the completion callback.
+ * The command must not be touched afterwards, as the callback
+ * might free it. */
+static void razer_usb_cmd_finish(struct razer_usb_cmd *cmd, int err)
+{
+	struct razer_usb_context *ctx = cmd->ctx;
+
+	WARN_ON(ctx->cmd_queue != cmd);
+	ctx->cmd_queue = cmd->next;
+	cmd->next = NULL;
+
+	if (cmd->xfer) {
+		libusb_free_transfer(cmd->xfer);
+		cmd->xfer = NULL;
+	}
+	/* The waiter may run in another thread and reuse the context as
+	 * soon as the command is completed. So kick the queue first. */
+	razer_usb_queue_kick(ctx);
+	cmd->err = err;
+	__atomic_store_n(&cmd->completed, 1, __ATOMIC_RELEASE);
+	if (cmd->callback)
+		cmd->callback(cmd);
+}
+
+/* Start the next queued command, if the queue is idle. */
+static void razer_usb_queue_kick(struct razer_usb_context *ctx)
+{
+	struct razer_usb_cmd *cmd;
+	int err;
+
+	while ((cmd = ctx->cmd_queue) && !cmd->xfer) {
+		err = razer_usb_cmd_start(cmd);
+		if (!err)
+			break;
+		razer_usb_cmd_finish(cmd, err);
+	}
+}
+
+static void LIBUSB_CALL razer_usb_cmd_xfer_done(struct libusb_transfer *xfer)
+{
+	struct razer_usb_cmd *cmd = xfer->user_data;
+	struct razer_usb_cmd_stage *stage = cmd_cur_stage(cmd);
+	int err;
+
+	err = razer_usb_xfer_errno(xfer->status);
+	if (!err && xfer->actual_length != stage->size)
+		err = -EIO;
+	if (err)
+		goto out;
+
+	if (cmd->in_read_stage) {
+		memcpy(stage->buf, libusb_control_transfer_get_data(xfer),
+		       stage->size);
+		goto out;
+	}
+	if (cmd->rd.size) {
+		cmd->in_read_stage = true;
+		err = razer_usb_cmd_submit_stage(cmd);
+		if (!err)
+			return;
+	}
+out:
+	razer_usb_cmd_finish(cmd, err);
+}
+
+/** razer_usb_cmd_submit - Queue an asynchronous command.
+ * @ctx: The claimed USB context.
+ * @cmd: The command. Must stay valid until completion.
+ *
+ * Returns 0, if the command was queued. The callback will be called later.
+ * On devices with a transport (hidraw, emulator) the command
+ * completes synchronously and the callback
+ * is called before this returns.
+ * Returns a negative error code, if the command could not be queued.
+ * The callback is not called in this case.
+ */
+int razer_usb_cmd_submit(struct razer_usb_context *ctx,
+			 struct razer_usb_cmd *cmd)
+{
+	struct razer_usb_cmd *c;
+	int err = 0;
+
+	if (WARN_ON(!ctx->h && !ctx->transport))
+		return -ENODEV;
+	if (cmd->wr.size > RAZER_USB_CMD_MAX_SIZE ||
+	    cmd->rd.size > RAZER_USB_CMD_MAX_SIZE ||
+	    (!cmd->wr.size && !cmd->rd.size))
+		return -EINVAL;
+
+	cmd->ctx = ctx;
+	cmd->next = NULL;
+	cmd->xfer = NULL;
+	cmd->err = 0;
+	cmd->completed = 0;
+
+	if (ctx->transport) {
+		/* Transports are synchronous. Complete right away. */
+		if (cmd->wr.size) {
+			err = ctx->transport->ctrl_write(ctx, cmd->wr.request,
+							 cmd->wr.value,
+							 cmd->wr.index,
+							 cmd->wr.buf,
+							 cmd->wr.size);
+			if (err)
+				goto transport_done;
+		}
+		if (cmd->rd.size) {
+			err = ctx->transport->ctrl_read(ctx, cmd->rd.request,
+							cmd->rd.value,
+							cmd->rd.index,
+							cmd->rd.buf,
+							cmd->rd.size);
+		}
+transport_done:
+		cmd->err = err;
+		__atomic_store_n(&cmd->completed, 1, __ATOMIC_RELEASE);
+		if (cmd->callback)
+			cmd->callback(cmd);
+		return 0;
+	}
+
+	if (!ctx->cmd_queue) {
+		ctx->cmd_queue = cmd;
+		err = razer_usb_cmd_start(cmd);
+		if (err) {
+			ctx->cmd_queue = NULL;
+			return err;
+		}
+		return 0;
+	}
+	for (c = ctx->cmd_queue; c->next; c = c->next)
+		;
+	c->next = cmd;
+
+	return 0;
+}
+
+/* Abort a command after USB event handling failed.
+ * A command in flight is cancelled and completes through the event
+ * handler. A command that is still queued behind another one is
+ * removed from the queue and completed with err right away, because
+ * nothing else would complete it.
+ * Returns true, if the command is completed. */
+static bool razer_usb_cmd_abort(struct razer_usb_cmd *cmd, int err)
+{
+	struct libusb_context *uctx = razer_libusb_context();
+	struct razer_usb_context *ctx = cmd->ctx;
+	struct razer_usb_cmd *c;
+	bool completed = 1;
+
+	/* Keep the event handler from changing the queue meanwhile. */
+	libusb_lock_events(uctx);
+	if (__atomic_load_n(&cmd->completed, __ATOMIC_ACQUIRE))
+		goto out;
+	if (cmd->xfer) {
+		libusb_cancel_transfer(cmd->xfer);
+		completed = 0;
+		goto out;
+	}
+	for (c = ctx->cmd_queue; c && c->next != cmd; c = c->next)
+		;
+	if (WARN_ON(!c))
+		goto out;
+	c->next = cmd->next;
+	cmd->next = NULL;
+	cmd->err = err;
+	__atomic_store_n(&cmd->completed, 1, __ATOMIC_RELEASE);
+	if (cmd->callback)
+		cmd->callback(cmd);
+out:
+	libusb_unlock_events(uctx);
+
+	return completed;
+}
+
+/** razer_usb_cmd_wait - Wait for the completion of a submitted command.
+ * This handles USB events while waiting, so commands on other devices
+ * keep completing.
+ * Returns the command result.
+ */
+int razer_usb_cmd_wait(struct razer_usb_cmd *cmd)
+{
+	struct libusb_context *uctx = razer_libusb_context();
+	int err;
+
+	while (!__atomic_load_n(&cmd->completed, __ATOMIC_ACQUIRE)) {
+		err = libusb_handle_events_completed(uctx, &cmd->completed);
+		if (err && err != LIBUSB_ERROR_INTERRUPTED) {
+			razer_error("USB event handling failed (%d)\n", err);
+			if (razer_usb_cmd_abort(cmd, razer_usb_errno(err)))
+				break;
+		}
+	}
+
+	return cmd->err;
+}
+
+/** razer_usb_cmd_exec - Run a command synchronously.
+ */
+int razer_usb_cmd_exec(struct razer_usb_context *ctx,
+		       struct razer_usb_cmd *cmd)
+{
+	int err;
+
+	err = razer_usb_cmd_submit(ctx, cmd);
+	if (err)
+		return err;
+
+	return razer_usb_cmd_wait(cmd);
+}
+
+/** razer_usb_cmd_flush - Wait until the command queue of a context is empty.
+ */
+void razer_usb_cmd_flush(struct razer_usb_context *ctx)
+{
+	struct libusb_context *uctx = razer_libusb_context();
+	int err;
+
+	while (ctx->cmd_queue) {
+		err = libusb_handle_events(uctx);
+		if (err && err != LIBUSB_ERROR_INTERRUPTED) {
+			razer_error("USB event handling failed (%d)\n", err);
+			if (ctx->cmd_queue && ctx->cmd_queue->xfer)
+				libusb_cancel_transfer(ctx->cmd_queue->xfer);
+		}
+	}
+}
+
+int razer_usb_ctrl_write(struct razer_usb_context *ctx,
+			 uint8_t type, uint8_t request,
+			 uint16_t value, uint16_t index,
+			 void *buf, size_t size)
+{
+	struct razer_usb_cmd cmd = {
+		.type		= type,
+		.wr = {
+			.request	= request,
+			.value		= value,
+			.index		= index,
+			.buf		= buf,
+			.size		= size,
+		},
+	};
+
+	if (size > RAZER_USB_CMD_MAX_SIZE)
+		return -EINVAL;
+
+	return razer_usb_cmd_exec(ctx, &cmd);
+}
+
+int razer_usb_ctrl_read(struct razer_usb_context *ctx,
+			uint8_t type, uint8_t request,
+			uint16_t value, uint16_t index,
+			void *buf, size_t size)
+{
+	struct razer_usb_cmd cmd = {
+		.type		= type,
+		.rd = {
+			.request	= request,
+			.value		= value,
+			.index		= index,
+			.buf		= buf,
+			.size		= size,
+		},
+	};
+
+	if (size > RAZER_USB_CMD_MAX_SIZE)
+		return -EINVAL;
+
+	return razer_usb_cmd_exec(ctx, &cmd);
+}
+
+static int razer_usb_report_xfer(struct razer_usb_context *ctx,
+				 struct razer_event_spacing *es,
+				 bool read, void *buf, size_t size)
+{
+	int err;
+
+	if (es)
+		razer_event_spacing_enter(es);
+	if (read)
+		err = razer_usb_ctrl_read(ctx, RAZER_USB_CMD_TYPE_DEFAULT,
+					  LIBUSB_REQUEST_CLEAR_FEATURE,
+					  RAZER_USB_REPORT_VALUE, 0,
+					  buf, size);
+	else
+		err = razer_usb_ctrl_write(ctx, RAZER_USB_CMD_TYPE_DEFAULT,
+					   LIBUSB_REQUEST_SET_CONFIGURATION,
+					   RAZER_USB_REPORT_VALUE, 0,
+					   buf, size);
+	if (es)
+		razer_event_spacing_leave(es);
+	if (err) {
+		razer_error("USB report %s failed with %d\n",
+			    read ? "read" : "write", err);
+	}
+
+	return err;
+}
+
+/* The number of times the reply to one sent report is read. */
+#define RAZER_USB_REPORT_READ_TRIES	2
+
+/* Read the reply to a report. Failed reads are retried. */
+static int razer_usb_report_read(struct razer_usb_context *ctx,
+				 struct razer_event_spacing *es,
+				 void *report, size_t size)
+{
+	unsigned int try;
+	int err = -EINVAL;
+
+	for (try = 0; try < RAZER_USB_REPORT_READ_TRIES; try++) {
+		err = razer_usb_report_xfer(ctx, es, 1, report, size);
+		if (!err || err == -ENODEV)
+			break;
+		/* The caller reports the last error. */
+		if (es && try + 1 < RAZER_USB_REPORT_READ_TRIES)
+			razer_event_spacing_result(es, err);
+	}
+
+	return err;
+}
+
+/** razer_usb_report_exec - Send a report and verify the reply.
+ * @ctx: The USB context.
+ * @es: The packet spacing of the device. May be NULL.
+ * @report: The report to send. The verified reply is returned in it.
+ * @size: The size of the report.
+ * @check: Verifies the reply against the request.
+ * @max_tries: The maximum number of times the report is sent.
+ *
+ * The report is sent once. It is only sent again, if the check rejects
+ * the reply or a transfer fails. A failed read of the reply is retried
+ * once first, without resending the report. So there are at most
+ * max_tries writes and 2 * max_tries reads. Each rejected reply and each
+ * transfer error backs off the packet spacing.
+ * Returns the last error, if all tries failed.
+ */
+int razer_usb_report_exec(struct razer_usb_context *ctx,
+			  struct razer_event_spacing *es,
+			  void *report, size_t size,
+			  razer_usb_report_check_t check,
+			  unsigned int max_tries)
+{
+	uint8_t request[RAZER_USB_CMD_MAX_SIZE];
+	unsigned int try;
+	int err = -EINVAL;
+
+	if (WARN_ON(size > sizeof(request)))
+		return -EINVAL;
+	memcpy(request, report, size);
+
+	for (try = 0; try < max_tries; try++) {
+		if (try) {
+			memcpy(report, request, size);
+			if (es)
+				es->nr_retries++;
+		}
+		err = razer_usb_report_xfer(ctx, es, 0, report, size);
+		if (!err)
+			err = razer_usb_report_read(ctx, es, report, size);
+		if (err == -ENODEV)
+			break; /* Unplugged. Retrying is pointless. */
+		if (err) {
+			if (es)
+				razer_event_spacing_result(es, err);
+			continue;
+		}
+		err = check(request, report);
+		if (es)
+			razer_event_spacing_result(es, err);
+		if (!err)
+			break;
+	}
+
+	return err;
+}
+
+int razer_get_pollfds(struct razer_pollfd *fds, unsigned int max_fds)
+{
+	const struct libusb_pollfd **pollfds;
+	unsigned int i;
+	int fd;
+
+	if (!razer_libusb_context())
+		return -ENODEV;
+	pollfds = libusb_get_pollfds(razer_libusb_context());
+	if (!pollfds)
+		return -ENOMEM;
+	for (i = 0; pollfds[i]; i++) {
+		if (i >= max_fds) {
+			libusb_free_pollfds(pollfds);
+			return -ENOSPC;
+		}
+		fds[i].fd = pollfds[i]->fd;
+		fds[i].events = pollfds[i]->events;
+	}
+	libusb_free_pollfds(pollfds);
+	fd = razer_hotplug_pollfd();
+	if (fd >= 0) {
+		if (i >= max_fds)
+			return -ENOSPC;
+		fds[i].fd = fd;
+		fds[i].events = POLLIN;
+		i++;
+	}
+
+	return i;
+}
+
+int razer_get_next_timeout(void)
+{
+	struct timeval tv;
+	int res, msec = -1, lease_msec;
+
+	if (!razer_libusb_context())
+		return -1;
+	res = libusb_get_next_timeout(razer_libusb_context(), &tv);
+	if (res > 0)
+		msec = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+	lease_msec = razer_claim_lease_timeout();
+	if (lease_msec >= 0 && (msec < 0 || lease_msec < msec))
+		msec = lease_msec;
+
+	return msec;
+}
+
+int razer_handle_events(void)
+{
+	struct timeval tv = { .tv_sec = 0, .tv_usec = 0, };
+	int err;
+
+	if (!razer_libusb_context())
+		return -ENODEV;
+	err = libusb_handle_events_timeout(razer_libusb_context(), &tv);
+	razer_handle_hotplug_events();
+	razer_handle_claim_leases();
+
+	return razer_usb_errno(err);
+}
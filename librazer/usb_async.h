@@ -0,0 +1,102 @@
+#ifndef RAZER_USB_ASYNC_H_
+#define RAZER_USB_ASYNC_H_
+
+#include "razer_private.h"
+
+
+/* Maximum payload size of one command stage. */
+#define RAZER_USB_CMD_MAX_SIZE		256
+
+/* Default bmRequestType (without direction) of a Razer report. */
+#define RAZER_USB_CMD_TYPE_DEFAULT	(LIBUSB_REQUEST_TYPE_CLASS | \
+					 LIBUSB_RECIPIENT_INTERFACE)
+
+struct razer_usb_cmd;
+
+typedef void (*razer_usb_cmd_callback_t)(struct razer_usb_cmd *cmd);
+
+struct razer_usb_cmd_stage {
+	uint8_t request;
+	uint16_t value;
+	uint16_t index;
+	void *buf;
+	uint16_t size;
+};
+
+/** struct razer_usb_cmd - An asynchronous write+read command pair.
+ *
+ * @type: The bmRequestType, without the direction bit.
+ * @wr: The host-to-device stage. Skipped, if wr.size is 0.
+ * @rd: The device-to-host stage. Skipped, if rd.size is 0.
+ *	The reply is copied into rd.buf on success.
+ * @timeout: The timeout of each stage, in milliseconds.
+ *	Defaults to RAZER_USB_TIMEOUT, if 0.
+ *
+ * @callback: Completion callback. May be NULL.
+ *	Called from the libusb event handler, after the command
+ *	was removed from the queue.
+ * @priv: Private data for the callback.
+ *
+ * @err: The result. 0 on success or a negative error code.
+ *	Valid after completion.
+ * @completed: Nonzero after completion. Set by the thread that handles
+ *	the USB events, so it must be read atomically.
+ */
+struct razer_usb_cmd {
+	uint8_t type;
+	struct razer_usb_cmd_stage wr;
+	struct razer_usb_cmd_stage rd;
+	unsigned int timeout;
+
+	razer_usb_cmd_callback_t callback;
+	void *priv;
+
+	int err;
+	int completed;
+
+	/* Internal */
+	struct razer_usb_cmd *next;
+	struct razer_usb_context *ctx;
+	struct libusb_transfer *xfer;
+	bool in_read_stage;
+	unsigned char buf[LIBUSB_CONTROL_SETUP_SIZE + RAZER_USB_CMD_MAX_SIZE];
+};
+
+int razer_usb_cmd_submit(struct razer_usb_context *ctx,
+			 struct razer_usb_cmd *cmd);
+int razer_usb_cmd_wait(struct razer_usb_cmd *cmd);
+int razer_usb_cmd_exec(struct razer_usb_context *ctx,
+		       struct razer_usb_cmd *cmd);
+void razer_usb_cmd_flush(struct razer_usb_context *ctx);
+
+int razer_usb_ctrl_write(struct razer_usb_context *ctx,
+			 uint8_t type, uint8_t request,
+			 uint16_t value, uint16_t index,
+			 void *buf, size_t size);
+int razer_usb_ctrl_read(struct razer_usb_context *ctx,
+			uint8_t type, uint8_t request,
+			uint16_t value, uint16_t index,
+			void *buf, size_t size);
+
+/* The feature report used by most Razer devices. It is written with
+ * SET_CONFIGURATION (HID SET_REPORT) and the reply is read back with
+ * CLEAR_FEATURE (HID GET_REPORT). */
+#define RAZER_USB_REPORT_VALUE		0x300
+
+/** razer_usb_report_check_t - Verify the reply to a report.
+ * @request: The report as it was sent.
+ * @reply: The report as it was read back.
+ *
+ * Returns 0, if the device accepted the report, or a negative
+ * error code to retry it.
+ */
+typedef int (*razer_usb_report_check_t)(const void *request,
+					const void *reply);
+
+int razer_usb_report_exec(struct razer_usb_context *ctx,
+			  struct razer_event_spacing *es,
+			  void *report, size_t size,
+			  razer_usb_report_check_t check,
+			  unsigned int max_tries);
+
+#endif /* RAZER_USB_ASYNC_H_ */
@@ -0,0 +1,420 @@
+/*
+ *   Emulated Razer USB devices
+ *
+ *   The emulator implements the wire protocols of some devices
+ *   in-process, so that the library and razerd can be exercised
+ *   and benchmarked without real hardware.
+ *
+ *   Copyright (C) 2007-2016 Michael Buesch <m@bues.ch>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include "usb_emu.h"
+#include "razer_private.h"
+#include "util.h"
+
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <stdio.h>
+
+
+/* The requests used by the drivers for the report transfers. */
+#define EMU_REQ_GET_REPORT		LIBUSB_REQUEST_CLEAR_FEATURE
+#define EMU_REQ_SET_REPORT		LIBUSB_REQUEST_SET_CONFIGURATION
+#define EMU_REPORT_VALUE		0x300
+
+/* Report layout of the naga, taipan and chroma protocols. */
+#define REPORT_STATUS			0
+#define REPORT_SIZE			5
+#define REPORT_REQUEST			7
+#define REPORT_ARGS			8
+#define REPORT_CHECKSUM			88
+
+#define REPORT_STATUS_OK		0x02
+#define REPORT_STATUS_FAIL		0x03
+
+/* Synapse request layout. */
+#define SYNAPSE_MAGIC			0
+#define SYNAPSE_FLAGS			1
+#define SYNAPSE_RW			2
+#define SYNAPSE_COMMAND			3
+#define SYNAPSE_PAYLOAD			8
+#define SYNAPSE_CHECKSUM		88
+
+#define SYNAPSE_REQ_MAGIC		0x01
+#define SYNAPSE_REQ_FLG_TRANSOK		0x02
+#define SYNAPSE_REQ_READ		0x01
+
+#define SYNAPSE_CMD_DEVINFO		0x02
+#define SYNAPSE_CMD_GLOBCONFIG		0x05
+#define SYNAPSE_CMD_HWCONFIG		0x06
+#define SYNAPSE_CMD_PROFNAME		0x22
+
+struct razer_usb_emu_model {
+	const char *name;
+	uint16_t product_id;
+	/* Handle a received report and prepare the reply. */
+	void (*handle)(struct razer_usb_emu *emu, const uint8_t *report);
+	/* Report protocol details. Unused for synapse. */
+	uint8_t (*checksum)(const uint8_t *report);
+	uint8_t fw_request;
+	uint8_t fw_major_offset;
+	uint8_t fw_minor_offset;
+	uint8_t serial_request;
+};
+
+static struct razer_usb_emu *emu_list;
+static unsigned int emu_count;
+
+
+static uint8_t report_checksum(const uint8_t *report)
+{
+	return razer_xor8_checksum(report + 2, RAZER_USB_EMU_REPORT_SIZE - 4);
+}
+
+static uint8_t chroma_report_checksum(const uint8_t *report)
+{
+	size_t size;
+
+	/* Size byte, request and the arguments. */
+	size = min(3 + (size_t)report[REPORT_SIZE],
+		   (size_t)(REPORT_CHECKSUM - REPORT_SIZE));
+
+	return razer_xor8_checksum(report + REPORT_SIZE, size);
+}
+
+static void emu_handle_report(struct razer_usb_emu *emu, const uint8_t *report)
+{
+	const struct razer_usb_emu_model *model = emu->model;
+	uint8_t *reply = emu->reply;
+	size_t len;
+
+	memcpy(reply, report, RAZER_USB_EMU_REPORT_SIZE);
+	if (model->checksum(report) != report[REPORT_CHECKSUM]) {
+		emu->nr_bad_checksums++;
+		reply[REPORT_STATUS] = REPORT_STATUS_FAIL;
+		goto out;
+	}
+	reply[REPORT_STATUS] = REPORT_STATUS_OK;
+
+	if (report[REPORT_REQUEST] == model->fw_request) {
+		reply[model->fw_major_offset] = emu->fw_version >> 8;
+		reply[model->fw_minor_offset] = emu->fw_version & 0xFF;
+	} else if (model->serial_request &&
+		   report[REPORT_REQUEST] == model->serial_request) {
+		len = min(strlen(emu->serial), (size_t)report[REPORT_SIZE]);
+		memset(reply + REPORT_ARGS, 0, report[REPORT_SIZE]);
+		memcpy(reply + REPORT_ARGS, emu->serial, len);
+	}
+out:
+	reply[REPORT_CHECKSUM] = model->checksum(reply);
+}
+
+static le16_t synapse_checksum(const uint8_t *req)
+{
+	uint16_t checksum;
+
+	checksum = razer_xor8_checksum(req + 2, RAZER_USB_EMU_REPORT_SIZE - 4);
+	if (!(req[SYNAPSE_FLAGS] & SYNAPSE_REQ_FLG_TRANSOK))
+		checksum |= 0x100;
+
+	return cpu_to_le16(checksum);
+}
+
+static uint8_t * synapse_store(struct razer_usb_emu *emu,
+			       uint8_t command, uint8_t profile)
+{
+	switch (command) {
+	case SYNAPSE_CMD_GLOBCONFIG:
+		return emu->globconfig;
+	case SYNAPSE_CMD_PROFNAME:
+		if (profile < 1 || profile > RAZER_USB_EMU_NR_PROFILES)
+			return NULL;
+		return emu->profnames[profile - 1];
+	case SYNAPSE_CMD_HWCONFIG:
+		if (profile < 1 || profile > RAZER_USB_EMU_NR_PROFILES)
+			return NULL;
+		return emu->hwconfig[profile - 1];
+	}
+
+	return NULL;
+}
+
+static void emu_handle_synapse(struct razer_usb_emu *emu, const uint8_t *req)
+{
+	uint8_t *reply = emu->reply;
+	uint8_t *payload = reply + SYNAPSE_PAYLOAD;
+	uint8_t *store;
+	le16_t checksum;
+
+	/* The null request terminates a transaction.
+	 * It does not change the pending reply. */
+	if (req[SYNAPSE_COMMAND] == 0)
+		return;
+
+	memcpy(reply, req, RAZER_USB_EMU_REPORT_SIZE);
+	reply[SYNAPSE_FLAGS] &= (uint8_t)~SYNAPSE_REQ_FLG_TRANSOK;
+
+	memcpy(&checksum, req + SYNAPSE_CHECKSUM, sizeof(checksum));
+	if (req[SYNAPSE_MAGIC] != SYNAPSE_REQ_MAGIC ||
+	    checksum != synapse_checksum(req)) {
+		emu->nr_bad_checksums++;
+		goto out;
+	}
+
+	if (req[SYNAPSE_COMMAND] == SYNAPSE_CMD_DEVINFO) {
+		if (req[SYNAPSE_RW] != SYNAPSE_REQ_READ)
+			goto out;
+		memset(payload, 0, RAZER_USB_EMU_PAYLOAD_SIZE);
+		memcpy(payload, emu->serial, strlen(emu->serial));
+		payload[RAZER_USB_EMU_SERIAL_LEN + 0] = emu->fw_version >> 8;
+		payload[RAZER_USB_EMU_SERIAL_LEN + 1] = emu->fw_version & 0xFF;
+	} else {
+		store = synapse_store(emu, req[SYNAPSE_COMMAND],
+				      req[SYNAPSE_PAYLOAD]);
+		if (!store)
+			goto out;
+		if (req[SYNAPSE_RW] == SYNAPSE_REQ_READ)
+			memcpy(payload, store, RAZER_USB_EMU_PAYLOAD_SIZE);
+		else
+			memcpy(store, payload, RAZER_USB_EMU_PAYLOAD_SIZE);
+	}
+	reply[SYNAPSE_FLAGS] |= SYNAPSE_REQ_FLG_TRANSOK;
+out:
+	checksum = synapse_checksum(reply);
+	memcpy(reply + SYNAPSE_CHECKSUM, &checksum, sizeof(checksum));
+}
+
+static void emu_init_synapse(struct razer_usb_emu *emu)
+{
+	/* DPI values for 400, 800, 1600, 3200 and 5600 DPI. */
+	static const uint8_t dpivals[] = { 12, 28, 60, 124, 220, };
+	uint8_t *hw;
+	unsigned int i, j;
+
+	emu->globconfig[0] = 1;		/* profile */
+	emu->globconfig[1] = 1;		/* 1000 Hz */
+	emu->globconfig[2] = 2;		/* dpisel */
+	emu->globconfig[3] = dpivals[1];
+	emu->globconfig[4] = dpivals[1];
+
+	for (i = 0; i < RAZER_USB_EMU_NR_PROFILES; i++) {
+		emu->profnames[i][0] = i + 1;
+
+		hw = emu->hwconfig[i];
+		hw[0] = i + 1;		/* profile */
+		hw[1] = 0x04 | 0x03;	/* leds */
+		hw[2] = 2;		/* dpisel */
+		hw[3] = ARRAY_SIZE(dpivals);
+		for (j = 0; j < ARRAY_SIZE(dpivals); j++) {
+			hw[4 + j * 2 + 0] = dpivals[j];
+			hw[4 + j * 2 + 1] = dpivals[j];
+		}
+		/* Identity button map, 4 bytes per button. */
+		for (j = 0; j < 11; j++) {
+			hw[20 + j * 4 + 0] = j + 1;
+			hw[20 + j * 4 + 1] = j + 1;
+		}
+	}
+}
+
+static const struct razer_usb_emu_model emu_models[] = {
+	{
+		.name			= "naga",
+		.product_id		= 0x0015,
+		.handle			= emu_handle_report,
+		.checksum		= report_checksum,
+		.fw_request		= 0x81,
+		.fw_major_offset	= 8,
+		.fw_minor_offset	= 9,
+	}, {
+		.name			= "taipan",
+		.product_id		= 0x0034,
+		.handle			= emu_handle_report,
+		.checksum		= report_checksum,
+		.fw_request		= 0x81,
+		.fw_major_offset	= 9,
+		.fw_minor_offset	= 10,
+	}, {
+		.name			= "deathadder-chroma",
+		.product_id		= 0x0043,
+		.handle			= emu_handle_report,
+		.checksum		= chroma_report_checksum,
+		.fw_request		= 0x87,
+		.fw_major_offset	= 8,
+		.fw_minor_offset	= 10,
+		.serial_request		= 0x82,
+	}, {
+		/* Synapse protocol */
+		.name			= "lachesis5k6",
+		.product_id		= 0x001E,
+		.handle			= emu_handle_synapse,
+	},
+};
+
+static const struct razer_usb_emu_model * emu_model_lookup(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(emu_models); i++) {
+		if (strcasecmp(emu_models[i].name, name) == 0)
+			return &emu_models[i];
+	}
+
+	return NULL;
+}
+
+/** razer_usb_emu_add - Create emulated devices.
+ * @model: The model name.
+ * @count: The number of devices to create.
+ * @latency_msec: The emulated latency of each packet.
+ */
+int razer_usb_emu_add(const char *model, unsigned int count,
+		      unsigned int latency_msec)
+{
+	const struct razer_usb_emu_model *m;
+	struct razer_usb_emu *emu, **tail;
+	unsigned int i;
+
+	m = emu_model_lookup(model);
+	if (!m) {
+		razer_error("usb-emu: Unknown model \"%s\"\n", model);
+		return -ENODEV;
+	}
+	if (emu_count + count > 255) {
+		razer_error("usb-emu: Too many emulated devices\n");
+		return -ENOSPC;
+	}
+
+	for (tail = &emu_list; *tail; tail = &(*tail)->next)
+		;
+	for (i = 0; i < count; i++) {
+		emu = zalloc(sizeof(*emu));
+		if (!emu)
+			return -ENOMEM;
+		emu->model = m;
+		emu->devaddr = ++emu_count;
+		snprintf(emu->serial, sizeof(emu->serial),
+			 "EMU%06u", emu_count);
+		emu->fw_version = 0x0105;
+		emu->latency_msec = latency_msec;
+		if (m->handle == emu_handle_synapse)
+			emu_init_synapse(emu);
+
+		*tail = emu;
+		tail = &emu->next;
+	}
+	razer_debug("usb-emu: Added %u emulated %s devices\n", count, m->name);
+
+	return 0;
+}
+
+void razer_usb_emu_exit(void)
+{
+	struct razer_usb_emu *emu, *next;
+
+	for (emu = emu_list; emu; emu = next) {
+		next = emu->next;
+		razer_debug("usb-emu: %s: %u writes, %u reads, "
+			    "%u bad checksums\n",
+			    emu->serial, emu->nr_writes, emu->nr_reads,
+			    emu->nr_bad_checksums);
+		razer_free(emu, sizeof(*emu));
+	}
+	emu_list = NULL;
+	emu_count = 0;
+}
+
+struct razer_usb_emu * razer_usb_emu_list(void)
+{
+	return emu_list;
+}
+
+void razer_usb_emu_get_descriptor(struct razer_usb_emu *emu,
+				  struct libusb_device_descriptor *desc)
+{
+	memset(desc, 0, sizeof(*desc));
+	desc->bLength = LIBUSB_DT_DEVICE_SIZE;
+	desc->bDescriptorType = LIBUSB_DT_DEVICE;
+	desc->bcdUSB = 0x0200;
+	desc->bMaxPacketSize0 = 64;
+	desc->idVendor = RAZER_USB_VENDOR_ID;
+	desc->idProduct = emu->model->product_id;
+	desc->bcdDevice = emu->fw_version;
+	desc->bNumConfigurations = 1;
+}
+
+const char * razer_usb_emu_serial(struct razer_usb_emu *emu)
+{
+	return emu->serial;
+}
+
+static int razer_usb_emu_claim(struct razer_usb_context *ctx)
+{
+	ctx->emu->claimed = 1;
+
+	return 0;
+}
+
+static void razer_usb_emu_release(struct razer_usb_context *ctx)
+{
+	ctx->emu->claimed = 0;
+}
+
+static int razer_usb_emu_ctrl_write(struct razer_usb_context *ctx,
+				    uint8_t request, uint16_t value,
+				    uint16_t index,
+				    const void *buf, size_t size)
+{
+	struct razer_usb_emu *emu = ctx->emu;
+
+	if (WARN_ON(!emu->claimed))
+		return -EPERM;
+	if (request != EMU_REQ_SET_REPORT || value != EMU_REPORT_VALUE ||
+	    size != RAZER_USB_EMU_REPORT_SIZE)
+		return -EPIPE;
+
+	razer_msleep(emu->latency_msec);
+	emu->nr_writes++;
+	emu->model->handle(emu, buf);
+
+	return 0;
+}
+
+static int razer_usb_emu_ctrl_read(struct razer_usb_context *ctx,
+				   uint8_t request, uint16_t value,
+				   uint16_t index,
+				   void *buf, size_t size)
+{
+	struct razer_usb_emu *emu = ctx->emu;
+
+	if (WARN_ON(!emu->claimed))
+		return -EPERM;
+	if (request != EMU_REQ_GET_REPORT || value != EMU_REPORT_VALUE ||
+	    size != RAZER_USB_EMU_REPORT_SIZE)
+		return -EPIPE;
+
+	razer_msleep(emu->latency_msec);
+	emu->nr_reads++;
+	memcpy(buf, emu->reply, size);
+
+	return 0;
+}
+
+const struct razer_usb_transport razer_usb_emu_transport = {
+	.name		= "emulator",
+	.claim		= razer_usb_emu_claim,
+	.release	= razer_usb_emu_release,
+	.ctrl_write	= razer_usb_emu_ctrl_write,
+	.ctrl_read	= razer_usb_emu_ctrl_read,
+};
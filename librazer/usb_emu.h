@@ -0,0 +1,65 @@
+#ifndef RAZER_USB_EMU_H_
+#define RAZER_USB_EMU_H_
+
+#include "razer_private.h"
+
+
+#define RAZER_USB_EMU_REPORT_SIZE	90
+#define RAZER_USB_EMU_PAYLOAD_SIZE	80
+#define RAZER_USB_EMU_NR_PROFILES	5
+#define RAZER_USB_EMU_SERIAL_LEN	32
+
+struct razer_usb_emu_model;
+
+/** struct razer_usb_emu - An emulated Razer USB device.
+ *
+ * @model: The emulated device model.
+ * @devaddr: The emulated USB device address. The bus number is 0.
+ * @serial: The serial number of the device.
+ * @fw_version: The firmware version of the device.
+ * @latency_msec: The emulated latency of each packet, in milliseconds.
+ * @claimed: Nonzero while the device is claimed.
+ *
+ * @reply: The report returned by the next read.
+ *
+ * @globconfig: Synapse global config store.
+ * @profnames: Synapse profile name store.
+ * @hwconfig: Synapse profile config store.
+ *
+ * @nr_writes: The number of received reports.
+ * @nr_reads: The number of sent reports.
+ * @nr_bad_checksums: The number of received reports with a bad checksum.
+ */
+struct razer_usb_emu {
+	struct razer_usb_emu *next;
+
+	const struct razer_usb_emu_model *model;
+	uint8_t devaddr;
+	char serial[RAZER_USB_EMU_SERIAL_LEN + 1];
+	uint16_t fw_version;
+	unsigned int latency_msec;
+	bool claimed;
+
+	uint8_t reply[RAZER_USB_EMU_REPORT_SIZE];
+
+	uint8_t globconfig[RAZER_USB_EMU_PAYLOAD_SIZE];
+	uint8_t profnames[RAZER_USB_EMU_NR_PROFILES][RAZER_USB_EMU_PAYLOAD_SIZE];
+	uint8_t hwconfig[RAZER_USB_EMU_NR_PROFILES][RAZER_USB_EMU_PAYLOAD_SIZE];
+
+	unsigned int nr_writes;
+	unsigned int nr_reads;
+	unsigned int nr_bad_checksums;
+};
+
+extern const struct razer_usb_transport razer_usb_emu_transport;
+
+int razer_usb_emu_add(const char *model, unsigned int count,
+		      unsigned int latency_msec);
+void razer_usb_emu_exit(void);
+struct razer_usb_emu * razer_usb_emu_list(void);
+
+void razer_usb_emu_get_descriptor(struct razer_usb_emu *emu,
+				  struct libusb_device_descriptor *desc);
+const char * razer_usb_emu_serial(struct razer_usb_emu *emu);
+
+#endif /* RAZER_USB_EMU_H_ */
@@ -245,6 +245,33 @@ void razer_msleep(unsigned int msecs)
 	}
 }
 
+void razer_usleep(unsigned int usecs)
+{
+	int err;
+	struct timespec time;
+
+	time.tv_sec = usecs / 1000000;
+	time.tv_nsec = (long)(usecs % 1000000) * 1000;
+	do {
+		err = nanosleep(&time, &time);
+	} while (err && errno == EINTR);
+	if (err) {
+		razer_error("nanosleep() failed with: %s\n",
+			strerror(errno));
+	}
+}
+
+/* Return the monotonic clock in microseconds.
+ * Unlike the wall clock, this never jumps. */
+uint64_t razer_monotonic_usec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
 le16_t razer_xor16_checksum(const void *_buffer, size_t size)
 {
 	const uint8_t *buffer = _buffer;
@@ -82,6 +82,9 @@ void razer_timeval_add_msec(struct timeval *tv, unsigned int msec);
 bool razer_timeval_after(const struct timeval *a, const struct timeval *b);
 int razer_timeval_msec_diff(const struct timeval *a, const struct timeval *b);
 
+void razer_usleep(unsigned int usecs);
+uint64_t razer_monotonic_usec(void);
+
 le16_t razer_xor16_checksum(const void *_buffer, size_t size);
 be16_t razer_xor16_checksum_be(const void *_buffer, size_t size);
 uint8_t razer_xor8_checksum(const void *_buffer, size_t size);
@@ -23,16 +23,23 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
 #include <getopt.h>
 #include <syslog.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
 
 #ifdef __DragonFly__
 #include <sys/endian.h>
@@ -62,19 +69,32 @@ enum {
 	LOGLEVEL_DEBUG,
 };
 
+#define MAX_EMULATE_SPECS	8
+
+struct emulate_spec {
+	char model[32];
+	unsigned int count;
+	unsigned int latency_msec;
+};
+
 struct commandline_args {
 	bool background;
 	const char *configfile;
 	const char *pidfile;
+	const char *state_dir;
 	int loglevel;
 	bool force;
 	bool no_profile_emu;
+	unsigned int lease_msec;
+	struct emulate_spec emulate[MAX_EMULATE_SPECS];
+	unsigned int nr_emulate;
 } cmdargs = {
 #ifdef DEBUG
 	.loglevel	= LOGLEVEL_DEBUG,
 #else
 	.loglevel	= LOGLEVEL_INFO,
 #endif
+	.lease_msec	= 500,
 };
 
 
@@ -82,14 +102,30 @@ struct commandline_args {
 #define VAR_RUN_RAZERD		VAR_RUN "/razerd"
 #define SOCKPATH		VAR_RUN_RAZERD "/socket"
 #define PRIV_SOCKPATH		VAR_RUN_RAZERD "/socket.privileged"
+#define STATETABLE_PATH		VAR_RUN_RAZERD "/state"
 
-#define INTERFACE_REVISION	6
+#define INTERFACE_REVISION	7
 
 #define COMMAND_MAX_SIZE	512
 #define COMMAND_HDR_SIZE	sizeof(struct command_hdr)
+#define FRAME_HDR_SIZE		sizeof(struct frame_hdr)
+#define FRAME_MAX_SIZE		(FRAME_HDR_SIZE + COMMAND_MAX_SIZE)
 #define BULK_CHUNK_SIZE		128
 
 #define MAX_FIRMWARE_SIZE	0x400000
+/* Minimum interval between two FLASHFW progress replies. */
+#define FLASH_PROGRESS_INTERVAL_MSEC	250
+
+#define MAX_USB_POLLFDS		32
+#define MAX_EPOLL_EVENTS	64
+
+/* Clients with more unsent output are disconnected. */
+#define CLIENT_OUTQ_HIGHWATER	(256 * 1024)
+
+#define STATETABLE_MAGIC	0x525A5354 /* "RZST" */
+#define STATETABLE_VERSION	1
+#define STATETABLE_MAX_MICE	16
+#define STATETABLE_MAX_LEDS	8
 
 enum {
 	COMMAND_ID_GETREV = 0,		/* Get the revision number of the socket interface. */
@@ -118,6 +154,12 @@ enum {
 	COMMAND_ID_GETMOUSEINFO,	/* Get detailed information about a mouse */
 	COMMAND_ID_GETPROFNAME,		/* Get a profile name. */
 	COMMAND_ID_SETPROFNAME,		/* Set a profile name. */
+	COMMAND_ID_ENABLEFRAMING,	/* Switch the connection to framed messages. */
+	COMMAND_ID_GETSNAPSHOT,		/* Get the complete state of a mouse. */
+	COMMAND_ID_SUBSCRIBE,		/* Select the notifications to receive. */
+	COMMAND_ID_GETSERIAL,		/* Get the serial number of a mouse. */
+	COMMAND_ID_BATCH,		/* Apply a list of changes in one commit. */
+	COMMAND_ID_GETPACING,		/* Get the packet pacing statistics. */
 
 	/* Privileged commands */
 	COMMAND_PRIV_FLASHFW = 128,	/* Upload and flash a firmware image */
@@ -125,6 +167,18 @@ enum {
 	COMMAND_PRIV_RELEASE,		/* Release the device. */
 };
 
+enum {
+	/* Send REPLY_ID_FLASHPROGRESS replies before the errorcode.
+	 * On framed connections, they are sent while the command runs,
+	 * in frames with reqid 0, like notifications. */
+	FLASHFW_FLG_PROGRESS		= (1 << 0),
+	/* The image is not sent as bulk payload. The command packet
+	 * carries a file descriptor (SCM_RIGHTS) of a file holding it.
+	 * A memfd sealed against writing and shrinking is mapped directly.
+	 * Other files are copied. */
+	FLASHFW_FLG_FD			= (1 << 1),
+};
+
 enum {
 	ERR_NONE = 0,		/* No error */
 	ERR_CMDSIZE,
@@ -156,10 +210,35 @@ enum profile_special_values {
 	PROFILE_INVALID			= 0xFFFFFFFF,
 };
 
+/* Framed connections (COMMAND_ID_ENABLEFRAMING) wrap each command in
+ * a frame. len is the size of the frame without the len field.
+ * The command is not padded to COMMAND_MAX_SIZE. */
+struct frame_hdr {
+	uint16_t len;
+	uint32_t reqid;
+} _packed;
+
+/* All replies to a framed command are sent in one reply frame with
+ * the reqid of the command. Commands without replies get an empty
+ * frame. Notifications and FLASHFW progress are sent in frames
+ * with reqid 0. len is the size of the frame without the len field. */
+struct reply_frame_hdr {
+	uint32_t len;
+	uint32_t reqid;
+} _packed;
+
 struct command_hdr {
 	uint8_t id;
 } _packed;
 
+/* A change in a COMMAND_ID_BATCH.
+ * The payload is the payload of the SET... command id. */
+struct batch_entry {
+	uint8_t id;
+	uint8_t len;
+	uint8_t payload[0];
+} _packed;
+
 struct command {
 	struct command_hdr hdr;
 	char idstr[RAZER_IDSTR_MAX_SIZE];
@@ -256,8 +335,26 @@ struct command {
 			uint8_t utf16be_name[64 * 2];
 		} _packed setprofname;
 
+		struct {
+		} _packed getsnapshot;
+
+		struct {
+			uint32_t mask;
+		} _packed subscribe;
+		struct {
+		} _packed getserial;
+
+		struct {
+			uint8_t nr_entries;
+			/* nr_entries of struct batch_entry */
+			uint8_t entries[0];
+		} _packed batch;
+		struct {
+		} _packed getpacing;
+
 		struct {
 			uint32_t imagesize;
+			uint32_t flags; /* FLASHFW_FLG_... */
 		} _packed flashfw;
 
 		struct {
@@ -275,10 +372,35 @@ struct command {
 enum {
 	REPLY_ID_U32 = 0,		/* An unsigned 32bit integer. */
 	REPLY_ID_STR,			/* A string */
+	REPLY_ID_BLOB,			/* A binary blob */
+	REPLY_ID_FLASHPROGRESS,		/* Firmware flash progress */
 
 	/* Asynchonous notifications. */
 	NOTIFY_ID_NEWMOUSE = 128,	/* New mouse was connected. */
 	NOTIFY_ID_DELMOUSE,		/* A mouse was removed. */
+	NOTIFY_ID_ACTIVEPROF,		/* The active profile changed. */
+	NOTIFY_ID_PROFNAME,		/* A profile name changed. */
+	NOTIFY_ID_DPIMAPPING,		/* The DPI mapping of a profile changed. */
+	NOTIFY_ID_DPIMAPPINGCHANGE,	/* A DPI mapping was modified. */
+	NOTIFY_ID_FREQ,			/* A frequency changed. */
+	NOTIFY_ID_LED,			/* A LED changed. */
+	NOTIFY_ID_BUTFUNC,		/* A button function changed. */
+	NOTIFY_ID_COMMITERR,		/* Committing the settings of a mouse failed. */
+};
+
+/* Notification subscription mask bits. */
+enum notify_mask {
+	NOTIFYMSK_NEWMOUSE		= (1 << 0),
+	NOTIFYMSK_DELMOUSE		= (1 << 1),
+	NOTIFYMSK_PROFILE		= (1 << 2), /* ACTIVEPROF and PROFNAME */
+	NOTIFYMSK_DPIMAPPING		= (1 << 3), /* DPIMAPPING and DPIMAPPINGCHANGE */
+	NOTIFYMSK_FREQ			= (1 << 4),
+	NOTIFYMSK_LED			= (1 << 5),
+	NOTIFYMSK_BUTFUNC		= (1 << 6),
+	NOTIFYMSK_COMMITERR		= (1 << 7),
+
+	/* The mask of new clients. */
+	NOTIFYMSK_DEFAULT		= NOTIFYMSK_NEWMOUSE | NOTIFYMSK_DELMOUSE,
 };
 
 enum string_encoding {
@@ -302,32 +424,309 @@ struct reply {
 			uint16_t len; /* in characters */
 			uint8_t str[0]; /* Payload buffer */
 		} _packed string;
+		struct {
+			uint32_t len;
+			uint8_t data[0]; /* Payload buffer */
+		} _packed blob;
 
 		struct {
 		} _packed notify_newmouse;
 		struct {
 		} _packed notify_delmouse;
+		struct {
+			char idstr[RAZER_IDSTR_MAX_SIZE];
+			uint32_t profile_id;
+		} _packed notify_activeprof;
+		struct {
+			char idstr[RAZER_IDSTR_MAX_SIZE];
+			uint32_t profile_id;
+			uint8_t utf16be_name[64 * 2];
+		} _packed notify_profname;
+		struct {
+			char idstr[RAZER_IDSTR_MAX_SIZE];
+			uint32_t profile_id;
+			uint32_t axis_id;
+			uint32_t mapping_id;
+		} _packed notify_dpimapping;
+		struct {
+			char idstr[RAZER_IDSTR_MAX_SIZE];
+			uint32_t mapping_id;
+			uint32_t dimension;
+			uint32_t new_resolution;
+		} _packed notify_dpimappingchange;
+		struct {
+			char idstr[RAZER_IDSTR_MAX_SIZE];
+			uint32_t profile_id;
+			uint32_t new_frequency;
+		} _packed notify_freq;
+		struct {
+			char idstr[RAZER_IDSTR_MAX_SIZE];
+			uint32_t profile_id;
+			char led_name[RAZER_LEDNAME_MAX_SIZE];
+			uint8_t state;
+			uint8_t mode;
+			uint32_t color;
+		} _packed notify_led;
+		struct {
+			char idstr[RAZER_IDSTR_MAX_SIZE];
+			uint32_t profile_id;
+			uint32_t button_id;
+			uint32_t function_id;
+		} _packed notify_butfunc;
+		struct {
+			char idstr[RAZER_IDSTR_MAX_SIZE];
+			uint32_t errorcode; /* ERR_... */
+		} _packed notify_commiterr;
+
+		struct {
+			uint32_t done; /* Bytes written */
+			uint32_t total; /* Image size */
+			uint32_t elapsed_msec;
+			uint32_t bytes_per_sec;
+		} _packed flash_progress;
 	} _packed;
 } _packed;
 
 #define REPLY_SIZE(name)	(offsetof(struct reply, name) + \
 				 sizeof(((struct reply *)0)->name))
 
+struct mouse_worker;
+struct client;
+
+/* The state table razerd publishes in STATETABLE_PATH.
+ * Clients mmap it read-only to read the device state without IPC.
+ * All fields are in host byte order.
+ *
+ * razerd is the only writer. seq is odd while the table is updated.
+ * Readers copy the table and retry while seq is odd or changed during
+ * the copy. magic is cleared when razerd exits; readers then reopen
+ * the file. */
+struct statetable_led {
+	char name[RAZER_LEDNAME_MAX_SIZE];
+	uint8_t state;
+	uint8_t mode;
+	uint8_t _reserved[2];
+	uint32_t color;
+};
+
+struct statetable_mouse {
+	char idstr[RAZER_IDSTR_MAX_SIZE];
+	uint32_t active_profile;
+	uint32_t frequency;
+	uint32_t dpimapping_id;
+	uint32_t resolution[RAZER_NR_DIMS];
+	uint32_t nr_leds;
+	struct statetable_led leds[STATETABLE_MAX_LEDS];
+};
+
+struct statetable {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t nr_mice;
+	uint32_t mouse_size;
+	uint32_t max_mice;
+	struct statetable_mouse mice[STATETABLE_MAX_MICE];
+};
+
+/* A notification caused by a command.
+ * It is broadcast after the replies to the command. */
+struct notification {
+	struct notification *next;
+	uint32_t mask;
+	size_t size;
+	struct reply r;
+};
+
+enum poll_source_type {
+	POLLSRC_CTLSOCK,	/* The control socket. */
+	POLLSRC_PRIVSOCK,	/* The privileged control socket. */
+	POLLSRC_DONE,		/* The worker completion pipe. */
+	POLLSRC_USB,		/* A librazer USB event FD. */
+	POLLSRC_CONFIG,		/* The config file inotify FD. */
+	POLLSRC_CLIENT,		/* A client connection. */
+};
+
+/* A FLASHFW payload being received through the main loop. */
+struct bulk_recv {
+	/* The FLASHFW command, dispatched again once the payload is complete. */
+	char cmd[COMMAND_MAX_SIZE + 1];
+	unsigned int len;
+	uint32_t reqid;
+	char *data;
+	uint32_t size;
+	/* Number of received bytes. */
+	uint32_t pos;
+};
+
+/* The epoll data of a file descriptor. */
+struct poll_source {
+	enum poll_source_type type;
+	struct client *client;
+};
+
 struct client {
 	struct client *next;
 	struct sockaddr_un sockaddr;
 	socklen_t socklen;
 	int fd;
+	bool privileged;
+	/* The file descriptor received with the current command, or -1. */
+	int passed_fd;
+
+	struct poll_source source;
+	/* The currently registered epoll events. */
+	uint32_t epoll_events;
+	/* The client hung up, failed or overflowed its output queue.
+	 * It is disconnected at the end of the main loop iteration. */
+	bool dead;
+
+	/* Number of commands queued to device workers.
+	 * The client is not read while commands are pending, so that
+	 * the replies stay in order. */
+	unsigned int nr_pending;
+	/* The client disconnected while commands were pending. */
+	bool disconnected;
+
+	/* The connection uses framed messages. */
+	bool framed;
+	/* Received bytes of an incomplete frame. */
+	char inbuf[FRAME_MAX_SIZE];
+	size_t inbuf_len;
+	/* The bulk payload being received, or NULL.
+	 * No commands are read until it is complete. */
+	struct bulk_recv *bulk;
+
+	/* Non-NULL, if this is a worker's proxy client. */
+	struct mouse_worker *worker;
+	/* Replies are collected in replybuf instead of being sent,
+	 * while this is set. */
+	bool collect_replies;
+	char *replybuf;
+	size_t replybuf_len;
+	/* Notifications caused by the running command. */
+	struct notification *notifications;
+	/* Subscribed notifications. NOTIFYMSK_... */
+	uint32_t notify_mask;
+	/* Output not sent, yet. */
+	char *outbuf;
+	size_t outbuf_len;
+};
+
+/* A RECONFIGMICE command, fanned out to the workers of the mice. */
+struct reconfig {
+	struct client *client;
+	uint32_t reqid;
+	/* The reconfig work that did not complete, yet. */
+	unsigned int nr_pending;
+};
+
+/* A received firmware image. */
+struct firmware_image {
+	char *data;
+	uint32_t size;
+	/* data is mapped from a sealed memfd instead of allocated. */
+	bool mapped;
+};
+
+/* A command queued to a device worker. */
+struct work {
+	struct work *next;
+	/* The client that sent the command. */
+	struct client *client;
+	/* The client the command handler replies to. */
+	struct client proxy;
+	bool privileged;
+	uint32_t reqid;
+	char cmd[COMMAND_MAX_SIZE + 1];
+	unsigned int len;
+	/* The FLASHFW payload, if any. */
+	struct firmware_image image;
+	/* This is a resume of the worker's mouse and has no client. */
+	bool resume;
+	int resume_err;
+	/* This is a config reload of the worker's mouse and has no client. */
+	bool reload;
+	/* This drops the expired claim lease of the worker's mouse
+	 * and has no client. */
+	bool lease;
+	/* This reconfigures the worker's mouse for a RECONFIGMICE command.
+	 * The command is replied to, once all its work completed. */
+	struct reconfig *reconfig;
+};
+
+/* A reply of running work, to be sent by the main thread. */
+struct posted_reply {
+	struct posted_reply *next;
+	struct client *client;
+	size_t size;
+	struct reply r; /* Must be last */
+};
+
+/* The I/O worker thread of a mouse. */
+struct mouse_worker {
+	struct mouse_worker *next;
+	struct razer_mouse *mouse;
+	pthread_t thread;
+
+	/* Held while the device is accessed. */
+	pthread_mutex_t device_lock;
+
+	/* queue_lock protects queue, stop and detached. */
+	pthread_mutex_t queue_lock;
+	pthread_cond_t queue_cond;
+	struct work *queue;
+	bool stop;
+	/* Nobody waits for the stopped thread. It puts itself on
+	 * exited_workers, to be joined by the main thread. */
+	bool detached;
 };
 
 /* Control socket FDs. */
 static int ctlsock = -1;
 static int privsock = -1;
+/* The main loop epoll instance. */
+static int epollfd = -1;
+static struct poll_source ctlsock_source = { .type = POLLSRC_CTLSOCK, };
+static struct poll_source privsock_source = { .type = POLLSRC_PRIVSOCK, };
+static struct poll_source done_source = { .type = POLLSRC_DONE, };
+static struct poll_source usb_source = { .type = POLLSRC_USB, };
+static struct poll_source config_source = { .type = POLLSRC_CONFIG, };
+
+/* Watches the directory of the config file, or -1. */
+static int config_watch_fd = -1;
+/* The file name of the config file in the watched directory. */
+static const char *config_watch_name;
+/* The USB event FDs registered with epoll. */
+static struct razer_pollfd usb_pollfds[MAX_USB_POLLFDS];
+static int nr_usb_pollfds;
 /* Linked list of connected clients. */
 static struct client *clients;
 static struct client *privileged_clients;
 /* Linked list of detected mice. */
 static struct razer_mouse *mice;
+/* Linked list of device workers. */
+static struct mouse_worker *workers;
+/* Work completed by the device workers.
+ * A byte is written to done_pipe for each completed work. */
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct work *done_list;
+static int done_pipe[2] = { -1, -1 };
+/* Replies sent by the device workers while their work is running.
+ * FIFO, protected by done_lock. Sent before the completed work. */
+static struct posted_reply *posted_replies;
+static struct posted_reply **posted_replies_tail = &posted_replies;
+/* Detached workers whose thread exited. Protected by done_lock. */
+static struct mouse_worker *exited_workers;
+/* Set by SIGUSR1. The signal handler wakes the main loop via done_pipe. */
+static volatile sig_atomic_t resume_requested;
+/* The mice whose resume work did not complete, yet. */
+static unsigned int nr_resuming;
+static unsigned int nr_resume_failed;
+static uint64_t resume_start_usec;
+/* The mapped state table, if any. statetable_lock serializes writers. */
+static pthread_mutex_t statetable_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct statetable *statetable;
 
 
 static inline uint32_t cpu_to_be32(uint32_t v)
@@ -443,8 +842,61 @@ static int create_pidfile(void)
 	return 0;
 }
 
+static void create_statetable(void)
+{
+	struct statetable *table;
+	int fd;
+
+	if (cmdargs.force)
+		unlink(STATETABLE_PATH);
+	fd = open(STATETABLE_PATH, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		logerr("Failed to create the state table %s: %s\n",
+		       STATETABLE_PATH, strerror(errno));
+		return;
+	}
+	if (ftruncate(fd, sizeof(*table))) {
+		logerr("Failed to resize the state table: %s\n",
+		       strerror(errno));
+		goto err_unlink;
+	}
+	table = mmap(NULL, sizeof(*table), PROT_READ | PROT_WRITE,
+		     MAP_SHARED, fd, 0);
+	if (table == MAP_FAILED) {
+		logerr("Failed to map the state table: %s\n",
+		       strerror(errno));
+		goto err_unlink;
+	}
+	close(fd);
+
+	table->version = STATETABLE_VERSION;
+	table->mouse_size = sizeof(table->mice[0]);
+	table->max_mice = STATETABLE_MAX_MICE;
+	__atomic_store_n(&table->magic, STATETABLE_MAGIC, __ATOMIC_RELEASE);
+	statetable = table;
+
+	return;
+
+err_unlink:
+	unlink(STATETABLE_PATH);
+	close(fd);
+}
+
+static void remove_statetable(void)
+{
+	if (!statetable)
+		return;
+	/* Tell the readers to reopen the table. */
+	__atomic_store_n(&statetable->magic, 0, __ATOMIC_RELEASE);
+	munmap(statetable, sizeof(*statetable));
+	statetable = NULL;
+	unlink(STATETABLE_PATH);
+}
+
 static void cleanup_var_run(void)
 {
+	remove_statetable();
+
 	unlink(SOCKPATH);
 	close(ctlsock);
 	ctlsock = -1;
@@ -534,6 +986,9 @@ static int setup_var_run(void)
 	if (privsock == -1)
 		goto err_remove_ctlsock;
 
+	/* Clients fall back to commands without a state table. */
+	create_statetable();
+
 	return 0;
 
 err_remove_ctlsock:
@@ -550,6 +1005,8 @@ err_remove_pidfile:
 
 static int setup_environment(void)
 {
+	struct emulate_spec *spec;
+	unsigned int i;
 	int err;
 
 	err = razer_init(!cmdargs.no_profile_emu);
@@ -560,6 +1017,22 @@ static int setup_environment(void)
 	razer_set_logging(cmdargs.loglevel >= LOGLEVEL_INFO ? loginfo : NULL,
 			  cmdargs.loglevel >= LOGLEVEL_ERROR ? logerr : NULL,
 			  cmdargs.loglevel >= LOGLEVEL_DEBUG ? logdebug : NULL);
+	razer_set_claim_lease(cmdargs.lease_msec);
+	err = razer_set_state_cache(cmdargs.state_dir);
+	if (err) {
+		logerr("Failed to set the state cache directory (%d)\n", err);
+		goto err_exit;
+	}
+	for (i = 0; i < cmdargs.nr_emulate; i++) {
+		spec = &cmdargs.emulate[i];
+		err = razer_add_emulated_mice(spec->model, spec->count,
+					      spec->latency_msec);
+		if (err) {
+			logerr("Failed to add emulated %s mice (%d)\n",
+			       spec->model, err);
+			goto err_exit;
+		}
+	}
 	err = razer_load_config(cmdargs.configfile);
 	if (cmdargs.configfile && err) {
 		logerr("Failed to load config file %s\n",
@@ -577,14 +1050,19 @@ err_exit:
 	return err;
 }
 
+static void stop_all_workers(void);
+
 static void cleanup_environment(void)
 {
 	cleanup_var_run();
+	stop_all_workers();
 	razer_exit();
 }
 
 static void signal_handler(int signum)
 {
+	char c = 0;
+
 	switch (signum) {
 	case SIGINT:
 	case SIGTERM:
@@ -595,6 +1073,14 @@ static void signal_handler(int signum)
 	case SIGPIPE:
 		/* Ignore */
 		break;
+	case SIGUSR1:
+		/* The system resumed. Wake up the main loop to replay
+		 * the device configurations. If the write fails, the
+		 * resume runs on the next wakeup. */
+		resume_requested = 1;
+		if (write(done_pipe[1], &c, 1) < 0)
+			break;
+		break;
 	default:
 		logerr("Received unknown signal %d\n", signum);
 	}
@@ -612,10 +1098,26 @@ static void setup_sighandler(void)
 	sigaction(SIGINT, &act, NULL);
 	sigaction(SIGTERM, &act, NULL);
 	sigaction(SIGPIPE, &act, NULL);
+	/* Don't interrupt blocking calls for a resume request. */
+	act.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &act, NULL);
+}
+
+static void free_bulk_recv(struct bulk_recv *bulk)
+{
+	if (bulk) {
+		free(bulk->data);
+		free(bulk);
+	}
 }
 
 static void free_client(struct client *client)
 {
+	if (client->passed_fd >= 0)
+		close(client->passed_fd);
+	free_bulk_recv(client->bulk);
+	free(client->replybuf);
+	free(client->outbuf);
 	free(client);
 }
 
@@ -632,6 +1134,10 @@ static struct client * new_client(const struct sockaddr_un *sockaddr,
 	memcpy(&client->sockaddr, sockaddr, sizeof(client->sockaddr));
 	client->socklen = socklen;
 	client->fd = fd;
+	client->passed_fd = -1;
+	client->source.type = POLLSRC_CLIENT;
+	client->source.client = client;
+	client->notify_mask = NOTIFYMSK_DEFAULT;
 
 	return client;
 }
@@ -664,6 +1170,59 @@ static void client_list_del(struct client **base, struct client *del_entry)
 		i->next = del_entry->next;
 }
 
+static int epoll_add(int fd, uint32_t events, struct poll_source *source)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = source;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev)) {
+		logerr("Failed to add fd %d to epoll: %s\n",
+		       fd, strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int epoll_mod(int fd, uint32_t events, struct poll_source *source)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = source;
+	if (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev)) {
+		logerr("Failed to modify fd %d in epoll: %s\n",
+		       fd, strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+/* Update the epoll events of a client.
+ * A client with pending commands is not read.
+ * A client with queued output waits for writability. */
+static void update_client_events(struct client *client)
+{
+	uint32_t events = 0;
+
+	if (client->dead)
+		return;
+	if (!client->nr_pending)
+		events |= EPOLLIN;
+	if (client->outbuf_len)
+		events |= EPOLLOUT;
+	if (events == client->epoll_events)
+		return;
+	if (epoll_mod(client->fd, events, &client->source))
+		client->dead = 1;
+	else
+		client->epoll_events = events;
+}
+
 static void check_control_socket(int socket_fd, struct client **client_list)
 {
 	socklen_t socklen;
@@ -688,6 +1247,14 @@ static void check_control_socket(int socket_fd, struct client **client_list)
 		close(fd);
 		return;
 	}
+	client->privileged = (client_list == &privileged_clients);
+	client->epoll_events = EPOLLIN;
+	err = epoll_add(fd, client->epoll_events, &client->source);
+	if (err) {
+		free_client(client);
+		close(fd);
+		return;
+	}
 	client_list_add(client_list, client);
 	if (client_list == &privileged_clients)
 		logdebug("Privileged client connected (fd=%d)\n", fd);
@@ -698,32 +1265,132 @@ static void check_control_socket(int socket_fd, struct client **client_list)
 static void disconnect_client(struct client **client_list, struct client *client)
 {
 	client_list_del(client_list, client);
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
 	if (client_list == &privileged_clients)
 		logdebug("Privileged client disconnected (fd=%d)\n", client->fd);
 	else
 		logdebug("Client disconnected (fd=%d)\n", client->fd);
+	if (client->nr_pending) {
+		/* Freed when the last pending command completes. */
+		client->disconnected = 1;
+		return;
+	}
 	free_client(client);
 }
 
-static int send_reply(struct client *client, struct reply *r, size_t len)
+/* Send as much of the output queue as the socket takes. */
+static int flush_client_output(struct client *client)
 {
-	const uint8_t *buf = (const uint8_t *)r;
+	size_t sent = 0;
 	int ret;
 
-	while (len) {
-		ret = send(client->fd, buf, len, 0);
+	while (sent < client->outbuf_len) {
+		ret = send(client->fd, client->outbuf + sent,
+			   client->outbuf_len - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
 		if (ret < 0) {
-			if (errno == EAGAIN ||
-			    errno == EINTR) {
-				razer_msleep(1);
+			if (errno == EINTR)
 				continue;
-			}
-			logerr("send() failed: %s", strerror(errno));
+			if (errno == EAGAIN)
+				break;
+			logerr("send() failed: %s\n", strerror(errno));
+			client->dead = 1;
 			return -errno;
 		}
-		len -= ret;
-		buf += ret;
+		sent += ret;
+	}
+	client->outbuf_len -= sent;
+	memmove(client->outbuf, client->outbuf + sent, client->outbuf_len);
+	update_client_events(client);
+
+	return 0;
+}
+
+/* Append data to the output queue of a client. */
+static int queue_output(struct client *client, const void *data, size_t len)
+{
+	char *outbuf;
+
+	if (client->dead)
+		return -EPIPE;
+	if (client->outbuf_len + len > CLIENT_OUTQ_HIGHWATER) {
+		logerr("Client (fd=%d) does not read its replies. "
+		       "Disconnecting.\n", client->fd);
+		client->dead = 1;
+		return -ENOBUFS;
+	}
+	outbuf = realloc(client->outbuf, client->outbuf_len + len);
+	if (!outbuf) {
+		logerr("Out of memory\n");
+		return -ENOMEM;
+	}
+	memcpy(outbuf + client->outbuf_len, data, len);
+	client->outbuf = outbuf;
+	client->outbuf_len += len;
+
+	return 0;
+}
+
+static int send_data(struct client *client, const void *data, size_t len)
+{
+	int err;
+
+	err = queue_output(client, data, len);
+	if (err)
+		return err;
+
+	return flush_client_output(client);
+}
+
+static int send_frame(struct client *client, uint32_t reqid,
+		      const void *data, size_t len)
+{
+	struct reply_frame_hdr hdr;
+	int err;
+
+	hdr.len = cpu_to_be32(sizeof(hdr.reqid) + len);
+	hdr.reqid = cpu_to_be32(reqid);
+	err = queue_output(client, &hdr, sizeof(hdr));
+	if (err)
+		return err;
+
+	return send_data(client, data, len);
+}
+
+/* Send the collected replies to a command. */
+static int send_command_replies(struct client *client, uint32_t reqid,
+				const void *data, size_t len)
+{
+	if (client->framed)
+		return send_frame(client, reqid, data, len);
+	if (!len)
+		return 0;
+	return send_data(client, data, len);
+}
+
+/* Send a message that is not a reply to a command. */
+static int send_message(struct client *client, struct reply *r, size_t len)
+{
+	if (client->framed)
+		return send_frame(client, 0, r, len);
+	return send_data(client, r, len);
+}
+
+static int send_reply(struct client *client, struct reply *r, size_t len)
+{
+	char *replybuf;
+
+	if (!client->collect_replies)
+		return send_message(client, r, len);
+
+	replybuf = realloc(client->replybuf, client->replybuf_len + len);
+	if (!replybuf) {
+		logerr("Out of memory\n");
+		return -ENOMEM;
 	}
+	memcpy(replybuf + client->replybuf_len, r, len);
+	client->replybuf = replybuf;
+	client->replybuf_len += len;
 
 	return 0;
 }
@@ -790,83 +1457,288 @@ static int send_utf16_string(struct client *client, const razer_utf16_t *str)
 	return err;
 }
 
-static int recv_bulk(struct client *client, char *buf, unsigned int len)
+static int send_blob(struct client *client, const void *data, size_t len)
 {
-	unsigned int next_len, i;
-	int nr;
+	struct reply *r;
+	int err;
 
-//FIXME timeout
-	for (i = 0; i < len; i += BULK_CHUNK_SIZE) {
-		next_len = BULK_CHUNK_SIZE;
-		if (i + next_len > len)
-			next_len = len - i;
-		while (1) {
-			nr = recv(client->fd, buf + i, next_len, 0);
-			if (nr < 0) {
-				if (errno == EAGAIN ||
-				    errno == EINTR) {
-					razer_msleep(1);
-					continue;
-				}
-			}
-			if (nr > 0)
-				break;
-		}
-		if (nr < 0 || (unsigned int)nr != next_len) {
-			send_u32(client, ERR_PAYLOAD);
-			return -1;
-		}
-		send_u32(client, ERR_NONE);
+	r = malloc(len + REPLY_SIZE(blob));
+	if (!r) {
+		logerr("Out of memory\n");
+		return -ENOMEM;
 	}
 
-	return 0;
+	r->hdr.id = REPLY_ID_BLOB;
+	r->blob.len = cpu_to_be32(len);
+	if (len)
+		memcpy(r->blob.data, data, len);
+	err = send_reply(client, r, REPLY_SIZE(blob) + len);
+
+	free(r);
+
+	return err;
 }
 
-struct razer_mouse * find_mouse(const char *idstr)
+/* Queue a notification about a change made by the running command. */
+static void statetable_update_mouse(struct razer_mouse *mouse);
+
+/* Queue the notification of a device state change. */
+static void queue_notification(struct client *client, struct razer_mouse *mouse,
+			       uint32_t mask, const struct reply *r, size_t size)
 {
-	struct razer_mouse *m, *next;
+	struct notification *n, *i;
 
-	razer_for_each_mouse(m, next, mice) {
-		if (strncmp(m->idstr, idstr, RAZER_IDSTR_MAX_SIZE) == 0)
-			return m;
+	statetable_update_mouse(mouse);
+
+	n = malloc(sizeof(*n));
+	if (!n) {
+		logerr("Out of memory\n");
+		return;
 	}
+	n->next = NULL;
+	n->mask = mask;
+	n->size = size;
+	memcpy(&n->r, r, size);
 
-	return NULL;
+	if (!client->notifications) {
+		client->notifications = n;
+		return;
+	}
+	for (i = client->notifications; i->next; i = i->next)
+		;
+	i->next = n;
 }
 
-static struct razer_mouse_profile * find_mouse_profile(struct razer_mouse *mouse,
-						       unsigned int profile_id)
+/* Get the last queued notification, to pass to drop_notifications(). */
+static struct notification * last_notification(struct client *client)
 {
-	struct razer_mouse_profile *list;
-	unsigned int i;
+	struct notification *n;
 
-	if (!mouse->get_profiles)
-		return NULL;
-	list = mouse->get_profiles(mouse);
-	if (!list)
-		return NULL;
-	for (i = 0; i < mouse->nr_profiles; i++) {
-		if (list[i].nr == profile_id)
-			return &list[i];
-	}
+	for (n = client->notifications; n && n->next; n = n->next)
+		;
 
-	return NULL;
+	return n;
 }
 
-static struct razer_axis * find_mouse_axis(struct razer_mouse *mouse,
-					   unsigned int axis_id)
+/* Drop the notifications queued after mark. All, if mark is NULL. */
+static void drop_notifications(struct client *client, struct notification *mark)
 {
-	struct razer_axis *list;
-	int i, count;
+	struct notification *n, **pnext;
 
-	if (!mouse->supported_axes)
-		return NULL;
-	count = mouse->supported_axes(mouse, &list);
-	if (count <= 0)
-		return NULL;
-	for (i = 0; i < count; i++) {
-		if (list[i].id == axis_id)
-			return &list[i];
+	pnext = mark ? &mark->next : &client->notifications;
+	while ((n = *pnext)) {
+		*pnext = n->next;
+		free(n);
+	}
+}
+
+static void notify_set_idstr(char *idstr, const struct razer_mouse *mouse)
+{
+	memset(idstr, 0, RAZER_IDSTR_MAX_SIZE);
+	strncpy(idstr, mouse->idstr, RAZER_IDSTR_MAX_SIZE);
+}
+
+static void notify_activeprof(struct client *client, struct razer_mouse *mouse,
+			      uint32_t profile_id)
+{
+	struct reply r;
+
+	r.hdr.id = NOTIFY_ID_ACTIVEPROF;
+	notify_set_idstr(r.notify_activeprof.idstr, mouse);
+	r.notify_activeprof.profile_id = cpu_to_be32(profile_id);
+	queue_notification(client, mouse, NOTIFYMSK_PROFILE, &r,
+			   REPLY_SIZE(notify_activeprof));
+}
+
+static void notify_profname(struct client *client, struct razer_mouse *mouse,
+			    uint32_t profile_id, const uint8_t *utf16be_name)
+{
+	struct reply r;
+
+	r.hdr.id = NOTIFY_ID_PROFNAME;
+	notify_set_idstr(r.notify_profname.idstr, mouse);
+	r.notify_profname.profile_id = cpu_to_be32(profile_id);
+	memcpy(r.notify_profname.utf16be_name, utf16be_name,
+	       sizeof(r.notify_profname.utf16be_name));
+	queue_notification(client, mouse, NOTIFYMSK_PROFILE, &r,
+			   REPLY_SIZE(notify_profname));
+}
+
+static void notify_dpimapping(struct client *client, struct razer_mouse *mouse,
+			      uint32_t profile_id, uint32_t axis_id,
+			      uint32_t mapping_id)
+{
+	struct reply r;
+
+	r.hdr.id = NOTIFY_ID_DPIMAPPING;
+	notify_set_idstr(r.notify_dpimapping.idstr, mouse);
+	r.notify_dpimapping.profile_id = cpu_to_be32(profile_id);
+	r.notify_dpimapping.axis_id = cpu_to_be32(axis_id);
+	r.notify_dpimapping.mapping_id = cpu_to_be32(mapping_id);
+	queue_notification(client, mouse, NOTIFYMSK_DPIMAPPING, &r,
+			   REPLY_SIZE(notify_dpimapping));
+}
+
+static void notify_dpimappingchange(struct client *client, struct razer_mouse *mouse,
+				    uint32_t mapping_id, uint32_t dimension,
+				    uint32_t new_resolution)
+{
+	struct reply r;
+
+	r.hdr.id = NOTIFY_ID_DPIMAPPINGCHANGE;
+	notify_set_idstr(r.notify_dpimappingchange.idstr, mouse);
+	r.notify_dpimappingchange.mapping_id = cpu_to_be32(mapping_id);
+	r.notify_dpimappingchange.dimension = cpu_to_be32(dimension);
+	r.notify_dpimappingchange.new_resolution = cpu_to_be32(new_resolution);
+	queue_notification(client, mouse, NOTIFYMSK_DPIMAPPING, &r,
+			   REPLY_SIZE(notify_dpimappingchange));
+}
+
+static void notify_freq(struct client *client, struct razer_mouse *mouse,
+			uint32_t profile_id, uint32_t new_frequency)
+{
+	struct reply r;
+
+	r.hdr.id = NOTIFY_ID_FREQ;
+	notify_set_idstr(r.notify_freq.idstr, mouse);
+	r.notify_freq.profile_id = cpu_to_be32(profile_id);
+	r.notify_freq.new_frequency = cpu_to_be32(new_frequency);
+	queue_notification(client, mouse, NOTIFYMSK_FREQ, &r,
+			   REPLY_SIZE(notify_freq));
+}
+
+static void notify_led_state(struct client *client, struct razer_mouse *mouse,
+			     uint32_t profile_id, const char *led_name,
+			     uint8_t state, uint8_t mode, uint32_t color)
+{
+	struct reply r;
+
+	r.hdr.id = NOTIFY_ID_LED;
+	notify_set_idstr(r.notify_led.idstr, mouse);
+	r.notify_led.profile_id = cpu_to_be32(profile_id);
+	memset(r.notify_led.led_name, 0, sizeof(r.notify_led.led_name));
+	strncpy(r.notify_led.led_name, led_name, sizeof(r.notify_led.led_name));
+	r.notify_led.state = state;
+	r.notify_led.mode = mode;
+	r.notify_led.color = cpu_to_be32(color);
+	queue_notification(client, mouse, NOTIFYMSK_LED, &r,
+			   REPLY_SIZE(notify_led));
+}
+
+static void notify_led(struct client *client, struct razer_mouse *mouse,
+		       uint32_t profile_id, const struct razer_led *led)
+{
+	notify_led_state(client, mouse, profile_id, led->name,
+			 led->state, led->mode,
+			 ((uint32_t)led->color.r << 16) |
+			 ((uint32_t)led->color.g << 8) |
+			 ((uint32_t)led->color.b << 0));
+}
+
+static void notify_butfunc(struct client *client, struct razer_mouse *mouse,
+			   uint32_t profile_id, uint32_t button_id,
+			   uint32_t function_id)
+{
+	struct reply r;
+
+	r.hdr.id = NOTIFY_ID_BUTFUNC;
+	notify_set_idstr(r.notify_butfunc.idstr, mouse);
+	r.notify_butfunc.profile_id = cpu_to_be32(profile_id);
+	r.notify_butfunc.button_id = cpu_to_be32(button_id);
+	r.notify_butfunc.function_id = cpu_to_be32(function_id);
+	queue_notification(client, mouse, NOTIFYMSK_BUTFUNC, &r,
+			   REPLY_SIZE(notify_butfunc));
+}
+
+static void notify_commiterr(struct client *client, struct razer_mouse *mouse)
+{
+	struct reply r;
+
+	r.hdr.id = NOTIFY_ID_COMMITERR;
+	notify_set_idstr(r.notify_commiterr.idstr, mouse);
+	r.notify_commiterr.errorcode = cpu_to_be32(ERR_FAIL);
+	queue_notification(client, mouse, NOTIFYMSK_COMMITERR, &r,
+			   REPLY_SIZE(notify_commiterr));
+}
+
+/* Bulk acks are sent while the command runs, so they bypass
+ * reply collection. */
+static int send_bulk_ack(struct client *client, uint32_t v)
+{
+	struct reply r;
+
+	r.hdr.id = REPLY_ID_U32;
+	r.u32.val = cpu_to_be32(v);
+
+	return send_message(client, &r, REPLY_SIZE(u32));
+}
+
+static bool worker_stopping(struct mouse_worker *worker)
+{
+	bool stop;
+
+	pthread_mutex_lock(&worker->queue_lock);
+	stop = worker->stop;
+	pthread_mutex_unlock(&worker->queue_lock);
+
+	return stop;
+}
+
+struct razer_mouse * find_mouse(struct client *client, const char *idstr)
+{
+	struct razer_mouse *m, *next;
+
+	if (client->worker) {
+		/* Workers only access their own mouse. */
+		m = client->worker->mouse;
+		if (worker_stopping(client->worker))
+			return NULL;
+		if (strncmp(m->idstr, idstr, RAZER_IDSTR_MAX_SIZE) == 0)
+			return m;
+		return NULL;
+	}
+
+	razer_for_each_mouse(m, next, mice) {
+		if (strncmp(m->idstr, idstr, RAZER_IDSTR_MAX_SIZE) == 0)
+			return m;
+	}
+
+	return NULL;
+}
+
+static struct razer_mouse_profile * find_mouse_profile(struct razer_mouse *mouse,
+						       unsigned int profile_id)
+{
+	struct razer_mouse_profile *list;
+	unsigned int i;
+
+	if (!mouse->get_profiles)
+		return NULL;
+	list = mouse->get_profiles(mouse);
+	if (!list)
+		return NULL;
+	for (i = 0; i < mouse->nr_profiles; i++) {
+		if (list[i].nr == profile_id)
+			return &list[i];
+	}
+
+	return NULL;
+}
+
+static struct razer_axis * find_mouse_axis(struct razer_mouse *mouse,
+					   unsigned int axis_id)
+{
+	struct razer_axis *list;
+	int i, count;
+
+	if (!mouse->supported_axes)
+		return NULL;
+	count = mouse->supported_axes(mouse, &list);
+	if (count <= 0)
+		return NULL;
+	for (i = 0; i < count; i++) {
+		if (list[i].id == axis_id)
+			return &list[i];
 	}
 
 	return NULL;
@@ -945,26 +1817,84 @@ static void command_getmice(struct client *client, const struct command *cmd, un
 	}
 }
 
+static uint32_t get_fw_version(struct razer_mouse *mouse)
+{
+	struct razer_mouse_info info;
+
+	/* Does not claim the device. */
+	razer_mouse_get_info(mouse, &info);
+	if (info.fw_version < 0)
+		return 0xFFFFFFFF;
+
+	return info.fw_version;
+}
+
 static void command_getfwver(struct client *client, const struct command *cmd, unsigned int len)
 {
 	struct razer_mouse *mouse;
 	uint32_t fwver = 0xFFFFFFFF;
-	int err;
 
 	if (len < CMD_SIZE(getfwver))
 		goto out;
-	mouse = find_mouse(cmd->idstr);
-	if (!mouse || !mouse->get_fw_version)
-		goto out;
-	err = mouse->claim(mouse);
-	if (err)
+	mouse = find_mouse(client, cmd->idstr);
+	if (!mouse)
 		goto out;
-	fwver = mouse->get_fw_version(mouse);
-	mouse->release(mouse);
+	fwver = get_fw_version(mouse);
 out:
 	send_u32(client, fwver);
 }
 
+static void command_getserial(struct client *client, const struct command *cmd, unsigned int len)
+{
+	struct razer_mouse *mouse;
+	struct razer_mouse_info info;
+
+	if (len < CMD_SIZE(getserial))
+		goto error;
+	mouse = find_mouse(client, cmd->idstr);
+	if (!mouse)
+		goto error;
+	razer_mouse_get_info(mouse, &info);
+
+	send_string(client, info.serial);
+
+	return;
+error:
+	send_string(client, "");
+}
+
+/* Replies with the errorcode and the statistics as U32 values:
+ * current spacing, min spacing, max spacing, achieved spacing (all usec),
+ * number of packets, number of errors, number of retries. */
+static void command_getpacing(struct client *client, const struct command *cmd, unsigned int len)
+{
+	struct razer_mouse *mouse;
+	struct razer_pacing_stats stats;
+	uint32_t errorcode = ERR_NONE;
+
+	memset(&stats, 0, sizeof(stats));
+	if (len < CMD_SIZE(getpacing)) {
+		errorcode = ERR_CMDSIZE;
+		goto out;
+	}
+	mouse = find_mouse(client, cmd->idstr);
+	if (!mouse) {
+		errorcode = ERR_NOMOUSE;
+		goto out;
+	}
+	if (razer_mouse_get_pacing_stats(mouse, &stats))
+		errorcode = ERR_NOTSUPP;
+out:
+	send_u32(client, errorcode);
+	send_u32(client, stats.spacing_usec);
+	send_u32(client, stats.min_usec);
+	send_u32(client, stats.max_usec);
+	send_u32(client, stats.achieved_usec);
+	send_u32(client, stats.nr_packets);
+	send_u32(client, stats.nr_errors);
+	send_u32(client, stats.nr_retries);
+}
+
 static void command_getfreq(struct client *client, const struct command *cmd, unsigned int len)
 {
 	struct razer_mouse *mouse;
@@ -974,7 +1904,7 @@ static void command_getfreq(struct client *client, const struct command *cmd, un
 
 	if (len < CMD_SIZE(getfreq))
 		goto error;
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse)
 		goto error;
 	profile_id = be32_to_cpu(cmd->getfreq.profile_id);
@@ -1004,7 +1934,7 @@ static void command_suppfreqs(struct client *client, const struct command *cmd,
 
 	if (len < CMD_SIZE(suppfreqs))
 		goto error;
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse || !mouse->supported_freqs)
 		goto error;
 	count = mouse->supported_freqs(mouse, &freq_list);
@@ -1030,7 +1960,7 @@ static void command_suppresol(struct client *client, const struct command *cmd,
 
 	if (len < CMD_SIZE(suppresol))
 		goto error;
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse || !mouse->supported_resolutions)
 		goto error;
 	count = mouse->supported_resolutions(mouse, &res_list);
@@ -1056,7 +1986,7 @@ static void command_suppdpimappings(struct client *client, const struct command
 
 	if (len < CMD_SIZE(suppdpimappings))
 		goto error;
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse || !mouse->supported_dpimappings)
 		goto error;
 	count = mouse->supported_dpimappings(mouse, &list);
@@ -1092,7 +2022,7 @@ static void command_changedpimapping(struct client *client, const struct command
 		errorcode = ERR_CMDSIZE;
 		goto error;
 	}
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse) {
 		errorcode = ERR_NOMOUSE;
 		goto error;
@@ -1114,6 +2044,11 @@ static void command_changedpimapping(struct client *client, const struct command
 	if (err)
 		errorcode = ERR_FAIL;
 	mouse->release(mouse);
+	if (!err) {
+		notify_dpimappingchange(client, mouse, mapping->nr,
+					be32_to_cpu(cmd->changedpimapping.dimension),
+					be32_to_cpu(cmd->changedpimapping.new_resolution));
+	}
 
 error:
 	send_u32(client, errorcode);
@@ -1128,7 +2063,7 @@ static void command_getdpimapping(struct client *client, const struct command *c
 
 	if (len < CMD_SIZE(getdpimapping))
 		goto error;
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse)
 		goto error;
 	profile = find_mouse_profile(mouse, be32_to_cpu(cmd->getdpimapping.profile_id));
@@ -1159,7 +2094,7 @@ static void command_setdpimapping(struct client *client, const struct command *c
 		errorcode = ERR_CMDSIZE;
 		goto error;
 	}
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse) {
 		errorcode = ERR_NOMOUSE;
 		goto error;
@@ -1187,6 +2122,8 @@ static void command_setdpimapping(struct client *client, const struct command *c
 		errorcode = ERR_FAIL;
 		goto error;
 	}
+	notify_dpimapping(client, mouse, profile->nr,
+			  be32_to_cpu(cmd->setdpimapping.axis_id), mapping->nr);
 
 error:
 	send_u32(client, errorcode);
@@ -1199,20 +2136,18 @@ static void command_rescanmice(struct client *client, const struct command *cmd,
 
 static void command_reconfigmice(struct client *client, const struct command *cmd, unsigned int len)
 {
+	struct razer_mouse *mouse, *next;
+
 	razer_reconfig_mice();
+	razer_for_each_mouse(mouse, next, mice)
+		statetable_update_mouse(mouse);
 }
 
-static void command_getmouseinfo(struct client *client, const struct command *cmd, unsigned int len)
+static uint32_t get_mouseinfo_flags(struct razer_mouse *mouse)
 {
-	struct razer_mouse *mouse;
 	struct razer_mouse_profile *profiles;
-	unsigned int flags;
+	uint32_t flags;
 
-	if (len < CMD_SIZE(getmouseinfo))
-		goto error;
-	mouse = find_mouse(cmd->idstr);
-	if (!mouse)
-		goto error;
 	flags = MOUSEINFOFLG_RESULTOK;
 	if (mouse->global_get_leds)
 		flags |= MOUSEINFOFLG_GLOBAL_LEDS;
@@ -1231,24 +2166,56 @@ static void command_getmouseinfo(struct client *client, const struct command *cm
 	}
 	if (mouse->flags & RAZER_MOUSEFLG_SUGGESTFWUP)
 		flags |= MOUSEINFOFLG_SUGGESTFWUP;
-	send_u32(client, flags);
+
+	return flags;
+}
+
+static void command_getmouseinfo(struct client *client, const struct command *cmd, unsigned int len)
+{
+	struct razer_mouse *mouse;
+
+	if (len < CMD_SIZE(getmouseinfo))
+		goto error;
+	mouse = find_mouse(client, cmd->idstr);
+	if (!mouse)
+		goto error;
+	send_u32(client, get_mouseinfo_flags(mouse));
 
 	return;
 error:
 	send_u32(client, 0);
 }
 
+static uint32_t get_led_flags(const struct razer_led *led)
+{
+	uint32_t flags = 0;
+
+	if (led->color.valid)
+		flags |= LED_FLAG_HAVECOLOR;
+	if (led->change_color)
+		flags |= LED_FLAG_CHANGECOLOR;
+
+	return flags;
+}
+
+static uint32_t get_led_color(const struct razer_led *led)
+{
+	return ((uint32_t)led->color.r << 16) |
+	       ((uint32_t)led->color.g << 8) |
+	       ((uint32_t)led->color.b << 0);
+}
+
 static void command_getleds(struct client *client, const struct command *cmd, unsigned int len)
 {
 	struct razer_mouse *mouse;
 	struct razer_mouse_profile *profile;
 	struct razer_led *leds_list, *led;
 	int count;
-	unsigned int flags, profile_id;
+	unsigned int profile_id;
 
 	if (len < CMD_SIZE(getleds))
 		goto error;
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse)
 		goto error;
 	profile_id = be32_to_cpu(cmd->getleds.profile_id);
@@ -1269,19 +2236,12 @@ static void command_getleds(struct client *client, const struct command *cmd, un
 
 	send_u32(client, count);
 	for (led = leds_list; led; led = led->next) {
-		flags = 0;
-		if (led->color.valid)
-			flags |= LED_FLAG_HAVECOLOR;
-		if (led->change_color)
-			flags |= LED_FLAG_CHANGECOLOR;
-		send_u32(client, flags);
+		send_u32(client, get_led_flags(led));
 		send_string(client, led->name);
 		send_u32(client, led->state);
 		send_u32(client, led->mode);
 		send_u32(client, led->supported_modes_mask);
-		send_u32(client, ((uint32_t)led->color.r << 16) |
-				 ((uint32_t)led->color.g << 8) |
-				 ((uint32_t)led->color.b << 0));
+		send_u32(client, get_led_color(led));
 	}
 	razer_free_leds(leds_list);
 
@@ -1320,7 +2280,7 @@ static void command_setled(struct client *client, const struct command *cmd, uns
 		errorcode = ERR_CMDSIZE;
 		goto error;
 	}
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse) {
 		errorcode = ERR_NOMOUSE;
 		goto error;
@@ -1366,6 +2326,8 @@ static void command_setled(struct client *client, const struct command *cmd, uns
 			errorcode = ERR_FAIL;
 			goto error;
 		}
+		/* led is a copy. Update it for the notification. */
+		led->state = new_state;
 	}
 	new_mode = cmd->setled.new_mode;
 	if (new_mode != led->mode) {
@@ -1376,6 +2338,7 @@ static void command_setled(struct client *client, const struct command *cmd, uns
 				errorcode = ERR_FAIL;
 				goto error;
 			}
+			led->mode = new_mode;
 		}
 	}
 	if (led->change_color) {
@@ -1395,9 +2358,11 @@ static void command_setled(struct client *client, const struct command *cmd, uns
 				errorcode = ERR_FAIL;
 				goto error;
 			}
+			led->color = new_color;
 		}
 	}
 	mouse->release(mouse);
+	notify_led(client, mouse, profile_id, led);
 
 error:
 	razer_free_leds(leds_list);
@@ -1416,7 +2381,7 @@ static void command_setfreq(struct client *client, const struct command *cmd, un
 		errorcode = ERR_CMDSIZE;
 		goto error;
 	}
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse) {
 		errorcode = ERR_NOMOUSE;
 		goto error;
@@ -1456,6 +2421,8 @@ static void command_setfreq(struct client *client, const struct command *cmd, un
 		errorcode = ERR_FAIL;
 		goto error;
 	}
+	notify_freq(client, mouse, profile_id,
+		    be32_to_cpu(cmd->setfreq.new_frequency));
 
 error:
 	send_u32(client, errorcode);
@@ -1469,7 +2436,7 @@ static void command_getprofiles(struct client *client, const struct command *cmd
 
 	if (len < CMD_SIZE(getprofiles))
 		goto error;
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse)
 		goto error;
 	list = mouse->get_profiles(mouse);
@@ -1485,30 +2452,39 @@ error:
 	send_u32(client, 0);
 }
 
+/* Get the name of a profile. namebuf holds the default name. */
+static const razer_utf16_t * get_profile_name(struct razer_mouse_profile *profile,
+					      razer_utf16_t *namebuf,
+					      size_t namebuf_chars)
+{
+	char asciibuf[64] = { };
+
+	if (profile->get_name)
+		return profile->get_name(profile);
+
+	snprintf(asciibuf, sizeof(asciibuf),
+		 "Profile %u", profile->nr + 1);
+	razer_ascii_to_utf16(namebuf, namebuf_chars, asciibuf);
+
+	return namebuf;
+}
+
 static void command_getprofname(struct client *client, const struct command *cmd, unsigned int len)
 {
 	struct razer_mouse *mouse;
 	struct razer_mouse_profile *profile;
 	const razer_utf16_t *name;
 	razer_utf16_t namebuf[64] = { };
-	char asciibuf[64] = { };
 
 	if (len < CMD_SIZE(getprofname))
 		goto error;
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse)
 		goto error;
 	profile = find_mouse_profile(mouse, be32_to_cpu(cmd->getprofname.profile_id));
 	if (!profile)
 		goto error;
-	if (profile->get_name) {
-		name = profile->get_name(profile);
-	} else {
-		snprintf(asciibuf, sizeof(asciibuf),
-			 "Profile %u", profile->nr + 1);
-		razer_ascii_to_utf16(namebuf, ARRAY_SIZE(namebuf), asciibuf);
-		name = namebuf;
-	}
+	name = get_profile_name(profile, namebuf, ARRAY_SIZE(namebuf));
 	if (!name)
 		goto error;
 
@@ -1530,7 +2506,7 @@ static void command_setprofname(struct client *client, const struct command *cmd
 		errorcode = ERR_CMDSIZE;
 		goto error;
 	}
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse) {
 		errorcode = ERR_NOMOUSE;
 		goto error;
@@ -1550,6 +2526,8 @@ static void command_setprofname(struct client *client, const struct command *cmd
 		errorcode = ERR_FAIL;
 		goto error;
 	}
+	notify_profname(client, mouse, profile->nr,
+			cmd->setprofname.utf16be_name);
 
 error:
 	send_u32(client, errorcode);
@@ -1562,7 +2540,7 @@ static void command_getactiveprof(struct client *client, const struct command *c
 
 	if (len < CMD_SIZE(getactiveprof))
 		goto error;
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse)
 		goto error;
 	activeprof = mouse->get_active_profile(mouse);
@@ -1587,7 +2565,7 @@ static void command_setactiveprof(struct client *client, const struct command *c
 		errorcode = ERR_CMDSIZE;
 		goto error;
 	}
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse) {
 		errorcode = ERR_NOMOUSE;
 		goto error;
@@ -1607,6 +2585,8 @@ static void command_setactiveprof(struct client *client, const struct command *c
 	if (err)
 		errorcode = ERR_FAIL;
 	mouse->release(mouse);
+	if (!err)
+		notify_activeprof(client, mouse, profile->nr);
 
 error:
 	send_u32(client, errorcode);
@@ -1620,7 +2600,7 @@ static void command_suppbuttons(struct client *client, const struct command *cmd
 
 	if (len < CMD_SIZE(suppbuttons))
 		goto error;
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse || !mouse->supported_buttons)
 		goto error;
 	count = mouse->supported_buttons(mouse, &list);
@@ -1646,7 +2626,7 @@ static void command_suppbutfuncs(struct client *client, const struct command *cm
 
 	if (len < CMD_SIZE(suppbutfuncs))
 		goto error;
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse || !mouse->supported_button_functions)
 		goto error;
 	count = mouse->supported_button_functions(mouse, &list);
@@ -1673,7 +2653,7 @@ static void command_getbutfunc(struct client *client, const struct command *cmd,
 
 	if (len < CMD_SIZE(getbutfunc))
 		goto error;
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse)
 		goto error;
 	button = find_mouse_button(mouse, be32_to_cpu(cmd->getbutfunc.button_id));
@@ -1708,7 +2688,7 @@ static void command_setbutfunc(struct client *client, const struct command *cmd,
 		errorcode = ERR_CMDSIZE;
 		goto error;
 	}
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse) {
 		errorcode = ERR_NOMOUSE;
 		goto error;
@@ -1740,6 +2720,7 @@ static void command_setbutfunc(struct client *client, const struct command *cmd,
 		errorcode = ERR_FAIL;
 		goto error;
 	}
+	notify_butfunc(client, mouse, profile->nr, button->id, func->id);
 error:
 	send_u32(client, errorcode);
 }
@@ -1752,7 +2733,7 @@ static void command_suppaxes(struct client *client, const struct command *cmd, u
 
 	if (len < CMD_SIZE(suppaxes))
 		goto error;
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse || !mouse->supported_axes)
 		goto error;
 	count = mouse->supported_axes(mouse, &list);
@@ -1771,74 +2752,734 @@ error:
 	send_u32(client, 0);
 }
 
-static void command_flashfw(struct client *client, const struct command *cmd, unsigned int len)
+#define SNAPSHOT_VERSION	1
+
+/* Snapshot serialization buffer.
+ * All integers are big endian. Strings are a be16 length followed
+ * by the characters. */
+struct snapshot {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+	bool oom;
+};
+
+static void snapshot_put(struct snapshot *s, const void *data, size_t len)
 {
-	struct razer_mouse *mouse;
-	uint32_t image_size;
-	int err;
-	uint32_t errorcode = ERR_NONE;
-	char *image = NULL;
+	uint8_t *newdata;
+	size_t newsize;
 
-	if (len < CMD_SIZE(flashfw)) {
-		errorcode = ERR_CMDSIZE;
-		goto error;
-	}
-	image_size = be32_to_cpu(cmd->flashfw.imagesize);
-	if (image_size > MAX_FIRMWARE_SIZE) {
-		errorcode = ERR_CMDSIZE;
-		goto error;
+	if (s->oom)
+		return;
+	if (s->len + len > s->size) {
+		newsize = max(s->size * 2, s->len + len + 256);
+		newdata = realloc(s->data, newsize);
+		if (!newdata) {
+			s->oom = 1;
+			return;
+		}
+		s->data = newdata;
+		s->size = newsize;
 	}
+	memcpy(s->data + s->len, data, len);
+	s->len += len;
+}
 
-	image = malloc(image_size);
-	if (!image) {
-		errorcode = ERR_NOMEM;
-		goto error;
-	}
+static void snapshot_put_u8(struct snapshot *s, uint8_t v)
+{
+	snapshot_put(s, &v, sizeof(v));
+}
 
-	err = recv_bulk(client, image, image_size);
-	if (err) {
-		errorcode = ERR_PAYLOAD;
-		goto error;
-	}
+static void snapshot_put_u16(struct snapshot *s, uint16_t v)
+{
+	v = cpu_to_be16(v);
+	snapshot_put(s, &v, sizeof(v));
+}
 
-	mouse = find_mouse(cmd->idstr);
-	if (!mouse) {
-		errorcode = ERR_NOMOUSE;
-		goto error;
-	}
-	if (!mouse->flash_firmware) {
-		errorcode = ERR_NOTSUPP;
-		goto error;
-	}
-	err = mouse->claim(mouse);
-	if (err) {
-		errorcode = ERR_CLAIM;
-		goto error;
-	}
-	err = mouse->flash_firmware(mouse, image, image_size,
-				    RAZER_FW_FLASH_MAGIC);
-	mouse->release(mouse);
-	if (err) {
-		errorcode = ERR_FAIL;
-		goto error;
+static void snapshot_put_u32(struct snapshot *s, uint32_t v)
+{
+	v = cpu_to_be32(v);
+	snapshot_put(s, &v, sizeof(v));
+}
+
+/* Put an ASCII string. */
+static void snapshot_put_string(struct snapshot *s, const char *str)
+{
+	size_t i, len = min(strlen(str), (size_t)0xFFFF);
+
+	snapshot_put_u16(s, len);
+	for (i = 0; i < len; i++) {
+		if ((unsigned char)str[i] <= 0x7Fu)
+			snapshot_put_u8(s, str[i]);
+		else
+			snapshot_put_u8(s, '?'); /* Non-ASCII char. */
 	}
+}
 
-error:
-	send_u32(client, errorcode);
-	free(image);
+/* Put an UTF-16 string. It is sent as UTF-16BE. */
+static void snapshot_put_utf16(struct snapshot *s, const razer_utf16_t *str)
+{
+	size_t i, len = min(razer_utf16_strlen(str), (size_t)0xFFFF);
+
+	snapshot_put_u16(s, len);
+	for (i = 0; i < len; i++)
+		snapshot_put_u16(s, str[i]);
 }
 
-static void command_claim(struct client *client, const struct command *cmd, unsigned int len)
+static void snapshot_put_leds(struct snapshot *s, struct razer_led *leds_list,
+			      int count)
 {
-	struct razer_mouse *mouse;
-	uint32_t errorcode = ERR_NONE;
-	int err;
+	struct razer_led *led;
 
-	if (len < CMD_SIZE(claim)) {
-		errorcode = ERR_CMDSIZE;
-		goto error;
+	if (count <= 0) {
+		snapshot_put_u32(s, 0);
+		return;
+	}
+	snapshot_put_u32(s, count);
+	for (led = leds_list; led; led = led->next) {
+		snapshot_put_u32(s, get_led_flags(led));
+		snapshot_put_string(s, led->name);
+		snapshot_put_u32(s, led->state);
+		snapshot_put_u32(s, led->mode);
+		snapshot_put_u32(s, led->supported_modes_mask);
+		snapshot_put_u32(s, get_led_color(led));
+	}
+	razer_free_leds(leds_list);
+}
+
+static void snapshot_put_profile(struct snapshot *s,
+				 struct razer_mouse_profile *profile,
+				 struct razer_axis *axes, int nr_axes,
+				 struct razer_button *buttons, int nr_buttons)
+{
+	struct razer_mouse_dpimapping *mapping;
+	struct razer_button_function *func;
+	struct razer_led *leds_list = NULL;
+	const razer_utf16_t *name;
+	razer_utf16_t namebuf[64] = { };
+	int i, count = 0;
+
+	snapshot_put_u32(s, profile->nr);
+	name = get_profile_name(profile, namebuf, ARRAY_SIZE(namebuf));
+	snapshot_put_utf16(s, name ? name : namebuf);
+	snapshot_put_u32(s, profile->get_freq ? profile->get_freq(profile)
+					      : RAZER_MOUSE_FREQ_UNKNOWN);
+
+	/* The DPI mapping of each axis. Or one for all axes. */
+	snapshot_put_u32(s, max(nr_axes, 1));
+	for (i = 0; i < max(nr_axes, 1); i++) {
+		mapping = NULL;
+		if (profile->get_dpimapping)
+			mapping = profile->get_dpimapping(profile,
+							  nr_axes ? &axes[i] : NULL);
+		snapshot_put_u32(s, mapping ? mapping->nr : 0xFFFFFFFF);
+	}
+
+	if (profile->get_leds)
+		count = profile->get_leds(profile, &leds_list);
+	snapshot_put_leds(s, leds_list, count);
+
+	snapshot_put_u32(s, nr_buttons);
+	for (i = 0; i < nr_buttons; i++) {
+		func = NULL;
+		if (profile->get_button_function)
+			func = profile->get_button_function(profile, &buttons[i]);
+		snapshot_put_u32(s, func ? func->id : 0);
+	}
+}
+
+/* Serialize the complete state of a mouse. */
+static void snapshot_put_mouse(struct snapshot *s, struct razer_mouse *mouse)
+{
+	enum razer_mouse_freq *freq_list;
+	enum razer_mouse_res *res_list;
+	struct razer_axis *axes = NULL;
+	struct razer_mouse_dpimapping *mappings;
+	struct razer_button *buttons = NULL;
+	struct razer_button_function *funcs;
+	struct razer_mouse_profile *profiles, *activeprof;
+	struct razer_led *leds_list = NULL;
+	int i, j, count, nr_axes = 0, nr_buttons = 0;
+
+	snapshot_put_u8(s, SNAPSHOT_VERSION);
+	snapshot_put_u32(s, get_mouseinfo_flags(mouse));
+	snapshot_put_u32(s, get_fw_version(mouse));
+
+	count = 0;
+	if (mouse->supported_freqs)
+		count = mouse->supported_freqs(mouse, &freq_list);
+	snapshot_put_u32(s, max(count, 0));
+	if (count > 0) {
+		for (i = 0; i < count; i++)
+			snapshot_put_u32(s, freq_list[i]);
+		razer_free_freq_list(freq_list, count);
+	}
+
+	count = 0;
+	if (mouse->supported_resolutions)
+		count = mouse->supported_resolutions(mouse, &res_list);
+	snapshot_put_u32(s, max(count, 0));
+	if (count > 0) {
+		for (i = 0; i < count; i++)
+			snapshot_put_u32(s, res_list[i]);
+		razer_free_resolution_list(res_list, count);
+	}
+
+	if (mouse->supported_axes)
+		nr_axes = max(mouse->supported_axes(mouse, &axes), 0);
+	snapshot_put_u32(s, nr_axes);
+	for (i = 0; i < nr_axes; i++) {
+		snapshot_put_u32(s, axes[i].id);
+		snapshot_put_string(s, axes[i].name);
+		snapshot_put_u32(s, axes[i].flags);
+	}
+
+	count = 0;
+	if (mouse->supported_dpimappings)
+		count = mouse->supported_dpimappings(mouse, &mappings);
+	snapshot_put_u32(s, max(count, 0));
+	for (i = 0; i < count; i++) {
+		snapshot_put_u32(s, mappings[i].nr);
+		snapshot_put_u32(s, mappings[i].dimension_mask);
+		for (j = 0; j < RAZER_NR_DIMS; j++)
+			snapshot_put_u32(s, mappings[i].res[j]);
+		snapshot_put_u32(s, (mappings[i].profile_mask >> 32) & 0xFFFFFFFF);
+		snapshot_put_u32(s, (mappings[i].profile_mask >> 0) & 0xFFFFFFFF);
+		snapshot_put_u8(s, mappings[i].change ? 1 : 0);
+	}
+
+	if (mouse->supported_buttons)
+		nr_buttons = max(mouse->supported_buttons(mouse, &buttons), 0);
+	snapshot_put_u32(s, nr_buttons);
+	for (i = 0; i < nr_buttons; i++) {
+		snapshot_put_u32(s, buttons[i].id);
+		snapshot_put_string(s, buttons[i].name);
+	}
+
+	count = 0;
+	if (mouse->supported_button_functions)
+		count = mouse->supported_button_functions(mouse, &funcs);
+	snapshot_put_u32(s, max(count, 0));
+	for (i = 0; i < count; i++) {
+		snapshot_put_u32(s, funcs[i].id);
+		snapshot_put_string(s, funcs[i].name);
+	}
+
+	snapshot_put_u32(s, mouse->global_get_freq ? mouse->global_get_freq(mouse)
+						   : RAZER_MOUSE_FREQ_UNKNOWN);
+	count = 0;
+	if (mouse->global_get_leds)
+		count = mouse->global_get_leds(mouse, &leds_list);
+	snapshot_put_leds(s, leds_list, count);
+
+	activeprof = mouse->get_active_profile(mouse);
+	snapshot_put_u32(s, activeprof ? activeprof->nr : 0xFFFFFFFF);
+	profiles = mouse->get_profiles(mouse);
+	if (!profiles) {
+		snapshot_put_u32(s, 0);
+		return;
+	}
+	snapshot_put_u32(s, mouse->nr_profiles);
+	for (i = 0; i < (int)mouse->nr_profiles; i++) {
+		snapshot_put_profile(s, &profiles[i], axes, nr_axes,
+				     buttons, nr_buttons);
+	}
+}
+
+static void statetable_begin_write(void)
+{
+	uint32_t seq = statetable->seq;
+
+	__atomic_store_n(&statetable->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void statetable_end_write(void)
+{
+	uint32_t seq = statetable->seq;
+
+	__atomic_store_n(&statetable->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+static struct statetable_mouse * statetable_find_mouse(struct razer_mouse *mouse)
+{
+	uint32_t i;
+
+	for (i = 0; i < statetable->nr_mice; i++) {
+		if (strncmp(statetable->mice[i].idstr, mouse->idstr,
+			    RAZER_IDSTR_MAX_SIZE) == 0)
+			return &statetable->mice[i];
+	}
+
+	return NULL;
+}
+
+static void statetable_fill_mouse(struct statetable_mouse *entry,
+				  struct razer_mouse *mouse)
+{
+	struct razer_mouse_profile *profile = NULL;
+	struct razer_mouse_dpimapping *mapping = NULL;
+	struct razer_led *leds_list = NULL, *led;
+	struct statetable_led *tled;
+	int i;
+
+	memset(entry, 0, sizeof(*entry));
+	razer_strlcpy(entry->idstr, mouse->idstr, sizeof(entry->idstr));
+
+	if (mouse->get_active_profile)
+		profile = mouse->get_active_profile(mouse);
+	entry->active_profile = profile ? profile->nr : PROFILE_INVALID;
+
+	entry->frequency = RAZER_MOUSE_FREQ_UNKNOWN;
+	if (profile && profile->get_freq)
+		entry->frequency = profile->get_freq(profile);
+	else if (mouse->global_get_freq)
+		entry->frequency = mouse->global_get_freq(mouse);
+
+	if (profile && profile->get_dpimapping)
+		mapping = profile->get_dpimapping(profile, NULL);
+	entry->dpimapping_id = mapping ? mapping->nr : 0xFFFFFFFF;
+	if (mapping) {
+		for (i = 0; i < RAZER_NR_DIMS; i++)
+			entry->resolution[i] = mapping->res[i];
+	}
+
+	if (mouse->global_get_leds)
+		mouse->global_get_leds(mouse, &leds_list);
+	else if (profile && profile->get_leds)
+		profile->get_leds(profile, &leds_list);
+	for (led = leds_list; led; led = led->next) {
+		if (entry->nr_leds >= STATETABLE_MAX_LEDS)
+			break;
+		tled = &entry->leds[entry->nr_leds++];
+		razer_strlcpy(tled->name, led->name, sizeof(tled->name));
+		tled->state = led->state;
+		tled->mode = led->mode;
+		tled->color = get_led_color(led);
+	}
+	razer_free_leds(leds_list);
+}
+
+/* Publish the current state of a mouse.
+ * The caller holds the device lock of the mouse. */
+static void statetable_update_mouse(struct razer_mouse *mouse)
+{
+	struct statetable_mouse entry, *slot;
+
+	if (!statetable)
+		return;
+	/* Read the driver state before taking the lock. */
+	statetable_fill_mouse(&entry, mouse);
+
+	pthread_mutex_lock(&statetable_lock);
+	slot = statetable_find_mouse(mouse);
+	if (!slot) {
+		if (statetable->nr_mice >= STATETABLE_MAX_MICE) {
+			pthread_mutex_unlock(&statetable_lock);
+			logdebug("State table full. Not publishing %s\n",
+				 mouse->idstr);
+			return;
+		}
+		slot = &statetable->mice[statetable->nr_mice];
+	}
+	statetable_begin_write();
+	memcpy(slot, &entry, sizeof(entry));
+	if (slot == &statetable->mice[statetable->nr_mice])
+		statetable->nr_mice++;
+	statetable_end_write();
+	pthread_mutex_unlock(&statetable_lock);
+}
+
+static void statetable_remove_mouse(struct razer_mouse *mouse)
+{
+	struct statetable_mouse *slot, *last;
+
+	if (!statetable)
+		return;
+	pthread_mutex_lock(&statetable_lock);
+	slot = statetable_find_mouse(mouse);
+	if (slot) {
+		/* Keep the table dense. */
+		last = &statetable->mice[statetable->nr_mice - 1];
+		statetable_begin_write();
+		if (slot != last)
+			memcpy(slot, last, sizeof(*slot));
+		memset(last, 0, sizeof(*last));
+		statetable->nr_mice--;
+		statetable_end_write();
+	}
+	pthread_mutex_unlock(&statetable_lock);
+}
+
+static void command_subscribe(struct client *client, const struct command *cmd, unsigned int len)
+{
+	if (len < CMD_SIZE(subscribe)) {
+		send_u32(client, ERR_CMDSIZE);
+		return;
+	}
+	client->notify_mask = be32_to_cpu(cmd->subscribe.mask);
+	send_u32(client, ERR_NONE);
+}
+
+static bool batch_command_allowed(uint8_t id)
+{
+	switch (id) {
+	case COMMAND_ID_CHANGEDPIMAPPING:
+	case COMMAND_ID_SETDPIMAPPING:
+	case COMMAND_ID_SETLED:
+	case COMMAND_ID_SETFREQ:
+	case COMMAND_ID_SETACTIVEPROF:
+	case COMMAND_ID_SETBUTFUNC:
+	case COMMAND_ID_SETPROFNAME:
+		return 1;
+	}
+
+	return 0;
+}
+
+static void handle_received_command(struct client *client, const char *_cmd, unsigned int len);
+
+/* Apply the entries in one transaction.
+ * Replies with one U32 errorcode per entry and the commit errorcode. */
+static void command_batch(struct client *client, const struct command *cmd, unsigned int len)
+{
+	char subcmd_buf[COMMAND_MAX_SIZE];
+	struct command *subcmd = (struct command *)subcmd_buf;
+	const struct batch_entry *entry;
+	const size_t payload_offset = offsetof(struct command, batch);
+	struct notification *mark;
+	struct razer_mouse *mouse;
+	unsigned int i, nr_entries = 0, offset;
+	uint32_t errorcode = ERR_NONE;
+	int err;
+
+	if (len < CMD_SIZE(batch)) {
+		errorcode = ERR_CMDSIZE;
+		goto error;
+	}
+	nr_entries = cmd->batch.nr_entries;
+	mouse = find_mouse(client, cmd->idstr);
+	if (!mouse) {
+		errorcode = ERR_NOMOUSE;
+		goto error;
+	}
+	err = razer_mouse_begin(mouse);
+	if (err) {
+		errorcode = ERR_CLAIM;
+		goto error;
+	}
+	/* The entries queue their notifications before the commit. */
+	mark = last_notification(client);
+
+	offset = CMD_SIZE(batch);
+	for (i = 0; i < nr_entries; i++) {
+		entry = (const struct batch_entry *)((const char *)cmd + offset);
+		if (offset + sizeof(*entry) > len ||
+		    offset + sizeof(*entry) + entry->len > len ||
+		    payload_offset + entry->len > sizeof(subcmd_buf)) {
+			/* The remaining entries are malformed. */
+			for ( ; i < nr_entries; i++)
+				send_u32(client, ERR_PAYLOAD);
+			break;
+		}
+		offset += sizeof(*entry) + entry->len;
+		if (!batch_command_allowed(entry->id)) {
+			send_u32(client, ERR_NOTSUPP);
+			continue;
+		}
+
+		memset(subcmd_buf, 0, sizeof(subcmd_buf));
+		subcmd->hdr.id = entry->id;
+		memcpy(subcmd->idstr, cmd->idstr, sizeof(subcmd->idstr));
+		memcpy(subcmd_buf + payload_offset, entry->payload, entry->len);
+		/* The handler sends the errorcode of the entry. */
+		handle_received_command(client, subcmd_buf,
+					payload_offset + entry->len);
+	}
+
+	err = razer_mouse_commit(mouse);
+	if (err) {
+		/* The changes did not reach the hardware. Don't announce them. */
+		drop_notifications(client, mark);
+		statetable_update_mouse(mouse);
+		errorcode = ERR_FAIL;
+	}
+	send_u32(client, errorcode);
+
+	return;
+error:
+	for (i = 0; i < nr_entries; i++)
+		send_u32(client, errorcode);
+	send_u32(client, errorcode);
+}
+
+static void command_getsnapshot(struct client *client, const struct command *cmd, unsigned int len)
+{
+	struct razer_mouse *mouse;
+	struct snapshot s = { };
+
+	if (len < CMD_SIZE(getsnapshot))
+		goto error;
+	mouse = find_mouse(client, cmd->idstr);
+	if (!mouse)
+		goto error;
+	snapshot_put_mouse(&s, mouse);
+	if (s.oom) {
+		logerr("Out of memory\n");
+		goto error;
+	}
+	send_blob(client, s.data, s.len);
+	free(s.data);
+
+	return;
+error:
+	free(s.data);
+	send_blob(client, NULL, 0);
+}
+
+static void free_firmware_image(struct firmware_image *image)
+{
+	if (image->mapped)
+		munmap(image->data, image->size);
+	else
+		free(image->data);
+	memset(image, 0, sizeof(*image));
+}
+
+/* Get the FLASHFW image from a passed file descriptor. */
+static uint32_t map_flashfw_image(int fd, uint32_t image_size,
+				  struct firmware_image *image)
+{
+	struct stat st;
+	char *data;
+	size_t done;
+	ssize_t nr;
+	int seals;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+	    !image_size || (uint64_t)st.st_size < image_size)
+		return ERR_PAYLOAD;
+
+	seals = fcntl(fd, F_GET_SEALS);
+	if (seals >= 0 &&
+	    (seals & (F_SEAL_WRITE | F_SEAL_SHRINK)) == (F_SEAL_WRITE | F_SEAL_SHRINK)) {
+		/* The client cannot modify it anymore. */
+		data = mmap(NULL, image_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			image->data = data;
+			image->size = image_size;
+			image->mapped = 1;
+			return ERR_NONE;
+		}
+	}
+
+	/* Copy it, so it cannot change while it is flashed. */
+	data = malloc(image_size);
+	if (!data)
+		return ERR_NOMEM;
+	for (done = 0; done < image_size; done += nr) {
+		nr = pread(fd, data + done, image_size - done, done);
+		if (nr < 0 && errno == EINTR) {
+			nr = 0;
+			continue;
+		}
+		if (nr <= 0) {
+			free(data);
+			return ERR_PAYLOAD;
+		}
+	}
+	image->data = data;
+	image->size = image_size;
+	image->mapped = 0;
+
+	return ERR_NONE;
+}
+
+/* Receive the FLASHFW payload.
+ * Returns an error code. On success, the caller frees the image. */
+static uint32_t recv_flashfw_image(struct client *client, const struct command *cmd,
+				   unsigned int len, struct firmware_image *image)
+{
+	struct bulk_recv *bulk;
+	uint32_t image_size, errorcode;
+
+	memset(image, 0, sizeof(*image));
+	if (len < CMD_SIZE(flashfw))
+		return ERR_CMDSIZE;
+	image_size = be32_to_cpu(cmd->flashfw.imagesize);
+	if (image_size > MAX_FIRMWARE_SIZE)
+		return ERR_CMDSIZE;
+
+	if (be32_to_cpu(cmd->flashfw.flags) & FLASHFW_FLG_FD) {
+		if (client->passed_fd < 0)
+			return ERR_PAYLOAD;
+		errorcode = map_flashfw_image(client->passed_fd, image_size, image);
+		close(client->passed_fd);
+		client->passed_fd = -1;
+		return errorcode;
+	}
+
+	if (!image_size)
+		return ERR_NONE;
+	/* The payload was received by the main loop before the command
+	 * was dispatched. Only an allocation failure leaves it missing. */
+	bulk = client->bulk;
+	if (!bulk)
+		return ERR_NOMEM;
+	image->data = bulk->data;
+	image->size = bulk->size;
+	bulk->data = NULL;
+
+	return ERR_NONE;
+}
+
+static uint64_t monotonic_usec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+/* Pass a reply of a worker to the main thread. */
+static void post_reply(struct client *client, struct reply *r, size_t size)
+{
+	struct posted_reply *p;
+	char c = 0;
+
+	p = malloc(offsetof(struct posted_reply, r) + size);
+	if (!p) {
+		logerr("Out of memory\n");
+		return;
+	}
+	p->next = NULL;
+	p->client = client;
+	p->size = size;
+	memcpy(&p->r, r, size);
+
+	pthread_mutex_lock(&done_lock);
+	*posted_replies_tail = p;
+	posted_replies_tail = &p->next;
+	pthread_mutex_unlock(&done_lock);
+	if (write(done_pipe[1], &c, 1) < 0)
+		logerr("Failed to signal a posted reply: %s\n", strerror(errno));
+}
+
+struct flash_progress {
+	/* The client the command handler replies to. */
+	struct client *client;
+	/* The client that sent the command. */
+	struct client *origin;
+	bool enabled;
+	uint64_t start_usec;
+	uint64_t last_usec;
+};
+
+static void flash_progress_handler(struct razer_mouse *mouse,
+				   size_t done, size_t total, void *priv)
+{
+	struct flash_progress *fp = priv;
+	struct reply r;
+	uint64_t now, elapsed;
+
+	if (!fp->enabled)
+		return;
+	now = monotonic_usec();
+	if (done < total && fp->last_usec &&
+	    now - fp->last_usec < FLASH_PROGRESS_INTERVAL_MSEC * 1000)
+		return;
+	fp->last_usec = now;
+	elapsed = now - fp->start_usec;
+
+	r.hdr.id = REPLY_ID_FLASHPROGRESS;
+	r.flash_progress.done = cpu_to_be32(done);
+	r.flash_progress.total = cpu_to_be32(total);
+	r.flash_progress.elapsed_msec = cpu_to_be32(elapsed / 1000);
+	r.flash_progress.bytes_per_sec = cpu_to_be32(elapsed ?
+		(uint64_t)done * 1000000 / elapsed : 0);
+	/* Replies are collected until the command completes.
+	 * Progress must reach the client while it runs, so it is
+	 * not a reply. Framed clients get it with reqid 0. */
+	if (fp->client->worker)
+		post_reply(fp->origin, &r, REPLY_SIZE(flash_progress));
+	else
+		send_message(fp->origin, &r, REPLY_SIZE(flash_progress));
+}
+
+/* Flash a received firmware image and free it.
+ * origin is the client that sent the command. */
+static void flash_firmware_image(struct client *client, struct client *origin,
+				 const struct command *cmd,
+				 struct firmware_image *image)
+{
+	struct razer_mouse *mouse;
+	struct flash_progress fp;
+	uint32_t errorcode = ERR_NONE;
+	uint64_t elapsed;
+	int err;
+
+	mouse = find_mouse(client, cmd->idstr);
+	if (!mouse) {
+		errorcode = ERR_NOMOUSE;
+		goto error;
+	}
+	if (!mouse->flash_firmware) {
+		errorcode = ERR_NOTSUPP;
+		goto error;
+	}
+	err = mouse->claim(mouse);
+	if (err) {
+		errorcode = ERR_CLAIM;
+		goto error;
+	}
+
+	memset(&fp, 0, sizeof(fp));
+	fp.client = client;
+	fp.origin = origin;
+	fp.enabled = !!(be32_to_cpu(cmd->flashfw.flags) & FLASHFW_FLG_PROGRESS);
+	fp.start_usec = monotonic_usec();
+	err = razer_mouse_flash_firmware(mouse, image->data, image->size,
+					 flash_progress_handler, &fp);
+	mouse->release(mouse);
+	if (err) {
+		errorcode = ERR_FAIL;
+		goto error;
+	}
+	elapsed = monotonic_usec() - fp.start_usec;
+	loginfo("Flashed %u bytes to %s in %u msec\n",
+		(unsigned int)image->size, mouse->idstr,
+		(unsigned int)(elapsed / 1000));
+
+error:
+	send_u32(client, errorcode);
+	free_firmware_image(image);
+}
+
+static void command_flashfw(struct client *client, const struct command *cmd, unsigned int len)
+{
+	struct firmware_image image;
+	uint32_t errorcode;
+
+	errorcode = recv_flashfw_image(client, cmd, len, &image);
+	if (errorcode) {
+		send_u32(client, errorcode);
+		return;
+	}
+	flash_firmware_image(client, client, cmd, &image);
+}
+
+static void command_claim(struct client *client, const struct command *cmd, unsigned int len)
+{
+	struct razer_mouse *mouse;
+	uint32_t errorcode = ERR_NONE;
+	int err;
+
+	if (len < CMD_SIZE(claim)) {
+		errorcode = ERR_CMDSIZE;
+		goto error;
 	}
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse) {
 		errorcode = ERR_NOMOUSE;
 		goto error;
@@ -1862,7 +3503,7 @@ static void command_release(struct client *client, const struct command *cmd, un
 		errorcode = ERR_CMDSIZE;
 		goto error;
 	}
-	mouse = find_mouse(cmd->idstr);
+	mouse = find_mouse(client, cmd->idstr);
 	if (!mouse) {
 		errorcode = ERR_NOMOUSE;
 		goto error;
@@ -1958,6 +3599,24 @@ static void handle_received_command(struct client *client, const char *_cmd, uns
 	case COMMAND_ID_SETPROFNAME:
 		command_setprofname(client, cmd, len);
 		break;
+	case COMMAND_ID_ENABLEFRAMING:
+		send_u32(client, ERR_NONE);
+		break;
+	case COMMAND_ID_GETSNAPSHOT:
+		command_getsnapshot(client, cmd, len);
+		break;
+	case COMMAND_ID_SUBSCRIBE:
+		command_subscribe(client, cmd, len);
+		break;
+	case COMMAND_ID_GETSERIAL:
+		command_getserial(client, cmd, len);
+		break;
+	case COMMAND_ID_BATCH:
+		command_batch(client, cmd, len);
+		break;
+	case COMMAND_ID_GETPACING:
+		command_getpacing(client, cmd, len);
+		break;
 	default:
 		/* Unknown command. */
 		break;
@@ -1987,81 +3646,1247 @@ static void handle_received_privileged_command(struct client *client,
 	}
 }
 
-static void check_client_connections(void)
+static struct mouse_worker * find_worker(struct razer_mouse *mouse)
 {
-	char command[COMMAND_MAX_SIZE + 1] = { 0, };
-	int nr;
-	struct client *client, *next;
+	struct mouse_worker *worker;
 
-	for (client = clients; client; ) {
-		next = client->next;
-		nr = recv(client->fd, command, COMMAND_MAX_SIZE, 0);
-		if (nr < 0)
-			goto next_client;
-		if (nr == 0) {
-			disconnect_client(&clients, client);
-			goto next_client;
+	for (worker = workers; worker; worker = worker->next) {
+		if (worker->mouse == mouse)
+			return worker;
+	}
+
+	return NULL;
+}
+
+/* Find the worker of the mouse a command is addressed to. */
+static struct mouse_worker * find_command_worker(struct client *client,
+						 const struct command *cmd,
+						 unsigned int len)
+{
+	struct razer_mouse *mouse;
+
+	if (len < offsetof(struct command, idstr) + sizeof(cmd->idstr))
+		return NULL;
+	mouse = find_mouse(client, cmd->idstr);
+	if (!mouse)
+		return NULL;
+
+	return find_worker(mouse);
+}
+
+static void broadcast_notification(uint32_t mask, struct reply *r, size_t size)
+{
+	struct client *client;
+
+	for (client = clients; client; client = client->next) {
+		if (client->notify_mask & mask)
+			send_message(client, r, size);
+	}
+}
+
+/* Broadcast the notifications caused by a command. */
+static void broadcast_queued_notifications(struct client *client)
+{
+	struct notification *n;
+
+	while ((n = client->notifications)) {
+		client->notifications = n->next;
+		broadcast_notification(n->mask, &n->r, n->size);
+		free(n);
+	}
+}
+
+/* Stop collecting replies and send the collected ones. */
+static void send_collected_replies(struct client *client, uint32_t reqid)
+{
+	client->collect_replies = 0;
+	send_command_replies(client, reqid, client->replybuf, client->replybuf_len);
+	client->replybuf_len = 0;
+	broadcast_queued_notifications(client);
+}
+
+/* Run a command handler and send its replies. */
+static void run_command(struct client *client, const char *cmd,
+			unsigned int len, bool privileged, uint32_t reqid)
+{
+	client->collect_replies = 1;
+	if (privileged)
+		handle_received_privileged_command(client, cmd, len);
+	else
+		handle_received_command(client, cmd, len);
+	send_collected_replies(client, reqid);
+}
+
+/* Rewrite the configuration of a mouse after a system resume. */
+static int resume_mouse(struct razer_mouse *mouse)
+{
+	uint64_t start;
+	int err;
+
+	start = monotonic_usec();
+	err = razer_mouse_reconfig(mouse);
+	if (err) {
+		logerr("Failed to resume %s (%d)\n", mouse->idstr, err);
+	} else {
+		loginfo("Resumed %s in %u ms\n", mouse->idstr,
+			(unsigned int)((monotonic_usec() - start) / 1000));
+	}
+	statetable_update_mouse(mouse);
+
+	return err;
+}
+
+/* Queue notifications for the published settings that changed
+ * between the snapshots old and new of a mouse. */
+static void notify_state_changes(struct client *client, struct razer_mouse *mouse,
+				 const struct statetable_mouse *old,
+				 const struct statetable_mouse *new)
+{
+	struct razer_mouse_profile *profile = NULL;
+	const struct statetable_led *led, *old_led;
+	uint32_t profile_id = new->active_profile;
+	uint32_t i, j;
+
+	if (mouse->get_active_profile)
+		profile = mouse->get_active_profile(mouse);
+	if (new->active_profile != old->active_profile &&
+	    new->active_profile != PROFILE_INVALID)
+		notify_activeprof(client, mouse, new->active_profile);
+	if (new->frequency != old->frequency) {
+		notify_freq(client, mouse,
+			    profile && profile->get_freq ? profile_id : PROFILE_INVALID,
+			    new->frequency);
+	}
+	if (new->dpimapping_id != old->dpimapping_id &&
+	    new->dpimapping_id != 0xFFFFFFFF)
+		notify_dpimapping(client, mouse, profile_id, 0xFFFFFFFF,
+				  new->dpimapping_id);
+
+	/* statetable_fill_mouse() prefers the global LEDs. */
+	if (mouse->global_get_leds)
+		profile_id = PROFILE_INVALID;
+	for (i = 0; i < new->nr_leds; i++) {
+		led = &new->leds[i];
+		old_led = NULL;
+		for (j = 0; j < old->nr_leds; j++) {
+			if (strncmp(old->leds[j].name, led->name,
+				    sizeof(led->name)) == 0) {
+				old_led = &old->leds[j];
+				break;
+			}
 		}
-		handle_received_command(client, command, nr);
-  next_client:
-		client = next;
+		if (old_led && old_led->state == led->state &&
+		    old_led->mode == led->mode && old_led->color == led->color)
+			continue;
+		notify_led_state(client, mouse, profile_id, led->name,
+				 led->state, led->mode, led->color);
 	}
 }
 
-static void check_privileged_connections(void)
+/* Apply a reloaded config file to a mouse.
+ * The caller holds the device lock of the mouse. */
+static void reload_mouse(struct client *client, struct razer_mouse *mouse)
 {
-	char command[COMMAND_MAX_SIZE + 1] = { 0, };
-	int nr;
-	struct client *client, *next;
+	struct statetable_mouse old, new;
+	int err;
 
-	for (client = privileged_clients; client; ) {
-		next = client->next;
-		nr = recv(client->fd, command, COMMAND_MAX_SIZE, 0);
-		if (nr < 0)
-			goto next_client;
-		if (nr == 0) {
-			disconnect_client(&privileged_clients, client);
-			goto next_client;
+	/* Don't reconfigure a removed mouse. */
+	if (client->worker && worker_stopping(client->worker))
+		return;
+	statetable_fill_mouse(&old, mouse);
+	err = razer_mouse_reload_config(mouse);
+	if (err) {
+		logerr("Failed to apply the reloaded config to %s (%d)\n",
+		       mouse->idstr, err);
+	}
+	/* The notifications also republish the mouse state. */
+	statetable_fill_mouse(&new, mouse);
+	notify_state_changes(client, mouse, &old, &new);
+}
+
+/* Commit a mouse whose claim lease expired.
+ * The caller holds the device lock of the mouse. */
+static void expire_claim_lease(struct client *client, struct razer_mouse *mouse)
+{
+	int err;
+
+	/* The lease of a removed mouse is dropped when it is freed. */
+	if (client->worker && worker_stopping(client->worker))
+		return;
+	err = razer_mouse_expire_claim_lease(mouse);
+	if (!err)
+		return;
+	/* The command that changed the settings already succeeded. */
+	logerr("Deferred commit of mouse %s failed (%d)\n",
+	       mouse->idstr, err);
+	notify_commiterr(client, mouse);
+}
+
+/* Rewrite the configuration of a mouse for a RECONFIGMICE command.
+ * The caller holds the device lock of the mouse. */
+static void reconfig_mouse(struct mouse_worker *worker, struct razer_mouse *mouse)
+{
+	int err;
+
+	/* Don't reconfigure a removed mouse. */
+	if (worker && worker_stopping(worker))
+		return;
+	err = razer_mouse_reconfig(mouse);
+	if (err)
+		logerr("Failed to reconfigure %s (%d)\n", mouse->idstr, err);
+	statetable_update_mouse(mouse);
+}
+
+static void resume_done(int err)
+{
+	if (!nr_resuming)
+		return;
+	if (err)
+		nr_resume_failed++;
+	if (--nr_resuming)
+		return;
+	loginfo("Resume completed in %u ms (%u failed)\n",
+		(unsigned int)((monotonic_usec() - resume_start_usec) / 1000),
+		nr_resume_failed);
+	nr_resume_failed = 0;
+}
+
+static void run_work(struct work *work)
+{
+	const struct command *cmd = (const struct command *)work->cmd;
+
+	if (work->resume)
+		work->resume_err = resume_mouse(work->proxy.worker->mouse);
+	else if (work->reload)
+		reload_mouse(&work->proxy, work->proxy.worker->mouse);
+	else if (work->lease)
+		expire_claim_lease(&work->proxy, work->proxy.worker->mouse);
+	else if (work->reconfig)
+		reconfig_mouse(work->proxy.worker, work->proxy.worker->mouse);
+	else if (work->image.data)
+		flash_firmware_image(&work->proxy, work->client, cmd,
+				     &work->image);
+	else if (work->privileged)
+		handle_received_privileged_command(&work->proxy, work->cmd, work->len);
+	else
+		handle_received_command(&work->proxy, work->cmd, work->len);
+}
+
+static void * worker_thread(void *_worker)
+{
+	struct mouse_worker *worker = _worker;
+	struct work *work;
+	sigset_t sigset;
+	bool detached;
+	char c = 0;
+
+	/* Resume requests are handled by the main thread. */
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+	while (1) {
+		pthread_mutex_lock(&worker->queue_lock);
+		while (!worker->queue && !worker->stop)
+			pthread_cond_wait(&worker->queue_cond, &worker->queue_lock);
+		work = worker->queue;
+		if (work)
+			worker->queue = work->next;
+		detached = worker->detached;
+		pthread_mutex_unlock(&worker->queue_lock);
+		if (!work)
+			break; /* Stopped and idle. */
+
+		/* Commands queued before the stop still complete.
+		 * They reply with an error, as find_mouse() fails. */
+		pthread_mutex_lock(&worker->device_lock);
+		run_work(work);
+		pthread_mutex_unlock(&worker->device_lock);
+
+		pthread_mutex_lock(&done_lock);
+		work->next = done_list;
+		done_list = work;
+		pthread_mutex_unlock(&done_lock);
+		if (write(done_pipe[1], &c, 1) < 0)
+			logerr("Failed to signal work completion: %s\n",
+			       strerror(errno));
+	}
+
+	if (detached) {
+		pthread_mutex_lock(&done_lock);
+		worker->next = exited_workers;
+		exited_workers = worker;
+		pthread_mutex_unlock(&done_lock);
+		if (write(done_pipe[1], &c, 1) < 0)
+			logerr("Failed to signal worker exit: %s\n",
+			       strerror(errno));
+	}
+
+	return NULL;
+}
+
+static void enqueue_work(struct mouse_worker *worker, struct work *work)
+{
+	struct work *i;
+
+	pthread_mutex_lock(&worker->queue_lock);
+	if (!worker->queue) {
+		worker->queue = work;
+	} else {
+		for (i = worker->queue; i->next; i = i->next)
+			;
+		i->next = work;
+	}
+	pthread_cond_signal(&worker->queue_cond);
+	pthread_mutex_unlock(&worker->queue_lock);
+}
+
+static void queue_work(struct mouse_worker *worker, struct client *client,
+		       const char *cmd, unsigned int len, bool privileged,
+		       uint32_t reqid, struct firmware_image *image)
+{
+	struct work *work;
+
+	work = malloc(sizeof(*work));
+	if (!work) {
+		/* Run it here instead. */
+		pthread_mutex_lock(&worker->device_lock);
+		if (image) {
+			client->collect_replies = 1;
+			flash_firmware_image(client, client,
+					     (const struct command *)cmd,
+					     image);
+			send_collected_replies(client, reqid);
+		} else {
+			run_command(client, cmd, len, privileged, reqid);
 		}
-		handle_received_privileged_command(client, command, nr);
-  next_client:
-		client = next;
+		pthread_mutex_unlock(&worker->device_lock);
+		return;
 	}
+	memset(work, 0, sizeof(*work));
+	work->client = client;
+	work->proxy.fd = -1;
+	work->proxy.passed_fd = -1;
+	work->proxy.worker = worker;
+	work->proxy.collect_replies = 1;
+	work->privileged = privileged;
+	work->reqid = reqid;
+	memcpy(work->cmd, cmd, len);
+	work->len = len;
+	if (image)
+		work->image = *image;
+
+	client->nr_pending++;
+
+	enqueue_work(worker, work);
 }
 
-static void broadcast_notification(unsigned int notifyId, size_t size)
+/* Allocate work without a client for the worker of a mouse.
+ * Returns NULL, if the work must run in the caller instead. */
+static struct work * new_mouse_work(struct mouse_worker *worker)
 {
-	struct reply r;
+	struct work *work;
+
+	if (!worker)
+		return NULL;
+	work = malloc(sizeof(*work));
+	if (!work)
+		return NULL;
+	memset(work, 0, sizeof(*work));
+	work->proxy.fd = -1;
+	work->proxy.passed_fd = -1;
+	work->proxy.worker = worker;
+
+	return work;
+}
+
+/* Replay the configuration of all mice after a system resume.
+ * Each mouse resumes on its own worker, so the mice resume in parallel
+ * and a failing mouse does not hold up the others. */
+static void resume_mice(void)
+{
+	struct razer_mouse *mouse, *next;
+	struct mouse_worker *worker;
+	struct work *work;
+
+	loginfo("Resuming mice\n");
+	if (!nr_resuming)
+		resume_start_usec = monotonic_usec();
+	razer_for_each_mouse(mouse, next, mice) {
+		nr_resuming++;
+		worker = find_worker(mouse);
+		work = new_mouse_work(worker);
+		if (!work) {
+			/* Resume it here instead. */
+			if (worker)
+				pthread_mutex_lock(&worker->device_lock);
+			resume_done(resume_mouse(mouse));
+			if (worker)
+				pthread_mutex_unlock(&worker->device_lock);
+			continue;
+		}
+		work->resume = 1;
+		enqueue_work(worker, work);
+	}
+}
+
+/* Apply the reloaded config file to a mouse on its worker. */
+static void queue_reload(struct razer_mouse *mouse)
+{
+	struct mouse_worker *worker;
+	struct client proxy;
+	struct work *work;
+
+	worker = find_worker(mouse);
+	work = new_mouse_work(worker);
+	if (!work) {
+		/* Reload it here instead. */
+		memset(&proxy, 0, sizeof(proxy));
+		proxy.fd = -1;
+		proxy.passed_fd = -1;
+		if (worker)
+			pthread_mutex_lock(&worker->device_lock);
+		reload_mouse(&proxy, mouse);
+		if (worker)
+			pthread_mutex_unlock(&worker->device_lock);
+		broadcast_queued_notifications(&proxy);
+		return;
+	}
+	work->reload = 1;
+	enqueue_work(worker, work);
+}
+
+/* The claim lease handler. Commit the mouse on its worker,
+ * so that the main loop does not wait for the device. */
+static void queue_lease_expiry(struct razer_mouse *mouse)
+{
+	struct mouse_worker *worker;
+	struct client proxy;
+	struct work *work;
+
+	worker = find_worker(mouse);
+	work = new_mouse_work(worker);
+	if (!work) {
+		/* Commit it here instead. */
+		memset(&proxy, 0, sizeof(proxy));
+		proxy.fd = -1;
+		proxy.passed_fd = -1;
+		if (worker)
+			pthread_mutex_lock(&worker->device_lock);
+		expire_claim_lease(&proxy, mouse);
+		if (worker)
+			pthread_mutex_unlock(&worker->device_lock);
+		broadcast_queued_notifications(&proxy);
+		return;
+	}
+	work->lease = 1;
+	enqueue_work(worker, work);
+}
+
+static void process_client_input(struct client *client);
+
+static void lock_all_workers(void)
+{
+	struct mouse_worker *worker;
+
+	for (worker = workers; worker; worker = worker->next)
+		pthread_mutex_lock(&worker->device_lock);
+}
+
+static void unlock_all_workers(void)
+{
+	struct mouse_worker *worker;
+
+	for (worker = workers; worker; worker = worker->next)
+		pthread_mutex_unlock(&worker->device_lock);
+}
+
+/* Account the completion of a command of a client. */
+static void client_command_done(struct client *client)
+{
+	client->nr_pending--;
+	if (client->disconnected && !client->nr_pending) {
+		free_client(client);
+	} else if (!client->nr_pending) {
+		/* Pipelined frames may already be buffered. */
+		process_client_input(client);
+	}
+}
+
+/* Account the completion of a reconfig work.
+ * The command is replied to, once the last one completed. */
+static void reconfig_done(struct reconfig *reconfig)
+{
+	struct client *client = reconfig->client;
+
+	if (--reconfig->nr_pending)
+		return;
+	if (!client->disconnected)
+		send_command_replies(client, reconfig->reqid, NULL, 0);
+	free(reconfig);
+	client_command_done(client);
+}
+
+/* Reconfigure all mice for a RECONFIGMICE command.
+ * Like resume_mice(), each mouse is reconfigured on its own worker. */
+static void reconfig_mice(struct client *client, const char *cmd,
+			  unsigned int len, uint32_t reqid)
+{
+	struct razer_mouse *mouse, *next;
+	struct mouse_worker *worker;
+	struct reconfig *reconfig;
+	struct work *work;
+
+	reconfig = malloc(sizeof(*reconfig));
+	if (!reconfig) {
+		/* Reconfigure them all here instead. */
+		lock_all_workers();
+		run_command(client, cmd, len, 0, reqid);
+		unlock_all_workers();
+		return;
+	}
+	reconfig->client = client;
+	reconfig->reqid = reqid;
+	reconfig->nr_pending = 0;
+
+	razer_for_each_mouse(mouse, next, mice) {
+		worker = find_worker(mouse);
+		work = new_mouse_work(worker);
+		if (!work) {
+			/* Reconfigure it here instead. */
+			if (worker)
+				pthread_mutex_lock(&worker->device_lock);
+			reconfig_mouse(worker, mouse);
+			if (worker)
+				pthread_mutex_unlock(&worker->device_lock);
+			continue;
+		}
+		work->reconfig = reconfig;
+		reconfig->nr_pending++;
+		enqueue_work(worker, work);
+	}
+
+	if (!reconfig->nr_pending) {
+		/* All mice were reconfigured here. */
+		free(reconfig);
+		send_command_replies(client, reqid, NULL, 0);
+		return;
+	}
+	/* Completed work is only handled by the main loop. */
+	client->nr_pending++;
+}
+
+/* Free a worker whose thread was joined. */
+static void free_worker(struct mouse_worker *worker)
+{
+	pthread_cond_destroy(&worker->queue_cond);
+	pthread_mutex_destroy(&worker->queue_lock);
+	pthread_mutex_destroy(&worker->device_lock);
+	/* Work that ran after the removal may have republished it. */
+	statetable_remove_mouse(worker->mouse);
+	razer_mouse_put(worker->mouse);
+	free(worker);
+}
+
+/* Join the detached workers that exited. */
+static void reap_exited_workers(struct mouse_worker *list)
+{
+	struct mouse_worker *worker;
+
+	while ((worker = list)) {
+		list = worker->next;
+		pthread_join(worker->thread, NULL);
+		free_worker(worker);
+	}
+}
+
+/* Send the replies of completed work to the clients. */
+static void handle_completed_work(void)
+{
+	struct work *work, *list, *prev = NULL;
+	struct posted_reply *posted, *p;
+	struct mouse_worker *exited;
 	struct client *client;
+	char buf[64];
 
-	for (client = clients; client; client = client->next) {
-		r.hdr.id = notifyId;
-		send_reply(client, &r, size);
+	while (read(done_pipe[0], buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&done_lock);
+	list = done_list;
+	done_list = NULL;
+	posted = posted_replies;
+	posted_replies = NULL;
+	posted_replies_tail = &posted_replies;
+	exited = exited_workers;
+	exited_workers = NULL;
+	pthread_mutex_unlock(&done_lock);
+
+	/* Posted replies precede the completion of their work. */
+	while ((p = posted)) {
+		posted = p->next;
+		if (!p->client->disconnected)
+			send_message(p->client, &p->r, p->size);
+		free(p);
+	}
+
+	/* The list is in reverse completion order. */
+	while (list) {
+		work = list;
+		list = work->next;
+		work->next = prev;
+		prev = work;
+	}
+
+	while ((work = prev)) {
+		prev = work->next;
+		if (work->resume) {
+			resume_done(work->resume_err);
+			free(work);
+			continue;
+		}
+		if (work->reload || work->lease) {
+			broadcast_queued_notifications(&work->proxy);
+			free(work);
+			continue;
+		}
+		if (work->reconfig) {
+			reconfig_done(work->reconfig);
+			free(work);
+			continue;
+		}
+		client = work->client;
+		if (!client->disconnected) {
+			send_command_replies(client, work->reqid,
+					     work->proxy.replybuf,
+					     work->proxy.replybuf_len);
+		}
+		broadcast_queued_notifications(&work->proxy);
+		client_command_done(client);
+		free(work->proxy.replybuf);
+		free(work);
+	}
+
+	/* A worker exits after completing its last work. */
+	reap_exited_workers(exited);
+}
+
+static int mouse_trylock(struct razer_mouse *mouse)
+{
+	struct mouse_worker *worker = find_worker(mouse);
+
+	if (!worker)
+		return 0;
+	return pthread_mutex_trylock(&worker->device_lock);
+}
+
+static void mouse_unlock(struct razer_mouse *mouse)
+{
+	struct mouse_worker *worker = find_worker(mouse);
+
+	if (worker)
+		pthread_mutex_unlock(&worker->device_lock);
+}
+
+static void start_worker(struct razer_mouse *mouse)
+{
+	struct mouse_worker *worker;
+	int err;
+
+	worker = malloc(sizeof(*worker));
+	if (!worker) {
+		logerr("Out of memory\n");
+		return;
+	}
+	memset(worker, 0, sizeof(*worker));
+	worker->mouse = mouse;
+	pthread_mutex_init(&worker->device_lock, NULL);
+	pthread_mutex_init(&worker->queue_lock, NULL);
+	pthread_cond_init(&worker->queue_cond, NULL);
+
+	err = pthread_create(&worker->thread, NULL, worker_thread, worker);
+	if (err) {
+		/* Commands to this mouse run in the main thread. */
+		logerr("Failed to create the worker thread of %s (%d)\n",
+		       mouse->idstr, err);
+		pthread_cond_destroy(&worker->queue_cond);
+		pthread_mutex_destroy(&worker->queue_lock);
+		pthread_mutex_destroy(&worker->device_lock);
+		free(worker);
+		return;
+	}
+	/* The worker may outlive the removal of the mouse. */
+	razer_mouse_get(mouse);
+	worker->next = workers;
+	workers = worker;
+}
+
+/* Stop the worker of a mouse. If wait is false, the thread is
+ * joined from handle_completed_work(), once its running work
+ * completed. This keeps a slow device operation, like a reconnect,
+ * from stalling the main loop. */
+static void stop_worker(struct razer_mouse *mouse, bool wait)
+{
+	struct mouse_worker *worker, *i;
+
+	worker = find_worker(mouse);
+	if (!worker)
+		return;
+
+	if (worker == workers) {
+		workers = worker->next;
+	} else {
+		for (i = workers; i->next != worker; i = i->next)
+			;
+		i->next = worker->next;
+	}
+
+	pthread_mutex_lock(&worker->queue_lock);
+	worker->stop = 1;
+	worker->detached = !wait;
+	pthread_cond_signal(&worker->queue_cond);
+	pthread_mutex_unlock(&worker->queue_lock);
+	if (!wait)
+		return;
+	pthread_join(worker->thread, NULL);
+	free_worker(worker);
+}
+
+/* Stop all workers and wait for them. librazer frees the mice
+ * on razer_exit(), so this must be called before that. */
+static void stop_all_workers(void)
+{
+	struct mouse_worker *exited;
+
+	while (workers)
+		stop_worker(workers->mouse, 1);
+
+	pthread_mutex_lock(&done_lock);
+	exited = exited_workers;
+	exited_workers = NULL;
+	pthread_mutex_unlock(&done_lock);
+	reap_exited_workers(exited);
+}
+
+/* Run global commands in the main thread and hand device commands
+ * to the worker of the device. */
+/* Start receiving the bulk payload of a FLASHFW command.
+ * The payload is received by the main loop, one acked chunk at a time,
+ * so that a slow client does not block the daemon.
+ * Returns true, if the command is dispatched again once the payload
+ * is complete. */
+static bool start_bulk_recv(struct client *client, const char *_cmd,
+			    unsigned int len, uint32_t reqid)
+{
+	const struct command *cmd = (const struct command *)_cmd;
+	struct bulk_recv *bulk;
+	uint32_t image_size;
+
+	if (client->bulk)
+		return false; /* The payload is complete. */
+	if (len < CMD_SIZE(flashfw))
+		return false;
+	if (be32_to_cpu(cmd->flashfw.flags) & FLASHFW_FLG_FD)
+		return false;
+	image_size = be32_to_cpu(cmd->flashfw.imagesize);
+	if (!image_size || image_size > MAX_FIRMWARE_SIZE)
+		return false;
+
+	bulk = malloc(sizeof(*bulk));
+	if (!bulk)
+		return false;
+	memset(bulk, 0, sizeof(*bulk));
+	bulk->data = malloc(image_size);
+	if (!bulk->data) {
+		free(bulk);
+		return false;
+	}
+	memcpy(bulk->cmd, _cmd, len);
+	bulk->len = len;
+	bulk->reqid = reqid;
+	bulk->size = image_size;
+	client->bulk = bulk;
+
+	return true;
+}
+
+static void dispatch_command(struct client *client, const char *_cmd,
+			     unsigned int len, bool privileged, uint32_t reqid)
+{
+	const struct command *cmd = (const struct command *)_cmd;
+	struct mouse_worker *worker;
+	struct firmware_image image;
+	uint32_t errorcode;
+
+	if (len < COMMAND_HDR_SIZE)
+		return;
+	if (!privileged) {
+		switch (cmd->hdr.id) {
+		case COMMAND_ID_GETREV:
+		case COMMAND_ID_RESCANMICE:
+		case COMMAND_ID_GETMICE:
+		case COMMAND_ID_SUBSCRIBE:
+		/* Metadata queries never access the device. */
+		case COMMAND_ID_GETFWVER:
+		case COMMAND_ID_GETSERIAL:
+		case COMMAND_ID_SUPPFREQS:
+		case COMMAND_ID_SUPPRESOL:
+		case COMMAND_ID_SUPPAXES:
+		case COMMAND_ID_SUPPBUTTONS:
+		case COMMAND_ID_SUPPBUTFUNCS:
+			run_command(client, _cmd, len, 0, reqid);
+			return;
+		case COMMAND_ID_RECONFIGMICE:
+			reconfig_mice(client, _cmd, len, reqid);
+			return;
+		case COMMAND_ID_ENABLEFRAMING:
+			/* The reply is still in the old format. */
+			run_command(client, _cmd, len, 0, reqid);
+			client->framed = 1;
+			return;
+		}
+	}
+
+	if (privileged && cmd->hdr.id == COMMAND_PRIV_FLASHFW &&
+	    start_bulk_recv(client, _cmd, len, reqid))
+		return;
+
+	worker = find_command_worker(client, cmd, len);
+	if (!worker) {
+		/* Let the handler reply with the error. */
+		run_command(client, _cmd, len, privileged, reqid);
+		return;
+	}
+
+	if (privileged && cmd->hdr.id == COMMAND_PRIV_FLASHFW) {
+		/* Take the image from the client. */
+		errorcode = recv_flashfw_image(client, cmd, len, &image);
+		if (errorcode) {
+			client->collect_replies = 1;
+			send_u32(client, errorcode);
+			send_collected_replies(client, reqid);
+			return;
+		}
+		queue_work(worker, client, _cmd, len, 1, reqid, &image);
+		return;
+	}
+
+	queue_work(worker, client, _cmd, len, privileged, reqid, NULL);
+}
+
+/* Number of payload bytes up to the end of the current chunk. */
+static unsigned int bulk_chunk_left(const struct bulk_recv *bulk)
+{
+	unsigned int left;
+
+	left = BULK_CHUNK_SIZE - bulk->pos % BULK_CHUNK_SIZE;
+	if (left > bulk->size - bulk->pos)
+		left = bulk->size - bulk->pos;
+
+	return left;
+}
+
+/* Account nr received payload bytes. Every complete chunk is acked.
+ * The FLASHFW command is dispatched again, once the payload is complete. */
+static void bulk_received(struct client *client, unsigned int nr)
+{
+	struct bulk_recv *bulk = client->bulk;
+
+	bulk->pos += nr;
+	if (bulk->pos % BULK_CHUNK_SIZE && bulk->pos < bulk->size)
+		return;
+	send_bulk_ack(client, ERR_NONE);
+	if (bulk->pos < bulk->size)
+		return;
+
+	dispatch_command(client, bulk->cmd, bulk->len,
+			 client->privileged, bulk->reqid);
+	client->bulk = NULL;
+	free_bulk_recv(bulk);
+}
+
+/* Move payload bytes from the frame receive buffer to the bulk buffer.
+ * Returns false, if more bytes have to be received. */
+static bool process_bulk_inbuf(struct client *client)
+{
+	struct bulk_recv *bulk = client->bulk;
+	unsigned int nr;
+
+	nr = bulk_chunk_left(bulk);
+	if (nr > client->inbuf_len)
+		nr = client->inbuf_len;
+	if (!nr)
+		return false;
+	memcpy(bulk->data + bulk->pos, client->inbuf, nr);
+	client->inbuf_len -= nr;
+	memmove(client->inbuf, client->inbuf + nr, client->inbuf_len);
+	bulk_received(client, nr);
+
+	return true;
+}
+
+/* Dispatch the complete frames in the receive buffer.
+ * Stops at a command that waits for a worker, to keep the replies
+ * in order. */
+static void process_client_input(struct client *client)
+{
+	char command[COMMAND_MAX_SIZE + 1];
+	const struct frame_hdr *hdr;
+	unsigned int frame_len, cmd_len;
+	uint32_t reqid;
+
+	while (client->framed && !client->dead && !client->nr_pending) {
+		if (client->bulk) {
+			if (!process_bulk_inbuf(client))
+				break;
+			continue;
+		}
+		if (client->inbuf_len < FRAME_HDR_SIZE)
+			break;
+		hdr = (const struct frame_hdr *)client->inbuf;
+		frame_len = be16_to_cpu(hdr->len) + sizeof(hdr->len);
+		if (frame_len < FRAME_HDR_SIZE + COMMAND_HDR_SIZE ||
+		    frame_len > FRAME_MAX_SIZE) {
+			logerr("Client (fd=%d) sent an invalid frame size %u\n",
+			       client->fd, frame_len);
+			client->dead = 1;
+			break;
+		}
+		if (client->inbuf_len < frame_len)
+			break;
+		reqid = be32_to_cpu(hdr->reqid);
+		cmd_len = frame_len - FRAME_HDR_SIZE;
+
+		/* Handlers expect commands padded to the maximum size. */
+		memset(command, 0, sizeof(command));
+		memcpy(command, client->inbuf + FRAME_HDR_SIZE, cmd_len);
+		client->inbuf_len -= frame_len;
+		memmove(client->inbuf, client->inbuf + frame_len, client->inbuf_len);
+
+		dispatch_command(client, command, COMMAND_MAX_SIZE,
+				 client->privileged, reqid);
+	}
+	update_client_events(client);
+}
+
+/* Receive one unframed command packet and the file descriptor
+ * passed with it, if any. */
+static int recv_command_packet(struct client *client, char *buf, size_t size)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = size, };
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int nr, fd;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	nr = recvmsg(client->fd, &msg, MSG_CMSG_CLOEXEC);
+	if (nr < 0)
+		return nr;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS ||
+		    cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+			continue;
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+		if (client->privileged && client->passed_fd < 0)
+			client->passed_fd = fd;
+		else
+			close(fd);
+	}
+
+	return nr;
+}
+
+static void handle_client_input(struct client *client)
+{
+	char command[COMMAND_MAX_SIZE + 1] = { 0, };
+	struct bulk_recv *bulk = NULL;
+	int nr;
+
+	if (client->dead || client->nr_pending)
+		return;
+	if (client->bulk && !client->framed) {
+		/* Receive at most one chunk, which is acked. */
+		bulk = client->bulk;
+		nr = recv(client->fd, bulk->data + bulk->pos,
+			  bulk_chunk_left(bulk), 0);
+	} else if (client->framed) {
+		nr = recv(client->fd, client->inbuf + client->inbuf_len,
+			  sizeof(client->inbuf) - client->inbuf_len, 0);
+	} else {
+		/* Unframed connections send one command per packet. */
+		nr = recv_command_packet(client, command, COMMAND_MAX_SIZE);
+	}
+	if (nr < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			client->dead = 1;
+		return;
+	}
+	if (nr == 0) {
+		client->dead = 1;
+		return;
+	}
+	if (client->framed) {
+		client->inbuf_len += nr;
+		process_client_input(client);
+		return;
+	}
+	if (bulk) {
+		bulk_received(client, nr);
+		update_client_events(client);
+		return;
+	}
+	dispatch_command(client, command, nr, client->privileged, 0);
+	/* The descriptor is only valid for the command it came with. */
+	if (client->passed_fd >= 0) {
+		close(client->passed_fd);
+		client->passed_fd = -1;
+	}
+	update_client_events(client);
+}
+
+static void handle_client_event(struct client *client, uint32_t events)
+{
+	if (events & EPOLLOUT)
+		flush_client_output(client);
+	if (client->nr_pending) {
+		/* Hangups are reported even without EPOLLIN. */
+		if (events & (EPOLLHUP | EPOLLERR))
+			client->dead = 1;
+		return;
+	}
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		handle_client_input(client);
+}
+
+static void reap_dead_clients(struct client **client_list)
+{
+	struct client *client, *next;
+
+	for (client = *client_list; client; client = next) {
+		next = client->next;
+		if (client->dead)
+			disconnect_client(client_list, client);
 	}
 }
 
 static void event_handler(enum razer_event event,
 			  const struct razer_event_data *data)
 {
+	struct reply r;
+
 	switch (event) {
 	case RAZER_EV_MOUSE_ADD:
+		start_worker(data->u.mouse);
+		statetable_update_mouse(data->u.mouse);
+		/* The config may have been reloaded while the mouse
+		 * was initialized. This is a no-op otherwise. */
+		queue_reload(data->u.mouse);
 		logdebug("Broadcasting mouse-add event\n");
-		broadcast_notification(NOTIFY_ID_NEWMOUSE,
+		r.hdr.id = NOTIFY_ID_NEWMOUSE;
+		broadcast_notification(NOTIFYMSK_NEWMOUSE, &r,
 				       REPLY_SIZE(notify_newmouse));
 		break;
 	case RAZER_EV_MOUSE_REMOVE:
+		/* The worker holds a reference to the mouse, so running
+		 * work may complete after this returns. */
+		stop_worker(data->u.mouse, 0);
+		statetable_remove_mouse(data->u.mouse);
 		logdebug("Broadcasting mouse-remove event\n");
-		broadcast_notification(NOTIFY_ID_DELMOUSE,
+		r.hdr.id = NOTIFY_ID_DELMOUSE;
+		broadcast_notification(NOTIFYMSK_DELMOUSE, &r,
 				       REPLY_SIZE(notify_delmouse));
 		break;
+	case RAZER_EV_MOUSE_COMMIT_FAILED:
+		/* A client's command already succeeded, but the deferred
+		 * commit of its changes did not reach the hardware.
+		 * Expired leases are committed by queue_lease_expiry(),
+		 * so this is a lease dropped by razer_set_claim_lease(). */
+		logerr("Deferred commit of mouse %s failed (%d)\n",
+		       data->u.mouse->idstr, data->error);
+		statetable_update_mouse(data->u.mouse);
+		r.hdr.id = NOTIFY_ID_COMMITERR;
+		notify_set_idstr(r.notify_commiterr.idstr, data->u.mouse);
+		r.notify_commiterr.errorcode = cpu_to_be32(ERR_FAIL);
+		broadcast_notification(NOTIFYMSK_COMMITERR, &r,
+				       REPLY_SIZE(notify_commiterr));
+		break;
 	}
 }
 
-static int mainloop(void)
+static uint32_t usb_pollfd_epoll_events(const struct razer_pollfd *pfd)
 {
-	struct client *client;
+	uint32_t events = 0;
+
+	if (pfd->events & POLLIN)
+		events |= EPOLLIN;
+	if (pfd->events & POLLOUT)
+		events |= EPOLLOUT;
+
+	return events;
+}
+
+static const struct razer_pollfd * find_pollfd(const struct razer_pollfd *fds,
+					       int count, int fd)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (fds[i].fd == fd)
+			return &fds[i];
+	}
+
+	return NULL;
+}
+
+/* Bring the librazer USB event file descriptors in epoll up to date. */
+static void sync_usb_pollfds(void)
+{
+	struct razer_pollfd fds[MAX_USB_POLLFDS];
+	const struct razer_pollfd *old;
+	int i, count;
+
+	count = razer_get_pollfds(fds, ARRAY_SIZE(fds));
+	if (count < 0) {
+		logerr("Failed to get USB event file descriptors (%d)\n", count);
+		return;
+	}
+	for (i = 0; i < nr_usb_pollfds; i++) {
+		if (!find_pollfd(fds, count, usb_pollfds[i].fd))
+			epoll_ctl(epollfd, EPOLL_CTL_DEL, usb_pollfds[i].fd, NULL);
+	}
+	for (i = 0; i < count; i++) {
+		old = find_pollfd(usb_pollfds, nr_usb_pollfds, fds[i].fd);
+		if (!old) {
+			epoll_add(fds[i].fd, usb_pollfd_epoll_events(&fds[i]),
+				  &usb_source);
+		} else if (old->events != fds[i].events) {
+			epoll_mod(fds[i].fd, usb_pollfd_epoll_events(&fds[i]),
+				  &usb_source);
+		}
+	}
+	memcpy(usb_pollfds, fds, count * sizeof(fds[0]));
+	nr_usb_pollfds = count;
+}
+
+/* Watch the config file for changes.
+ * The directory is watched, so that replacing the file by a rename
+ * is noticed, too. */
+static void setup_config_watch(void)
+{
+	char dir[PATH_MAX];
+	const char *path = cmdargs.configfile;
+	char *slash;
+	int wd;
+
+	if (!path)
+		path = RAZER_DEFAULT_CONFIG;
+	if (!strlen(path))
+		return;
+	if (strlen(path) >= sizeof(dir))
+		return;
+	strcpy(dir, path);
+	slash = strrchr(dir, '/');
+	if (!slash) {
+		config_watch_name = path;
+		strcpy(dir, ".");
+	} else {
+		config_watch_name = path + (slash - dir) + 1;
+		if (slash == dir)
+			slash++;
+		*slash = '\0';
+	}
+
+	config_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (config_watch_fd < 0)
+		goto error;
+	wd = inotify_add_watch(config_watch_fd, dir,
+			       IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (wd < 0 || epoll_add(config_watch_fd, EPOLLIN, &config_source))
+		goto error;
+
+	return;
+error:
+	loginfo("Not watching the config file %s for changes: %s\n",
+		path, strerror(errno));
+	if (config_watch_fd >= 0)
+		close(config_watch_fd);
+	config_watch_fd = -1;
+}
+
+/* Reload the config file and apply it to all mice.
+ * Each mouse is reconfigured on its own worker, like on a resume. */
+static void reload_config(void)
+{
+	struct razer_mouse *mouse, *next;
 	int err;
-	fd_set wait_fdset;
+
+	loginfo("Config file changed. Reloading.\n");
+	err = razer_reload_config(cmdargs.configfile);
+	if (err) {
+		logerr("Failed to reload the config file (%d). "
+		       "Keeping the old config.\n", err);
+		return;
+	}
+	razer_for_each_mouse(mouse, next, mice)
+		queue_reload(mouse);
+}
+
+static void handle_config_event(void)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	bool changed = 0;
+	ssize_t len;
+	char *p;
+
+	while ((len = read(config_watch_fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->len && strcmp(ev->name, config_watch_name) == 0)
+				changed = 1;
+		}
+	}
+	if (changed)
+		reload_config();
+}
+
+static int setup_epoll(void)
+{
+	int err;
+
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollfd < 0) {
+		logerr("Failed to create epoll instance: %s\n", strerror(errno));
+		return -1;
+	}
+	err = epoll_add(ctlsock, EPOLLIN, &ctlsock_source);
+	if (!err)
+		err = epoll_add(privsock, EPOLLIN, &privsock_source);
+	if (!err)
+		err = epoll_add(done_pipe[0], EPOLLIN, &done_source);
+	if (err) {
+		close(epollfd);
+		epollfd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mainloop(void)
+{
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	struct poll_source *source;
+	int err, i, count;
 
 	loginfo("Razer device service daemon\n");
 
@@ -2069,30 +4894,78 @@ static int mainloop(void)
 	err = setup_environment();
 	if (err)
 		return 1;
+	err = pipe(done_pipe);
+	if (err) {
+		logerr("Failed to create the worker pipe: %s\n", strerror(errno));
+		cleanup_environment();
+		return 1;
+	}
+	fcntl(done_pipe[0], F_SETFL, O_NONBLOCK);
+	err = setup_epoll();
+	if (err) {
+		cleanup_environment();
+		return 1;
+	}
 	err = razer_register_event_handler(event_handler);
 	if (err) {
 		logerr("Failed to register event handler\n");
 		cleanup_environment();
 		return 1;
 	}
+	razer_set_mouse_lock_handlers(mouse_trylock, mouse_unlock);
+	razer_set_claim_lease_handler(queue_lease_expiry);
+	setup_config_watch();
 
 	mice = razer_rescan_mice();
+	err = razer_enable_hotplug();
+	if (err) {
+		loginfo("USB hotplug not available (%d). "
+			"Devices will only be detected on rescan.\n", err);
+	}
 
 	while (1) {
-		FD_ZERO(&wait_fdset);
-		FD_SET(privsock, &wait_fdset);
-		FD_SET(ctlsock, &wait_fdset);
-		for (client = clients; client; client = client->next)
-			FD_SET(client->fd, &wait_fdset);
-		for (client = privileged_clients; client; client = client->next)
-			FD_SET(client->fd, &wait_fdset);
-		select(FD_SETSIZE, &wait_fdset, NULL, NULL, NULL);
+		sync_usb_pollfds();
+		count = epoll_wait(epollfd, events, ARRAY_SIZE(events),
+				   razer_get_next_timeout());
+		if (count < 0) {
+			if (errno != EINTR)
+				logerr("epoll_wait() failed: %s\n", strerror(errno));
+			count = 0;
+		}
 
-		check_control_socket(privsock, &privileged_clients);
-		check_privileged_connections();
+		razer_handle_events();
+		mice = razer_get_mice();
+		if (resume_requested) {
+			resume_requested = 0;
+			resume_mice();
+		}
 
-		check_control_socket(ctlsock, &clients);
-		check_client_connections();
+		for (i = 0; i < count; i++) {
+			source = events[i].data.ptr;
+			switch (source->type) {
+			case POLLSRC_CTLSOCK:
+				check_control_socket(ctlsock, &clients);
+				break;
+			case POLLSRC_PRIVSOCK:
+				check_control_socket(privsock, &privileged_clients);
+				break;
+			case POLLSRC_DONE:
+				handle_completed_work();
+				break;
+			case POLLSRC_USB:
+				/* Handled by razer_handle_events() above. */
+				break;
+			case POLLSRC_CONFIG:
+				handle_config_event();
+				break;
+			case POLLSRC_CLIENT:
+				handle_client_event(source->client, events[i].events);
+				break;
+			}
+		}
+
+		reap_dead_clients(&privileged_clients);
+		reap_dead_clients(&clients);
 	}
 
 	return 1;
@@ -2112,8 +4985,20 @@ static void usage(FILE *fd, int argc, char **argv)
 	fprintf(fd, "  -l|--loglevel LEVEL       Set the loglevel\n");
 	fprintf(fd, "                            0=error, 1=warning, 2=info(default), 3=debug\n");
 	fprintf(fd, "  -f|--force                Force remove sockets before starting up\n");
+	fprintf(fd, "  -s|--state-dir PATH       Cache the device state in PATH. Defaults to %s\n",
+		RAZER_DEFAULT_STATE_DIR);
+	fprintf(fd, "  -S|--no-state-cache       Do not cache the device state\n");
+	fprintf(fd, "  -L|--lease MSEC           Keep devices claimed for MSEC milliseconds\n");
+	fprintf(fd, "                            after the last command. 0 disables. Default: %u\n",
+		cmdargs.lease_msec);
+	fprintf(fd, "  -E|--emulate MODEL:COUNT[:LATENCY]\n");
+	fprintf(fd, "                            Add COUNT emulated mice of MODEL with LATENCY\n");
+	fprintf(fd, "                            milliseconds per USB packet. May be repeated.\n");
+	fprintf(fd, "                            MODEL: naga, taipan, deathadder-chroma, lachesis5k6\n");
 	fprintf(fd, "\n");
 	fprintf(fd, "  -h|--help                 Print this help text\n");
+	fprintf(fd, "\n");
+	fprintf(fd, "Send SIGUSR1 after a system resume to rewrite the configuration of all mice.\n");
 }
 
 static int parse_args(int argc, char **argv)
@@ -2128,13 +5013,17 @@ static int parse_args(int argc, char **argv)
 		{ "pidfile", required_argument, 0, 'P', },
 		{ "loglevel", required_argument, 0, 'l', },
 		{ "force", no_argument, 0, 'f', },
+		{ "state-dir", required_argument, 0, 's', },
+		{ "no-state-cache", no_argument, 0, 'S', },
+		{ "lease", required_argument, 0, 'L', },
+		{ "emulate", required_argument, 0, 'E', },
 		{ 0, },
 	};
 
 	int c, idx;
 
 	while (1) {
-		c = getopt_long(argc, argv, "hvBc:CpP:l:f",
+		c = getopt_long(argc, argv, "hvBc:CpP:l:fs:SL:E:",
 				long_options, &idx);
 		if (c == -1)
 			break;
@@ -2167,6 +5056,34 @@ static int parse_args(int argc, char **argv)
 		case 'f':
 			cmdargs.force = 1;
 			break;
+		case 's':
+			cmdargs.state_dir = optarg;
+			break;
+		case 'S':
+			cmdargs.state_dir = "";
+			break;
+		case 'L':
+			if (sscanf(optarg, "%u", &cmdargs.lease_msec) != 1) {
+				fprintf(stderr, "Failed to parse --lease argument\n");
+				return -1;
+			}
+			break;
+		case 'E': {
+			struct emulate_spec *spec;
+
+			if (cmdargs.nr_emulate >= MAX_EMULATE_SPECS) {
+				fprintf(stderr, "Too many --emulate arguments\n");
+				return -1;
+			}
+			spec = &cmdargs.emulate[cmdargs.nr_emulate];
+			if (sscanf(optarg, "%31[^:]:%u:%u", spec->model,
+				   &spec->count, &spec->latency_msec) < 2) {
+				fprintf(stderr, "Failed to parse --emulate argument\n");
+				return -1;
+			}
+			cmdargs.nr_emulate++;
+			break;
+		}
 		default:
 			return -1;
 		}
@@ -23,10 +23,13 @@ if sys.version_info[0] != 3:
 	print("Please install Python 3.x")
 	sys.exit(1)
 
+import os
+import fcntl
 import socket
 import select
 import hashlib
 import struct
+import mmap
 
 RAZER_VERSION	= "0.37"
 
@@ -195,14 +198,241 @@ class RazerDpiMapping(object):
 		self.profileMask = profileMask
 		self.mutable = mutable
 
+class RazerProfileSnapshot(object):
+	"The state of one profile in a RazerDeviceSnapshot"
+
+	def __init__(self, id, name, freq, dpiMappings, leds, buttonFunctions):
+		self.id = id
+		self.name = name
+		self.freq = freq
+		self.dpiMappings = dpiMappings		# List of (axisId, mappingId)
+		self.leds = leds			# List of RazerLED
+		self.buttonFunctions = buttonFunctions	# List of (buttonId, (funcId, funcName))
+
+class RazerDeviceSnapshot(object):
+	"The complete state of a device"
+
+	def __init__(self):
+		self.mouseInfo = 0
+		self.fwVer = None
+		self.supportedFreqs = []
+		self.supportedRes = []
+		self.supportedAxes = []			# List of (id, name, flags)
+		self.supportedDpiMappings = []		# List of RazerDpiMapping
+		self.supportedButtons = []		# List of (id, name)
+		self.supportedButtonFunctions = []	# List of (id, name)
+		self.globalFreq = 0
+		self.globalLeds = []
+		self.activeProfile = None
+		self.profiles = []			# List of RazerProfileSnapshot
+
+class RazerSnapshotParser(object):
+	"Parser for the REPLY_ID_BLOB of COMMAND_ID_GETSNAPSHOT"
+
+	SNAPSHOT_VERSION = 1
+
+	def __init__(self, data):
+		self.data = data
+		self.offset = 0
+
+	def __take(self, size):
+		if self.offset + size > len(self.data):
+			raise RazerEx("Truncated device snapshot")
+		data = self.data[self.offset : self.offset + size]
+		self.offset += size
+		return data
+
+	def u8(self):
+		return self.__take(1)[0]
+
+	def u16(self):
+		return razer_be16_to_int(self.__take(2))
+
+	def u32(self):
+		return razer_be32_to_int(self.__take(4))
+
+	def string(self):
+		return self.__take(self.u16()).decode("ASCII")
+
+	def utf16String(self):
+		return self.__take(self.u16() * 2).decode("UTF-16-BE")
+
+	def leds(self, profileId):
+		leds = []
+		for i in range(self.u32()):
+			flags = self.u32()
+			name = self.string()
+			state = self.u32()
+			mode = RazerLEDMode(self.u32())
+			supported_modes = RazerLEDMode.listFromSupportedModes(self.u32())
+			color = self.u32()
+			if (flags & Razer.LED_FLAG_HAVECOLOR) == 0:
+				color = None
+			else:
+				color = RazerRGB.fromU32(color)
+			canChangeColor = bool(flags & Razer.LED_FLAG_CHANGECOLOR)
+			leds.append(RazerLED(profileId, name, state, mode,
+					     supported_modes, color, canChangeColor))
+		return leds
+
+	def parse(self):
+		if not self.data:
+			return None
+		snap = RazerDeviceSnapshot()
+		if self.u8() != self.SNAPSHOT_VERSION:
+			raise RazerEx("Unsupported device snapshot version")
+		snap.mouseInfo = self.u32()
+		fwVer = self.u32()
+		snap.fwVer = None if fwVer == 0xFFFFFFFF else\
+			     ((fwVer >> 8) & 0xFF, fwVer & 0xFF)
+		snap.supportedFreqs = [ self.u32() for i in range(self.u32()) ]
+		snap.supportedRes = [ self.u32() for i in range(self.u32()) ]
+		for i in range(self.u32()):
+			snap.supportedAxes.append( (self.u32(), self.string(), self.u32()) )
+		for i in range(self.u32()):
+			id = self.u32()
+			dimMask = self.u32()
+			res = []
+			for j in range(Razer.RAZER_NR_DIMS):
+				rVal = self.u32()
+				res.append(rVal if dimMask & (1 << j) else None)
+			profileMask = (self.u32() << 32)
+			profileMask |= self.u32()
+			mutable = self.u8()
+			snap.supportedDpiMappings.append(RazerDpiMapping(
+				id, res, profileMask, mutable))
+		for i in range(self.u32()):
+			snap.supportedButtons.append( (self.u32(), self.string()) )
+		for i in range(self.u32()):
+			snap.supportedButtonFunctions.append( (self.u32(), self.string()) )
+		funcNames = dict(snap.supportedButtonFunctions)
+		snap.globalFreq = self.u32()
+		snap.globalLeds = self.leds(Razer.PROFILE_INVALID)
+		activeProfile = self.u32()
+		snap.activeProfile = None if activeProfile == 0xFFFFFFFF else activeProfile
+		for i in range(self.u32()):
+			id = self.u32()
+			name = self.utf16String()
+			freq = self.u32()
+			dpiMappings = []
+			nrMappings = self.u32()
+			for j in range(nrMappings):
+				axisId = snap.supportedAxes[j][0] if snap.supportedAxes else None
+				mapping = self.u32()
+				dpiMappings.append( (axisId, None if mapping == 0xFFFFFFFF else mapping) )
+			leds = self.leds(id)
+			buttonFunctions = []
+			for j in range(self.u32()):
+				funcId = self.u32()
+				buttonFunctions.append( (snap.supportedButtons[j][0],
+							 (funcId, funcNames.get(funcId, ""))) )
+			snap.profiles.append(RazerProfileSnapshot(
+				id, name, freq, dpiMappings, leds, buttonFunctions))
+		return snap
+
+class RazerDeviceState(object):
+	"The state of a device, as published in the razerd state table"
+
+	def __init__(self, idstr, activeProfile, freq, dpiMappingId, res, leds):
+		self.idstr = idstr
+		self.activeProfile = activeProfile	# None, if unknown
+		self.freq = freq
+		self.dpiMappingId = dpiMappingId	# None, if unknown
+		self.res = res				# Resolution per dimension
+		self.leds = leds			# List of RazerLED
+
+class RazerStateTable(object):
+	"""Read-only view of the device state table razerd publishes.
+	Reading it needs no razerd round trip."""
+
+	PATH		= "/var/run/razerd/state"
+	MAGIC		= 0x525A5354
+	VERSION		= 1
+
+	__hdr = struct.Struct("=6I")
+	__mouse = struct.Struct("=128s6II")
+	__led = struct.Struct("=64sBB2xI")
+
+	def __init__(self):
+		self.map = None
+
+	def close(self):
+		if self.map:
+			self.map.close()
+			self.map = None
+
+	def __open(self):
+		self.close()
+		try:
+			with open(self.PATH, "rb") as f:
+				self.map = mmap.mmap(f.fileno(), 0,
+						     access=mmap.ACCESS_READ)
+		except (OSError, ValueError) as e:
+			raise RazerEx("Failed to map the razerd state table: %s" % e)
+
+	def __copy(self):
+		"Returns a consistent copy of the table, or None if razerd restarted."
+		while 1:
+			magic, version, seq1 = struct.unpack_from("=3I", self.map)
+			if magic != self.MAGIC:
+				return None
+			if version != self.VERSION:
+				raise RazerEx("Unsupported state table version %u" % version)
+			if seq1 & 1:
+				continue # Update in progress
+			data = self.map[:]
+			seq2 = struct.unpack_from("=I", self.map, 8)[0]
+			if seq1 == seq2:
+				return data
+
+	def read(self):
+		"Returns a list of RazerDeviceState"
+		data = None
+		for i in range(2):
+			if not self.map:
+				self.__open()
+			data = self.__copy()
+			if data is not None:
+				break
+			self.close()
+		if data is None:
+			raise RazerEx("razerd is not running")
+
+		magic, version, seq, nrMice, mouseSize, maxMice =\
+			self.__hdr.unpack_from(data)
+		states = []
+		for i in range(min(nrMice, maxMice)):
+			offset = self.__hdr.size + i * mouseSize
+			idstr, activeProf, freq, mappingId, resX, resY, resZ, nrLeds =\
+				self.__mouse.unpack_from(data, offset)
+			offset += self.__mouse.size
+			leds = []
+			for j in range(nrLeds):
+				name, state, mode, color =\
+					self.__led.unpack_from(data, offset + j * self.__led.size)
+				leds.append(RazerLED(Razer.PROFILE_INVALID,
+						     name.split(b'\0')[0].decode("ASCII", "replace"),
+						     state, RazerLEDMode(mode), [],
+						     RazerRGB.fromU32(color), False))
+			states.append(RazerDeviceState(
+				idstr.split(b'\0')[0].decode("UTF-8", "replace"),
+				None if activeProf == 0xFFFFFFFF else activeProf,
+				freq,
+				None if mappingId == 0xFFFFFFFF else mappingId,
+				(resX, resY, resZ),
+				leds))
+		return states
+
 class Razer(object):
 	SOCKET_PATH	= "/var/run/razerd/socket"
 	PRIVSOCKET_PATH	= "/var/run/razerd/socket.privileged"
 
-	INTERFACE_REVISION = 6
+	INTERFACE_REVISION = 7
 
 	COMMAND_MAX_SIZE = 512
 	COMMAND_HDR_SIZE = 1
+	FRAME_HDR_SIZE = 6
+	REPLY_FRAME_HDR_SIZE = 8
 	BULK_CHUNK_SIZE = 128
 	RAZER_IDSTR_MAX_SIZE = 128
 	RAZER_LEDNAME_MAX_SIZE = 64
@@ -234,6 +464,12 @@ class Razer(object):
 	COMMAND_ID_GETMOUSEINFO = 23	# Get detailed information about a mouse
 	COMMAND_ID_GETPROFNAME = 24	# Get a profile name.
 	COMMAND_ID_SETPROFNAME = 25	# Set a profile name.
+	COMMAND_ID_ENABLEFRAMING = 26	# Switch the connection to framed messages.
+	COMMAND_ID_GETSNAPSHOT = 27	# Get the complete state of a mouse.
+	COMMAND_ID_SUBSCRIBE = 28	# Select the notifications to receive.
+	COMMAND_ID_GETSERIAL = 29	# Get the serial number of a mouse.
+	COMMAND_ID_BATCH = 30		# Apply a list of changes in one commit.
+	COMMAND_ID_GETPACING = 31	# Get the packet pacing statistics.
 
 	COMMAND_PRIV_FLASHFW = 128	# Upload and flash a firmware image
 	COMMAND_PRIV_CLAIM = 129	# Claim the device.
@@ -242,10 +478,35 @@ class Razer(object):
 	# Replies to commands
 	REPLY_ID_U32 = 0		# An unsigned 32bit integer.
 	REPLY_ID_STR = 1		# A string
+	REPLY_ID_BLOB = 2		# A binary blob
+	REPLY_ID_FLASHPROGRESS = 3	# Firmware flash progress
+
+	# COMMAND_PRIV_FLASHFW flags
+	FLASHFW_FLG_PROGRESS = (1 << 0)	# Send REPLY_ID_FLASHPROGRESS replies.
+	FLASHFW_FLG_FD = (1 << 1)	# The image is passed as a file descriptor.
 	# Notifications. These go through the reply channel.
 	__NOTIFY_ID_FIRST = 128
 	NOTIFY_ID_NEWMOUSE = 128	# New mouse was connected.
 	NOTIFY_ID_DELMOUSE = 129	# A mouse was removed.
+	NOTIFY_ID_ACTIVEPROF = 130	# The active profile changed.
+	NOTIFY_ID_PROFNAME = 131	# A profile name changed.
+	NOTIFY_ID_DPIMAPPING = 132	# The DPI mapping of a profile changed.
+	NOTIFY_ID_DPIMAPPINGCHANGE = 133 # A DPI mapping was modified.
+	NOTIFY_ID_FREQ = 134		# A frequency changed.
+	NOTIFY_ID_LED = 135		# A LED changed.
+	NOTIFY_ID_BUTFUNC = 136		# A button function changed.
+	NOTIFY_ID_COMMITERR = 137	# Committing the settings of a mouse failed.
+
+	# Notification subscription mask bits
+	NOTIFYMSK_NEWMOUSE	= (1 << 0)
+	NOTIFYMSK_DELMOUSE	= (1 << 1)
+	NOTIFYMSK_PROFILE	= (1 << 2) # ACTIVEPROF and PROFNAME
+	NOTIFYMSK_DPIMAPPING	= (1 << 3) # DPIMAPPING and DPIMAPPINGCHANGE
+	NOTIFYMSK_FREQ		= (1 << 4)
+	NOTIFYMSK_LED		= (1 << 5)
+	NOTIFYMSK_BUTFUNC	= (1 << 6)
+	NOTIFYMSK_COMMITERR	= (1 << 7)
+	NOTIFYMSK_ALL		= (1 << 8) - 1
 
 	# String encodings
 	STRING_ENC_ASCII = 0
@@ -305,6 +566,11 @@ class Razer(object):
 		"Connect to razerd."
 		self.enableNotifications = enableNotifications
 		self.notifications = []
+		self.framed = False
+		self.batch = None
+		self.nextReqId = 1
+		self.pendingReqIds = []
+		self.rxbuf = b""
 		try:
 			self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
 			self.sock.connect(self.SOCKET_PATH)
@@ -329,15 +595,30 @@ class Razer(object):
 				      "%s" %\
 					(rev, self.INTERFACE_REVISION, additional))
 
-	def __constructCommand(self, commandId, idstr, payload):
+		self.__sendCommand(self.COMMAND_ID_ENABLEFRAMING)
+		if self.__recvU32() != self.ERR_NONE:
+			raise RazerEx("Failed to enable framed messages")
+		self.framed = True
+
+		self.subscribe(self.NOTIFYMSK_ALL if enableNotifications else 0)
+
+	def __constructCommand(self, commandId, idstr, payload, pad=True):
 		cmd = bytes((commandId,))
 		idstr = idstr.encode("UTF-8")
 		idstr += b'\0' * (self.RAZER_IDSTR_MAX_SIZE - len(idstr))
 		cmd += idstr
 		cmd += payload
-		cmd += b'\0' * (self.COMMAND_MAX_SIZE - len(cmd))
+		if pad:
+			cmd += b'\0' * (self.COMMAND_MAX_SIZE - len(cmd))
 		return cmd
 
+	def __constructFrame(self, cmd):
+		reqId = self.nextReqId
+		self.nextReqId = (self.nextReqId % 0xFFFFFFFF) + 1
+		self.pendingReqIds.append(reqId)
+		return razer_int_to_be16(len(cmd) + 4) +\
+		       razer_int_to_be32(reqId) + cmd
+
 	def __send(self, data):
 		self.sock.sendall(data)
 
@@ -356,12 +637,55 @@ class Razer(object):
 				raise RazerEx("Privileged bulk write failed. %u" % result)
 
 	def __sendCommand(self, commandId, idstr="", payload=b""):
-		cmd = self.__constructCommand(commandId, idstr, payload)
-		self.__send(cmd)
+		if self.framed:
+			cmd = self.__constructCommand(commandId, idstr, payload,
+						      pad=False)
+			self.__send(self.__constructFrame(cmd))
+		else:
+			cmd = self.__constructCommand(commandId, idstr, payload)
+			self.__send(cmd)
+
+	def __sendSetCommand(self, commandId, idstr, payload):
+		"Send a SET command, or record it in the open batch."
+		if self.batch is not None and self.batch[0] == idstr:
+			self.batch[1].append(bytes((commandId, len(payload))) + payload)
+			return self.ERR_NONE
+		self.__sendCommand(commandId, idstr, payload)
+		return self.__recvU32()
 
-	def __sendPrivilegedCommand(self, commandId, idstr="", payload=b""):
+	def __sendPrivilegedCommand(self, commandId, idstr="", payload=b"", fd=None):
 		cmd = self.__constructCommand(commandId, idstr, payload)
-		self.__sendPrivileged(cmd)
+		if fd is None:
+			self.__sendPrivileged(cmd)
+			return
+		try:
+			self.privsock.sendmsg([cmd], [(socket.SOL_SOCKET, socket.SCM_RIGHTS,
+						       struct.pack("i", fd))])
+		except (socket.error, AttributeError) as e:
+			raise RazerEx("Privileged command failed. Do you have permission?")
+
+	@staticmethod
+	def __createImageFd(image):
+		"""Returns a sealed memfd holding the image,
+		or None if memfds are not supported."""
+		if not hasattr(os, "memfd_create") or not hasattr(fcntl, "F_ADD_SEALS"):
+			return None
+		try:
+			fd = os.memfd_create("razer-firmware",
+					     os.MFD_CLOEXEC | os.MFD_ALLOW_SEALING)
+		except OSError as e:
+			return None
+		try:
+			view = memoryview(image)
+			while view:
+				view = view[os.write(fd, view):]
+			fcntl.fcntl(fd, fcntl.F_ADD_SEALS,
+				    fcntl.F_SEAL_WRITE | fcntl.F_SEAL_SHRINK |
+				    fcntl.F_SEAL_GROW | fcntl.F_SEAL_SEAL)
+		except OSError as e:
+			os.close(fd)
+			return None
+		return fd
 
 	def __handleReceivedMessage(self, packet):
 		id = packet[0]
@@ -370,17 +694,62 @@ class Razer(object):
 		if self.enableNotifications:
 			self.notifications.append(packet)
 
+	@staticmethod
+	def __recvExact(sock, size):
+		data = b""
+		while len(data) < size:
+			chunk = sock.recv(size - len(data))
+			if not chunk:
+				raise RazerEx("razerd closed the connection")
+			data += chunk
+		return data
+
+	def __readBuffered(self, size):
+		if len(self.rxbuf) < size:
+			raise RazerEx("Received truncated reply frame")
+		data = self.rxbuf[:size]
+		self.rxbuf = self.rxbuf[size:]
+		return data
+
+	def __receiveFrame(self):
+		"Receive the next reply frame into the receive buffer."
+		hdr = self.__recvExact(self.sock, self.REPLY_FRAME_HDR_SIZE)
+		length = razer_be32_to_int(hdr, 0)
+		reqId = razer_be32_to_int(hdr, 4)
+		if length < 4:
+			raise RazerEx("Received invalid reply frame")
+		data = self.__recvExact(self.sock, length - 4)
+		if reqId == 0:
+			# Notification frame
+			rxbuf, self.rxbuf = self.rxbuf, data
+			while self.rxbuf:
+				self.__handleReceivedMessage(
+					self.__parseMessage(self.__readBuffered))
+			self.rxbuf = rxbuf
+			return
+		if not self.pendingReqIds or self.pendingReqIds[0] != reqId:
+			raise RazerEx("Received reply to unknown request %u" % reqId)
+		self.pendingReqIds.pop(0)
+		self.rxbuf += data
+
 	def __receive(self, sock):
 		"Receive the next message. This will block until a message arrives."
+		if self.framed and sock is self.sock:
+			while not self.rxbuf:
+				self.__receiveFrame()
+			return self.__parseMessage(self.__readBuffered)
+		return self.__parseMessage(lambda size: self.__recvExact(sock, size))
+
+	def __parseMessage(self, read):
 		hdrlen = 1
-		hdr = sock.recv(hdrlen)
+		hdr = read(hdrlen)
 		id = hdr[0]
 		payload = None
 		if id == self.REPLY_ID_U32:
-			payload = razer_be32_to_int(sock.recv(4))
+			payload = razer_be32_to_int(read(4))
 		elif id == self.REPLY_ID_STR:
-			encoding = sock.recv(1)[0]
-			strlen = razer_be16_to_int(sock.recv(2))
+			encoding = read(1)[0]
+			strlen = razer_be16_to_int(read(2))
 			if encoding == self.STRING_ENC_ASCII:
 				nrbytes = strlen
 				decode = lambda pl: pl.decode("ASCII")
@@ -393,20 +762,75 @@ class Razer(object):
 			else:
 				raise RazerEx("Received invalid string encoding %d" %\
 					      encoding)
-			payload = sock.recv(nrbytes) if nrbytes else b""
+			payload = read(nrbytes) if nrbytes else b""
 			try:
 				payload = decode(payload)
 			except UnicodeError as e:
 				raise RazerEx("Unicode decode error in received payload")
+		elif id == self.REPLY_ID_BLOB:
+			bloblen = razer_be32_to_int(read(4))
+			payload = read(bloblen) if bloblen else b""
+		elif id == self.REPLY_ID_FLASHPROGRESS:
+			data = read(16)
+			payload = tuple(razer_be32_to_int(data, i * 4)
+					for i in range(4))
 		elif id == self.NOTIFY_ID_NEWMOUSE:
 			pass
 		elif id == self.NOTIFY_ID_DELMOUSE:
 			pass
+		elif id == self.NOTIFY_ID_ACTIVEPROF:
+			idstr = self.__parseIdstr(read)
+			payload = (idstr, razer_be32_to_int(read(4)))
+		elif id == self.NOTIFY_ID_PROFNAME:
+			idstr = self.__parseIdstr(read)
+			profileId = razer_be32_to_int(read(4))
+			name = read(64 * 2).decode("UTF-16-BE", "replace")
+			payload = (idstr, profileId, name.split("\0")[0])
+		elif id == self.NOTIFY_ID_DPIMAPPING:
+			idstr = self.__parseIdstr(read)
+			data = read(12)
+			axisId = razer_be32_to_int(data, 4)
+			payload = (idstr, razer_be32_to_int(data, 0),
+				   None if axisId == 0xFFFFFFFF else axisId,
+				   razer_be32_to_int(data, 8))
+		elif id == self.NOTIFY_ID_DPIMAPPINGCHANGE:
+			idstr = self.__parseIdstr(read)
+			data = read(12)
+			payload = (idstr, razer_be32_to_int(data, 0),
+				   razer_be32_to_int(data, 4),
+				   razer_be32_to_int(data, 8))
+		elif id == self.NOTIFY_ID_FREQ:
+			idstr = self.__parseIdstr(read)
+			data = read(8)
+			payload = (idstr, razer_be32_to_int(data, 0),
+				   razer_be32_to_int(data, 4))
+		elif id == self.NOTIFY_ID_LED:
+			idstr = self.__parseIdstr(read)
+			profileId = razer_be32_to_int(read(4))
+			ledName = read(self.RAZER_LEDNAME_MAX_SIZE)
+			ledName = ledName.split(b'\0')[0].decode("ASCII", "replace")
+			data = read(6)
+			payload = (idstr, profileId, ledName,
+				   bool(data[0]), data[1],
+				   razer_be32_to_int(data, 2))
+		elif id == self.NOTIFY_ID_BUTFUNC:
+			idstr = self.__parseIdstr(read)
+			data = read(12)
+			payload = (idstr, razer_be32_to_int(data, 0),
+				   razer_be32_to_int(data, 4),
+				   razer_be32_to_int(data, 8))
+		elif id == self.NOTIFY_ID_COMMITERR:
+			idstr = self.__parseIdstr(read)
+			payload = (idstr, razer_be32_to_int(read(4)))
 		else:
 			raise RazerEx("Received unknown message (id=%u)" % id)
 
 		return (id, payload)
 
+	def __parseIdstr(self, read):
+		idstr = read(self.RAZER_IDSTR_MAX_SIZE)
+		return idstr.split(b'\0')[0].decode("UTF-8", "replace")
+
 	def __receiveExpectedMessage(self, sock, expectedId):
 		"""Receive messages until the expected one appears.
 		Unexpected messages will be handled by __handleReceivedMessage.
@@ -434,6 +858,22 @@ class Razer(object):
 		"Receive an expected REPLY_ID_STR"
 		return self.__receiveExpectedMessage(self.sock, self.REPLY_ID_STR)
 
+	def __recvBlob(self):
+		"Receive an expected REPLY_ID_BLOB"
+		return self.__receiveExpectedMessage(self.sock, self.REPLY_ID_BLOB)
+
+	def fileno(self):
+		"Returns the file descriptor notifications arrive on."
+		return self.sock.fileno()
+
+	def subscribe(self, mask):
+		"""Select the notifications to receive (NOTIFYMSK_...).
+		Change notifications carry the idstr of the mouse as the
+		first item of their payload tuple."""
+		payload = razer_int_to_be32(mask)
+		self.__sendCommand(self.COMMAND_ID_SUBSCRIBE, "", payload)
+		return self.__recvU32()
+
 	def pollNotifications(self):
 		"Returns a list of pending notifications (id, payload)"
 		if not self.enableNotifications:
@@ -442,6 +882,9 @@ class Razer(object):
 			res = select.select([self.sock], [], [], 0.001)
 			if not res[0]:
 				break
+			if self.framed:
+				self.__receiveFrame()
+				continue
 			pack = self.__receive(self.sock)
 			self.__handleReceivedMessage(pack)
 		notifications = self.notifications
@@ -487,6 +930,24 @@ class Razer(object):
 		rawVer = self.__recvU32()
 		return ((rawVer >> 8) & 0xFF, rawVer & 0xFF)
 
+	def getSerial(self, idstr):
+		"Returns the serial number string. This does not claim the device."
+		self.__sendCommand(self.COMMAND_ID_GETSERIAL, idstr)
+		return self.__recvString()
+
+	def getPacingStats(self, idstr):
+		"""Returns the packet pacing statistics as a dict, or None
+		if the device does not pace its packets. All spacings are
+		in microseconds."""
+		self.__sendCommand(self.COMMAND_ID_GETPACING, idstr)
+		err = self.__recvU32()
+		values = [ self.__recvU32() for i in range(7) ]
+		if err != self.ERR_NONE:
+			return None
+		keys = ("spacing", "minSpacing", "maxSpacing", "achievedSpacing",
+			"nrPackets", "nrErrors", "nrRetries")
+		return dict(zip(keys, values))
+
 	def getSupportedFreqs(self, idstr):
 		"Returns a list of supported frequencies for a mouse."
 		self.__sendCommand(self.COMMAND_ID_SUPPFREQS, idstr)
@@ -547,14 +1008,12 @@ class Razer(object):
 			payload += razer_int_to_be32(led.color.toU32())
 		else:
 			payload += razer_int_to_be32(0)
-		self.__sendCommand(self.COMMAND_ID_SETLED, idstr, payload)
-		return self.__recvU32()
+		return self.__sendSetCommand(self.COMMAND_ID_SETLED, idstr, payload)
 
 	def setFrequency(self, idstr, profileId, newFrequency):
 		"Set a new scan frequency (in Hz)."
 		payload = razer_int_to_be32(profileId) + razer_int_to_be32(newFrequency)
-		self.__sendCommand(self.COMMAND_ID_SETFREQ, idstr, payload)
-		return self.__recvU32()
+		return self.__sendSetCommand(self.COMMAND_ID_SETFREQ, idstr, payload)
 
 	def getSupportedDpiMappings(self, idstr):
 		"Returns a list of supported DPI mappings. Each entry is a RazerDpiMapping() instance."
@@ -583,8 +1042,7 @@ class Razer(object):
 		payload = razer_int_to_be32(mappingId) +\
 			  razer_int_to_be32(dimensionId) +\
 			  razer_int_to_be32(newResolution)
-		self.__sendCommand(self.COMMAND_ID_CHANGEDPIMAPPING, idstr, payload)
-		return self.__recvU32()
+		return self.__sendSetCommand(self.COMMAND_ID_CHANGEDPIMAPPING, idstr, payload)
 
 	def getDpiMapping(self, idstr, profileId, axisId=None):
 		"Gets the resolution mapping of a profile."
@@ -602,8 +1060,7 @@ class Razer(object):
 		payload = razer_int_to_be32(profileId) +\
 			  razer_int_to_be32(axisId) +\
 			  razer_int_to_be32(mappingId)
-		self.__sendCommand(self.COMMAND_ID_SETDPIMAPPING, idstr, payload)
-		return self.__recvU32()
+		return self.__sendSetCommand(self.COMMAND_ID_SETDPIMAPPING, idstr, payload)
 
 	def getProfiles(self, idstr):
 		"Returns a list of profiles. Each entry is the profile ID."
@@ -622,8 +1079,7 @@ class Razer(object):
 	def setActiveProfile(self, idstr, profileId):
 		"Selects the active profile."
 		payload = razer_int_to_be32(profileId)
-		self.__sendCommand(self.COMMAND_ID_SETACTIVEPROF, idstr, payload)
-		return self.__recvU32()
+		return self.__sendSetCommand(self.COMMAND_ID_SETACTIVEPROF, idstr, payload)
 
 	def getProfileName(self, idstr, profileId):
 		"Get a profile name."
@@ -638,15 +1094,39 @@ class Razer(object):
 		rawstr = rawstr[:min(len(rawstr), 64 * 2)]
 		rawstr += b'\0' * (64 * 2 - len(rawstr))
 		payload += rawstr
-		self.__sendCommand(self.COMMAND_ID_SETPROFNAME, idstr, payload)
-		return self.__recvU32()
-
-	def flashFirmware(self, idstr, image):
-		"Flash a new firmware on the device. Needs high privileges!"
-		payload = razer_int_to_be32(len(image))
-		self.__sendPrivilegedCommand(self.COMMAND_PRIV_FLASHFW, idstr, payload)
-		self.__sendBulkPrivileged(image)
-		return self.__recvU32Privileged()
+		return self.__sendSetCommand(self.COMMAND_ID_SETPROFNAME, idstr, payload)
+
+	def flashFirmware(self, idstr, image, progress=None):
+		"""Flash a new firmware on the device. Needs high privileges!
+		progress is called as progress(done, total, elapsedMsec, bytesPerSec)
+		while the image is written. It may be None."""
+		flags = self.FLASHFW_FLG_PROGRESS if progress else 0
+		fd = self.__createImageFd(image) if image else None
+		if fd is not None:
+			flags |= self.FLASHFW_FLG_FD
+		payload = razer_int_to_be32(len(image)) + razer_int_to_be32(flags)
+		if fd is not None:
+			try:
+				self.__sendPrivilegedCommand(self.COMMAND_PRIV_FLASHFW,
+							     idstr, payload, fd)
+			finally:
+				os.close(fd)
+		else:
+			self.__sendPrivilegedCommand(self.COMMAND_PRIV_FLASHFW, idstr, payload)
+			self.__sendBulkPrivileged(image)
+		if not progress:
+			return self.__recvU32Privileged()
+		while 1:
+			try:
+				id, payload = self.__receive(self.privsock)
+			except (socket.error, AttributeError) as e:
+				raise RazerEx("Privileged receive failed. Do you have permission?")
+			if id == self.REPLY_ID_U32:
+				return payload
+			if id == self.REPLY_ID_FLASHPROGRESS:
+				progress(*payload)
+			else:
+				self.__handleReceivedMessage((id, payload))
 
 	def getSupportedButtons(self, idstr):
 		"Get a list of supported buttons. Each entry is a tuple (id, name)."
@@ -683,8 +1163,52 @@ class Razer(object):
 		payload = razer_int_to_be32(profileId) +\
 			  razer_int_to_be32(buttonId) +\
 			  razer_int_to_be32(functionId)
-		self.__sendCommand(self.COMMAND_ID_SETBUTFUNC, idstr, payload)
-		return self.__recvU32()
+		return self.__sendSetCommand(self.COMMAND_ID_SETBUTFUNC, idstr, payload)
+
+	def beginBatch(self, idstr):
+		"""Start recording changes to a device.
+		Until commitBatch(), the set...() methods for this device
+		only record the change and return ERR_NONE."""
+		if self.batch is not None:
+			raise RazerEx("A batch is already open")
+		self.batch = (idstr, [])
+
+	def commitBatch(self):
+		"""Apply the recorded changes. razerd applies each batch
+		command in one transaction with one hardware commit.
+		Returns a tuple (list of errorcodes per change, commit errorcode)."""
+		if self.batch is None:
+			raise RazerEx("No batch is open")
+		idstr, entries = self.batch
+		self.batch = None
+		maxSize = self.COMMAND_MAX_SIZE - self.COMMAND_HDR_SIZE -\
+			  self.RAZER_IDSTR_MAX_SIZE - 1
+		results = []
+		commitError = self.ERR_NONE
+		while entries:
+			# Split the changes, if they don't fit into one command.
+			count, size = 0, 0
+			while count < min(len(entries), 255) and\
+			      size + len(entries[count]) <= maxSize:
+				size += len(entries[count])
+				count += 1
+			if not count:
+				raise RazerEx("Batch entry too big")
+			payload = bytes((count,)) + b"".join(entries[:count])
+			entries = entries[count:]
+			self.__sendCommand(self.COMMAND_ID_BATCH, idstr, payload)
+			for i in range(count):
+				results.append(self.__recvU32())
+			err = self.__recvU32()
+			if err != self.ERR_NONE:
+				commitError = err
+		return (results, commitError)
+
+	def getDeviceSnapshot(self, idstr):
+		"""Get the complete state of a device in one request.
+		Returns a RazerDeviceSnapshot, or None if the device was not found."""
+		self.__sendCommand(self.COMMAND_ID_GETSNAPSHOT, idstr)
+		return RazerSnapshotParser(self.__recvBlob()).parse()
 
 	def getSupportedAxes(self, idstr):
 		"Get a list of axes on the device. Each entry is a tuple (id, name, flags)."
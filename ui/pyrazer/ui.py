@@ -653,14 +653,27 @@ class MainWindow(QMainWindow):
 		self.mice = []
 		self.scan()
 		if enableNotificationPolling:
-			self.__notifyPollTimer = QTimer(self)
-			self.__notifyPollTimer.timeout.connect(self.pollNotifications)
-			self.__notifyPollTimer.start(300)
+			self.__notifier = QSocketNotifier(razer.fileno(),
+							  QSocketNotifier.Read, self)
+			self.__notifier.activated.connect(self.pollNotifications)
 
 	def pollNotifications(self):
-		n = razer.pollNotifications()
-		if n:
-			self.scan()
+		self.handleNotifications(razer.pollNotifications())
+
+	def handleNotifications(self, notifications):
+		mouse = getattr(self.mousewidget, "mouse", None)
+		reload = False
+		for id, payload in notifications:
+			if id in (Razer.NOTIFY_ID_NEWMOUSE, Razer.NOTIFY_ID_DELMOUSE):
+				self.scan()
+				return
+			if id == Razer.NOTIFY_ID_COMMITERR:
+				self.statusBar().showMessage(
+					self.tr("Failed to apply the settings of %s" % payload[0]))
+			if payload[0] == mouse:
+				reload = True
+		if reload:
+			self.mousewidget.reloadProfiles()
 
 	# Rescan for new devices
 	def scan(self):
@@ -722,9 +735,11 @@ class RazerApplet(QSystemTrayIcon):
 		self.menu = QMenu()
 		self.mainwnd = AppletMainWindow()
 
-		self.__pollTimer = QTimer(self)
-		self.__pollTimer.setInterval(300)
-		self.__pollTimer.stop()
+		# The socket is always drained, so razerd never drops us
+		# for not reading. The content is rebuilt lazily.
+		self.__dirty = False
+		self.__notifier = QSocketNotifier(razer.fileno(),
+						  QSocketNotifier.Read, self)
 
 		self.mainwnd.scan()
 		self.mice = razer.getMice();
@@ -732,7 +747,7 @@ class RazerApplet(QSystemTrayIcon):
 
 		self.setContextMenu(self.menu)
 
-		self.__pollTimer.timeout.connect(self.updateContent)
+		self.__notifier.activated.connect(self.__handleNotifications)
 		self.contextMenu().aboutToShow.connect(self.__contextAboutToShow)
 		self.contextMenu().aboutToHide.connect(self.__contextAboutToHide)
 		self.activated.connect(self.__handleActivate)
@@ -747,37 +762,33 @@ class RazerApplet(QSystemTrayIcon):
 
 	def __contextAboutToShow(self):
 		self.__contextMenuIsShown = True
-		self.__setPolling()
 		self.updateContent()
 
 	def __contextAboutToHide(self):
 		self.__contextMenuIsShown = False
-		self.__setPolling()
 
 	def __mainwndShown(self, widget):
 		self.__mainwndIsShown = True
-		self.__setPolling()
 		self.updateContent()
 
 	def __mainwndHidden(self, widget):
 		self.__mainwndIsShown = False
-		self.__setPolling()
 
-	def __setPolling(self):
-		if self.__contextMenuIsShown or self.__mainwndIsShown:
-			if not self.__pollTimer.isActive():
-				self.__pollTimer.start()
-		else:
-			if self.__pollTimer.isActive():
-				self.__pollTimer.stop()
+	def __handleNotifications(self):
+		if razer.pollNotifications():
+			self.__dirty = True
+			if self.__contextMenuIsShown or self.__mainwndIsShown:
+				self.updateContent()
 
 	def updateContent(self):
-		if razer.pollNotifications():
-			self.mainwnd.scan()
-			mice = razer.getMice()
-			if mice != self.mice:
-				self.mice = mice
-				self.buildMenu()
+		if not self.__dirty:
+			return
+		self.__dirty = False
+		self.mainwnd.scan()
+		mice = razer.getMice()
+		if mice != self.mice:
+			self.mice = mice
+			self.buildMenu()
 
 	def buildMenu(self):
 		# clear the menu